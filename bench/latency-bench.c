@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sysexits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/serial.h>
+
+#include "argparse/argparse.h"
+#include "src/privelev.h"
+
+typedef struct {
+  const char * name;
+  bool low_latency;
+} Profile;
+
+// the default runs first, so it measures the device before the low latency profile changes it
+static const Profile profiles[] = {
+  { "default", false },
+  { "low_latency", true },
+};
+
+// a request without a response by then is a failure
+#define RESPONSE_TIMEOUT_MS 1000
+
+// what the device had before the low latency profile, so it can be put back
+typedef struct {
+  bool serial_flags_known;
+  int serial_flags;
+  int latency_timer;
+} DeviceLatency;
+
+static int64_t
+monotonic_ns (void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+}
+
+static int
+compare_int64 (const void * a, const void * b) {
+
+  int64_t x = *(const int64_t *) a;
+  int64_t y = *(const int64_t *) b;
+  return (x > y) - (x < y);
+
+}
+
+/**
+ * Opens a pty pair, and forks a child echoing everything written to the slave back to it.
+ * The slave's path is assigned, and the master returned so the caller can hang up the child.
+ * The slave is kept open, otherwise closing it between profiles hangs up the child.
+ */
+static int
+open_echo_pty (char * slave_path, size_t slave_path_size, int * slave_fd, pid_t * echo_pid) {
+
+  int master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master_fd == -1) return -1;
+
+  if (grantpt(master_fd) != 0 ||
+      unlockpt(master_fd) != 0 ||
+      ptsname_r(master_fd, slave_path, slave_path_size) != 0) {
+    close(master_fd);
+    return -1;
+  }
+
+  *slave_fd = open(slave_path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (*slave_fd == -1) {
+    close(master_fd);
+    return -1;
+  }
+
+  *echo_pid = fork();
+  if (*echo_pid == -1) {
+    close(master_fd);
+    close(*slave_fd);
+    return -1;
+  }
+  if (*echo_pid == 0) {
+    close(*slave_fd);
+    char buffer[4096];
+    ssize_t length;
+    // the master reads EIO once the slave is closed for good
+    while ((length = read(master_fd, buffer, sizeof(buffer))) > 0) {
+      if (write(master_fd, buffer, length) != length) break;
+    }
+    _exit(0);
+  }
+
+  return master_fd;
+
+}
+
+/**
+ * The path of the device's latency timer in sysfs, false if it has none.
+ */
+static bool
+latency_timer_path (const privelev_device * device, char * path, size_t path_size) {
+
+  if (!device->sysfs_path[0]) return false;
+  snprintf(path, path_size, "%s/device/latency_timer", device->sysfs_path);
+  return access(path, F_OK) == 0;
+
+}
+
+/**
+ * Reads the device's latency timer in milliseconds, -1 if it has none.
+ */
+static int
+read_latency_timer (const privelev_device * device) {
+
+  char path[PRIVELEV_SYSFS_PATH_MAX + 32];
+  if (!latency_timer_path(device, path, sizeof(path))) return -1;
+  FILE * timer = fopen(path, "re");
+  if (!timer) return -1;
+  int latency_timer = -1;
+  if (fscanf(timer, "%d", &latency_timer) != 1) latency_timer = -1;
+  fclose(timer);
+  return latency_timer;
+
+}
+
+/**
+ * Puts back what the device had before the low latency profile, where we are allowed to.
+ */
+static void
+restore_latency (const privelev_device * device, const DeviceLatency * latency) {
+
+  struct serial_struct serial_info;
+  if (latency->serial_flags_known && ioctl(device->fd, TIOCGSERIAL, &serial_info) == 0) {
+    serial_info.flags = latency->serial_flags;
+    ioctl(device->fd, TIOCSSERIAL, &serial_info);
+  }
+
+  char path[PRIVELEV_SYSFS_PATH_MAX + 32];
+  if (latency->latency_timer >= 0 && latency_timer_path(device, path, sizeof(path))) {
+    FILE * timer = fopen(path, "we");
+    if (timer) {
+      fprintf(timer, "%d", latency->latency_timer);
+      fclose(timer);
+    }
+  }
+
+}
+
+/**
+ * Sends a request and waits until the whole response is back, as an event driven reader does.
+ * Returns the round trip in nanoseconds, or -1 if it timed out or failed.
+ */
+static int64_t
+round_trip (int fd, const char * request, char * response, size_t size) {
+
+  int64_t start = monotonic_ns();
+  if (write(fd, request, size) != (ssize_t) size) return -1;
+
+  size_t received = 0;
+  while (received < size) {
+    struct pollfd poll_fd = { .fd = fd, .events = POLLIN };
+    int status = poll(&poll_fd, 1, RESPONSE_TIMEOUT_MS);
+    if (status <= 0) return -1;
+    ssize_t length = read(fd, response + received, size - received);
+    if (length < 0 && errno != EINTR && errno != EAGAIN) return -1;
+    if (length > 0) received += length;
+  }
+  int64_t elapsed = monotonic_ns() - start;
+
+  return memcmp(request, response, size) ? -1 : elapsed;
+
+}
+
+/**
+ * Opens the port with the profile and measures the round trips of requests echoed back.
+ */
+static size_t
+bench_profile (
+  privelev_ctx * ctx,
+  const Profile * profile,
+  privelev_device * device,
+  DeviceLatency * latency,
+  int64_t * samples,
+  int iterations,
+  size_t size,
+  int * failures
+) {
+
+  device->line.low_latency = profile->low_latency;
+  if (privelev_open_serial_many(ctx, device, 1) != PRIVELEV_OK) {
+    return 0;
+  }
+
+  if (!profile->low_latency) {
+    struct serial_struct serial_info;
+    latency->serial_flags_known = ioctl(device->fd, TIOCGSERIAL, &serial_info) == 0;
+    latency->serial_flags = serial_info.flags;
+    latency->latency_timer = read_latency_timer(device);
+  }
+
+  char * request = malloc(size);
+  char * response = malloc(size);
+  if (!request || !response) {
+    perror("malloc()");
+    exit(EX_OSERR);
+  }
+
+  tcflush(device->fd, TCIOFLUSH);
+  size_t samples_count = 0;
+  *failures = 0;
+  for (int i = 0; i < iterations; ++i) {
+    // every request differs, so a late response to an earlier one is not taken for it
+    memset(request, 'A' + (i % 26), size);
+    int64_t elapsed = round_trip(device->fd, request, response, size);
+    if (elapsed >= 0) {
+      samples[samples_count++] = elapsed;
+    } else {
+      ++*failures;
+      usleep(RESPONSE_TIMEOUT_MS * 1000 / 10);
+      tcflush(device->fd, TCIOFLUSH);
+    }
+  }
+
+  free(request);
+  free(response);
+
+  qsort(samples, samples_count, sizeof(int64_t), compare_int64);
+  return samples_count;
+
+}
+
+int
+main (int argc, const char * const * argv) {
+
+  static const char * const command_usage[] = {
+    "latency-bench [options] [<serial-port-path>]",
+    NULL,
+  };
+
+  int iterations = 1000;
+  int size = 8;
+  int baud = 115200;
+
+  struct argparse_option command_options[] = {
+    OPT_HELP(),
+    OPT_INTEGER('n', "iterations", &iterations, "round trips per profile, the default is 1000"),
+    OPT_INTEGER('s', "size", &size, "bytes per request, the default is 8"),
+    OPT_INTEGER('b', "baud", &baud, "baud rate to open the port at, the default is 115200"),
+    OPT_END(),
+  };
+
+  struct argparse argparse;
+  argparse_init(&argparse, command_options, command_usage, 0);
+  argparse_describe(&argparse, "\nMeasures the request and response round trip of a port with the default and the low latency profile.\nThe port must echo what it is sent, with a loopback plug or a device doing so, and without one a pty is echoed instead.\nResults are written to stdout as JSON.", "");
+
+  const char * * argv_ = malloc(sizeof(char *) * argc);
+  memcpy((char * *) argv_, argv, sizeof(char *) * argc);
+  int argc_ = argparse_parse(&argparse, argc, argv_);
+
+  if (iterations < 1 || size < 1 || baud < 1 || argc_ > 1 || !privelev_baud_supported((uint32_t) baud)) {
+    argparse_usage(&argparse);
+    exit(EX_USAGE);
+  }
+
+  char slave_path[64];
+  int master_fd = -1;
+  int slave_fd = -1;
+  pid_t echo_pid = -1;
+  const char * path = argc_ ? argv_[0] : NULL;
+  if (!path) {
+    master_fd = open_echo_pty(slave_path, sizeof(slave_path), &slave_fd, &echo_pid);
+    if (master_fd == -1) {
+      perror("posix_openpt()");
+      exit(EX_OSERR);
+    }
+    path = slave_path;
+  }
+
+  int64_t * samples = calloc(iterations, sizeof(int64_t));
+  privelev_ctx * ctx = privelev_ctx_new();
+  if (!samples || !ctx) {
+    perror("privelev_ctx_new()");
+    exit(EX_OSERR);
+  }
+
+  printf(
+    "{\n  \"port\": \"%s\",\n  \"baud\": %d,\n  \"size\": %d,\n  \"iterations\": %d,\n  \"profiles\": [",
+    argc_ ? path : "pty",
+    baud,
+    size,
+    iterations
+  );
+
+  DeviceLatency latency = { false, 0, -1 };
+  size_t profiles_count = sizeof(profiles) / sizeof(profiles[0]);
+  for (size_t p = 0; p < profiles_count; ++p) {
+
+    const Profile * profile = &profiles[p];
+    printf("%s\n    { \"name\": \"%s\"", p ? "," : "", profile->name);
+    fflush(stdout);
+
+    privelev_device device = { .path = path, .baud = (uint32_t) baud };
+    int failures = 0;
+    size_t samples_count = bench_profile(ctx, profile, &device, &latency, samples, iterations, (size_t) size, &failures);
+    if (device.fd < 0) {
+      printf(", \"failed\": \"%s\" }", strerror(device.error));
+      continue;
+    }
+
+    int latency_timer = read_latency_timer(&device);
+    if (latency_timer >= 0) {
+      printf(", \"latency_timer_ms\": %d", latency_timer);
+    }
+    printf(", \"samples\": %zu, \"failures\": %d", samples_count, failures);
+    if (samples_count) {
+      printf(
+        ", \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f",
+        samples[samples_count / 2] / 1000.0,
+        samples[(samples_count * 99) / 100] / 1000.0,
+        samples[samples_count - 1] / 1000.0
+      );
+    }
+    printf(" }");
+
+    if (profile->low_latency) {
+      restore_latency(&device, &latency);
+    }
+    close(device.fd);
+
+  }
+
+  printf("\n  ]\n}\n");
+
+  privelev_ctx_free(ctx);
+  if (echo_pid > 0) {
+    close(slave_fd);
+    close(master_fd);
+    waitpid(echo_pid, NULL, 0);
+  }
+
+  exit(EXIT_SUCCESS);
+
+}
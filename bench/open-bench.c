@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sysexits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <linux/capability.h>
+
+#include "argparse/argparse.h"
+#include "src/privelev.h"
+
+typedef struct {
+  const char * name;
+  // try in-process before launching the mechanism
+  bool fast_path;
+  // the device is made inaccessible to us, so only an elevated mechanism can open it
+  bool elevated;
+  // the stub pkexec denies the elevation
+  bool denied;
+  // the elevated mechanism serves a lease, so only the first open runs pkexec
+  bool leased;
+} Scenario;
+
+static const Scenario scenarios[] = {
+  { "in_process", true, false, false, false },
+  { "unprivileged", false, false, false, false },
+  { "privileged", true, true, false, false },
+  { "leased", true, true, false, true },
+  { "denied", true, true, true, false },
+};
+
+// outlasts every iteration of the leased scenario
+static const privelev_lease bench_lease = { 3600000, 0, NULL, 0 };
+
+static int64_t
+monotonic_ns (void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+}
+
+static int
+compare_int64 (const void * a, const void * b) {
+
+  int64_t x = *(const int64_t *) a;
+  int64_t y = *(const int64_t *) b;
+  return (x > y) - (x < y);
+
+}
+
+/**
+ * Opens a pty pair and returns the master, the slave's path is assigned.
+ * The slave is the device being opened, the master keeps it alive between opens.
+ */
+static int
+open_pty (char * slave_path, size_t slave_path_size) {
+
+  int master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master_fd == -1) return -1;
+
+  if (grantpt(master_fd) != 0 ||
+      unlockpt(master_fd) != 0 ||
+      ptsname_r(master_fd, slave_path, slave_path_size) != 0) {
+    close(master_fd);
+    return -1;
+  }
+
+  return master_fd;
+
+}
+
+/**
+ * Root can open any device in-process, so to get onto the elevated path
+ * we give up overriding file permissions. This only clears the effective set,
+ * the mechanism gets the capabilities back when the stub pkexec executes it.
+ */
+static bool
+drop_dac_override (void) {
+
+  struct __user_cap_header_struct header = { .version = _LINUX_CAPABILITY_VERSION_3, .pid = 0 };
+  struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+
+  if (syscall(SYS_capget, &header, data) != 0) return false;
+  data[CAP_TO_INDEX(CAP_DAC_OVERRIDE)].effective &= ~CAP_TO_MASK(CAP_DAC_OVERRIDE);
+  data[CAP_TO_INDEX(CAP_DAC_READ_SEARCH)].effective &= ~CAP_TO_MASK(CAP_DAC_READ_SEARCH);
+  return syscall(SYS_capset, &header, data) == 0;
+
+}
+
+/**
+ * Measures the time from asking for the device until its file descriptor is
+ * in hand, or until the expected failure is reported. Failures of any other kind
+ * are counted and left out of the samples.
+ */
+static size_t
+bench_scenario (
+  privelev_ctx * ctx,
+  const Scenario * scenario,
+  const char * slave_path,
+  int64_t * samples,
+  int iterations,
+  int * failures
+) {
+
+  privelev_ctx_set_fast_path(ctx, scenario->fast_path);
+  if (!privelev_ctx_set_lease(ctx, scenario->leased ? &bench_lease : NULL)) {
+    perror("privelev_ctx_set_lease()");
+    exit(EX_OSERR);
+  }
+
+  size_t samples_count = 0;
+  *failures = 0;
+
+  for (int i = 0; i < iterations; ++i) {
+
+    int fd = -1;
+    int64_t start = monotonic_ns();
+    privelev_status status = privelev_open_serial(ctx, slave_path, 9600, &fd);
+    int64_t elapsed = monotonic_ns() - start;
+
+    if (fd >= 0) close(fd);
+
+    bool expected = scenario->denied ? status == PRIVELEV_ERROR_DENIED : status == PRIVELEV_OK;
+    if (expected) {
+      samples[samples_count++] = elapsed;
+    } else {
+      ++*failures;
+    }
+
+  }
+
+  qsort(samples, samples_count, sizeof(int64_t), compare_int64);
+  return samples_count;
+
+}
+
+int
+main (int argc, const char * const * argv) {
+
+  static const char * const command_usage[] = {
+    "open-bench [options]",
+    NULL,
+  };
+
+  int iterations = 2000;
+  const char * mechanism_path = NULL;
+  int mechanism_uid = -1;
+
+  struct argparse_option command_options[] = {
+    OPT_HELP(),
+    OPT_INTEGER('n', "iterations", &iterations, "opens per scenario, the default is 2000"),
+    OPT_STRING('m', "mechanism", &mechanism_path, "mechanism to launch, the default is the installed one"),
+    OPT_INTEGER('u', "mechanism-uid", &mechanism_uid, "user the stub pkexec runs the elevated mechanism as, the default is root"),
+    OPT_END(),
+  };
+
+  struct argparse argparse;
+  argparse_init(&argparse, command_options, command_usage, 0);
+  argparse_describe(&argparse, "\nMeasures the time to a file descriptor for each way of opening a pty.\nThe elevated scenarios need the stub pkexec on PATH, and all but the denied one need root.\nResults are written to stdout as JSON.", "");
+
+  const char * * argv_ = malloc(sizeof(char *) * argc);
+  memcpy((char * *) argv_, argv, sizeof(char *) * argc);
+  argparse_parse(&argparse, argc, argv_);
+
+  if (iterations < 1) {
+    argparse_usage(&argparse);
+    exit(EX_USAGE);
+  }
+
+  // the mechanism reports what it sends on its stdout, which must not end up in the results
+  int results_fd = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  FILE * results = (results_fd != -1) ? fdopen(results_fd, "w") : NULL;
+  if (!results || null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1) {
+    perror("dup2()");
+    exit(EX_OSERR);
+  }
+  close(null_fd);
+
+  int64_t * samples = calloc(iterations, sizeof(int64_t));
+  if (!samples) {
+    perror("calloc()");
+    exit(EX_OSERR);
+  }
+
+  char slave_path[64];
+  int master_fd = open_pty(slave_path, sizeof(slave_path));
+  if (master_fd == -1) {
+    perror("posix_openpt()");
+    exit(EX_OSERR);
+  }
+
+  privelev_ctx * ctx = privelev_ctx_new();
+  if (!ctx) {
+    perror("privelev_ctx_new()");
+    exit(EX_OSERR);
+  }
+
+  // a stuck mechanism fails its iteration instead of the whole run
+  privelev_ctx_set_timeout(ctx, 10000);
+  if (mechanism_path && !privelev_ctx_set_mechanism_path(ctx, mechanism_path)) {
+    perror("privelev_ctx_set_mechanism_path()");
+    exit(EX_OSERR);
+  }
+
+  fprintf(results, "{\n  \"iterations\": %d,\n  \"uid\": %u,\n  \"scenarios\": [", iterations, (unsigned int) getuid());
+
+  bool elevated_ready = false;
+  const char * elevated_skip = NULL;
+  size_t scenarios_count = sizeof(scenarios) / sizeof(scenarios[0]);
+
+  for (size_t s = 0; s < scenarios_count; ++s) {
+
+    const Scenario * scenario = &scenarios[s];
+
+    fprintf(results, "%s\n    { \"name\": \"%s\"", s ? "," : "", scenario->name);
+
+    if (scenario->elevated && !elevated_ready && !elevated_skip) {
+      // the scenarios without elevation have run by now, so their device can be locked away
+      bool root = geteuid() == 0;
+      if (root && !drop_dac_override()) {
+        elevated_skip = "cannot drop CAP_DAC_OVERRIDE";
+      } else if (root && mechanism_uid >= 0) {
+        char uid[16];
+        snprintf(uid, sizeof(uid), "%d", mechanism_uid);
+        setenv("PRIVELEV_BENCH_UID", uid, 1);
+        if (chown(slave_path, (uid_t) mechanism_uid, (gid_t) -1) != 0 || chmod(slave_path, 0600) != 0) {
+          elevated_skip = "cannot hand the device over to the mechanism user";
+        }
+      } else if (chmod(slave_path, 0000) != 0) {
+        elevated_skip = "cannot lock the device";
+      }
+      elevated_ready = !elevated_skip;
+    }
+
+    // without root the stub pkexec cannot elevate the mechanism, it can only deny it
+    const char * skip = elevated_skip;
+    if (scenario->elevated && !scenario->denied && geteuid() != 0) {
+      skip = "requires root";
+    }
+
+    if (scenario->elevated && skip) {
+      fprintf(results, ", \"skipped\": \"%s\" }", skip);
+      continue;
+    }
+
+    if (scenario->denied) {
+      setenv("PRIVELEV_BENCH_DENY", "127", 1);
+    } else {
+      unsetenv("PRIVELEV_BENCH_DENY");
+    }
+
+    int failures;
+    size_t samples_count = bench_scenario(ctx, scenario, slave_path, samples, iterations, &failures);
+
+    fprintf(results, ", \"samples\": %zu, \"failures\": %d", samples_count, failures);
+    if (samples_count) {
+      fprintf(
+        results,
+        ", \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f",
+        samples[samples_count / 2] / 1000.0,
+        samples[(samples_count * 99) / 100] / 1000.0,
+        samples[samples_count - 1] / 1000.0
+      );
+    }
+    fprintf(results, " }");
+
+  }
+
+  fprintf(results, "\n  ]\n}\n");
+  fclose(results);
+
+  privelev_ctx_free(ctx);
+  close(master_fd);
+
+  exit(EXIT_SUCCESS);
+
+}
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sysexits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <termios.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "argparse/argparse.h"
+#include "src/relay.h"
+
+static const RelayBackend backends[] = {
+  RELAY_BACKEND_EPOLL,
+  RELAY_BACKEND_IO_URING,
+};
+
+// what the relay process reports back once it is done
+typedef struct {
+  RelayBackend backend;
+  int status;
+  uint64_t bytes;
+  uint64_t syscalls;
+  int64_t cpu_ns;
+  int64_t wall_ns;
+} RelayResult;
+
+typedef struct {
+  int master_fd;
+  int slave_fd;
+  // the relay writes what it reads from the slave here, and we read it back
+  int pipe_fds[2];
+  bool drained;
+} Port;
+
+static int64_t
+monotonic_ns (void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+}
+
+static int64_t
+timeval_ns (struct timeval time) {
+
+  return (int64_t) time.tv_sec * 1000000000 + (int64_t) time.tv_usec * 1000;
+
+}
+
+/**
+ * Opens a raw pty pair, the slave stands in for a serial port.
+ */
+static bool
+open_port (Port * port) {
+
+  port->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+  if (port->master_fd == -1) return false;
+
+  char slave_path[64];
+  if (grantpt(port->master_fd) != 0 ||
+      unlockpt(port->master_fd) != 0 ||
+      ptsname_r(port->master_fd, slave_path, sizeof(slave_path)) != 0) {
+    return false;
+  }
+
+  port->slave_fd = open(slave_path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (port->slave_fd == -1) return false;
+
+  struct termios termios;
+  if (tcgetattr(port->slave_fd, &termios) != 0) return false;
+  cfmakeraw(&termios);
+  termios.c_cc[VMIN] = 0;
+  termios.c_cc[VTIME] = 0;
+  if (tcsetattr(port->slave_fd, TCSANOW, &termios) != 0) return false;
+
+  if (pipe2(port->pipe_fds, O_CLOEXEC) != 0) return false;
+  if (fcntl(port->pipe_fds[0], F_SETFL, O_NONBLOCK) != 0) return false;
+  port->drained = false;
+
+  return true;
+
+}
+
+/**
+ * Runs in the forked relay process, relaying every slave to its pipe
+ * until the masters are closed.
+ */
+static RelayResult
+run_relay (RelayBackend backend, Port * ports, int ports_count) {
+
+  RelayResult result = { backend, -1, 0, 0, 0, 0 };
+
+  Relay relay;
+  if (!relay_init(&relay, backend)) {
+    return result;
+  }
+  for (int i = 0; i < ports_count; ++i) {
+    close(ports[i].master_fd);
+    close(ports[i].pipe_fds[0]);
+    if (!relay_add(&relay, "port", ports[i].slave_fd, ports[i].pipe_fds[1], false)) {
+      relay_destroy(&relay);
+      return result;
+    }
+  }
+
+  int64_t start = monotonic_ns();
+  result.status = relay_run(&relay, NULL);
+  result.wall_ns = monotonic_ns() - start;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  result.cpu_ns = timeval_ns(usage.ru_utime) + timeval_ns(usage.ru_stime);
+  result.backend = relay.backend;
+  result.syscalls = relay.syscalls;
+  for (size_t i = 0; i < relay.links_count; ++i) {
+    result.bytes += relay.links[i].counters.bytes;
+  }
+  relay_destroy(&relay);
+
+  return result;
+
+}
+
+/**
+ * Reads back whatever the relay has written, returning the bytes read.
+ */
+static uint64_t
+drain_ports (Port * ports, int ports_count, char * buffer, size_t buffer_size) {
+
+  uint64_t received = 0;
+  for (int i = 0; i < ports_count; ++i) {
+    if (ports[i].drained) continue;
+    ssize_t length;
+    while ((length = read(ports[i].pipe_fds[0], buffer, buffer_size)) > 0) {
+      received += length;
+    }
+    if (length == 0) {
+      ports[i].drained = true;
+    }
+  }
+  return received;
+
+}
+
+/**
+ * Feeds every master a burst each millisecond for the duration, like ports receiving
+ * at the given rate, while a forked process relays the slaves with the backend.
+ */
+static bool
+bench_backend (
+  RelayBackend backend,
+  int ports_count,
+  int rate,
+  int duration_ms,
+  RelayResult * result,
+  uint64_t * sent,
+  uint64_t * received
+) {
+
+  Port * ports = calloc(ports_count, sizeof(Port));
+  if (!ports) return false;
+  for (int i = 0; i < ports_count; ++i) {
+    if (!open_port(&ports[i])) {
+      perror("open_port()");
+      return false;
+    }
+  }
+
+  int result_fds[2];
+  if (pipe2(result_fds, O_CLOEXEC) != 0) return false;
+
+  pid_t pid = fork();
+  if (pid == -1) return false;
+  if (pid == 0) {
+    close(result_fds[0]);
+    RelayResult child_result = run_relay(backend, ports, ports_count);
+    _exit(write(result_fds[1], &child_result, sizeof(child_result)) == sizeof(child_result) ? 0 : 1);
+  }
+  close(result_fds[1]);
+  for (int i = 0; i < ports_count; ++i) {
+    close(ports[i].slave_fd);
+    close(ports[i].pipe_fds[1]);
+  }
+
+  size_t burst_size = (size_t) rate / 1000 ? (size_t) rate / 1000 : 1;
+  char * burst = malloc(burst_size);
+  char * buffer = malloc(65536);
+  if (!burst || !buffer) return false;
+  memset(burst, 'U', burst_size);
+
+  *sent = 0;
+  *received = 0;
+  struct timespec tick;
+  clock_gettime(CLOCK_MONOTONIC, &tick);
+  for (int ms = 0; ms < duration_ms; ++ms) {
+    for (int i = 0; i < ports_count; ++i) {
+      // a relay that falls behind fills the pty, which only costs it the rest of the burst
+      ssize_t length = write(ports[i].master_fd, burst, burst_size);
+      if (length > 0) *sent += length;
+    }
+    *received += drain_ports(ports, ports_count, buffer, 65536);
+    tick.tv_nsec += 1000000;
+    if (tick.tv_nsec >= 1000000000) {
+      tick.tv_nsec -= 1000000000;
+      ++tick.tv_sec;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
+  }
+
+  // hanging up every port ends the relay once it has written out what they had
+  for (int i = 0; i < ports_count; ++i) {
+    close(ports[i].master_fd);
+  }
+  bool drained = false;
+  while (!drained) {
+    *received += drain_ports(ports, ports_count, buffer, 65536);
+    drained = true;
+    for (int i = 0; i < ports_count; ++i) {
+      drained = drained && ports[i].drained;
+    }
+    if (!drained) usleep(1000);
+  }
+
+  bool reported = read(result_fds[0], result, sizeof(*result)) == sizeof(*result);
+  close(result_fds[0]);
+  waitpid(pid, NULL, 0);
+
+  for (int i = 0; i < ports_count; ++i) {
+    close(ports[i].pipe_fds[0]);
+  }
+  free(burst);
+  free(buffer);
+  free(ports);
+
+  return reported && result->status == 1;
+
+}
+
+int
+main (int argc, const char * const * argv) {
+
+  static const char * const command_usage[] = {
+    "relay-bench [options]",
+    NULL,
+  };
+
+  int ports_count = 128;
+  // 3 Mbaud with 8N1 framing
+  int rate = 300000;
+  int duration_ms = 2000;
+
+  struct argparse_option command_options[] = {
+    OPT_HELP(),
+    OPT_INTEGER('p', "ports", &ports_count, "pty pairs relayed at once, the default is 128"),
+    OPT_INTEGER('r', "rate", &rate, "bytes per second received by each port, the default is 300000 (3 Mbaud)"),
+    OPT_INTEGER('d', "duration", &duration_ms, "milliseconds to feed the ports for, the default is 2000"),
+    OPT_END(),
+  };
+
+  struct argparse argparse;
+  argparse_init(&argparse, command_options, command_usage, 0);
+  argparse_describe(&argparse, "\nMeasures the system calls and CPU each relay backend spends relaying many ptys to pipes.\nBackends that are not built in or not available fall back to epoll, which the results name.\nResults are written to stdout as JSON.", "");
+
+  const char * * argv_ = malloc(sizeof(char *) * argc);
+  memcpy((char * *) argv_, argv, sizeof(char *) * argc);
+  argparse_parse(&argparse, argc, argv_);
+
+  if (ports_count < 1 || rate < 1 || duration_ms < 1) {
+    argparse_usage(&argparse);
+    exit(EX_USAGE);
+  }
+
+  // every pty takes a master and two pipe ends besides the slave
+  struct rlimit files;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+
+  printf(
+    "{\n  \"ports\": %d,\n  \"rate\": %d,\n  \"duration_ms\": %d,\n  \"backends\": [",
+    ports_count,
+    rate,
+    duration_ms
+  );
+
+  size_t backends_count = sizeof(backends) / sizeof(backends[0]);
+  for (size_t b = 0; b < backends_count; ++b) {
+
+    printf("%s\n    { \"name\": \"%s\"", b ? "," : "", relay_backend_name(backends[b]));
+    fflush(stdout);
+
+    RelayResult result;
+    uint64_t sent;
+    uint64_t received;
+    if (!bench_backend(backends[b], ports_count, rate, duration_ms, &result, &sent, &received)) {
+      printf(", \"failed\": true }");
+      continue;
+    }
+
+    printf(
+      ", \"used\": \"%s\", \"sent\": %llu, \"relayed\": %llu, \"received\": %llu",
+      relay_backend_name(result.backend),
+      (unsigned long long) sent,
+      (unsigned long long) result.bytes,
+      (unsigned long long) received
+    );
+    printf(
+      ", \"syscalls\": %llu, \"syscalls_per_kib\": %.3f, \"cpu_percent\": %.1f }",
+      (unsigned long long) result.syscalls,
+      result.bytes ? result.syscalls * 1024.0 / result.bytes : 0,
+      result.wall_ns ? 100.0 * result.cpu_ns / result.wall_ns : 0
+    );
+
+  }
+
+  printf("\n  ]\n}\n");
+
+  exit(EXIT_SUCCESS);
+
+}
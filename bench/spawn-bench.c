@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sysexits.h>
+
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "argparse/argparse.h"
+#include "src/spawn.h"
+
+static int64_t
+monotonic_ns (void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+}
+
+static int
+compare_int64 (const void * a, const void * b) {
+
+  int64_t x = *(const int64_t *) a;
+  int64_t y = *(const int64_t *) b;
+  return (x > y) - (x < y);
+
+}
+
+/**
+ * Measures the time from spawning until the exec has succeeded,
+ * which is the latency spawn_process adds before the mechanism runs.
+ */
+static int
+bench_backend (
+  SpawnBackend backend,
+  const char * const * process_arguments,
+  const sigset_t * signal_mask,
+  int64_t * samples,
+  int iterations
+) {
+
+  for (int i = 0; i < iterations; ++i) {
+    pid_t pid;
+    int64_t start = monotonic_ns();
+    if (spawn_process(backend, process_arguments[0], process_arguments, signal_mask, -1, &pid) != 1) {
+      return -1;
+    }
+    samples[i] = monotonic_ns() - start;
+    waitpid(pid, NULL, 0);
+  }
+
+  qsort(samples, iterations, sizeof(int64_t), compare_int64);
+  return 0;
+
+}
+
+int
+main (int argc, const char * const * argv) {
+
+  static const char * const command_usage[] = {
+    "spawn-bench [options] [--] [<rss-mib> ...]",
+    NULL,
+  };
+
+  int iterations = 200;
+  const char * program = "true";
+
+  struct argparse_option command_options[] = {
+    OPT_HELP(),
+    OPT_INTEGER('n', "iterations", &iterations, "spawns per backend and size, the default is 200"),
+    OPT_STRING('p', "program", &program, "program to spawn, the default is true"),
+    OPT_END(),
+  };
+
+  struct argparse argparse;
+  argparse_init(&argparse, command_options, command_usage, 0);
+  argparse_describe(&argparse, "\nCompares the spawn backends across parent resident set sizes.\nEach size is allocated and touched before spawning.", "");
+
+  const char * * argv_ = malloc(sizeof(char *) * argc);
+  memcpy((char * *) argv_, argv, sizeof(char *) * argc);
+  int argc_ = argparse_parse(&argparse, argc, argv_);
+
+  static const char * default_sizes[] = { "0", "64", "256", "1024" };
+  const char * const * sizes = argv_;
+  if (argc_ < 1) {
+    sizes = default_sizes;
+    argc_ = sizeof(default_sizes) / sizeof(default_sizes[0]);
+  }
+
+  if (iterations < 1) {
+    argparse_usage(&argparse);
+    exit(EX_USAGE);
+  }
+
+  int64_t * samples = calloc(iterations, sizeof(int64_t));
+  if (!samples) {
+    perror("calloc()");
+    exit(EX_OSERR);
+  }
+
+  const char * const process_arguments[] = { program, NULL };
+
+  sigset_t signal_mask;
+  sigprocmask(SIG_SETMASK, NULL, &signal_mask);
+
+  printf("%10s %12s %10s %10s %10s\n", "rss_mib", "backend", "p50_us", "p99_us", "max_us");
+
+  for (int s = 0; s < argc_; ++s) {
+
+    size_t rss_mib = strtoul(sizes[s], NULL, 10);
+    size_t rss_size = rss_mib * 1024 * 1024;
+    char * ballast = NULL;
+
+    if (rss_size) {
+      ballast = mmap(NULL, rss_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ballast == MAP_FAILED) {
+        perror("mmap()");
+        exit(EX_OSERR);
+      }
+      // touch every page so it is resident and has page table entries
+      memset(ballast, 1, rss_size);
+    }
+
+    for (SpawnBackend backend = SPAWN_FORK; backend <= SPAWN_POSIX_SPAWN; ++backend) {
+
+      if (bench_backend(backend, process_arguments, &signal_mask, samples, iterations) != 0) {
+        perror(spawn_backend_names[backend]);
+        exit(EX_OSERR);
+      }
+
+      printf(
+        "%10zu %12s %10.1f %10.1f %10.1f\n",
+        rss_mib,
+        spawn_backend_names[backend],
+        samples[iterations / 2] / 1000.0,
+        samples[(iterations * 99) / 100] / 1000.0,
+        samples[iterations - 1] / 1000.0
+      );
+
+    }
+
+    if (ballast) munmap(ballast, rss_size);
+
+  }
+
+  exit(EXIT_SUCCESS);
+
+}
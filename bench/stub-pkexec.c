@@ -0,0 +1,52 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <errno.h>
+#include <sysexits.h>
+
+#include <unistd.h>
+
+/**
+ * Stands in for pkexec when benchmarking, it authorises everything without a prompt.
+ * `pkexec <program> [<argument> ...]` runs the program directly, so what is measured
+ * is the elevation path of libprivelev and the mechanism, not Polkit.
+ *
+ * PRIVELEV_BENCH_DENY=<status> exits with that status instead, 127 is how pkexec
+ * reports a denied authorisation and 126 a dismissed dialog.
+ * PRIVELEV_BENCH_UID=<uid> switches to that user before running the program,
+ * which only works when the stub itself runs as root.
+ */
+int
+main (int argc, char * const * argv) {
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: pkexec <program> [<argument> ...]\n");
+    exit(EX_USAGE);
+  }
+
+  const char * deny = getenv("PRIVELEV_BENCH_DENY");
+  if (deny && *deny) {
+    exit(atoi(deny));
+  }
+
+  // pkexec tells the program who asked for it
+  char caller_uid[16];
+  snprintf(caller_uid, sizeof(caller_uid), "%u", (unsigned int) getuid());
+  setenv("PKEXEC_UID", caller_uid, 1);
+
+  const char * uid = getenv("PRIVELEV_BENCH_UID");
+  if (uid && *uid) {
+    uid_t target_uid = (uid_t) strtoul(uid, NULL, 10);
+    if (setresgid(target_uid, target_uid, target_uid) != 0 || setresuid(target_uid, target_uid, target_uid) != 0) {
+      perror("setresuid()");
+      exit(EX_NOPERM);
+    }
+  }
+
+  execv(argv[1], argv + 1);
+  perror("execv()");
+  exit(EX_OSERR);
+
+}
@@ -3,209 +3,229 @@
 #include <termios.h>
 
 #ifdef B50
-    #define CASEB50(TARGET) case 50: TARGET = B50; break;
+    #define BAUD50 { 50, B50 },
 #else
-    #define CASEB50(TARGET)
+    #define BAUD50
 #endif
 
 #ifdef B75
-    #define CASEB75(TARGET) case 75: TARGET = B75; break;
+    #define BAUD75 { 75, B75 },
 #else
-    #define CASEB75(TARGET)
+    #define BAUD75
 #endif
 
 #ifdef B110
-    #define CASEB110(TARGET) case 110: TARGET = B110; break;
+    #define BAUD110 { 110, B110 },
 #else
-    #define CASEB110(TARGET)
+    #define BAUD110
 #endif
 
 #ifdef B134
-    #define CASEB134(TARGET) case 134: TARGET = B134; break;
+    #define BAUD134 { 134, B134 },
 #else
-    #define CASEB134(TARGET)
+    #define BAUD134
 #endif
 
 #ifdef B150
-    #define CASEB150(TARGET) case 150: TARGET = B150; break;
+    #define BAUD150 { 150, B150 },
 #else
-    #define CASEB150(TARGET)
+    #define BAUD150
 #endif
 
 #ifdef B200
-    #define CASEB200(TARGET) case 200: TARGET = B200; break;
+    #define BAUD200 { 200, B200 },
 #else
-    #define CASEB200(TARGET)
+    #define BAUD200
 #endif
 
 #ifdef B300
-    #define CASEB300(TARGET) case 300: TARGET = B300; break;
+    #define BAUD300 { 300, B300 },
 #else
-    #define CASEB300(TARGET)
+    #define BAUD300
 #endif
 
 #ifdef B600
-    #define CASEB600(TARGET) case 600: TARGET = B600; break;
+    #define BAUD600 { 600, B600 },
 #else
-    #define CASEB600(TARGET)
+    #define BAUD600
 #endif
 
 #ifdef B1200
-    #define CASEB1200(TARGET) case 1200: TARGET = B1200; break;
+    #define BAUD1200 { 1200, B1200 },
 #else
-    #define CASEB1200(TARGET)
+    #define BAUD1200
 #endif
 
 #ifdef B2400
-    #define CASEB2400(TARGET) case 2400: TARGET = B2400; break;
+    #define BAUD2400 { 2400, B2400 },
 #else
-    #define CASEB2400(TARGET)
+    #define BAUD2400
 #endif
 
 #ifdef B4800
-    #define CASEB4800(TARGET) case 4800: TARGET = B4800; break;
+    #define BAUD4800 { 4800, B4800 },
 #else
-    #define CASEB4800(TARGET)
+    #define BAUD4800
 #endif
 
 #ifdef B9600
-    #define CASEB9600(TARGET) case 9600: TARGET = B9600; break;
+    #define BAUD9600 { 9600, B9600 },
 #else
-    #define CASEB9600(TARGET)
+    #define BAUD9600
 #endif
 
 #ifdef B19200
-    #define CASEB19200(TARGET) case 19200: TARGET = B19200; break;
+    #define BAUD19200 { 19200, B19200 },
 #else
-    #define CASEB19200(TARGET)
+    #define BAUD19200
 #endif
 
 #ifdef B38400
-    #define CASEB38400(TARGET) case 38400: TARGET = B38400; break;
+    #define BAUD38400 { 38400, B38400 },
 #else
-    #define CASEB38400(TARGET)
+    #define BAUD38400
 #endif
 
 #ifdef B57600
-    #define CASEB57600(TARGET) case 57600: TARGET = B57600; break;
+    #define BAUD57600 { 57600, B57600 },
 #else
-    #define CASEB57600(TARGET)
+    #define BAUD57600
 #endif
 
 #ifdef B115200
-    #define CASEB115200(TARGET) case 115200: TARGET = B115200; break;
+    #define BAUD115200 { 115200, B115200 },
 #else
-    #define CASEB115200(TARGET)
+    #define BAUD115200
 #endif
 
 #ifdef B128000
-    #define CASEB128000(TARGET) case 128000: TARGET = B128000; break;
+    #define BAUD128000 { 128000, B128000 },
 #else
-    #define CASEB128000(TARGET)
+    #define BAUD128000
 #endif
 
 #ifdef B230400
-    #define CASEB230400(TARGET) case 230400: TARGET = B230400; break;
+    #define BAUD230400 { 230400, B230400 },
 #else
-    #define CASEB230400(TARGET)
+    #define BAUD230400
 #endif
 
 #ifdef B256000
-    #define CASEB256000(TARGET) case 256000: TARGET = B256000; break;
+    #define BAUD256000 { 256000, B256000 },
 #else
-    #define CASEB256000(TARGET)
+    #define BAUD256000
 #endif
 
 #ifdef B460800
-    #define CASEB460800(TARGET) case 460800: TARGET = B460800; break;
+    #define BAUD460800 { 460800, B460800 },
 #else
-    #define CASEB460800(TARGET)
+    #define BAUD460800
 #endif
 
 #ifdef B500000
-    #define CASEB500000(TARGET) case 500000: TARGET = B500000; break;
+    #define BAUD500000 { 500000, B500000 },
 #else
-    #define CASEB500000(TARGET)
+    #define BAUD500000
 #endif
 
 #ifdef B576000
-    #define CASEB576000(TARGET) case 576000: TARGET = B576000; break;
+    #define BAUD576000 { 576000, B576000 },
 #else
-    #define CASEB576000(TARGET)
+    #define BAUD576000
 #endif
 
 #ifdef B921600
-    #define CASEB921600(TARGET) case 921600: TARGET = B921600; break;
+    #define BAUD921600 { 921600, B921600 },
 #else
-    #define CASEB921600(TARGET)
+    #define BAUD921600
 #endif
 
 #ifdef B1000000
-    #define CASEB1000000(TARGET) case 1000000: TARGET = B1000000; break;
+    #define BAUD1000000 { 1000000, B1000000 },
 #else
-    #define CASEB1000000(TARGET)
+    #define BAUD1000000
 #endif
 
 #ifdef B1152000
-    #define CASEB1152000(TARGET) case 1152000: TARGET = B1152000; break;
+    #define BAUD1152000 { 1152000, B1152000 },
 #else
-    #define CASEB1152000(TARGET)
+    #define BAUD1152000
 #endif
 
 #ifdef B1500000
-    #define CASEB1500000(TARGET) case 1500000: TARGET = B1500000; break;
+    #define BAUD1500000 { 1500000, B1500000 },
 #else
-    #define CASEB1500000(TARGET)
+    #define BAUD1500000
 #endif
 
 #ifdef B2000000
-    #define CASEB2000000(TARGET) case 2000000: TARGET = B2000000; break;
+    #define BAUD2000000 { 2000000, B2000000 },
 #else
-    #define CASEB2000000(TARGET)
+    #define BAUD2000000
 #endif
 
 #ifdef B2500000
-    #define CASEB2500000(TARGET) case 2500000: TARGET = B2500000; break;
+    #define BAUD2500000 { 2500000, B2500000 },
 #else
-    #define CASEB2500000(TARGET)
+    #define BAUD2500000
 #endif
 
 #ifdef B3000000
-    #define CASEB3000000(TARGET) case 3000000: TARGET = B3000000; break;
-#else
-    #define CASEB3000000(TARGET)
-#endif
-
-#define BAUDSWITCH(SOURCE, TARGET, DEFAULT) \
-    switch (SOURCE) { \
-        CASEB50(TARGET) \
-        CASEB75(TARGET) \
-        CASEB110(TARGET) \
-        CASEB134(TARGET) \
-        CASEB150(TARGET) \
-        CASEB200(TARGET) \
-        CASEB300(TARGET) \
-        CASEB600(TARGET) \
-        CASEB1200(TARGET) \
-        CASEB2400(TARGET) \
-        CASEB4800(TARGET) \
-        CASEB9600(TARGET) \
-        CASEB19200(TARGET) \
-        CASEB38400(TARGET) \
-        CASEB57600(TARGET) \
-        CASEB115200(TARGET) \
-        CASEB128000(TARGET) \
-        CASEB230400(TARGET) \
-        CASEB256000(TARGET) \
-        CASEB460800(TARGET) \
-        CASEB500000(TARGET) \
-        CASEB576000(TARGET) \
-        CASEB921600(TARGET) \
-        CASEB1000000(TARGET) \
-        CASEB1152000(TARGET) \
-        CASEB1500000(TARGET) \
-        CASEB2000000(TARGET) \
-        CASEB2500000(TARGET) \
-        CASEB3000000(TARGET) \
-        DEFAULT(TARGET) \
-    }
+    #define BAUD3000000 { 3000000, B3000000 },
+#else
+    #define BAUD3000000
+#endif
+
+#ifdef B3500000
+    #define BAUD3500000 { 3500000, B3500000 },
+#else
+    #define BAUD3500000
+#endif
+
+#ifdef B4000000
+    #define BAUD4000000 { 4000000, B4000000 },
+#else
+    #define BAUD4000000
+#endif
+
+typedef struct BaudRate {
+  unsigned int rate;
+  speed_t speed;
+} BaudRate;
+
+// the standard rates this platform has, in ascending order
+static const BaudRate baud_rates[] = {
+  BAUD50
+  BAUD75
+  BAUD110
+  BAUD134
+  BAUD150
+  BAUD200
+  BAUD300
+  BAUD600
+  BAUD1200
+  BAUD2400
+  BAUD4800
+  BAUD9600
+  BAUD19200
+  BAUD38400
+  BAUD57600
+  BAUD115200
+  BAUD128000
+  BAUD230400
+  BAUD256000
+  BAUD460800
+  BAUD500000
+  BAUD576000
+  BAUD921600
+  BAUD1000000
+  BAUD1152000
+  BAUD1500000
+  BAUD2000000
+  BAUD2500000
+  BAUD3000000
+  BAUD3500000
+  BAUD4000000
+};
+
+#define BAUD_RATES_COUNT (sizeof(baud_rates) / sizeof(baud_rates[0]))
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/param.h>
+
+#include "cache.h"
+
+// the cache only ever holds a handful of devices, anything past this is dropped
+#define CACHE_ENTRIES_MAX 256
+
+static int
+compare_gid (const void * a, const void * b) {
+
+  gid_t x = *(const gid_t *) a;
+  gid_t y = *(const gid_t *) b;
+  return (x > y) - (x < y);
+
+}
+
+static uint64_t
+hash_bytes (uint64_t hash, const void * bytes, size_t size) {
+
+  // FNV-1a
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= ((const unsigned char *) bytes)[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+
+}
+
+static uint64_t
+credentials_hash (void) {
+
+  uid_t uid = geteuid();
+  gid_t gid = getegid();
+  uint64_t hash = 0xcbf29ce484222325;
+  hash = hash_bytes(hash, &uid, sizeof(uid));
+  hash = hash_bytes(hash, &gid, sizeof(gid));
+
+  gid_t groups[NGROUPS_MAX];
+  int groups_count = getgroups(NGROUPS_MAX, groups);
+  if (groups_count > 0) {
+    qsort(groups, groups_count, sizeof(gid_t), compare_gid);
+    hash = hash_bytes(hash, groups, sizeof(gid_t) * groups_count);
+  }
+
+  return hash;
+
+}
+
+bool
+cache_key (const char * path, int fd, CacheKey * key) {
+
+  struct stat device_stat;
+  if ((fd != -1 ? fstat(fd, &device_stat) : stat(path, &device_stat)) != 0) {
+    return false;
+  }
+
+  key->rdev = device_stat.st_rdev;
+  key->uid = device_stat.st_uid;
+  key->gid = device_stat.st_gid;
+  key->mode = device_stat.st_mode;
+  key->credentials = credentials_hash();
+  serial_sysfs_path(major(key->rdev), minor(key->rdev), key->sysfs_path, sizeof(key->sysfs_path));
+
+  return true;
+
+}
+
+/**
+ * Parses a line of the cache:
+ * `<major>:<minor> <uid> <gid> <mode> <credentials> <decision> <sysfs-path>`
+ * where an empty sysfs path is written as `-`.
+ */
+static bool
+parse_entry (const char * line, CacheKey * key, CacheDecision * decision) {
+
+  unsigned int device_major, device_minor, uid, gid, mode, decision_;
+  unsigned long long credentials;
+  char sysfs_path[SERIAL_SYSFS_PATH_MAX];
+
+  if (
+    sscanf(
+      line,
+      "%u:%u %u %u %o %llx %u %255s",
+      &device_major,
+      &device_minor,
+      &uid,
+      &gid,
+      &mode,
+      &credentials,
+      &decision_,
+      sysfs_path
+    ) != 8 ||
+    decision_ > CACHE_ELEVATED
+  ) {
+    return false;
+  }
+
+  key->rdev = makedev(device_major, device_minor);
+  key->uid = uid;
+  key->gid = gid;
+  key->mode = mode;
+  key->credentials = credentials;
+  snprintf(key->sysfs_path, sizeof(key->sysfs_path), "%s", strcmp(sysfs_path, "-") ? sysfs_path : "");
+  *decision = (CacheDecision) decision_;
+  return true;
+
+}
+
+static void
+write_entry (FILE * stream, const CacheKey * key, CacheDecision decision) {
+
+  fprintf(
+    stream,
+    "%u:%u %u %u %o %llx %u %s\n",
+    major(key->rdev),
+    minor(key->rdev),
+    (unsigned int) key->uid,
+    (unsigned int) key->gid,
+    (unsigned int) key->mode,
+    (unsigned long long) key->credentials,
+    (unsigned int) decision,
+    key->sysfs_path[0] ? key->sysfs_path : "-"
+  );
+
+}
+
+// the same device, which may have changed owner or mode since
+static bool
+same_device (const CacheKey * a, const CacheKey * b) {
+
+  return a->rdev == b->rdev && strcmp(a->sysfs_path, b->sysfs_path) == 0;
+
+}
+
+static bool
+same_key (const CacheKey * a, const CacheKey * b) {
+
+  return same_device(a, b) &&
+    a->uid == b->uid &&
+    a->gid == b->gid &&
+    a->mode == b->mode &&
+    a->credentials == b->credentials;
+
+}
+
+void
+cache_lookup (
+  const char * cache_path,
+  const CacheKey * keys,
+  CacheDecision * decisions,
+  size_t count
+) {
+
+  for (size_t i = 0; i < count; ++i) {
+    decisions[i] = CACHE_UNKNOWN;
+  }
+
+  FILE * stream = fopen(cache_path, "re");
+  if (!stream) return;
+
+  // every device has at most one entry
+  char line[512];
+  while (fgets(line, sizeof(line), stream)) {
+    CacheKey entry_key;
+    CacheDecision decision;
+    if (!parse_entry(line, &entry_key, &decision)) continue;
+    for (size_t i = 0; i < count; ++i) {
+      if (keys[i].rdev != 0 && same_key(&entry_key, &keys[i])) {
+        decisions[i] = decision;
+      }
+    }
+  }
+
+  fclose(stream);
+
+}
+
+/**
+ * Creates the directories leading up to the cache, only we can read them.
+ */
+static bool
+make_parents (const char * cache_path) {
+
+  char dir_path[PATH_MAX];
+  snprintf(dir_path, sizeof(dir_path), "%s", cache_path);
+
+  for (char * separator = strchr(dir_path + 1, '/'); separator; separator = strchr(separator + 1, '/')) {
+    *separator = '\0';
+    if (mkdir(dir_path, 0700) != 0 && errno != EEXIST) return false;
+    *separator = '/';
+  }
+
+  return true;
+
+}
+
+bool
+cache_store (
+  const char * cache_path,
+  const CacheKey * keys,
+  const CacheDecision * decisions,
+  size_t count
+) {
+
+  if (!make_parents(cache_path)) return false;
+
+  char tmp_path[PATH_MAX];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", cache_path) >= (int) sizeof(tmp_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  int tmp_fd = mkostemp(tmp_path, O_CLOEXEC);
+  if (tmp_fd == -1) return false;
+
+  FILE * tmp_stream = fdopen(tmp_fd, "w");
+  if (!tmp_stream) {
+    close(tmp_fd);
+    unlink(tmp_path);
+    return false;
+  }
+
+  // the new decisions go first, so they survive the entry limit
+  size_t entries_count = 0;
+  for (size_t i = 0; i < count && entries_count < CACHE_ENTRIES_MAX; ++i) {
+    write_entry(tmp_stream, &keys[i], decisions[i]);
+    ++entries_count;
+  }
+
+  FILE * stream = fopen(cache_path, "re");
+  if (stream) {
+    char line[512];
+    while (entries_count < CACHE_ENTRIES_MAX && fgets(line, sizeof(line), stream)) {
+      CacheKey entry_key;
+      CacheDecision decision;
+      if (!parse_entry(line, &entry_key, &decision)) continue;
+      bool replaced = false;
+      for (size_t i = 0; i < count && !replaced; ++i) {
+        replaced = same_device(&entry_key, &keys[i]);
+      }
+      if (replaced) continue;
+      write_entry(tmp_stream, &entry_key, decision);
+      ++entries_count;
+    }
+    fclose(stream);
+  }
+
+  if (fclose(tmp_stream) != 0 || rename(tmp_path, cache_path) != 0) {
+    int store_errno = errno;
+    unlink(tmp_path);
+    errno = store_errno;
+    return false;
+  }
+
+  return true;
+
+}
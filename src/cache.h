@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "serial.h"
+
+/**
+ * How a device was last opened.
+ */
+typedef enum {
+  CACHE_UNKNOWN = 0,
+  // in-process or by the unprivileged mechanism
+  CACHE_UNPRIVILEGED,
+  CACHE_ELEVATED
+} CacheDecision;
+
+/**
+ * Identity of a device and of who is opening it.
+ * A decision only holds while all of it is unchanged, so a device that was
+ * replaced, chowned or chmodded, or a user whose groups changed, starts over.
+ */
+typedef struct CacheKey {
+  dev_t rdev;
+  uid_t uid;
+  gid_t gid;
+  mode_t mode;
+  // hash of our effective user, group and supplementary groups
+  uint64_t credentials;
+  char sysfs_path[SERIAL_SYSFS_PATH_MAX];
+} CacheKey;
+
+/**
+ * Builds the key of the device at the path, or of an opened device if fd is not -1.
+ * Returns false with errno set if it could not be inspected.
+ */
+bool cache_key (const char * path, int fd, CacheKey * key);
+
+/**
+ * Looks up the decisions for devices, CACHE_UNKNOWN for those that have none
+ * or whose entry is stale. Keys with an rdev of 0 are not looked up.
+ */
+void cache_lookup (
+  const char * cache_path,
+  const CacheKey * keys,
+  CacheDecision * decisions,
+  size_t count
+);
+
+/**
+ * Records decisions, replacing the entries of the same devices.
+ * The cache is replaced atomically, so concurrent readers never see a partial file,
+ * concurrent writers may lose each other's entries which only costs a later lookup.
+ * Returns false with errno set if the cache could not be written.
+ */
+bool cache_store (
+  const char * cache_path,
+  const CacheKey * keys,
+  const CacheDecision * decisions,
+  size_t count
+);
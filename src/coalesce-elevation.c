@@ -0,0 +1,951 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <sysexits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+
+#include <string.h>
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "argparse/argparse.h"
+#include "coalesce.h"
+#include "privelev.h"
+#include "protocol.h"
+#include "rendezvous.h"
+
+// an elevation starts once nobody else has asked for this long
+#define COALESCE_GATHER_MS 10
+// or this long after the first ask, however many keep coming
+#define COALESCE_GATHER_MAX_MS 100
+// stay around after an elevation, for those that were just behind it
+#define COALESCE_LINGER_MS 100
+// a client sends everything it wants right after connecting, it is read as it arrives
+// so one that stalls only holds up itself, and is dropped after this long
+#define COALESCE_RECEIVE_TIMEOUT_MS 1000
+// the most a client may send, which is plenty of devices
+#define COALESCE_REQUEST_MAX (1024 * (sizeof(MechanismProtoHeader) + PRIVFD_BODY_MAX))
+
+typedef struct Client {
+  int sock_fd;
+  // what it sent that is not parsed yet, until its end message
+  char * received;
+  size_t received_length;
+  size_t received_capacity;
+  int64_t connected_ms;
+  // what the client asked for, the file descriptors are not the client's own
+  privelev_device * devices;
+  size_t devices_count;
+  size_t devices_capacity;
+  // some of its devices are not kept and need the round's elevation
+  bool elevating;
+} Client;
+
+/**
+ * The clients of one elevation and the union of the devices it opens.
+ */
+typedef struct Round {
+  Client * clients;
+  size_t clients_count;
+  size_t clients_capacity;
+  privelev_device * devices;
+  size_t devices_count;
+  size_t devices_capacity;
+  int64_t first_ms;
+  int64_t last_ms;
+} Round;
+
+/**
+ * Clients that connected and are still sending what they want.
+ */
+typedef struct Arrivals {
+  Client * clients;
+  size_t count;
+  size_t capacity;
+} Arrivals;
+
+/**
+ * A device kept open after it was handed out.
+ */
+typedef struct Entry {
+  privelev_device device;
+  // the line settings it was opened with, it is dropped once they change
+  struct termios termios;
+} Entry;
+
+typedef struct Store {
+  Entry * entries;
+  size_t count;
+  size_t capacity;
+} Store;
+
+static int64_t
+monotonic_ms (void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+}
+
+static void
+free_devices (privelev_device * devices, size_t devices_count, bool owned) {
+
+  for (size_t i = 0; i < devices_count; ++i) {
+    if (owned && devices[i].fd >= 0) close(devices[i].fd);
+    free((char *) devices[i].path);
+  }
+
+}
+
+/**
+ * Appends a device with its own copy of the path.
+ */
+static privelev_device *
+append_device (
+  privelev_device * * devices,
+  size_t * devices_count,
+  size_t * devices_capacity,
+  const char * path,
+  size_t path_length,
+  uint32_t baud,
+  const privelev_line * line
+) {
+
+  if (*devices_count == *devices_capacity) {
+    size_t capacity = MAX(*devices_capacity * 2, 8);
+    privelev_device * grown = realloc(*devices, capacity * sizeof(privelev_device));
+    if (!grown) return NULL;
+    *devices = grown;
+    *devices_capacity = capacity;
+  }
+
+  char * device_path = strndup(path, path_length);
+  if (!device_path) return NULL;
+
+  privelev_device * device = &(*devices)[(*devices_count)++];
+  *device = (privelev_device) { .path = device_path, .baud = baud, .line = *line, .fd = -1 };
+  return device;
+
+}
+
+/**
+ * Whether two devices are asked for with the same baud and line settings.
+ * Clients send the line with its defaults filled in, so the fields compare as they are.
+ */
+static bool
+same_settings (const privelev_device * device, const privelev_device * other_device) {
+
+  const privelev_line * line = &device->line;
+  const privelev_line * other_line = &other_device->line;
+  return (
+    device->baud == other_device->baud &&
+    line->data_bits == other_line->data_bits &&
+    line->parity == other_line->parity &&
+    line->stop_bits == other_line->stop_bits &&
+    line->rts_cts == other_line->rts_cts &&
+    line->xon_xoff == other_line->xon_xoff &&
+    line->rs485 == other_line->rs485 &&
+    line->low_latency == other_line->low_latency &&
+    line->rs485_delay_before_ms == other_line->rs485_delay_before_ms &&
+    line->rs485_delay_after_ms == other_line->rs485_delay_after_ms
+  );
+
+}
+
+static privelev_device *
+find_device (privelev_device * devices, size_t devices_count, const privelev_device * request) {
+
+  for (size_t i = 0; i < devices_count; ++i) {
+    if (same_settings(&devices[i], request) && strcmp(devices[i].path, request->path) == 0) {
+      return &devices[i];
+    }
+  }
+  return NULL;
+
+}
+
+static Entry *
+find_entry (Store * store, const char * path) {
+
+  for (size_t i = 0; i < store->count; ++i) {
+    if (strcmp(store->entries[i].device.path, path) == 0) {
+      return &store->entries[i];
+    }
+  }
+  return NULL;
+
+}
+
+static void
+drop_entry (Store * store, Entry * entry) {
+
+  free_devices(&entry->device, 1, true);
+  *entry = store->entries[--store->count];
+
+}
+
+static bool
+same_termios (const struct termios * a, const struct termios * b) {
+
+  return a->c_iflag == b->c_iflag &&
+    a->c_oflag == b->c_oflag &&
+    a->c_cflag == b->c_cflag &&
+    a->c_lflag == b->c_lflag &&
+    cfgetispeed(a) == cfgetispeed(b) &&
+    cfgetospeed(a) == cfgetospeed(b) &&
+    memcmp(a->c_cc, b->c_cc, sizeof(a->c_cc)) == 0;
+
+}
+
+/**
+ * A kept device is only handed out again while it is still attached,
+ * its path still names it, and nobody has set it up differently since.
+ */
+static bool
+entry_valid (const Entry * entry) {
+
+  int fd = entry->device.fd;
+
+  struct pollfd poll_fd = { .fd = fd, .events = 0 };
+  if (poll(&poll_fd, 1, 0) != 0) return false;
+
+  struct stat kept_stat, path_stat;
+  if (
+    fstat(fd, &kept_stat) != 0 ||
+    stat(entry->device.path, &path_stat) != 0 ||
+    kept_stat.st_rdev != path_stat.st_rdev
+  ) {
+    return false;
+  }
+
+  struct termios termios;
+  return tcgetattr(fd, &termios) == 0 && same_termios(&termios, &entry->termios);
+
+}
+
+static void
+prune_store (Store * store) {
+
+  for (size_t i = store->count; i > 0; --i) {
+    if (!entry_valid(&store->entries[i - 1])) {
+      drop_entry(store, &store->entries[i - 1]);
+    }
+  }
+
+}
+
+/**
+ * Keeps a device opened by the round, taking over its file descriptor.
+ */
+static void
+keep_device (Store * store, privelev_device * device) {
+
+  struct termios termios;
+  if (device->fd < 0 || tcgetattr(device->fd, &termios) != 0) return;
+
+  Entry * replaced = find_entry(store, device->path);
+  if (replaced) drop_entry(store, replaced);
+
+  if (store->count == store->capacity) {
+    size_t capacity = MAX(store->capacity * 2, 8);
+    Entry * entries = realloc(store->entries, capacity * sizeof(Entry));
+    if (!entries) return;
+    store->entries = entries;
+    store->capacity = capacity;
+  }
+
+  char * path = strdup(device->path);
+  if (!path) return;
+
+  Entry * entry = &store->entries[store->count++];
+  entry->device = *device;
+  entry->device.path = path;
+  entry->termios = termios;
+  device->fd = -1;
+
+}
+
+/**
+ * The kept device for what a client asked for, NULL if it is not kept.
+ */
+static const privelev_device *
+kept_device (Store * store, const privelev_device * request) {
+
+  Entry * entry = find_entry(store, request->path);
+  if (!entry || !same_settings(&entry->device, request)) return NULL;
+  return &entry->device;
+
+}
+
+/**
+ * Parses the messages a client sent so far.
+ * Returns 1 once it sent its end message, 0 while it has more to send, or -1 if it is malformed.
+ */
+static int
+parse_client (Client * client) {
+
+  size_t offset = 0;
+  int status = 0;
+
+  while (status == 0) {
+
+    MechanismProtoHeader header;
+    const char * body;
+    ssize_t size = protocol_parse(client->received + offset, client->received_length - offset, &header, &body);
+    if (size == -1) {
+      fprintf(stderr, "%s: %s\n", "Could not receive request", strerror(errno));
+      return -1;
+    } else if (size == 0) {
+      break;
+    }
+    offset += (size_t) size;
+
+    if (header.type == PRIVFD_END) {
+      status = (client->devices_count > 0) ? 1 : -1;
+      continue;
+    } else if (header.type != PRIVFD_OPEN) {
+      // later additions to the protocol are skipped
+      continue;
+    }
+
+    MechanismProtoOpen open_device;
+    if (header.length < sizeof(open_device)) {
+      fprintf(stderr, "%s\n", "Received incorrect message size from client");
+      return -1;
+    }
+    memcpy(&open_device, body, sizeof(open_device));
+    if (header.length != sizeof(open_device) + open_device.path_length || open_device.path_length == 0) {
+      fprintf(stderr, "%s\n", "Received incorrect message size from client");
+      return -1;
+    }
+    if (open_device.line_flags & ~PRIVFD_LINE_KNOWN) {
+      fprintf(stderr, "%s\n", "Received unknown line flags from client");
+      return -1;
+    }
+
+    if (
+      !append_device(
+        &client->devices,
+        &client->devices_count,
+        &client->devices_capacity,
+        body + sizeof(open_device),
+        open_device.path_length,
+        open_device.baud,
+        &(privelev_line) {
+          .data_bits = open_device.data_bits,
+          .parity = (privelev_parity) open_device.parity,
+          .stop_bits = open_device.stop_bits,
+          .rts_cts = open_device.line_flags & PRIVFD_LINE_RTS_CTS,
+          .xon_xoff = open_device.line_flags & PRIVFD_LINE_XON_XOFF,
+          .rs485 = open_device.line_flags & PRIVFD_LINE_RS485,
+          .rs485_delay_before_ms = open_device.rs485_delay_before_ms,
+          .rs485_delay_after_ms = open_device.rs485_delay_after_ms,
+          .low_latency = open_device.line_flags & PRIVFD_LINE_LOW_LATENCY
+        }
+      )
+    ) {
+      perror("append_device()");
+      return -1;
+    }
+
+  }
+
+  // what is left is the start of a message still being sent
+  memmove(client->received, client->received + offset, client->received_length - offset);
+  client->received_length -= offset;
+  return status;
+
+}
+
+/**
+ * Sends a client its devices, in the same messages as the mechanism would.
+ */
+static int
+send_devices (const Client * client) {
+
+  const privelev_device * devices = client->devices;
+
+  for (size_t offset = 0; offset < client->devices_count; offset += PRIVFD_BATCH_MAX) {
+
+    size_t count = MIN(client->devices_count - offset, PRIVFD_BATCH_MAX);
+    MechanismProtoBatch batch = { (uint8_t) count };
+    MechanismProtoResult results[PRIVFD_BATCH_MAX];
+    char body[sizeof(batch) + sizeof(results)];
+    int fds[PRIVFD_BATCH_MAX];
+    size_t fds_count = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+      const privelev_device * device = &devices[offset + i];
+      results[i].index = (uint16_t) (offset + i);
+      results[i].error = (device->fd >= 0) ? 0 : (device->error ? device->error : EIO);
+      if (device->fd >= 0) {
+        fds[fds_count++] = device->fd;
+      }
+    }
+
+    size_t length = sizeof(batch) + sizeof(MechanismProtoResult) * count;
+    memcpy(body, &batch, sizeof(batch));
+    memcpy(body + sizeof(batch), results, sizeof(MechanismProtoResult) * count);
+
+    int status = protocol_send(client->sock_fd, PRIVFD_BATCH, body, length, fds, fds_count, NULL);
+    if (status != 1) return status;
+
+    for (size_t i = offset; i < offset + count; ++i) {
+      const privelev_device * device = &devices[i];
+      if (device->fd < 0) continue;
+      size_t sysfs_path_length = MIN(strlen(device->sysfs_path), PRIVFD_SYSFS_PATH_MAX);
+      MechanismProtoDevice description = {
+        .index = (uint16_t) i,
+        .major = device->major,
+        .minor = device->minor,
+        .ispeed = device->applied_baud,
+        .ospeed = device->applied_baud,
+        .sysfs_path_length = (uint16_t) sysfs_path_length
+      };
+      char device_body[sizeof(description) + PRIVFD_SYSFS_PATH_MAX];
+      memcpy(device_body, &description, sizeof(description));
+      memcpy(device_body + sizeof(description), device->sysfs_path, sysfs_path_length);
+      status = protocol_send(
+        client->sock_fd,
+        PRIVFD_DEVICE,
+        device_body,
+        sizeof(description) + sysfs_path_length,
+        NULL,
+        0,
+        NULL
+      );
+      if (status != 1) return status;
+    }
+
+  }
+
+  return protocol_send(client->sock_fd, PRIVFD_END, NULL, 0, NULL, 0, NULL);
+
+}
+
+static void
+send_failure (const Client * client, privelev_status status) {
+
+  MechanismProtoError failure = { PRIVFD_ERROR_SYSTEM, EIO };
+  switch (status) {
+  case PRIVELEV_ERROR_DENIED:
+    failure.code = PRIVFD_ERROR_DENIED;
+    failure.error = 0;
+    break;
+  case PRIVELEV_ERROR_DISMISSED:
+    failure.code = PRIVFD_ERROR_DISMISSED;
+    failure.error = 0;
+    break;
+  case PRIVELEV_ERROR_SYSTEM:
+    failure.error = errno;
+    break;
+  default:
+    break;
+  }
+  protocol_send(client->sock_fd, PRIVFD_ERROR, &failure, sizeof(failure), NULL, 0, NULL);
+
+}
+
+/**
+ * Fills in a client's devices from the store, or else from the round's devices.
+ */
+static void
+resolve_client (Client * client, Store * store, Round * round) {
+
+  for (size_t i = 0; i < client->devices_count; ++i) {
+    privelev_device * request = &client->devices[i];
+    const privelev_device * source = kept_device(store, request);
+    if (!source) source = find_device(round->devices, round->devices_count, request);
+    if (!source) {
+      request->error = ENODEV;
+      continue;
+    }
+    const char * path = request->path;
+    *request = *source;
+    request->path = path;
+  }
+
+}
+
+static void
+end_client (Client * client) {
+
+  close(client->sock_fd);
+  free(client->received);
+  free_devices(client->devices, client->devices_count, false);
+  free(client->devices);
+
+}
+
+/**
+ * Accepts every waiting client of our user, which then sends what it wants as it arrives.
+ * Returns the number of clients accepted.
+ */
+static size_t
+accept_clients (Arrivals * arrivals, int listen_fd) {
+
+  size_t accepted = 0;
+
+  while (true) {
+
+    int sock_fd = TEMP_FAILURE_RETRY(accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK));
+    if (sock_fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept()");
+      return accepted;
+    }
+    ++accepted;
+
+    Client client = { .sock_fd = sock_fd, .connected_ms = monotonic_ms() };
+
+    // the socket's directory already keeps everyone else out
+    struct ucred peer_credentials;
+    socklen_t peer_credentials_size = sizeof(peer_credentials);
+    if (
+      getsockopt(sock_fd, SOL_SOCKET, SO_PEERCRED, &peer_credentials, &peer_credentials_size) != 0
+    ) {
+      perror("getsockopt()");
+      end_client(&client);
+      continue;
+    } else if (peer_credentials.uid != getuid()) {
+      fprintf(stderr, "%s\n", "Rejected connection from another user");
+      end_client(&client);
+      continue;
+    }
+
+    if (arrivals->count == arrivals->capacity) {
+      size_t capacity = MAX(arrivals->capacity * 2, 8);
+      Client * clients = realloc(arrivals->clients, capacity * sizeof(Client));
+      if (!clients) {
+        perror("realloc()");
+        end_client(&client);
+        continue;
+      }
+      arrivals->clients = clients;
+      arrivals->capacity = capacity;
+    }
+    arrivals->clients[arrivals->count++] = client;
+
+  }
+
+}
+
+/**
+ * Reads what a client sent since it was last readable.
+ * Returns 1 once it sent everything it wants, 0 while it has more to send, or -1 if it cannot be served.
+ */
+static int
+receive_client (Client * client) {
+
+  while (true) {
+
+    if (client->received_length == client->received_capacity) {
+      if (client->received_capacity == COALESCE_REQUEST_MAX) {
+        fprintf(stderr, "%s\n", "Received too large a request from client");
+        return -1;
+      }
+      size_t capacity = MIN(MAX(client->received_capacity * 2, 4096), COALESCE_REQUEST_MAX);
+      char * received = realloc(client->received, capacity);
+      if (!received) {
+        perror("realloc()");
+        return -1;
+      }
+      client->received = received;
+      client->received_capacity = capacity;
+    }
+
+    ssize_t size = TEMP_FAILURE_RETRY(
+      recv(
+        client->sock_fd,
+        client->received + client->received_length,
+        client->received_capacity - client->received_length,
+        0
+      )
+    );
+    if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    } else if (size <= 0) {
+      fprintf(stderr, "%s: %s\n", "Could not receive request", (size == 0) ? "Client hung up" : strerror(errno));
+      return -1;
+    }
+    client->received_length += (size_t) size;
+
+    int status = parse_client(client);
+    if (status != 0) {
+      return status;
+    }
+
+  }
+
+}
+
+/**
+ * Serves a client whose devices are all kept right away, the rest join the round.
+ */
+static void
+admit_client (Round * round, Store * store, Client client) {
+
+  // answers are sent as they were before there were many clients to read at once
+  free(client.received);
+  client.received = NULL;
+  client.received_length = 0;
+  client.received_capacity = 0;
+  if (fcntl(client.sock_fd, F_SETFL, fcntl(client.sock_fd, F_GETFL, 0) & ~O_NONBLOCK) == -1) {
+    perror("fcntl()");
+    end_client(&client);
+    return;
+  }
+
+  prune_store(store);
+  for (size_t i = 0; i < client.devices_count && !client.elevating; ++i) {
+    client.elevating = !kept_device(store, &client.devices[i]);
+  }
+
+  if (!client.elevating) {
+    resolve_client(&client, store, round);
+    if (send_devices(&client) == -1 && errno != EPIPE) {
+      perror("sendmsg()");
+    }
+    end_client(&client);
+    return;
+  }
+
+  if (round->clients_count == round->clients_capacity) {
+    size_t capacity = MAX(round->clients_capacity * 2, 8);
+    Client * clients = realloc(round->clients, capacity * sizeof(Client));
+    if (!clients) {
+      perror("realloc()");
+      end_client(&client);
+      return;
+    }
+    round->clients = clients;
+    round->clients_capacity = capacity;
+  }
+
+  round->clients[round->clients_count++] = client;
+  round->last_ms = monotonic_ms();
+  if (round->clients_count == 1) round->first_ms = round->last_ms;
+
+}
+
+/**
+ * Reads the arriving clients that were polled readable, the first polled_count of them,
+ * admitting those that sent everything. A client we cannot serve, or that took too long,
+ * sees the connection close.
+ */
+static void
+receive_arrivals (
+  Arrivals * arrivals,
+  const struct pollfd * poll_fds,
+  size_t polled_count,
+  Round * round,
+  Store * store
+) {
+
+  int64_t now_ms = monotonic_ms();
+  size_t kept = 0;
+
+  for (size_t i = 0; i < arrivals->count; ++i) {
+    Client client = arrivals->clients[i];
+    int status = 0;
+    if (i < polled_count && poll_fds[i].revents) {
+      status = receive_client(&client);
+    }
+    if (status == 0 && now_ms - client.connected_ms >= COALESCE_RECEIVE_TIMEOUT_MS) {
+      fprintf(stderr, "%s\n", "Client did not send its request in time");
+      status = -1;
+    }
+    if (status == 1) {
+      admit_client(round, store, client);
+    } else if (status == -1) {
+      end_client(&client);
+    } else {
+      arrivals->clients[kept++] = client;
+    }
+  }
+
+  arrivals->count = kept;
+
+}
+
+/**
+ * When the round's elevation starts, once nobody else has asked for a while.
+ */
+static int64_t
+round_start_ms (const Round * round) {
+
+  return MIN(round->last_ms + COALESCE_GATHER_MS, round->first_ms + COALESCE_GATHER_MAX_MS);
+
+}
+
+/**
+ * Opens the union of the round's devices that are not kept with a single elevation,
+ * and hands every client its devices.
+ * Clients that gave up in the meantime are skipped, their sends fail with EPIPE.
+ */
+static void
+run_round (privelev_ctx * ctx, Round * round, Store * store, bool keeping) {
+
+  prune_store(store);
+
+  // the tty has one set of line settings, so a kept device asked for with
+  // another baud or line is reopened, and set up, for everyone in this round
+  for (size_t i = 0; i < round->clients_count; ++i) {
+    Client * client = &round->clients[i];
+    for (size_t j = 0; j < client->devices_count; ++j) {
+      const privelev_device * request = &client->devices[j];
+      Entry * entry = find_entry(store, request->path);
+      if (entry && !same_settings(&entry->device, request)) drop_entry(store, entry);
+    }
+  }
+
+  for (size_t i = 0; i < round->clients_count; ++i) {
+    Client * client = &round->clients[i];
+    for (size_t j = 0; j < client->devices_count; ++j) {
+      const privelev_device * request = &client->devices[j];
+      if (
+        !kept_device(store, request) &&
+        !find_device(round->devices, round->devices_count, request) &&
+        !append_device(
+          &round->devices,
+          &round->devices_count,
+          &round->devices_capacity,
+          request->path,
+          strlen(request->path),
+          request->baud,
+          &request->line
+        )
+      ) {
+        perror("append_device()");
+      }
+    }
+  }
+
+  privelev_status status = PRIVELEV_OK;
+  if (round->devices_count) {
+    status = privelev_open_serial_many(ctx, round->devices, round->devices_count);
+  }
+
+  for (size_t i = 0; i < round->clients_count; ++i) {
+    Client * client = &round->clients[i];
+    if (status == PRIVELEV_OK) {
+      resolve_client(client, store, round);
+      if (send_devices(client) == -1 && errno != EPIPE) {
+        perror("sendmsg()");
+      }
+    } else {
+      send_failure(client, status);
+    }
+    end_client(client);
+  }
+
+  // the clients have their own copies now, which the store may keep
+  if (status == PRIVELEV_OK && keeping) {
+    for (size_t i = 0; i < round->devices_count; ++i) {
+      keep_device(store, &round->devices[i]);
+    }
+  }
+  free_devices(round->devices, round->devices_count, true);
+
+  round->clients_count = 0;
+  round->devices_count = 0;
+
+}
+
+int
+main (int argc, const char * const * argv) {
+
+  static const char * const command_usage[] = {
+    "coalesce-elevation [options] <runtime-directory> fd:<listening-socket>",
+    NULL,
+  };
+
+  const char * mechanism_path = NULL;
+  const char * pkexec_path = NULL;
+  int keep_ms = 0;
+  int lease_ms = 0;
+  int lease_opens = 0;
+
+  struct argparse_option command_options[] = {
+    OPT_HELP(),
+    OPT_STRING(0, "mechanism", &mechanism_path, "the mechanism to run with elevated privileges"),
+    OPT_STRING(0, "pkexec", &pkexec_path, "the pkexec to run the mechanism with"),
+    OPT_INTEGER(0, "keep", &keep_ms, "keep the opened devices for this many milliseconds after last being asked for anything"),
+    OPT_INTEGER(0, "lease", &lease_ms, "have the elevated mechanism serve later elevations for this many milliseconds"),
+    OPT_INTEGER(0, "lease-opens", &lease_opens, "have it open at most this many more devices"),
+    OPT_END(),
+  };
+
+  struct argparse argparse;
+  argparse_init(&argparse, command_options, command_usage, 0);
+  argparse_describe(&argparse, "\nThis is started by libprivelev and not meant to be executed directly. It runs one elevated mechanism for every process of the user needing elevation at about the same time, and passes each its file descriptors.", "");
+
+  const char * * argv_ = malloc(sizeof (char *) * argc);
+  memcpy((char * *) argv_, argv, sizeof(char *) * argc);
+
+  int argc_ = argparse_parse(&argparse, argc, argv_);
+  if (argc_ != 2) {
+    argparse_usage(&argparse);
+    exit(EX_USAGE);
+  }
+
+  CoalescePaths paths;
+  if (!coalesce_paths(argv_[0], &paths)) {
+    perror("coalesce_paths()");
+    exit(EX_OSERR);
+  }
+
+  int listen_fd = rendezvous_inherited_fd(argv_[1]);
+  struct stat listen_stat;
+  if (listen_fd < 0 || fstat(listen_fd, &listen_stat) != 0 || !S_ISSOCK(listen_stat.st_mode)) {
+    fprintf(stderr, "%s\n", "Inherited listening socket is not a socket");
+    exit(EX_USAGE);
+  }
+  if (
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC) == -1 ||
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK) == -1
+  ) {
+    perror("fcntl()");
+    exit(EX_OSERR);
+  }
+
+  privelev_ctx * ctx = privelev_ctx_new();
+  if (
+    !ctx ||
+    (mechanism_path && !privelev_ctx_set_mechanism_path(ctx, mechanism_path)) ||
+    (pkexec_path && !privelev_ctx_set_pkexec_path(ctx, pkexec_path)) ||
+    (
+      lease_ms > 0 &&
+      !privelev_ctx_set_lease(ctx, &(privelev_lease) { lease_ms, (unsigned int) MAX(lease_opens, 0), NULL, 0 })
+    )
+  ) {
+    perror("privelev_ctx_new()");
+    exit(EX_OSERR);
+  }
+
+  // we outlive the process that started us, whose output may be a pipe
+  // someone is waiting to be closed, so only failures to start are reported
+  int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (
+    null_fd == -1 ||
+    dup2(null_fd, STDIN_FILENO) == -1 ||
+    dup2(null_fd, STDOUT_FILENO) == -1 ||
+    dup2(null_fd, STDERR_FILENO) == -1
+  ) {
+    perror("/dev/null");
+    exit(EX_OSERR);
+  }
+  close(null_fd);
+
+  // the process that started us only waits for this, so it does not have to reap us later
+  // we stay in its session, where pkexec finds the controlling terminal to prompt on
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork()");
+    exit(EX_OSERR);
+  } else if (pid > 0) {
+    _exit(EXIT_SUCCESS);
+  }
+
+  Round round = {0};
+  Store store = {0};
+  Arrivals arrivals = {0};
+  int64_t active_ms = monotonic_ms();
+  struct pollfd * poll_fds = NULL;
+
+  while (true) {
+
+    int64_t now_ms = monotonic_ms();
+    // staying around as long as the mechanism's lease, which ends with us
+    int linger_ms = MAX(MAX(keep_ms, lease_ms), COALESCE_LINGER_MS);
+    int64_t wake_ms = round.clients_count ? round_start_ms(&round) : active_ms + linger_ms;
+    for (size_t i = 0; i < arrivals.count; ++i) {
+      wake_ms = MIN(wake_ms, arrivals.clients[i].connected_ms + COALESCE_RECEIVE_TIMEOUT_MS);
+    }
+    int timeout = (int) MAX(wake_ms - now_ms, 0);
+
+    // arriving clients are read as they send,
+    // and kept devices are watched for hanging up, which is how a removed device shows
+    size_t polled_count = arrivals.count;
+    struct pollfd * grown = realloc(poll_fds, (1 + polled_count + store.count) * sizeof(struct pollfd));
+    if (!grown) {
+      perror("realloc()");
+      break;
+    }
+    poll_fds = grown;
+    poll_fds[0] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+    for (size_t i = 0; i < polled_count; ++i) {
+      poll_fds[1 + i] = (struct pollfd) { .fd = arrivals.clients[i].sock_fd, .events = POLLIN };
+    }
+    struct pollfd * store_poll_fds = poll_fds + 1 + polled_count;
+    for (size_t i = 0; i < store.count; ++i) {
+      store_poll_fds[i] = (struct pollfd) { .fd = store.entries[i].device.fd, .events = 0 };
+    }
+
+    int ready = poll(poll_fds, 1 + polled_count + store.count, timeout);
+    if (ready == -1 && errno == EINTR) {
+      continue;
+    } else if (ready == -1) {
+      perror("poll()");
+      break;
+    }
+
+    if (ready) {
+      for (size_t i = 0; i < store.count; ++i) {
+        if (store_poll_fds[i].revents) {
+          prune_store(&store);
+          break;
+        }
+      }
+      if (poll_fds[0].revents & POLLIN) {
+        accept_clients(&arrivals, listen_fd);
+        active_ms = monotonic_ms();
+      }
+    }
+    // also drops those that took too long, whether or not they were readable
+    receive_arrivals(&arrivals, poll_fds + 1, polled_count, &round, &store);
+
+    now_ms = monotonic_ms();
+    if (round.clients_count) {
+      // however many are still arriving
+      if (now_ms >= round_start_ms(&round)) {
+        run_round(ctx, &round, &store, keep_ms > 0);
+        active_ms = monotonic_ms();
+      }
+    } else if (!ready && !arrivals.count && now_ms >= active_ms + linger_ms) {
+      // those connecting hold the lock, so once we have it nobody is left in the backlog
+      int lock_fd = coalesce_lock(&paths);
+      size_t accepted = accept_clients(&arrivals, listen_fd);
+      if (accepted == 0) {
+        unlink(paths.sock_path);
+        close(listen_fd);
+      }
+      if (lock_fd != -1) close(lock_fd);
+      if (accepted == 0) break;
+      active_ms = monotonic_ms();
+    }
+
+  }
+
+  while (store.count) {
+    drop_entry(&store, &store.entries[0]);
+  }
+  free(store.entries);
+  free(arrivals.clients);
+  free(poll_fds);
+  privelev_ctx_free(ctx);
+
+  exit(EXIT_SUCCESS);
+
+}
@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "coalesce.h"
+#include "rendezvous.h"
+
+// the coalescer's backlog, connections past it wait in connect
+#define COALESCE_BACKLOG 128
+
+bool
+coalesce_paths (const char * runtime_dir, CoalescePaths * paths) {
+
+  if (
+    snprintf(paths->dir_path, sizeof(paths->dir_path), "%s/privilege-elevation", runtime_dir) >=
+      (int) sizeof(paths->dir_path) ||
+    snprintf(paths->lock_path, sizeof(paths->lock_path), "%s/coalesce.lock", paths->dir_path) >=
+      (int) sizeof(paths->lock_path) ||
+    snprintf(paths->sock_path, sizeof(paths->sock_path), "%s/coalesce.sock", paths->dir_path) >=
+      (int) sizeof(paths->sock_path)
+  ) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  // only we can reach the socket, which is what lets the coalescer trust its clients
+  if (mkdir(paths->dir_path, 0700) != 0 && errno != EEXIST) {
+    return false;
+  }
+
+  return true;
+
+}
+
+int
+coalesce_lock (const CoalescePaths * paths) {
+
+  int lock_fd = open(paths->lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd == -1) return -1;
+
+  if (TEMP_FAILURE_RETRY(flock(lock_fd, LOCK_EX)) != 0) {
+    int lock_errno = errno;
+    close(lock_fd);
+    errno = lock_errno;
+    return -1;
+  }
+
+  return lock_fd;
+
+}
+
+int
+coalesce_connect (const CoalescePaths * paths) {
+
+  struct sockaddr_un sock_addr;
+  socklen_t sock_addr_size = rendezvous_sockaddr(paths->sock_path, &sock_addr);
+
+  int sock_fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock_fd == -1) return -1;
+
+  if (TEMP_FAILURE_RETRY(connect(sock_fd, (struct sockaddr *) &sock_addr, sock_addr_size)) != 0) {
+    int connect_errno = errno;
+    close(sock_fd);
+    errno = connect_errno;
+    return -1;
+  }
+
+  return sock_fd;
+
+}
+
+int
+coalesce_listen (const CoalescePaths * paths) {
+
+  struct sockaddr_un sock_addr;
+  socklen_t sock_addr_size = rendezvous_sockaddr(paths->sock_path, &sock_addr);
+
+  int sock_fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock_fd == -1) return -1;
+
+  // under the lock, a socket nobody accepts on was left behind
+  unlink(paths->sock_path);
+
+  if (
+    bind(sock_fd, (struct sockaddr *) &sock_addr, sock_addr_size) != 0 ||
+    listen(sock_fd, COALESCE_BACKLOG) != 0
+  ) {
+    int listen_errno = errno;
+    close(sock_fd);
+    errno = listen_errno;
+    return -1;
+  }
+
+  return sock_fd;
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <limits.h>
+
+#include <linux/un.h>
+
+/**
+ * Where concurrent elevations of one user meet.
+ * The first process to need elevation starts a coalescer listening on the socket,
+ * and every process needing elevation while it runs asks it instead of running pkexec.
+ * The lock serialises connecting against the coalescer exiting,
+ * so a connection is never left in the backlog of a socket nobody will accept.
+ */
+typedef struct CoalescePaths {
+  char dir_path[PATH_MAX];
+  char lock_path[PATH_MAX];
+  char sock_path[UNIX_PATH_MAX];
+} CoalescePaths;
+
+/**
+ * Fills in the paths under the runtime directory, creating their directory.
+ * Returns false with errno set if they are too long or the directory could not be created.
+ */
+bool coalesce_paths (const char * runtime_dir, CoalescePaths * paths);
+
+/**
+ * Takes the lock, blocking until it is free.
+ * Returns the lock's file descriptor, closing it releases the lock, or -1 with errno set.
+ */
+int coalesce_lock (const CoalescePaths * paths);
+
+/**
+ * Connects to the running coalescer.
+ * Returns the connected socket, or -1 with errno set,
+ * ENOENT or ECONNREFUSED if there is no coalescer.
+ */
+int coalesce_connect (const CoalescePaths * paths);
+
+/**
+ * Creates the coalescer's listening socket, replacing one left behind by a crash.
+ * This must be called while holding the lock.
+ * Returns the listening socket, or -1 with errno set.
+ */
+int coalesce_listen (const CoalescePaths * paths);
@@ -2,203 +2,588 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <limits.h>
 
 #include <errno.h>
 #include <sysexits.h>
 
 #include <unistd.h>
 #include <fcntl.h>
-#include <termios.h>
+#include <poll.h>
+#include <time.h>
 
 #include <string.h>
 
+#include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/major.h>
 #include <linux/un.h>
 
 #include <assert.h>
 
 #include "argparse/argparse.h"
-#include "baudrates.h"
+#include "probes.h"
 #include "protocol.h"
+#include "rendezvous.h"
+#include "serial.h"
 
-static int status;
-static ssize_t ssize;
+// a parent serving its lease sends everything it wants right after waking us
+#define LEASE_RECEIVE_TIMEOUT_MS 1000
 
-static int
-set_tty_attribs (int fd, speed_t speed) {
+// we run as root for the lease, so whatever the unprivileged parent asks for is bounded here
+#define LEASE_MAX_MS (15 * 60 * 1000)
+#define LEASE_MAX_OPENS 1024
 
-  // get the current attributes
-  struct termios tty_attribs;
-  if (tcgetattr(fd, &tty_attribs) < 0) {
-    return 0;
-  }
+static int status;
 
-  // only set what we want to change for the current attributes
+// the stdout we inherit may be the data stream of a relaying parent, so the trace is opt-in and on stderr
+static int trace;
+
+typedef struct SerialDevice {
+  const char * path;
+  unsigned int baud;
+  SerialLine line;
+  int fd;
+  int error;
+} SerialDevice;
+
+/**
+ * What the mechanism may open after the devices it was launched for.
+ */
+typedef struct Lease {
+  int64_t deadline_ms;
+  // the opens left
+  long opens;
+  const char * * allow;
+  size_t allow_count;
+  size_t allow_capacity;
+} Lease;
+
+static Lease lease;
+
+static int64_t
+monotonic_ms (void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
 
-  // set input and output baud rate
-  cfsetospeed(&tty_attribs, speed);
-  cfsetispeed(&tty_attribs, speed);
+}
 
-  // helper for setting up for non-canonical mode settings
-  // this basically means input, line and output processing are all disabled
-  // canonical mode is designed for actual terminals, not dumb serial transports
-  cfmakeraw(&tty_attribs);
+static bool
+allow_path (const char * path) {
 
-  // ignore modem controls and enable receiver
-  tty_attribs.c_cflag |= (CLOCAL | CREAD);
-  // only 1 stop bit
-  tty_attribs.c_cflag &= ~CSTOPB;
-  // disable hardware flow control
-  tty_attribs.c_cflag &= ~CRTSCTS;
+  if (lease.allow_count == lease.allow_capacity) {
+    size_t capacity = MAX(lease.allow_capacity * 2, 8);
+    const char * * allow = realloc(lease.allow, capacity * sizeof(char *));
+    if (!allow) return false;
+    lease.allow = allow;
+    lease.allow_capacity = capacity;
+  }
+  lease.allow[lease.allow_count++] = path;
+  return true;
 
-  // here we setup the non-blocking non-canonical mode
-  // this means O_NONBLOCK must not be set on the file descriptor
-  tty_attribs.c_cc[VMIN] = 0;
-  tty_attribs.c_cc[VTIME] = 0;
+}
 
-  // set the modified attributes
-  if (tcsetattr(fd, TCSANOW, &tty_attribs) != 0) {
-    return -1;
-  }
+static int
+allow_path_option (struct argparse * self, const struct argparse_option * option) {
 
-  return 1;
+  if (!allow_path(*(const char * *) option->value)) {
+    perror("allow_path()");
+    exit(EX_OSERR);
+  }
+  return 0;
 
 }
 
-speed_t
-select_baud (unsigned int selected_baud) {
+static bool
+lease_covers (const SerialDevice * devices, size_t devices_count) {
+
+  if ((size_t) lease.opens < devices_count) return false;
 
-  speed_t baud;
-  #define BAUDDEFAULT(TARGET) default: TARGET = 9600;
-  BAUDSWITCH(selected_baud, baud, BAUDDEFAULT)
-  return baud;
+  for (size_t i = 0; i < devices_count; ++i) {
+    bool allowed = false;
+    for (size_t j = 0; j < lease.allow_count && !allowed; ++j) {
+      allowed = strcmp(devices[i].path, lease.allow[j]) == 0;
+    }
+    if (!allowed) return false;
+  }
+  return true;
 
 }
 
-int
-main (int argc, const char * const * argv) {
+/**
+ * Whether a path the lease allows is a tty, checked before opening it as root,
+ * since opening other devices can have side effects of its own.
+ * The open itself still fails with ENOTTY if the path changed meanwhile.
+ */
+static bool
+lease_device_is_tty (const char * path) {
 
-  static const char * const command_usage[] = {
-    "open-serial-device [--] <serial-port-path> <baud> <unix-domain-socket-path>",
-    NULL,
-  };
+  struct stat device_stat;
+  if (stat(path, &device_stat) != 0 || !S_ISCHR(device_stat.st_mode)) return false;
 
-  struct argparse_option command_options[] = {
-    OPT_HELP(),
-    OPT_END(),
-  };
+  unsigned int device_major = major(device_stat.st_rdev);
+  if (device_major >= UNIX98_PTY_SLAVE_MAJOR && device_major < UNIX98_PTY_SLAVE_MAJOR + UNIX98_PTY_MAJOR_COUNT) {
+    return true;
+  }
+  // every other tty is in the tty class
+  char sysfs_path[SERIAL_SYSFS_PATH_MAX];
+  serial_sysfs_path(device_major, minor(device_stat.st_rdev), sysfs_path, sizeof(sysfs_path));
+  return strstr(sysfs_path, "/tty/") != NULL;
 
-  struct argparse argparse;
-  argparse_init(&argparse, command_options, command_usage, 0);
-  argparse_describe(&argparse, "\nThis is to be executed as a child process. It will open the serial port and pass the file descriptor back to the parent process through the unix domain socket.", "");
+}
 
-  const char * * argv_ = malloc(sizeof (char *) * argc);
-  memcpy((char * *) argv_, argv, sizeof(char *) * argc);
+static void
+open_device (SerialDevice * device) {
 
-  int argc_ = argparse_parse(&argparse, argc, argv_);
+  device->fd = open_serial(device->path, device->baud, &device->line);
+  if (device->fd >= 0) {
+    device->error = 0;
+    return;
+  }
 
-  if (argc_ < 3) {
-      argparse_usage(&argparse);
-      exit(EX_USAGE);
+  device->error = errno;
+  switch (errno) {
+  case EACCES:
+  case EPERM:
+    fprintf(stderr, "%s: %s\n", device->path, "Could not open serial device, try with elevated privileges");
+    break;
+  case ENOTTY:
+    fprintf(stderr, "%s: %s\n", device->path, "Serial port path does not open to a serial port, or lacks RS-485");
+    break;
+  case EINVAL:
+    fprintf(stderr, "%s: %s\n", device->path, "Serial port does not support the baud rate or line settings");
+    break;
+  default:
+    fprintf(stderr, "%s: open(): %s\n", device->path, strerror(errno));
   }
 
-  const char * serial_port = argv_[0];
-  unsigned int desired_baud = (unsigned int) strtol(argv[1], (char * *) NULL, 10);
-  const char * unix_sock_path = argv_[2];
+}
 
-  speed_t baud = select_baud(desired_baud);
+/**
+ * Sends one message, tracing it to stderr with --trace.
+ * Returns 1 on success, 0 on a short send, or -1 with errno set.
+ */
+static int
+send_message (
+  int sock_fd,
+  MechanismProtoType type,
+  const void * body,
+  size_t length,
+  const int * fds,
+  size_t fds_count
+) {
+
+  PROBE_START(send_start);
+  int sent = protocol_send(sock_fd, type, body, length, fds, fds_count, trace ? stderr : NULL);
+  PROBE(
+    mechanism__send,
+    (int) type,
+    length,
+    fds_count,
+    sent,
+    (sent == -1) ? errno : 0,
+    PROBE_ELAPSED(send_start)
+  );
 
-  // do not open in non-blocking mode when using non-canonical mode
-  int serial_fd = open(serial_port, O_RDWR | O_NOCTTY | O_SYNC);
-  if (serial_fd < 0) {
-    if (errno == EACCES) {
-      fprintf(stderr, "%s\n", "Could not open serial device, try with elevated privileges");
-      exit(EX_NOPERM);
-    } else {
-      perror("open()");
-      exit(EX_UNAVAILABLE);
+  return sent;
+
+}
+
+/**
+ * Sends the results for devices [offset, offset + count) as one batch message.
+ * The opened file descriptors go into a single SCM_RIGHTS control message.
+ */
+static int
+send_batch (
+  int sock_fd,
+  const SerialDevice * devices,
+  size_t offset,
+  size_t count
+) {
+
+  assert(count <= PRIVFD_BATCH_MAX);
+
+  MechanismProtoBatch batch = { (uint8_t) count };
+  MechanismProtoResult results[PRIVFD_BATCH_MAX];
+  char body[sizeof(batch) + sizeof(results)];
+  int fds[PRIVFD_BATCH_MAX];
+  size_t fds_count = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    const SerialDevice * device = &devices[offset + i];
+    results[i].index = (uint16_t) (offset + i);
+    results[i].error = device->error;
+    if (device->error == 0) {
+      fds[fds_count++] = device->fd;
     }
   }
 
-  if (!isatty(serial_fd)) {
-    close(serial_fd);
-    fprintf(stderr, "%s\n", "Serial port path does not open to a serial port");
-    exit(EX_NOINPUT);
+  size_t length = sizeof(batch) + sizeof(MechanismProtoResult) * count;
+  memcpy(body, &batch, sizeof(batch));
+  memcpy(body + sizeof(batch), results, sizeof(MechanismProtoResult) * count);
+
+  return send_message(sock_fd, PRIVFD_BATCH, body, length, fds, fds_count);
+
+}
+
+/**
+ * Sends the identity and applied line settings of an opened device.
+ * This is informational, so a device that cannot be described is skipped.
+ */
+static int
+send_device (int sock_fd, const SerialDevice * device, size_t index) {
+
+  SerialInfo info;
+  if (!describe_serial(device->fd, &info)) {
+    return 1;
   }
 
-  if (set_tty_attribs(serial_fd, baud) < 0) {
-    fprintf(stderr, "%s\n", "Could not set tty attributes");
-    exit(EX_OSERR);
+  size_t sysfs_path_length = MIN(strlen(info.sysfs_path), PRIVFD_SYSFS_PATH_MAX);
+  MechanismProtoDevice description = {
+    .index = (uint16_t) index,
+    .major = info.major,
+    .minor = info.minor,
+    .ispeed = info.ispeed,
+    .ospeed = info.ospeed,
+    .iflag = info.iflag,
+    .oflag = info.oflag,
+    .cflag = info.cflag,
+    .lflag = info.lflag,
+    .sysfs_path_length = (uint16_t) sysfs_path_length
+  };
+  char body[sizeof(description) + PRIVFD_SYSFS_PATH_MAX];
+  memcpy(body, &description, sizeof(description));
+  memcpy(body + sizeof(description), info.sysfs_path, sysfs_path_length);
+
+  return send_message(sock_fd, PRIVFD_DEVICE, body, sizeof(description) + sysfs_path_length, NULL, 0);
+
+}
+
+/**
+ * Tells the parent why the mechanism failed, so it does not have to wait for the exit status.
+ * This is best effort, the exit status still reports the failure.
+ */
+static void
+send_error (int sock_fd, MechanismProtoErrorCode code, int error) {
+
+  MechanismProtoError failure = { (uint8_t) code, error };
+  send_message(sock_fd, PRIVFD_ERROR, &failure, sizeof(failure), NULL, 0);
+
+}
+
+/**
+ * Connects to the parent process through the rendezvous address.
+ * An inherited socket is already connected and is used as is.
+ */
+static int
+connect_rendezvous (const char * address) {
+
+  int inherited_fd = rendezvous_inherited_fd(address);
+  if (inherited_fd >= 0) {
+    struct stat inherited_stat;
+    if (fstat(inherited_fd, &inherited_stat) != 0 || !S_ISSOCK(inherited_stat.st_mode)) {
+      fprintf(stderr, "%s\n", "Inherited rendezvous is not a socket");
+      return -1;
+    }
+    PROBE(mechanism__connect, address, inherited_fd, 0, 0);
+    return inherited_fd;
   }
 
-  int unix_sock_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  int unix_sock_fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (unix_sock_fd < 0) {
     perror("socket()");
-    exit(EX_OSERR);
+    return -1;
   }
 
   struct sockaddr_un unix_sock_addr;
-  unix_sock_addr.sun_family = AF_UNIX;
-  snprintf(unix_sock_addr.sun_path, UNIX_PATH_MAX, "%s", unix_sock_path);
+  socklen_t unix_sock_addr_size = rendezvous_sockaddr(address, &unix_sock_addr);
 
+  PROBE_START(connect_start);
   status = TEMP_FAILURE_RETRY(
     connect(
       unix_sock_fd,
       (struct sockaddr *) &unix_sock_addr,
-      sizeof(unix_sock_addr)
+      unix_sock_addr_size
     )
   );
+  PROBE(mechanism__connect, address, unix_sock_fd, (status != 0) ? errno : 0, PROBE_ELAPSED(connect_start));
 
   if (status != 0) {
     perror("connect()");
+    close(unix_sock_fd);
+    return -1;
+  }
+
+  return unix_sock_fd;
+
+}
+
+/**
+ * Reports every device, even those that failed to open,
+ * so the parent can decide per device whether to escalate.
+ */
+static void
+report_devices (int unix_sock_fd, const SerialDevice * devices, size_t devices_count) {
+
+  for (size_t offset = 0; offset < devices_count; offset += PRIVFD_BATCH_MAX) {
+
+    size_t count = MIN(devices_count - offset, PRIVFD_BATCH_MAX);
+
+    status = send_batch(unix_sock_fd, devices, offset, count);
+
+    for (size_t i = offset; status == 1 && i < offset + count; ++i) {
+      if (devices[i].error == 0) {
+        status = send_device(unix_sock_fd, &devices[i], i);
+      }
+    }
+
+    if (status == -1) {
+      perror("sendmsg()");
+      exit(EX_OSERR);
+    } else if (status == 0) {
+      fprintf(stderr, "sendmsg(): %s\n", "Sent incorrect message size from mechanism");
+      exit(EX_PROTOCOL);
+    }
+
+  }
+
+  status = send_message(unix_sock_fd, PRIVFD_END, NULL, 0, NULL, 0);
+  if (status != 1) {
+    perror("sendmsg()");
     exit(EX_OSERR);
   }
 
-  MechanismProto message[1] = {{ PRIVFD }};
-  char message_buffer[sizeof(message)] = {0};
-  memcpy(message_buffer, message, sizeof(message));
-  struct iovec io_vector[1] = {
-    {
-      .iov_base = message_buffer,
-      .iov_len = sizeof(message_buffer)
+}
+
+/**
+ * Receives the devices of one more open, up to the parent's end message.
+ * Returns false once the parent hung up or sent something unexpected.
+ */
+static bool
+receive_opens (int unix_sock_fd, SerialDevice * * devices, size_t * devices_count) {
+
+  size_t capacity = 0;
+  while (true) {
+
+    MechanismProtoHeader header;
+    char body[PRIVFD_BODY_MAX];
+    status = protocol_receive(unix_sock_fd, &header, body);
+    if (status == 0) {
+      return false;
+    } else if (status == -1) {
+      perror("recv()");
+      return false;
     }
+
+    if (header.type == PRIVFD_END) {
+      return *devices_count > 0;
+    } else if (header.type != PRIVFD_OPEN) {
+      // later additions to the protocol are skipped
+      continue;
+    }
+
+    MechanismProtoOpen open_device;
+    if (header.length < sizeof(open_device)) {
+      fprintf(stderr, "%s\n", "Received incorrect message size from parent");
+      return false;
+    }
+    memcpy(&open_device, body, sizeof(open_device));
+    if (header.length != sizeof(open_device) + open_device.path_length || open_device.path_length == 0) {
+      fprintf(stderr, "%s\n", "Received incorrect message size from parent");
+      return false;
+    }
+    if (open_device.line_flags & ~PRIVFD_LINE_KNOWN) {
+      fprintf(stderr, "%s\n", "Received unknown line flags from parent");
+      return false;
+    }
+
+    if (*devices_count == capacity) {
+      capacity = MAX(capacity * 2, 8);
+      SerialDevice * grown = realloc(*devices, capacity * sizeof(SerialDevice));
+      if (!grown) {
+        perror("realloc()");
+        return false;
+      }
+      *devices = grown;
+    }
+
+    char * path = strndup(body + sizeof(open_device), open_device.path_length);
+    if (!path) {
+      perror("strndup()");
+      return false;
+    }
+    (*devices)[(*devices_count)++] = (SerialDevice) {
+      .path = path,
+      .baud = open_device.baud,
+      .line = {
+        .data_bits = open_device.data_bits,
+        .parity = (SerialParity) open_device.parity,
+        .stop_bits = open_device.stop_bits,
+        .rts_cts = open_device.line_flags & PRIVFD_LINE_RTS_CTS,
+        .xon_xoff = open_device.line_flags & PRIVFD_LINE_XON_XOFF,
+        .rs485 = open_device.line_flags & PRIVFD_LINE_RS485,
+        .rs485_delay_before_ms = open_device.rs485_delay_before_ms,
+        .rs485_delay_after_ms = open_device.rs485_delay_after_ms,
+        .low_latency = open_device.line_flags & PRIVFD_LINE_LOW_LATENCY
+      },
+      .fd = -1
+    };
+
+  }
+
+}
+
+/**
+ * Keeps opening devices for the parent over the same connection until the lease runs out,
+ * the parent hangs up, or it asks for something the lease does not cover.
+ * This is what spares the parent running pkexec, and the user a Polkit prompt, for every open.
+ */
+static void
+serve_lease (int unix_sock_fd) {
+
+  struct timeval receive_timeout = {
+    .tv_sec = LEASE_RECEIVE_TIMEOUT_MS / 1000,
+    .tv_usec = (LEASE_RECEIVE_TIMEOUT_MS % 1000) * 1000
   };
+  if (setsockopt(unix_sock_fd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout)) != 0) {
+    perror("setsockopt()");
+    exit(EX_OSERR);
+  }
 
-  union {
-    char buf[CMSG_SPACE(sizeof(int))];
-    struct cmsghdr align;
-  } ancillary_buffer;
+  while (true) {
 
-  struct msghdr message_options = {0};
-  message_options.msg_iov = io_vector;
-  message_options.msg_iovlen = 1;
-  message_options.msg_control = ancillary_buffer.buf;
-  message_options.msg_controllen = sizeof(ancillary_buffer.buf);
+    int64_t remaining = lease.deadline_ms - monotonic_ms();
+    if (remaining <= 0) return;
+
+    struct pollfd poll_fd = { .fd = unix_sock_fd, .events = POLLIN };
+    int ready = poll(&poll_fd, 1, (int) MIN(remaining, INT_MAX));
+    if (ready == -1 && errno == EINTR) {
+      continue;
+    } else if (ready == -1) {
+      perror("poll()");
+      exit(EX_OSERR);
+    } else if (ready == 0) {
+      return;
+    }
+
+    SerialDevice * devices = NULL;
+    size_t devices_count = 0;
+    bool received = receive_opens(unix_sock_fd, &devices, &devices_count);
+
+    bool covered = received && lease_covers(devices, devices_count);
+    if (covered) {
+      for (size_t i = 0; i < devices_count; ++i) {
+        if (lease_device_is_tty(devices[i].path)) {
+          open_device(&devices[i]);
+        } else {
+          devices[i].fd = -1;
+          devices[i].error = ENOTTY;
+        }
+      }
+      report_devices(unix_sock_fd, devices, devices_count);
+      lease.opens -= (long) devices_count;
+    } else if (received) {
+      send_error(unix_sock_fd, PRIVFD_ERROR_LEASE, EPERM);
+    }
 
-  struct cmsghdr * ancillary_message = CMSG_FIRSTHDR(&message_options);
-  ancillary_message->cmsg_level = SOL_SOCKET;
-  ancillary_message->cmsg_type = SCM_RIGHTS;
-  ancillary_message->cmsg_len = CMSG_LEN(sizeof(int));
+    for (size_t i = 0; i < devices_count; ++i) {
+      if (devices[i].fd >= 0) close(devices[i].fd);
+      free((char *) devices[i].path);
+    }
+    free(devices);
 
-  int * ancillary_p = (int *) CMSG_DATA(ancillary_message);
-  *ancillary_p = serial_fd;
+    if (!covered || lease.opens == 0) return;
 
-  printf("Sending Data:");
-  for (int i = 0; i < sizeof(message_buffer); ++i) {
-    printf(" 0x%02X", message_buffer[i]);
   }
-  printf("\n");
 
-  ssize = TEMP_FAILURE_RETRY(
-    sendmsg(unix_sock_fd, &message_options, 0)
-  );
+}
 
-  if (ssize == -1) {
-    perror("sendmsg()");
+int
+main (int argc, const char * const * argv) {
+
+  static const char * const command_usage[] = {
+    "open-serial-device [options] [--] <serial-port-path> <baud>[:<line>] [<serial-port-path> <baud>[:<line>] ...] <unix-domain-socket>",
+    NULL,
+  };
+
+  int lease_ms = 0;
+  int lease_opens = 0;
+  const char * allowed_path = NULL;
+
+  struct argparse_option command_options[] = {
+    OPT_HELP(),
+    OPT_INTEGER(0, "lease-ms", &lease_ms, "keep opening devices asked for over the socket for this many milliseconds, at most 900000"),
+    OPT_INTEGER(0, "lease-opens", &lease_opens, "open at most this many more devices during the lease, at most and by default 1024"),
+    OPT_STRING(0, "lease-allow", &allowed_path, "a further path that may be opened during the lease", allow_path_option),
+    OPT_BOOLEAN(0, "trace", &trace, "write each message sent to the parent to stderr in hex"),
+    OPT_END(),
+  };
+
+  struct argparse argparse;
+  argparse_init(&argparse, command_options, command_usage, 0);
+  argparse_describe(&argparse, "\nThis is to be executed as a child process. It will open the serial ports with the line settings, such as 115200:8E1,rtscts or 9600:8N1,rs485=1/1, and pass the file descriptors back to the parent process through the unix domain socket.\nThe socket is a path, @<name> for an abstract socket, or fd:<n> for an inherited connected socket.\nWith a lease, it then keeps opening the ports the parent asks for over the socket until the lease runs out.", "");
+
+  const char * * argv_ = malloc(sizeof (char *) * argc);
+  memcpy((char * *) argv_, argv, sizeof(char *) * argc);
+
+  int argc_ = argparse_parse(&argparse, argc, argv_);
+
+  // pairs of serial port path and baud, followed by the socket path
+  if (argc_ < 3 || (argc_ % 2) == 0) {
+      argparse_usage(&argparse);
+      exit(EX_USAGE);
+  }
+
+  size_t devices_count = (argc_ - 1) / 2;
+  const char * unix_sock_address = argv_[argc_ - 1];
+
+  // connect first, so every later failure can be reported over the socket
+  int unix_sock_fd = connect_rendezvous(unix_sock_address);
+  if (unix_sock_fd < 0) {
     exit(EX_OSERR);
-  } else if ((size_t) ssize < sizeof(message_buffer)) {
-    fprintf(stderr, "sendmsg(): %s\n", "Sent incorrect message size from mechanism");
-    exit(EX_PROTOCOL);
+  }
+
+  SerialDevice * devices = calloc(devices_count, sizeof(SerialDevice));
+  if (!devices) {
+    perror("calloc()");
+    send_error(unix_sock_fd, PRIVFD_ERROR_SYSTEM, errno);
+    exit(EX_OSERR);
+  }
+
+  for (size_t i = 0; i < devices_count; ++i) {
+    devices[i].path = argv_[i * 2];
+    // settings out of range are left to fail the open with EINVAL
+    if (!serial_settings_parse(argv_[i * 2 + 1], &devices[i].baud, &devices[i].line)) {
+      fprintf(stderr, "%s: %s\n", argv_[i * 2 + 1], "Baud rate and line settings are malformed");
+      send_error(unix_sock_fd, PRIVFD_ERROR_USAGE, EINVAL);
+      exit(EX_USAGE);
+    }
+    // the devices Polkit was asked about are always covered by the lease
+    if (lease_ms > 0 && !allow_path(devices[i].path)) {
+      perror("allow_path()");
+      send_error(unix_sock_fd, PRIVFD_ERROR_SYSTEM, errno);
+      exit(EX_OSERR);
+    }
+  }
+
+  for (size_t i = 0; i < devices_count; ++i) {
+    open_device(&devices[i]);
+  }
+
+  report_devices(unix_sock_fd, devices, devices_count);
+
+  if (lease_ms > 0) {
+    lease.deadline_ms = monotonic_ms() + MIN(lease_ms, LEASE_MAX_MS);
+    lease.opens = (lease_opens > 0) ? MIN(lease_opens, LEASE_MAX_OPENS) : LEASE_MAX_OPENS;
+    for (size_t i = 0; i < devices_count; ++i) {
+      if (devices[i].error == 0) close(devices[i].fd);
+    }
+    serve_lease(unix_sock_fd);
   }
 
   exit(EXIT_SUCCESS);
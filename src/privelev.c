@@ -0,0 +1,2643 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <string.h>
+#if defined(PATH_RENDEZVOUS)
+#include <ftw.h>
+#endif
+
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <linux/un.h>
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include "cache.h"
+#include "coalesce.h"
+#include "privelev.h"
+#include "probes.h"
+#include "protocol.h"
+#include "rendezvous.h"
+#include "serial.h"
+#include "spawn.h"
+#include "supervisor.h"
+
+#if !defined(MECHANISM_PATH)
+  #error "MECHANISM_PATH must be defined."
+#endif
+
+#if !defined(COALESCER_PATH)
+  #error "COALESCER_PATH must be defined."
+#endif
+
+// how long completing a request waits on each further message of a mechanism that started sending,
+// which sends everything at once, so this only bounds one that stalled without a deadline
+#define RECEIVE_TIMEOUT_MS 1000
+
+// how long each step of a negotiation waits on the device, unless it is given
+#define NEGOTIATION_TIMEOUT_MS 1000
+
+// how long baud detection listens at each rate, unless it is given
+#define AUTO_BAUD_WINDOW_MS 250
+// a rate is only scored once this much has been received at it
+#define AUTO_BAUD_MIN_BYTES 8
+// a rate scoring this well over this many bytes is taken without trying the others
+#define AUTO_BAUD_LOCK_SCORE 0.95
+#define AUTO_BAUD_LOCK_BYTES 32
+// the best rate is only taken if it scores at least this well
+#define AUTO_BAUD_MIN_SCORE 0.6
+
+struct privelev_ctx {
+  char * mechanism_path;
+  char * pkexec_path;
+  // NULL if decisions are not cached
+  char * cache_path;
+  // NULL if elevations are not coalesced with other processes
+  char * coalesce_dir;
+  // how long a coalescer we start keeps devices open, 0 if it does not
+  int keep_ms;
+  // what the elevated mechanism is asked to keep opening after its first open
+  // a lease_ms of 0 means no lease
+  int lease_ms;
+  unsigned int lease_opens;
+  char * * lease_allow;
+  size_t lease_allow_count;
+  int timeout_ms;
+  bool fast_path;
+  bool signal_cancellation;
+  // the most mechanisms run at once by the unprivileged attempt
+  size_t concurrency;
+  SpawnBackend spawn_backend;
+  FILE * log;
+  privelev_timings_callback timings_callback;
+  void * timings_data;
+  // mechanisms abandoned on timeout or cancellation that still need reaping
+  // these are the only mutable state, so they have their own lock
+  pthread_mutex_t orphans_lock;
+  int * orphans;
+  size_t orphans_count;
+  size_t orphans_capacity;
+  // connection to an elevated mechanism serving its lease while no open is using it, -1 if none
+  pthread_mutex_t broker_lock;
+  int broker_fd;
+};
+
+typedef enum {
+  // the next attempt needs to be launched
+  PHASE_LAUNCH,
+  // waiting on the attempt's mechanisms
+  PHASE_WAITING,
+  PHASE_DONE
+} RequestPhase;
+
+/**
+ * One launched mechanism and the devices it was given.
+ */
+typedef struct Launch {
+  Request request;
+  // launch_map[i] is the device at the mechanism's argument position i
+  const size_t * launch_map;
+  size_t launch_count;
+  // connection to the mechanism, -1 until it connects to a listening socket
+  int peer_fd;
+  // the mechanism's end of the socketpair until it has been spawned
+  int mechanism_sock_fd;
+  // when the mechanism was executed, 0 once it has connected or sent something
+  int64_t started_ns;
+  // the request is registered with the supervisor
+  bool supervised;
+  // the connection is to a mechanism serving a lease, and outlives the launch
+  bool leased;
+  // the connection was kept from an earlier open
+  bool reused;
+  bool finished;
+} Launch;
+
+/**
+ * State of one open, advanced by advance_request without blocking.
+ * Nothing here is shared between requests, which is what makes them reentrant.
+ */
+struct privelev_request {
+  privelev_ctx * ctx;
+  privelev_device * devices;
+  size_t devices_count;
+  RequestPhase phase;
+  // the result once the phase is PHASE_DONE
+  privelev_status status;
+  bool privileged;
+  Supervisor supervisor;
+  bool supervising;
+  // the mechanisms of the current attempt
+  Launch * launches;
+  size_t launches_count;
+  size_t launches_pending;
+  // the first failure of the current attempt
+  privelev_status launches_status;
+  int64_t deadline;
+  size_t * launch_map;
+  const char * * mechanism_args;
+  const char * * pkexec_args;
+  char (* selected_settings)[SERIAL_SETTINGS_MAX];
+  char lease_ms[12];
+  char lease_opens[12];
+  // a mechanism serving a lease turned the open down, so it is launched again without one
+  bool lease_ended;
+  bool lease_refused;
+  // listening socket shared by the attempt's mechanisms, -1 when they inherit socketpairs
+  int sock_fd;
+  char sock_address[UNIX_PATH_MAX];
+#if defined(PATH_RENDEZVOUS)
+  char sock_dir[UNIX_PATH_MAX];
+#endif
+  // the cached decision of each device, NULL without a cache
+  CacheDecision * cached;
+  // devices sent to the elevated mechanism only for their latency timer,
+  // which says nothing about whether they need elevation, so their decisions are not stored
+  bool * latency_elevated;
+  privelev_timings timings;
+  int64_t started_ns;
+  int64_t attempt_started_ns;
+  // when the request completed, 0 while it is pending
+  int64_t completed_ns;
+};
+
+static const char * const status_names[] = {
+  [PRIVELEV_OK] = "Success",
+  [PRIVELEV_ERROR_SYSTEM] = "System error",
+  [PRIVELEV_ERROR_DENIED] = "Polkit denied permission to elevate privileges",
+  [PRIVELEV_ERROR_DISMISSED] = "User denied permission to elevate privileges",
+  [PRIVELEV_ERROR_MECHANISM] = "Mechanism failed",
+  [PRIVELEV_ERROR_PROTOCOL] = "Unexpected message from mechanism",
+  [PRIVELEV_ERROR_TIMED_OUT] = "Timed out waiting for the mechanism",
+  [PRIVELEV_ERROR_CANCELLED] = "Cancelled while waiting for the mechanism",
+  [PRIVELEV_ERROR_DEVICE] = "Could not open serial device",
+  [PRIVELEV_IN_PROGRESS] = "Request in progress"
+};
+
+static const char * const opener_names[] = {
+  [PRIVELEV_OPENED_NONE] = "not opened",
+  [PRIVELEV_OPENED_IN_PROCESS] = "opened in-process",
+  [PRIVELEV_OPENED_BY_MECHANISM] = "opened by mechanism",
+  [PRIVELEV_OPENED_BY_ELEVATED_MECHANISM] = "opened by elevated mechanism"
+};
+
+static const char * const phase_names[] = {
+  [PRIVELEV_PHASE_FAST_PATH] = "fast_path",
+  [PRIVELEV_PHASE_RENDEZVOUS] = "rendezvous",
+  [PRIVELEV_PHASE_SPAWN] = "spawn",
+  [PRIVELEV_PHASE_MECHANISM_START] = "mechanism_start",
+  [PRIVELEV_PHASE_AUTHORISATION] = "authorisation",
+  [PRIVELEV_PHASE_ACCEPT] = "accept",
+  [PRIVELEV_PHASE_PEER_CHECK] = "peer_check",
+  [PRIVELEV_PHASE_RECEIVE] = "receive",
+  [PRIVELEV_PHASE_UNPRIVILEGED_ATTEMPT] = "unprivileged_attempt",
+  [PRIVELEV_PHASE_ELEVATED_ATTEMPT] = "elevated_attempt"
+};
+
+/**
+ * The line settings, with the defaults filled in.
+ */
+static SerialLine
+serial_line (const privelev_line * line) {
+
+  return (SerialLine) {
+    .data_bits = line->data_bits ? line->data_bits : 8,
+    .parity = (SerialParity) line->parity,
+    .stop_bits = line->stop_bits ? line->stop_bits : 1,
+    .rts_cts = line->rts_cts,
+    .xon_xoff = line->xon_xoff,
+    .rs485 = line->rs485,
+    .rs485_delay_before_ms = line->rs485_delay_before_ms,
+    .rs485_delay_after_ms = line->rs485_delay_after_ms,
+    .low_latency = line->low_latency
+  };
+
+}
+
+/**
+ * Whether the device's settings are in range, otherwise no mechanism could set them either.
+ */
+static bool
+device_settings_valid (const privelev_device * device) {
+
+  SerialLine line = serial_line(&device->line);
+  return baud_supported(device->baud) && serial_line_valid(&line);
+
+}
+
+bool
+privelev_baud_supported (uint32_t baud) {
+
+  return baud_supported(baud);
+
+}
+
+uint32_t
+privelev_nearest_baud (uint32_t baud) {
+
+  return nearest_baud(baud);
+
+}
+
+bool
+privelev_line_valid (const privelev_line * line) {
+
+  SerialLine settings = serial_line(line);
+  return serial_line_valid(&settings);
+
+}
+
+const char *
+privelev_strerror (privelev_status status) {
+
+  if ((size_t) status >= sizeof(status_names) / sizeof(status_names[0])) {
+    return "Unknown status";
+  }
+  return status_names[status];
+
+}
+
+const char *
+privelev_opener_name (privelev_opener opener) {
+
+  if ((size_t) opener >= sizeof(opener_names) / sizeof(opener_names[0])) {
+    return "unknown";
+  }
+  return opener_names[opener];
+
+}
+
+const char *
+privelev_phase_name (privelev_phase phase) {
+
+  if ((size_t) phase >= sizeof(phase_names) / sizeof(phase_names[0])) {
+    return "unknown";
+  }
+  return phase_names[phase];
+
+}
+
+static void
+log_message (const privelev_ctx * ctx, const char * format, ...) {
+
+  if (!ctx->log) return;
+
+  va_list args;
+  va_start(args, format);
+  vfprintf(ctx->log, format, args);
+  va_end(args);
+
+}
+
+static void
+log_errno (const privelev_ctx * ctx, const char * what) {
+
+  log_message(ctx, "%s: %s\n", what, strerror(errno));
+
+}
+
+/**
+ * Adds the time since start to the phase, and returns the current time.
+ */
+static int64_t
+time_phase (privelev_request * acquisition, privelev_phase phase, int64_t start) {
+
+  int64_t now = monotonic_ns();
+  acquisition->timings.phase_ns[phase] += now - start;
+  ++acquisition->timings.phase_count[phase];
+  PROBE(phase, (int) phase, now - start);
+  return now;
+
+}
+
+privelev_ctx *
+privelev_ctx_new (void) {
+
+  privelev_ctx * ctx = calloc(1, sizeof(privelev_ctx));
+  if (!ctx) return NULL;
+
+  // everything privelev_ctx_free releases is set up before anything can fail
+  ctx->fast_path = true;
+  ctx->concurrency = 1;
+  ctx->spawn_backend = SPAWN_CLONE_VFORK;
+  ctx->broker_fd = -1;
+  pthread_mutex_init(&ctx->orphans_lock, NULL);
+  pthread_mutex_init(&ctx->broker_lock, NULL);
+
+  ctx->mechanism_path = strdup(MECHANISM_PATH);
+  ctx->pkexec_path = strdup("pkexec");
+  if (!ctx->mechanism_path || !ctx->pkexec_path) {
+    privelev_ctx_free(ctx);
+    return NULL;
+  }
+
+  return ctx;
+
+}
+
+void
+privelev_ctx_free (privelev_ctx * ctx) {
+
+  if (!ctx) return;
+
+  // reap whatever already exited, the rest are left to init when we exit
+  for (size_t i = 0; i < ctx->orphans_count; ++i) {
+    waitid(P_PIDFD, ctx->orphans[i], &(siginfo_t) {0}, WEXITED | WNOHANG);
+    close(ctx->orphans[i]);
+  }
+
+  // the mechanism serving the lease exits once we hang up
+  if (ctx->broker_fd != -1) close(ctx->broker_fd);
+  for (size_t i = 0; i < ctx->lease_allow_count; ++i) {
+    free(ctx->lease_allow[i]);
+  }
+  free(ctx->lease_allow);
+
+  pthread_mutex_destroy(&ctx->orphans_lock);
+  pthread_mutex_destroy(&ctx->broker_lock);
+  free(ctx->orphans);
+  free(ctx->mechanism_path);
+  free(ctx->pkexec_path);
+  free(ctx->cache_path);
+  free(ctx->coalesce_dir);
+  free(ctx);
+
+}
+
+void
+privelev_ctx_set_timeout (privelev_ctx * ctx, int timeout_ms) {
+
+  ctx->timeout_ms = MAX(timeout_ms, 0);
+
+}
+
+void
+privelev_ctx_set_fast_path (privelev_ctx * ctx, bool fast_path) {
+
+  ctx->fast_path = fast_path;
+
+}
+
+void
+privelev_ctx_set_log (privelev_ctx * ctx, FILE * log) {
+
+  ctx->log = log;
+
+}
+
+void
+privelev_ctx_set_timings_callback (
+  privelev_ctx * ctx,
+  privelev_timings_callback callback,
+  void * data
+) {
+
+  ctx->timings_callback = callback;
+  ctx->timings_data = data;
+
+}
+
+void
+privelev_ctx_set_signal_cancellation (privelev_ctx * ctx, bool signal_cancellation) {
+
+  ctx->signal_cancellation = signal_cancellation;
+
+}
+
+void
+privelev_ctx_set_concurrency (privelev_ctx * ctx, unsigned int concurrency) {
+
+  ctx->concurrency = MAX(concurrency, 1);
+
+}
+
+static bool
+replace_string (char * * target, const char * value) {
+
+  char * copy = strdup(value);
+  if (!copy) return false;
+  free(*target);
+  *target = copy;
+  return true;
+
+}
+
+bool
+privelev_ctx_set_mechanism_path (privelev_ctx * ctx, const char * mechanism_path) {
+
+  return replace_string(&ctx->mechanism_path, mechanism_path);
+
+}
+
+bool
+privelev_ctx_set_pkexec_path (privelev_ctx * ctx, const char * pkexec_path) {
+
+  return replace_string(&ctx->pkexec_path, pkexec_path);
+
+}
+
+bool
+privelev_ctx_set_cache_path (privelev_ctx * ctx, const char * cache_path) {
+
+  if (!cache_path) {
+    free(ctx->cache_path);
+    ctx->cache_path = NULL;
+    return true;
+  }
+  return replace_string(&ctx->cache_path, cache_path);
+
+}
+
+bool
+privelev_ctx_set_coalesce_dir (privelev_ctx * ctx, const char * runtime_dir) {
+
+  if (!runtime_dir) {
+    free(ctx->coalesce_dir);
+    ctx->coalesce_dir = NULL;
+    return true;
+  }
+  return replace_string(&ctx->coalesce_dir, runtime_dir);
+
+}
+
+void
+privelev_ctx_set_keep_timeout (privelev_ctx * ctx, int keep_ms) {
+
+  ctx->keep_ms = MAX(keep_ms, 0);
+
+}
+
+bool
+privelev_ctx_set_lease (privelev_ctx * ctx, const privelev_lease * lease) {
+
+  size_t allow_count = (lease && lease->allow) ? lease->allow_count : 0;
+  char * * allow = NULL;
+  if (allow_count) {
+    allow = calloc(allow_count, sizeof(char *));
+    if (!allow) return false;
+    for (size_t i = 0; i < allow_count; ++i) {
+      allow[i] = strdup(lease->allow[i]);
+      if (!allow[i]) {
+        for (size_t j = 0; j < i; ++j) free(allow[j]);
+        free(allow);
+        return false;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < ctx->lease_allow_count; ++i) {
+    free(ctx->lease_allow[i]);
+  }
+  free(ctx->lease_allow);
+  ctx->lease_allow = allow;
+  ctx->lease_allow_count = allow_count;
+  ctx->lease_ms = lease ? MAX(lease->duration_ms, 0) : 0;
+  ctx->lease_opens = lease ? lease->opens : 0;
+
+  // a mechanism serving the old lease is let go
+  pthread_mutex_lock(&ctx->broker_lock);
+  if (ctx->broker_fd != -1) {
+    close(ctx->broker_fd);
+    ctx->broker_fd = -1;
+  }
+  pthread_mutex_unlock(&ctx->broker_lock);
+
+  return true;
+
+}
+
+/**
+ * Takes the connection to the mechanism serving the lease, so no other open uses it at the same time.
+ * Returns -1 if there is none, or it has already hung up because its lease ran out.
+ */
+static int
+take_broker (privelev_ctx * ctx) {
+
+  pthread_mutex_lock(&ctx->broker_lock);
+  int broker_fd = ctx->broker_fd;
+  ctx->broker_fd = -1;
+  pthread_mutex_unlock(&ctx->broker_lock);
+
+  // between opens it never sends anything, so anything readable is its hangup
+  struct pollfd poll_fd = { .fd = broker_fd, .events = POLLIN };
+  if (broker_fd != -1 && poll(&poll_fd, 1, 0) != 0) {
+    close(broker_fd);
+    broker_fd = -1;
+  }
+
+  return broker_fd;
+
+}
+
+/**
+ * Hands the connection back for the next open, unless another open got there first.
+ */
+static void
+return_broker (privelev_ctx * ctx, int broker_fd) {
+
+  pthread_mutex_lock(&ctx->broker_lock);
+  if (ctx->broker_fd == -1) {
+    ctx->broker_fd = broker_fd;
+    broker_fd = -1;
+  }
+  pthread_mutex_unlock(&ctx->broker_lock);
+
+  if (broker_fd != -1) close(broker_fd);
+
+}
+
+/**
+ * Keeps the pidfd of an abandoned mechanism so it can be reaped later.
+ * Without this, a long running process would accumulate zombies.
+ */
+static void
+adopt_orphan (privelev_ctx * ctx, Request * request) {
+
+  pthread_mutex_lock(&ctx->orphans_lock);
+
+  if (ctx->orphans_count == ctx->orphans_capacity) {
+    size_t capacity = MAX(ctx->orphans_capacity * 2, 8);
+    int * orphans = realloc(ctx->orphans, capacity * sizeof(int));
+    if (!orphans) {
+      pthread_mutex_unlock(&ctx->orphans_lock);
+      close(request->pidfd);
+      request->pidfd = -1;
+      return;
+    }
+    ctx->orphans = orphans;
+    ctx->orphans_capacity = capacity;
+  }
+
+  ctx->orphans[ctx->orphans_count++] = request->pidfd;
+  request->pidfd = -1;
+
+  pthread_mutex_unlock(&ctx->orphans_lock);
+
+}
+
+static void
+reap_orphans (privelev_ctx * ctx) {
+
+  pthread_mutex_lock(&ctx->orphans_lock);
+
+  size_t kept = 0;
+  for (size_t i = 0; i < ctx->orphans_count; ++i) {
+    siginfo_t info = {0};
+    if (
+      waitid(P_PIDFD, ctx->orphans[i], &info, WEXITED | WNOHANG) == 0 &&
+      info.si_pid == 0
+    ) {
+      ctx->orphans[kept++] = ctx->orphans[i];
+    } else {
+      close(ctx->orphans[i]);
+    }
+  }
+  ctx->orphans_count = kept;
+
+  pthread_mutex_unlock(&ctx->orphans_lock);
+
+}
+
+#if defined(PATH_RENDEZVOUS)
+static int
+nftw_callback (
+  const char * path,
+  const struct stat * sb,
+  int type_flag,
+  struct FTW * ftw_buf
+) {
+
+  return remove(path);
+
+}
+#endif
+
+static pid_t
+peer_pid (int peer_sock_fd) {
+
+  struct ucred peer_credentials;
+  socklen_t peer_credentials_size = sizeof(peer_credentials);
+  if (
+    getsockopt(
+      peer_sock_fd,
+      SOL_SOCKET,
+      SO_PEERCRED,
+      &peer_credentials,
+      &peer_credentials_size
+    ) != 0
+  ) {
+    return -1;
+  }
+
+  return peer_credentials.pid;
+
+}
+
+static int
+setup_unix_sock (const char * sock_address, int backlog, bool nonblocking) {
+
+  struct sockaddr_un unix_sock_addr;
+  socklen_t unix_sock_addr_size = rendezvous_sockaddr(sock_address, &unix_sock_addr);
+
+  int unix_sock_fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (unix_sock_fd < 0) {
+    return -1;
+  }
+
+  if (
+    bind(
+      unix_sock_fd,
+      (struct sockaddr *) &unix_sock_addr,
+      unix_sock_addr_size
+    ) != 0
+  ) {
+    close(unix_sock_fd);
+    return -1;
+  }
+
+  // the backlog is the number of mechanisms expected to connect at once
+  if (listen(unix_sock_fd, backlog) != 0) {
+    close(unix_sock_fd);
+    return -1;
+  }
+
+  if (nonblocking) {
+    int nonblocking_flag = fcntl(unix_sock_fd, F_GETFL, 0) | O_NONBLOCK;
+    if (fcntl(unix_sock_fd, F_SETFL, nonblocking_flag) == -1) {
+      close(unix_sock_fd);
+      return -1;
+    }
+  }
+
+  return unix_sock_fd;
+
+}
+
+#if defined(PATH_RENDEZVOUS)
+
+/**
+ * Creates the temporary socket directory and the listening socket inside it.
+ * The same listening socket is reused for every mechanism launch.
+ */
+static bool
+setup_path_rendezvous (privelev_request * acquisition, int backlog) {
+
+  const char * tmp_dir= getenv("TMPDIR");
+  if (!tmp_dir) tmp_dir = "/tmp";
+  const char tmp_name[] = "polkit_demo.XXXXXX";
+  const char socket_name[] = "socket.sock";
+
+  if (
+    UNIX_PATH_MAX <
+    (
+      strlen(tmp_dir) +
+      sizeof(tmp_name) +
+      sizeof(socket_name) + 1
+    )
+  ) {
+    errno = ENAMETOOLONG;
+    log_errno(acquisition->ctx, "create_tmp_namespace()");
+    return false;
+  }
+
+  snprintf(acquisition->sock_dir, sizeof(acquisition->sock_dir), "%s/%s", tmp_dir, tmp_name);
+  if (!mkdtemp(acquisition->sock_dir)) {
+    acquisition->sock_dir[0] = '\0';
+    log_errno(acquisition->ctx, "create_tmp_namespace()");
+    return false;
+  }
+
+  // the unix_sock_path = unix_sock_dir + socket_name
+  snprintf(
+    acquisition->sock_address,
+    sizeof(acquisition->sock_address),
+    "%s/%s",
+    acquisition->sock_dir,
+    socket_name
+  );
+
+  // if an asynchronous network error occurs, accept needs to fail immediately
+  // but accept is a slow system call, so it can block indefinitely
+  // to prevent this, unix_sock_fd is set to non blocking
+  acquisition->sock_fd = setup_unix_sock(acquisition->sock_address, backlog, true);
+  if (acquisition->sock_fd == -1) {
+    log_errno(acquisition->ctx, "setup_unix_sock()");
+    return false;
+  }
+
+  return true;
+
+}
+
+#else
+
+/**
+ * Creates a connected socketpair for an unprivileged mechanism.
+ * The mechanism inherits its end, so nothing touches the filesystem
+ * and no other process can reach the socket.
+ */
+static bool
+setup_pair_rendezvous (privelev_request * acquisition, Launch * launch) {
+
+  // both ends stay close on exec here, spawn_process has only the mechanism inherit its end
+  int sock_pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sock_pair) != 0) {
+    log_errno(acquisition->ctx, "socketpair()");
+    return false;
+  }
+
+  launch->peer_fd = sock_pair[0];
+  launch->mechanism_sock_fd = sock_pair[1];
+
+  snprintf(
+    acquisition->sock_address,
+    sizeof(acquisition->sock_address),
+    "%s%i",
+    RENDEZVOUS_FD_PREFIX,
+    sock_pair[1]
+  );
+
+  return true;
+
+}
+
+/**
+ * Creates a listening socket in the linux abstract namespace.
+ * pkexec does not pass file descriptors through, so the elevated mechanism has to connect.
+ * The name is random and disappears with the socket, so crashes leave nothing behind.
+ * Anyone in the network namespace can connect, so peers are checked on accept.
+ */
+static bool
+setup_abstract_rendezvous (privelev_request * acquisition, int backlog) {
+
+  uint64_t nonce;
+  if (getrandom(&nonce, sizeof(nonce), 0) != sizeof(nonce)) {
+    log_errno(acquisition->ctx, "getrandom()");
+    return false;
+  }
+
+  snprintf(
+    acquisition->sock_address,
+    sizeof(acquisition->sock_address),
+    "%cprivilege-elevation.%i.%016llx",
+    RENDEZVOUS_ABSTRACT_PREFIX,
+    getpid(),
+    (unsigned long long) nonce
+  );
+
+  // non blocking for the same reason as the path based socket
+  acquisition->sock_fd = setup_unix_sock(acquisition->sock_address, backlog, true);
+  if (acquisition->sock_fd == -1) {
+    log_errno(acquisition->ctx, "setup_unix_sock()");
+    return false;
+  }
+
+  return true;
+
+}
+
+#endif
+
+/**
+ * Sets up the listening socket shared by the attempt's mechanisms.
+ */
+static bool
+setup_listen_rendezvous (privelev_request * acquisition, int backlog) {
+
+  if (acquisition->sock_fd == -1) {
+#if defined(PATH_RENDEZVOUS)
+    if (!setup_path_rendezvous(acquisition, backlog)) return false;
+#else
+    if (!setup_abstract_rendezvous(acquisition, backlog)) return false;
+#endif
+  }
+
+  if (!supervisor_listen(&acquisition->supervisor, acquisition->sock_fd)) {
+    log_errno(acquisition->ctx, "supervisor_listen()");
+    return false;
+  }
+
+  return true;
+
+}
+
+static void
+close_launch (Launch * launch) {
+
+  if (launch->mechanism_sock_fd != -1) {
+    close(launch->mechanism_sock_fd);
+    launch->mechanism_sock_fd = -1;
+  }
+
+  if (launch->peer_fd != -1) {
+    shutdown(launch->peer_fd, SHUT_RDWR);
+    close(launch->peer_fd);
+    launch->peer_fd = -1;
+  }
+
+}
+
+/**
+ * Closes the listening socket unless it is reused by the next attempt.
+ */
+static void
+close_rendezvous (privelev_request * acquisition, bool finished) {
+
+#if defined(PATH_RENDEZVOUS)
+  // the path based socket is reused for every launch
+  if (!finished) return;
+#endif
+
+  if (acquisition->supervising) {
+    supervisor_unlisten(&acquisition->supervisor);
+  }
+
+  if (acquisition->sock_fd != -1) {
+    close(acquisition->sock_fd);
+    acquisition->sock_fd = -1;
+  }
+
+#if defined(PATH_RENDEZVOUS)
+  if (acquisition->sock_dir[0]) {
+    nftw(acquisition->sock_dir, nftw_callback, 64, FTW_DEPTH | FTW_PHYS);
+    acquisition->sock_dir[0] = '\0';
+  }
+#endif
+
+}
+
+/**
+ * Maps the exit status of a mechanism that never connected.
+ */
+static privelev_status
+mechanism_exit_status (const privelev_ctx * ctx, const Request * request) {
+
+  switch (request->status) {
+  case 127:
+    return PRIVELEV_ERROR_DENIED;
+  case 126:
+    return PRIVELEV_ERROR_DISMISSED;
+  default:
+    log_message(ctx, "Error: %s %i\n", "Mechanism failed with code:", request->status);
+    return PRIVELEV_ERROR_MECHANISM;
+  }
+
+}
+
+static privelev_status
+settled_status (const privelev_ctx * ctx, const Request * request) {
+
+  switch (request->state) {
+  case REQUEST_READY:
+    return PRIVELEV_OK;
+  case REQUEST_TIMED_OUT:
+    return PRIVELEV_ERROR_TIMED_OUT;
+  case REQUEST_CANCELLED:
+    return PRIVELEV_ERROR_CANCELLED;
+  default:
+    // the mechanism exited without connecting
+    return mechanism_exit_status(ctx, request);
+  }
+
+}
+
+/**
+ * Whether a low latency open needs the elevated mechanism, to lower the adapter's latency timer.
+ */
+static bool
+latency_timer_needs_elevation (const privelev_device * device) {
+
+  if (!device->line.low_latency) return false;
+  struct stat device_stat;
+  if (stat(device->path, &device_stat) != 0 || !S_ISCHR(device_stat.st_mode)) return false;
+  char sysfs_path[PRIVELEV_SYSFS_PATH_MAX];
+  serial_sysfs_path(major(device_stat.st_rdev), minor(device_stat.st_rdev), sysfs_path, sizeof(sysfs_path));
+  return serial_latency_timer(sysfs_path) > 1;
+
+}
+
+static bool
+needs_elevation (const privelev_device * device) {
+
+  return (device->fd < 0 && (device->error == EACCES || device->error == EPERM));
+
+}
+
+/**
+ * Fills in the description of a device opened in-process,
+ * the same way the mechanism describes the devices it opens.
+ */
+static void
+describe_device (privelev_device * device) {
+
+  SerialInfo info;
+  if (!describe_serial(device->fd, &info)) return;
+
+  device->major = info.major;
+  device->minor = info.minor;
+  device->applied_baud = info.ospeed;
+  snprintf(device->sysfs_path, sizeof(device->sysfs_path), "%s", info.sysfs_path);
+  device->latency_timer_ms = serial_latency_timer(device->sysfs_path);
+
+}
+
+/**
+ * Builds the arguments of a mechanism for its devices.
+ * The address is that of the rendezvous set up last.
+ */
+static void
+prepare_arguments (privelev_request * acquisition, const Launch * launch) {
+
+  const privelev_ctx * ctx = acquisition->ctx;
+  const char * * mechanism_args = acquisition->mechanism_args;
+  const char * * pkexec_args = acquisition->pkexec_args;
+  size_t launch_count = launch->launch_count;
+
+  mechanism_args[0] = basename(ctx->mechanism_path);
+  pkexec_args[0] = basename(ctx->pkexec_path);
+  pkexec_args[1] = ctx->mechanism_path;
+
+  // only the elevated mechanism serves a lease, the unprivileged one costs nothing to launch again
+  size_t lease_count = 0;
+  if (ctx->lease_ms) {
+    snprintf(acquisition->lease_ms, sizeof(acquisition->lease_ms), "%i", ctx->lease_ms);
+    snprintf(acquisition->lease_opens, sizeof(acquisition->lease_opens), "%u", ctx->lease_opens);
+    pkexec_args[2 + lease_count++] = "--lease-ms";
+    pkexec_args[2 + lease_count++] = acquisition->lease_ms;
+    pkexec_args[2 + lease_count++] = "--lease-opens";
+    pkexec_args[2 + lease_count++] = acquisition->lease_opens;
+    for (size_t i = 0; i < ctx->lease_allow_count; ++i) {
+      pkexec_args[2 + lease_count++] = "--lease-allow";
+      pkexec_args[2 + lease_count++] = ctx->lease_allow[i];
+    }
+  }
+
+  for (size_t i = 0; i < launch_count; ++i) {
+    size_t index = launch->launch_map[i];
+    privelev_device * device = &acquisition->devices[index];
+    SerialLine line = serial_line(&device->line);
+    serial_settings_format(
+      device->baud,
+      &line,
+      acquisition->selected_settings[index],
+      sizeof(acquisition->selected_settings[index])
+    );
+    mechanism_args[1 + i * 2] = device->path;
+    mechanism_args[1 + i * 2 + 1] = acquisition->selected_settings[index];
+    pkexec_args[2 + lease_count + i * 2] = device->path;
+    pkexec_args[2 + lease_count + i * 2 + 1] = acquisition->selected_settings[index];
+  }
+  mechanism_args[1 + launch_count * 2] = acquisition->sock_address;
+  mechanism_args[2 + launch_count * 2] = (char *) NULL;
+  pkexec_args[2 + lease_count + launch_count * 2] = acquisition->sock_address;
+  pkexec_args[3 + lease_count + launch_count * 2] = (char *) NULL;
+
+}
+
+static privelev_status
+launch_mechanism (privelev_request * acquisition, Launch * launch) {
+
+  const privelev_ctx * ctx = acquisition->ctx;
+  bool privileged = acquisition->privileged;
+  const char * process_path = privileged ? ctx->pkexec_path : ctx->mechanism_path;
+  pid_t mechanism_pid;
+
+  prepare_arguments(acquisition, launch);
+
+  int64_t spawn_start = monotonic_ns();
+  int status = spawn_process(
+    ctx->spawn_backend,
+    process_path,
+    privileged ? acquisition->pkexec_args : acquisition->mechanism_args,
+    &acquisition->supervisor.signal_orig_mask,
+    launch->mechanism_sock_fd,
+    &mechanism_pid
+  );
+
+  launch->leased = privileged && ctx->lease_ms;
+
+  // the exec has succeeded by now, from here on the mechanism (or pkexec) is starting
+  launch->started_ns = time_phase(acquisition, PRIVELEV_PHASE_SPAWN, spawn_start);
+  PROBE(
+    spawn,
+    (status == 1) ? mechanism_pid : -1,
+    privileged,
+    launch->launch_count,
+    (status == 1) ? 0 : errno,
+    launch->started_ns - spawn_start
+  );
+
+  // the mechanism has its own copy of the socketpair end by now
+  if (launch->mechanism_sock_fd != -1) {
+    close(launch->mechanism_sock_fd);
+    launch->mechanism_sock_fd = -1;
+  }
+
+  switch (status) {
+  case 0:
+  case -1:
+    log_errno(ctx, "spawn_process()");
+    return PRIVELEV_ERROR_SYSTEM;
+  case -2:
+    {
+      int exec_errno = errno;
+      log_message(ctx, "execvp(%s): %s\n", process_path, strerror(exec_errno));
+      errno = exec_errno;
+    }
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+
+  // a mechanism connecting to the shared listening socket has no socket of its own yet
+  if (
+    !supervisor_add(
+      &acquisition->supervisor,
+      &launch->request,
+      mechanism_pid,
+      launch->peer_fd,
+      acquisition->deadline
+    )
+  ) {
+    log_errno(ctx, "supervisor_add()");
+    // without a pidfd we can only wait for it to finish
+    waitpid(mechanism_pid, NULL, 0);
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+  launch->supervised = true;
+
+  return PRIVELEV_OK;
+
+}
+
+/**
+ * Starts the user's coalescer on a new listening socket, while holding the lock.
+ * The coalescer detaches as soon as it has inherited the socket, so it is waited for right away.
+ */
+static bool
+start_coalescer (privelev_request * acquisition, const CoalescePaths * paths) {
+
+  const privelev_ctx * ctx = acquisition->ctx;
+
+  int listen_fd = coalesce_listen(paths);
+  if (listen_fd == -1) {
+    log_errno(ctx, "coalesce_listen()");
+    return false;
+  }
+
+  char address[sizeof(RENDEZVOUS_FD_PREFIX) + 11];
+  snprintf(address, sizeof(address), "%s%i", RENDEZVOUS_FD_PREFIX, listen_fd);
+  char keep[12];
+  char lease[12];
+  char lease_opens[12];
+  snprintf(keep, sizeof(keep), "%i", ctx->keep_ms);
+  snprintf(lease, sizeof(lease), "%i", ctx->lease_ms);
+  snprintf(lease_opens, sizeof(lease_opens), "%u", ctx->lease_opens);
+  const char * const coalescer_args[] = {
+    basename(COALESCER_PATH),
+    "--mechanism",
+    ctx->mechanism_path,
+    "--pkexec",
+    ctx->pkexec_path,
+    "--keep",
+    keep,
+    "--lease",
+    lease,
+    "--lease-opens",
+    lease_opens,
+    ctx->coalesce_dir,
+    address,
+    NULL
+  };
+
+  // only the coalescer inherits it, our copy stays close on exec for other spawns meanwhile
+  pid_t coalescer_pid;
+  int status = spawn_process(
+    ctx->spawn_backend,
+    COALESCER_PATH,
+    coalescer_args,
+    &acquisition->supervisor.signal_orig_mask,
+    listen_fd,
+    &coalescer_pid
+  );
+  close(listen_fd);
+
+  if (status != 1) {
+    log_errno(ctx, "spawn_process()");
+    return false;
+  }
+
+  int coalescer_status;
+  if (
+    TEMP_FAILURE_RETRY(waitpid(coalescer_pid, &coalescer_status, 0)) == -1 ||
+    !WIFEXITED(coalescer_status) ||
+    WEXITSTATUS(coalescer_status) != EXIT_SUCCESS
+  ) {
+    log_message(ctx, "Error: %s\n", "Coalescer failed to start");
+    return false;
+  }
+
+  return true;
+
+}
+
+/**
+ * Asks the coalescer for the launch's devices.
+ */
+static bool
+send_opens (privelev_request * acquisition, const Launch * launch) {
+
+  for (size_t i = 0; i < launch->launch_count; ++i) {
+
+    const privelev_device * device = &acquisition->devices[launch->launch_map[i]];
+    size_t path_length = strlen(device->path);
+    SerialLine line = serial_line(&device->line);
+    MechanismProtoOpen open_device = {
+      .baud = device->baud,
+      .data_bits = (uint8_t) line.data_bits,
+      .parity = (uint8_t) line.parity,
+      .stop_bits = (uint8_t) line.stop_bits,
+      .line_flags = (line.rts_cts ? PRIVFD_LINE_RTS_CTS : 0) |
+        (line.xon_xoff ? PRIVFD_LINE_XON_XOFF : 0) |
+        (line.rs485 ? PRIVFD_LINE_RS485 : 0) |
+        (line.low_latency ? PRIVFD_LINE_LOW_LATENCY : 0),
+      .rs485_delay_before_ms = line.rs485_delay_before_ms,
+      .rs485_delay_after_ms = line.rs485_delay_after_ms,
+      .path_length = (uint16_t) path_length
+    };
+    char body[PRIVFD_BODY_MAX];
+    if (path_length > sizeof(body) - sizeof(open_device)) {
+      errno = ENAMETOOLONG;
+      return false;
+    }
+    memcpy(body, &open_device, sizeof(open_device));
+    memcpy(body + sizeof(open_device), device->path, path_length);
+
+    if (protocol_send(launch->peer_fd, PRIVFD_OPEN, body, sizeof(open_device) + path_length, NULL, 0, NULL) != 1) {
+      return false;
+    }
+
+  }
+
+  return protocol_send(launch->peer_fd, PRIVFD_END, NULL, 0, NULL, 0, NULL) == 1;
+
+}
+
+/**
+ * Joins the elevation of the user's coalescer instead of running pkexec,
+ * starting the coalescer if none is running.
+ * The coalescer answers like a mechanism, so its answer is received the same way,
+ * but it is not our child, so only its socket is supervised.
+ */
+static privelev_status
+join_coalescer (privelev_request * acquisition, Launch * launch) {
+
+  const privelev_ctx * ctx = acquisition->ctx;
+  int64_t join_start = monotonic_ns();
+
+  CoalescePaths paths;
+  if (!coalesce_paths(ctx->coalesce_dir, &paths)) {
+    log_errno(ctx, "coalesce_paths()");
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+
+  int lock_fd = coalesce_lock(&paths);
+  if (lock_fd == -1) {
+    log_errno(ctx, "coalesce_lock()");
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+
+  // while we hold the lock, the coalescer cannot exit without seeing our connection
+  bool started = false;
+  int sock_fd = coalesce_connect(&paths);
+  if (sock_fd == -1 && (errno == ENOENT || errno == ECONNREFUSED)) {
+    started = start_coalescer(acquisition, &paths);
+    if (started) sock_fd = coalesce_connect(&paths);
+  }
+  int join_errno = errno;
+  close(lock_fd);
+
+  if (sock_fd == -1) {
+    errno = join_errno;
+    log_errno(ctx, "coalesce_connect()");
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+  launch->peer_fd = sock_fd;
+
+  if (!send_opens(acquisition, launch)) {
+    log_errno(ctx, "send_opens()");
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+
+  // from here on, the coalescer's elevation is starting
+  launch->started_ns = time_phase(acquisition, PRIVELEV_PHASE_SPAWN, join_start);
+  PROBE(join, started, launch->launch_count, launch->started_ns - join_start);
+
+  if (!supervisor_add(&acquisition->supervisor, &launch->request, 0, sock_fd, acquisition->deadline)) {
+    log_errno(ctx, "supervisor_add()");
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+  launch->supervised = true;
+
+  return PRIVELEV_OK;
+
+}
+
+/**
+ * Asks the elevated mechanism serving the lease to open the devices, instead of running pkexec again.
+ * It answers like a newly launched mechanism, but it is no longer waited on as our child,
+ * so only its socket is supervised.
+ */
+static privelev_status
+ask_broker (privelev_request * acquisition, Launch * launch, int broker_fd) {
+
+  const privelev_ctx * ctx = acquisition->ctx;
+  int64_t ask_start = monotonic_ns();
+
+  launch->peer_fd = broker_fd;
+  launch->leased = true;
+  launch->reused = true;
+
+  if (!send_opens(acquisition, launch)) {
+    // it hung up as its lease ran out, so the devices get a new elevation
+    log_errno(ctx, "send_opens()");
+    acquisition->lease_ended = true;
+    return PRIVELEV_ERROR_MECHANISM;
+  }
+
+  launch->started_ns = time_phase(acquisition, PRIVELEV_PHASE_SPAWN, ask_start);
+  PROBE(lease, launch->launch_count, launch->started_ns - ask_start);
+
+  if (!supervisor_add(&acquisition->supervisor, &launch->request, 0, broker_fd, acquisition->deadline)) {
+    log_errno(ctx, "supervisor_add()");
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+  launch->supervised = true;
+
+  return PRIVELEV_OK;
+
+}
+
+/**
+ * Times the start of a mechanism, which ends when it first reaches us.
+ * For the elevated mechanism this is dominated by the Polkit decision.
+ */
+static void
+time_mechanism_start (privelev_request * acquisition, Launch * launch) {
+
+  if (!launch->started_ns) return;
+  time_phase(
+    acquisition,
+    acquisition->privileged ? PRIVELEV_PHASE_AUTHORISATION : PRIVELEV_PHASE_MECHANISM_START,
+    launch->started_ns
+  );
+  launch->started_ns = 0;
+
+}
+
+/**
+ * Accepts every waiting connection on the shared listening socket.
+ * Each connection is matched to its mechanism by the peer's pid, which cannot be reused
+ * while the mechanism is unreaped. Connections from any other process are rejected,
+ * this matters for abstract sockets which anyone in the network namespace can reach.
+ */
+static privelev_status
+accept_mechanisms (privelev_request * acquisition) {
+
+  acquisition->supervisor.listen_ready = false;
+
+  while (true) {
+
+    struct sockaddr_un unix_peer_addr = {0};
+    socklen_t unix_peer_addr_size = sizeof(unix_peer_addr);
+
+    // the accepted connection is not non-blocking
+    int64_t accept_start = monotonic_ns();
+    int peer_fd = TEMP_FAILURE_RETRY(
+      accept4(
+        acquisition->sock_fd,
+        (struct sockaddr *) &unix_peer_addr,
+        &unix_peer_addr_size,
+        SOCK_CLOEXEC
+      )
+    );
+
+    if (peer_fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return PRIVELEV_OK;
+    } else if (peer_fd == -1) {
+      log_errno(acquisition->ctx, "accept()");
+      return PRIVELEV_ERROR_SYSTEM;
+    }
+
+    int64_t peer_check_start = time_phase(acquisition, PRIVELEV_PHASE_ACCEPT, accept_start);
+    pid_t pid = peer_pid(peer_fd);
+    Launch * launch = NULL;
+    for (size_t i = 0; i < acquisition->launches_count; ++i) {
+      Launch * candidate = &acquisition->launches[i];
+      if (!candidate->finished && candidate->peer_fd == -1 && candidate->request.pid == pid) {
+        launch = candidate;
+        break;
+      }
+    }
+    time_phase(acquisition, PRIVELEV_PHASE_PEER_CHECK, peer_check_start);
+
+    PROBE(accept, pid, peer_fd, launch != NULL);
+
+    if (!launch) {
+      log_message(acquisition->ctx, "Error: %s\n", "Rejected connection from unknown peer pid");
+      close(peer_fd);
+      continue;
+    }
+
+    launch->peer_fd = peer_fd;
+    time_mechanism_start(acquisition, launch);
+    if (!supervisor_watch(&acquisition->supervisor, &launch->request, peer_fd)) {
+      log_errno(acquisition->ctx, "supervisor_watch()");
+      return PRIVELEV_ERROR_SYSTEM;
+    }
+
+  }
+
+}
+
+/**
+ * Hands the results of a batch to their devices, along with the attached file descriptors.
+ */
+static privelev_status
+apply_batch (
+  privelev_request * acquisition,
+  const Launch * launch,
+  const char * body,
+  size_t length,
+  const int * fds,
+  size_t fds_count,
+  size_t * fds_used,
+  size_t * received
+) {
+
+  const privelev_ctx * ctx = acquisition->ctx;
+  privelev_opener opener = acquisition->privileged
+    ? PRIVELEV_OPENED_BY_ELEVATED_MECHANISM
+    : PRIVELEV_OPENED_BY_MECHANISM;
+
+  MechanismProtoBatch batch;
+  MechanismProtoResult results[PRIVFD_BATCH_MAX];
+
+  // reinterpreting message buffer as message
+  if (length < sizeof(batch)) {
+    log_message(ctx, "Error: %s\n", "Received incorrect message size from mechanism");
+    return PRIVELEV_ERROR_PROTOCOL;
+  }
+  memcpy(&batch, body, sizeof(batch));
+  if (
+    batch.count > PRIVFD_BATCH_MAX ||
+    length != sizeof(batch) + sizeof(MechanismProtoResult) * batch.count
+  ) {
+    log_message(ctx, "Error: %s\n", "Received incorrect message size from mechanism");
+    return PRIVELEV_ERROR_PROTOCOL;
+  }
+  memcpy(results, body + sizeof(batch), sizeof(MechanismProtoResult) * batch.count);
+
+  for (size_t i = 0; i < batch.count; ++i) {
+
+    if (results[i].index >= launch->launch_count) {
+      log_message(ctx, "Error: %s\n", "Mechanism reported an unknown device");
+      return PRIVELEV_ERROR_PROTOCOL;
+    }
+
+    privelev_device * device = &acquisition->devices[launch->launch_map[results[i].index]];
+
+    if (results[i].error == 0) {
+      if (*fds_used >= fds_count) {
+        log_message(ctx, "Error: %s\n", "Did not get a file descriptor from the mechanism");
+        return PRIVELEV_ERROR_PROTOCOL;
+      }
+      if (device->fd >= 0) close(device->fd);
+      device->fd = fds[(*fds_used)++];
+      device->error = 0;
+      device->opener = opener;
+    } else {
+      device->error = results[i].error;
+    }
+
+  }
+
+  *received += batch.count;
+  return PRIVELEV_OK;
+
+}
+
+static privelev_status
+apply_device (
+  privelev_request * acquisition,
+  const Launch * launch,
+  const char * body,
+  size_t length
+) {
+
+  MechanismProtoDevice description;
+  if (length < sizeof(description)) {
+    log_message(acquisition->ctx, "Error: %s\n", "Received incorrect message size from mechanism");
+    return PRIVELEV_ERROR_PROTOCOL;
+  }
+  memcpy(&description, body, sizeof(description));
+  if (
+    description.sysfs_path_length > PRIVFD_SYSFS_PATH_MAX ||
+    length != sizeof(description) + description.sysfs_path_length
+  ) {
+    log_message(acquisition->ctx, "Error: %s\n", "Received incorrect message size from mechanism");
+    return PRIVELEV_ERROR_PROTOCOL;
+  }
+  if (description.index >= launch->launch_count) {
+    log_message(acquisition->ctx, "Error: %s\n", "Mechanism reported an unknown device");
+    return PRIVELEV_ERROR_PROTOCOL;
+  }
+
+  privelev_device * device = &acquisition->devices[launch->launch_map[description.index]];
+  device->major = description.major;
+  device->minor = description.minor;
+  device->applied_baud = description.ospeed;
+  snprintf(
+    device->sysfs_path,
+    sizeof(device->sysfs_path),
+    "%.*s",
+    (int) description.sysfs_path_length,
+    body + sizeof(description)
+  );
+  device->latency_timer_ms = serial_latency_timer(device->sysfs_path);
+
+  return PRIVELEV_OK;
+
+}
+
+static privelev_status
+apply_error (privelev_request * acquisition, const char * body, size_t length) {
+
+  MechanismProtoError failure;
+  if (length != sizeof(failure)) {
+    log_message(acquisition->ctx, "Error: %s\n", "Received incorrect message size from mechanism");
+    return PRIVELEV_ERROR_PROTOCOL;
+  }
+  memcpy(&failure, body, sizeof(failure));
+
+  // the coalescer passes on how its elevation was refused
+  switch (failure.code) {
+  case PRIVFD_ERROR_DENIED:
+    return PRIVELEV_ERROR_DENIED;
+  case PRIVFD_ERROR_DISMISSED:
+    return PRIVELEV_ERROR_DISMISSED;
+  case PRIVFD_ERROR_LEASE:
+    log_message(acquisition->ctx, "%s\n", "The lease of the elevated mechanism does not cover this open");
+    acquisition->lease_ended = true;
+    return PRIVELEV_ERROR_MECHANISM;
+  }
+
+  log_message(
+    acquisition->ctx,
+    "Error: %s: %s\n",
+    (failure.code == PRIVFD_ERROR_USAGE) ? "Mechanism was misused" : "Mechanism failed",
+    strerror(failure.error)
+  );
+
+  return PRIVELEV_ERROR_MECHANISM;
+
+}
+
+/**
+ * Receives the mechanism's messages on the connected socket until it is done.
+ * Results are written into the devices selected by the launch map.
+ * This only starts once the first message is readable, and the mechanism
+ * sends everything at once, so it never waits on a Polkit prompt, and each
+ * message is waited on for at most RECEIVE_TIMEOUT_MS, less by the deadline.
+ */
+static privelev_status
+receive_devices (privelev_request * acquisition, const Launch * launch) {
+
+  const privelev_ctx * ctx = acquisition->ctx;
+  int peer_fd = launch->peer_fd;
+  int64_t deadline = acquisition->deadline;
+
+  // a mechanism serving a lease reads our next open from the same connection
+  if (!launch->leased) {
+    shutdown(peer_fd, SHUT_WR);
+  }
+
+  // the socket blocks, so a mechanism that connected but stalled mid-batch is bounded
+  // by the deadline, and otherwise by the receive timeout, so it cannot hang the caller
+  // a connection kept for a lease gets a new timeout for each open
+  int64_t timeout = (int64_t) RECEIVE_TIMEOUT_MS * 1000000;
+  if (deadline) {
+    timeout = MIN(timeout, MAX(deadline - monotonic_ns(), 1000));
+  }
+  struct timeval receive_timeout = {
+    .tv_sec = timeout / 1000000000,
+    .tv_usec = (timeout % 1000000000) / 1000
+  };
+  if (setsockopt(peer_fd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout)) != 0) {
+    log_errno(ctx, "setsockopt()");
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+
+  size_t received = 0;
+  while (true) {
+
+    MechanismProtoHeader header = {0};
+    char header_buffer[sizeof(header)] = {0};
+    char body[PRIVFD_BODY_MAX];
+    struct iovec io_vector[1] = {{
+        .iov_base = header_buffer,
+        .iov_len = sizeof(header_buffer)
+      }
+    };
+
+    // suitably aligned ancillary data
+    // the file descriptors are attached to the first byte of each batch
+    union {
+      char buf[CMSG_SPACE(sizeof(int) * PRIVFD_BATCH_MAX)];
+      struct cmsghdr align;
+    } ancillary_buffer;
+
+    struct msghdr message_options = {0};
+    message_options.msg_iov = io_vector;
+    message_options.msg_iovlen = 1;
+    message_options.msg_control = ancillary_buffer.buf;
+    message_options.msg_controllen = sizeof(ancillary_buffer.buf);
+
+    ssize_t ssize = TEMP_FAILURE_RETRY(
+      recvmsg(peer_fd, &message_options, MSG_WAITALL | MSG_CMSG_CLOEXEC)
+    );
+
+    if (ssize == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return PRIVELEV_ERROR_TIMED_OUT;
+    } else if (ssize == -1 && errno == ECONNRESET && launch->reused && received == 0) {
+      // the lease ran out before the mechanism read what we asked
+      acquisition->lease_ended = true;
+      return PRIVELEV_ERROR_MECHANISM;
+    } else if (ssize == -1) {
+      log_errno(ctx, "recvmsg()");
+      return PRIVELEV_ERROR_SYSTEM;
+    }
+
+    int * fds = NULL;
+    size_t fds_count = 0;
+    struct cmsghdr * ancillary_message = CMSG_FIRSTHDR(&message_options);
+    if (ancillary_message) {
+      if (
+        ancillary_message->cmsg_level == SOL_SOCKET &&
+        ancillary_message->cmsg_type == SCM_RIGHTS
+      ) {
+        fds = (int *) CMSG_DATA(ancillary_message);
+        fds_count = (ancillary_message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      } else {
+        log_message(ctx, "Error: %s\n", "Unknown ancillary data from mechanism");
+      }
+    }
+
+    // any descriptor not handed to a device is closed so it doesn't leak
+    size_t fds_used = 0;
+    privelev_status status = PRIVELEV_OK;
+    bool finished = false;
+
+    if (ssize == 0 && launch->reused && received == 0) {
+      // the lease ran out just as we asked
+      acquisition->lease_ended = true;
+      status = PRIVELEV_ERROR_MECHANISM;
+      goto close_fds;
+    } else if (ssize == 0) {
+      // the mechanism hung up without saying why, its exit status will
+      log_message(ctx, "Error: %s\n", "Mechanism closed the connection early");
+      status = PRIVELEV_ERROR_MECHANISM;
+      goto close_fds;
+    } else if ((size_t) ssize < sizeof(header_buffer)) {
+      log_message(ctx, "recvmsg(): %s\n", "Received incorrect message size from mechanism");
+      status = PRIVELEV_ERROR_PROTOCOL;
+      goto close_fds;
+    }
+
+    // reinterpreting message buffer as message
+    memcpy(&header, header_buffer, sizeof(header));
+
+    if (
+      header.magic != PRIVFD_MAGIC ||
+      header.version != PRIVFD_VERSION ||
+      header.length > PRIVFD_BODY_MAX
+    ) {
+      log_message(ctx, "Error: %s\n", "Unexpected message from mechanism");
+      status = PRIVELEV_ERROR_PROTOCOL;
+      goto close_fds;
+    }
+
+    if ((message_options.msg_flags & MSG_CTRUNC) == MSG_CTRUNC) {
+      log_message(ctx, "Error: %s\n", "Not enough space provided for ancillary data");
+      status = PRIVELEV_ERROR_PROTOCOL;
+      goto close_fds;
+    }
+
+    if (header.length > 0) {
+      ssize = TEMP_FAILURE_RETRY(
+        recv(peer_fd, body, header.length, MSG_WAITALL)
+      );
+      if (ssize == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        status = PRIVELEV_ERROR_TIMED_OUT;
+        goto close_fds;
+      } else if (ssize == -1) {
+        log_errno(ctx, "recv()");
+        status = PRIVELEV_ERROR_SYSTEM;
+        goto close_fds;
+      } else if ((size_t) ssize < header.length) {
+        log_message(ctx, "recv(): %s\n", "Received incorrect message size from mechanism");
+        status = PRIVELEV_ERROR_PROTOCOL;
+        goto close_fds;
+      }
+    }
+
+    PROBE(message, launch->request.pid, (int) header.type, (int) header.length, fds_count);
+
+    log_message(ctx, "Received Data:");
+    for (size_t i = 0; i < sizeof(header_buffer); ++i) {
+      log_message(ctx, " 0x%02X", (unsigned char) header_buffer[i]);
+    }
+    for (size_t i = 0; i < header.length; ++i) {
+      log_message(ctx, " 0x%02X", (unsigned char) body[i]);
+    }
+    log_message(ctx, "\n");
+
+    switch (header.type) {
+    case PRIVFD_BATCH:
+      status = apply_batch(acquisition, launch, body, header.length, fds, fds_count, &fds_used, &received);
+      break;
+    case PRIVFD_DEVICE:
+      status = apply_device(acquisition, launch, body, header.length);
+      break;
+    case PRIVFD_ERROR:
+      // acted on right away instead of waiting for the mechanism's exit status
+      status = apply_error(acquisition, body, header.length);
+      break;
+    case PRIVFD_END:
+      if (received != launch->launch_count) {
+        log_message(ctx, "Error: %s\n", "Mechanism did not report every device");
+        status = PRIVELEV_ERROR_PROTOCOL;
+      }
+      finished = true;
+      break;
+    default:
+      // later additions to the protocol are skipped
+      break;
+    }
+
+  close_fds:
+    for (size_t i = fds_used; i < fds_count; ++i) {
+      close(fds[i]);
+    }
+
+    if (status != PRIVELEV_OK || finished) {
+      return status;
+    }
+
+  }
+
+}
+
+/**
+ * Looks up how the devices were opened last time.
+ */
+static bool
+lookup_decisions (privelev_request * acquisition) {
+
+  size_t devices_count = acquisition->devices_count;
+
+  acquisition->cached = calloc(devices_count, sizeof(CacheDecision));
+  acquisition->latency_elevated = calloc(devices_count, sizeof(bool));
+  CacheKey * keys = calloc(devices_count, sizeof(CacheKey));
+  if (!acquisition->cached || !acquisition->latency_elevated || !keys) {
+    free(keys);
+    return false;
+  }
+
+  // a device that cannot be inspected has no decision
+  for (size_t i = 0; i < devices_count; ++i) {
+    if (!cache_key(acquisition->devices[i].path, -1, &keys[i])) {
+      keys[i].rdev = 0;
+    }
+  }
+
+  cache_lookup(acquisition->ctx->cache_path, keys, acquisition->cached, devices_count);
+
+  free(keys);
+  return true;
+
+}
+
+/**
+ * Records how the opened devices were opened, where that changed.
+ * Failing to is only logged, the cache is an optimisation.
+ */
+static void
+store_decisions (privelev_request * acquisition) {
+
+  if (!acquisition->cached) return;
+
+  const privelev_ctx * ctx = acquisition->ctx;
+  size_t devices_count = acquisition->devices_count;
+  CacheKey * keys = calloc(devices_count, sizeof(CacheKey));
+  CacheDecision * decisions = calloc(devices_count, sizeof(CacheDecision));
+  if (!keys || !decisions) {
+    log_errno(ctx, "calloc()");
+    free(keys);
+    free(decisions);
+    return;
+  }
+
+  size_t count = 0;
+  for (size_t i = 0; i < devices_count; ++i) {
+    const privelev_device * device = &acquisition->devices[i];
+    if (device->fd < 0 || acquisition->latency_elevated[i]) continue;
+    CacheDecision decision = (device->opener == PRIVELEV_OPENED_BY_ELEVATED_MECHANISM)
+      ? CACHE_ELEVATED
+      : CACHE_UNPRIVILEGED;
+    if (decision == acquisition->cached[i]) continue;
+    if (!cache_key(device->path, device->fd, &keys[count])) continue;
+    decisions[count++] = decision;
+  }
+
+  if (count && !cache_store(ctx->cache_path, keys, decisions, count)) {
+    log_errno(ctx, "cache_store()");
+  }
+
+  free(keys);
+  free(decisions);
+
+}
+
+/**
+ * The errno standing for a status, for devices that failed without one of their own.
+ */
+static int
+status_errno (privelev_status status) {
+
+  switch (status) {
+  case PRIVELEV_ERROR_DENIED:
+    return EACCES;
+  case PRIVELEV_ERROR_DISMISSED:
+  case PRIVELEV_ERROR_CANCELLED:
+    return ECANCELED;
+  case PRIVELEV_ERROR_PROTOCOL:
+    return EPROTO;
+  case PRIVELEV_ERROR_TIMED_OUT:
+    return ETIMEDOUT;
+  default:
+    return EIO;
+  }
+
+}
+
+static void
+finish_request (privelev_request * acquisition, privelev_status status) {
+
+  // every device not opened says why, even those the run never got to,
+  // and those still waiting on elevation say why it was not granted rather than that they needed it
+  if (status != PRIVELEV_OK && status != PRIVELEV_ERROR_DEVICE) {
+    for (size_t i = 0; i < acquisition->devices_count; ++i) {
+      privelev_device * device = &acquisition->devices[i];
+      bool waiting = acquisition->privileged && needs_elevation(device) && status_errno(status) != EIO;
+      if (device->fd < 0 && (device->error == 0 || waiting)) {
+        device->error = status_errno(status);
+      }
+    }
+  }
+
+  store_decisions(acquisition);
+  close_rendezvous(acquisition, true);
+  acquisition->phase = PHASE_DONE;
+  acquisition->status = status;
+  acquisition->completed_ns = monotonic_ns();
+  PROBE(open__done, (int) status, acquisition->completed_ns - acquisition->started_ns);
+
+}
+
+/**
+ * Lets go of a mechanism, keeping the attempt's first failure.
+ */
+static void
+end_launch (privelev_request * acquisition, Launch * launch, privelev_status status) {
+
+  Request * request = &launch->request;
+
+  PROBE(launch__done, request->pid, acquisition->privileged, (int) status);
+
+  if (launch->supervised) {
+    supervisor_remove(&acquisition->supervisor, request);
+  }
+  if (request->pidfd != -1) {
+    if (request->status == -1) {
+      // a still running mechanism exits once the rendezvous is closed (or right after sending)
+      // it may now run as root and not be signalable, so it is reaped later instead of waited for
+      adopt_orphan(acquisition->ctx, request);
+    } else {
+      request_reap(request);
+    }
+  }
+
+  // the mechanism serving the lease waits for the next open
+  if (launch->leased && status == PRIVELEV_OK && launch->peer_fd != -1) {
+    return_broker(acquisition->ctx, launch->peer_fd);
+    launch->peer_fd = -1;
+  }
+
+  close_launch(launch);
+
+  launch->finished = true;
+  --acquisition->launches_pending;
+  if (acquisition->launches_status == PRIVELEV_OK) {
+    acquisition->launches_status = status;
+  }
+
+}
+
+/**
+ * Moves on to the elevated attempt once every mechanism of the attempt is done.
+ */
+static void
+end_attempt (privelev_request * acquisition) {
+
+  privelev_status status = acquisition->launches_status;
+
+  close_rendezvous(acquisition, false);
+
+  time_phase(
+    acquisition,
+    acquisition->privileged ? PRIVELEV_PHASE_ELEVATED_ATTEMPT : PRIVELEV_PHASE_UNPRIVILEGED_ATTEMPT,
+    acquisition->attempt_started_ns
+  );
+
+  // a lease that ran out, or does not cover the devices, is replaced by a new elevation
+  if (acquisition->lease_ended) {
+    acquisition->lease_ended = false;
+    acquisition->lease_refused = true;
+    acquisition->phase = PHASE_LAUNCH;
+    return;
+  }
+
+  if (status != PRIVELEV_OK || acquisition->privileged) {
+    finish_request(acquisition, status);
+    return;
+  }
+
+  acquisition->privileged = true;
+  acquisition->phase = PHASE_LAUNCH;
+
+}
+
+/**
+ * Launches the mechanisms of the next attempt.
+ * The unprivileged attempt covers every device not known to need elevation,
+ * split over up to `concurrency` mechanisms.
+ * The privileged attempt only covers devices denied permission, with a single mechanism
+ * so there is at most one Polkit prompt.
+ */
+static void
+start_attempt (privelev_request * acquisition) {
+
+  const privelev_ctx * ctx = acquisition->ctx;
+  bool privileged = acquisition->privileged;
+
+  acquisition->attempt_started_ns = monotonic_ns();
+
+  size_t launch_count = 0;
+  for (size_t i = 0; i < acquisition->devices_count; ++i) {
+    const privelev_device * device = &acquisition->devices[i];
+    if (device_settings_valid(device) && privileged == needs_elevation(device)) {
+      acquisition->launch_map[launch_count++] = i;
+    }
+  }
+
+  if (launch_count == 0) {
+    finish_request(acquisition, PRIVELEV_OK);
+    return;
+  }
+
+  size_t launches_count = privileged ? 1 : MIN(ctx->concurrency, launch_count);
+
+  log_message(
+    ctx,
+    "%s\n",
+    privileged
+      ? "Attempting to open with elevated privileges"
+      : "Attempting to open without elevated privileges"
+  );
+
+  acquisition->phase = PHASE_WAITING;
+  acquisition->launches_count = launches_count;
+  acquisition->launches_pending = launches_count;
+  acquisition->launches_status = PRIVELEV_OK;
+  acquisition->deadline = ctx->timeout_ms ? monotonic_ns() + (int64_t) ctx->timeout_ms * 1000000 : 0;
+
+  // a lone unprivileged mechanism inherits a socketpair
+  // everything else connects to one listening socket and is told apart by its pid
+  // except for the coalescer and a mechanism serving its lease, which are already around
+  bool coalescing = privileged && ctx->coalesce_dir;
+  int broker_fd = -1;
+  if (privileged && !coalescing && ctx->lease_ms && !acquisition->lease_refused) {
+    broker_fd = take_broker(acquisition->ctx);
+  }
+  bool listening = !coalescing && broker_fd == -1;
+#if !defined(PATH_RENDEZVOUS)
+  listening = listening && (privileged || launches_count > 1);
+#endif
+
+  int64_t rendezvous_start = monotonic_ns();
+  if (listening && !setup_listen_rendezvous(acquisition, (int) launches_count)) {
+    acquisition->launches_status = PRIVELEV_ERROR_SYSTEM;
+    acquisition->launches_count = 0;
+    acquisition->launches_pending = 0;
+    end_attempt(acquisition);
+    return;
+  }
+  if (listening) {
+    time_phase(acquisition, PRIVELEV_PHASE_RENDEZVOUS, rendezvous_start);
+  }
+
+  for (size_t i = 0; i < launches_count; ++i) {
+
+    Launch * launch = &acquisition->launches[i];
+    size_t start = launch_count * i / launches_count;
+    size_t end = launch_count * (i + 1) / launches_count;
+    *launch = (Launch) {
+      .request = { .pidfd = -1 },
+      .launch_map = &acquisition->launch_map[start],
+      .launch_count = end - start,
+      .peer_fd = -1,
+      .mechanism_sock_fd = -1
+    };
+
+    privelev_status status = PRIVELEV_OK;
+#if !defined(PATH_RENDEZVOUS)
+    if (!listening && !coalescing && broker_fd == -1) {
+      rendezvous_start = monotonic_ns();
+      if (setup_pair_rendezvous(acquisition, launch)) {
+        time_phase(acquisition, PRIVELEV_PHASE_RENDEZVOUS, rendezvous_start);
+      } else {
+        status = PRIVELEV_ERROR_SYSTEM;
+      }
+    }
+#endif
+    // a failed launch leaves the remaining devices unopened
+    if (status == PRIVELEV_OK && acquisition->launches_status == PRIVELEV_OK) {
+      if (coalescing) {
+        status = join_coalescer(acquisition, launch);
+      } else if (broker_fd != -1) {
+        status = ask_broker(acquisition, launch, broker_fd);
+      } else {
+        status = launch_mechanism(acquisition, launch);
+      }
+    }
+    if (status != PRIVELEV_OK || acquisition->launches_status != PRIVELEV_OK) {
+      end_launch(acquisition, launch, status);
+    }
+
+  }
+
+  if (acquisition->launches_pending == 0) {
+    end_attempt(acquisition);
+  }
+
+}
+
+/**
+ * Advances the request until it completes or has to wait on the supervisor
+ * for longer than the timeout in milliseconds (-1 waits indefinitely).
+ */
+static privelev_status
+advance_request (privelev_request * acquisition, int timeout) {
+
+  while (acquisition->phase != PHASE_DONE) {
+
+    if (acquisition->phase == PHASE_LAUNCH) {
+      start_attempt(acquisition);
+      continue;
+    }
+
+    PROBE(wait__start, timeout);
+    int settled = supervisor_wait(&acquisition->supervisor, timeout);
+    PROBE(wait__done, settled, (settled == -1) ? errno : 0);
+    if (settled == -1) {
+      log_errno(acquisition->ctx, "supervisor_wait()");
+      for (size_t i = 0; i < acquisition->launches_count; ++i) {
+        if (!acquisition->launches[i].finished) {
+          end_launch(acquisition, &acquisition->launches[i], PRIVELEV_ERROR_SYSTEM);
+        }
+      }
+      end_attempt(acquisition);
+      continue;
+    } else if (settled == 0) {
+      return PRIVELEV_IN_PROGRESS;
+    }
+
+    // a mechanism may have connected and exited before its connection was accepted
+    // so connections are accepted before deciding that a mechanism never connected
+    if (acquisition->sock_fd != -1) {
+      privelev_status status = accept_mechanisms(acquisition);
+      if (status != PRIVELEV_OK && acquisition->launches_status == PRIVELEV_OK) {
+        acquisition->launches_status = status;
+      }
+    }
+
+    for (size_t i = 0; i < acquisition->launches_count; ++i) {
+
+      Launch * launch = &acquisition->launches[i];
+      Request * request = &launch->request;
+      if (launch->finished || request->state == REQUEST_PENDING) continue;
+
+      if (request->state != REQUEST_READY) {
+        end_launch(acquisition, launch, settled_status(acquisition->ctx, request));
+      } else if (launch->peer_fd != -1) {
+        // a socketpair mechanism first reaches us with its first message
+        time_mechanism_start(acquisition, launch);
+        int64_t receive_start = monotonic_ns();
+        privelev_status status = receive_devices(acquisition, launch);
+        time_phase(acquisition, PRIVELEV_PHASE_RECEIVE, receive_start);
+        end_launch(acquisition, launch, status);
+      } else {
+        // only a connected mechanism can have a readable socket
+        end_launch(acquisition, launch, PRIVELEV_ERROR_PROTOCOL);
+      }
+
+    }
+
+    if (acquisition->launches_pending == 0) {
+      end_attempt(acquisition);
+    }
+
+  }
+
+  return acquisition->status;
+
+}
+
+privelev_request *
+privelev_open_async (
+  privelev_ctx * ctx,
+  privelev_device * devices,
+  size_t devices_count
+) {
+
+  reap_orphans(ctx);
+
+  privelev_request * acquisition = calloc(1, sizeof(privelev_request));
+  if (!acquisition) return NULL;
+
+  acquisition->ctx = ctx;
+  acquisition->devices = devices;
+  acquisition->devices_count = devices_count;
+  acquisition->phase = PHASE_DONE;
+  acquisition->status = PRIVELEV_OK;
+  acquisition->sock_fd = -1;
+  acquisition->started_ns = monotonic_ns();
+  PROBE(open__start, devices_count, ctx->fast_path);
+
+  if (ctx->cache_path && !lookup_decisions(acquisition)) {
+    privelev_request_free(acquisition);
+    return NULL;
+  }
+
+  /* FAST PATH CODE */
+
+  // the unprivileged mechanism runs as the same user as this process
+  // so whatever it can open, we can open ourselves without spawning anything
+  // only permission failures need to go through the elevated mechanism
+  size_t pending_count = devices_count;
+  size_t elevated_count = 0;
+  for (size_t i = 0; i < devices_count; ++i) {
+    privelev_device * device = &devices[i];
+    device->fd = -1;
+    device->error = 0;
+    device->opener = PRIVELEV_OPENED_NONE;
+    device->major = 0;
+    device->minor = 0;
+    device->applied_baud = 0;
+    device->sysfs_path[0] = '\0';
+    device->latency_timer_ms = -1;
+    // rejected before launching any mechanism
+    if (!device_settings_valid(device)) {
+      device->error = EINVAL;
+      --pending_count;
+      continue;
+    }
+    if (acquisition->cached && acquisition->cached[i] == CACHE_ELEVATED) {
+      // it needed elevation last time and nothing about it has changed since
+      // so it goes straight to the elevated mechanism as if it had been denied
+      device->error = EACCES;
+      ++elevated_count;
+      continue;
+    }
+    if (!ctx->fast_path) continue;
+    if (latency_timer_needs_elevation(device)) {
+      // opened in-process, its latency timer would stay where it is
+      device->error = EACCES;
+      ++elevated_count;
+      if (acquisition->latency_elevated) acquisition->latency_elevated[i] = true;
+      continue;
+    }
+    SerialLine line = serial_line(&device->line);
+    device->fd = open_serial(device->path, device->baud, &line);
+    if (device->fd >= 0) {
+      device->opener = PRIVELEV_OPENED_IN_PROCESS;
+      describe_device(device);
+      --pending_count;
+    } else {
+      device->error = errno;
+      if (!needs_elevation(device)) --pending_count;
+    }
+    PROBE(fast__path, device->path, device->fd, device->error);
+  }
+  if (ctx->fast_path) {
+    time_phase(acquisition, PRIVELEV_PHASE_FAST_PATH, acquisition->started_ns);
+  }
+
+  if (pending_count == 0) {
+    store_decisions(acquisition);
+    acquisition->completed_ns = monotonic_ns();
+    PROBE(open__done, (int) PRIVELEV_OK, acquisition->completed_ns - acquisition->started_ns);
+    return acquisition;
+  }
+
+  /* EXECUTION CODE */
+
+  // 2 arguments per device, plus program name, socket path and NULL
+  // pkexec additionally needs the mechanism path, and the lease options
+  size_t lease_count = ctx->lease_ms ? 4 + ctx->lease_allow_count * 2 : 0;
+  acquisition->mechanism_args = calloc(devices_count * 2 + 3, sizeof(char *));
+  acquisition->pkexec_args = calloc(devices_count * 2 + 4 + lease_count, sizeof(char *));
+  acquisition->selected_settings = calloc(devices_count, sizeof(*acquisition->selected_settings));
+  acquisition->launch_map = calloc(devices_count, sizeof(size_t));
+  acquisition->launches = calloc(MIN(ctx->concurrency, devices_count), sizeof(Launch));
+  if (
+    !acquisition->mechanism_args ||
+    !acquisition->pkexec_args ||
+    !acquisition->selected_settings ||
+    !acquisition->launch_map ||
+    !acquisition->launches
+  ) {
+    privelev_request_free(acquisition);
+    return NULL;
+  }
+
+  if (!supervisor_init(&acquisition->supervisor, ctx->signal_cancellation)) {
+    privelev_request_free(acquisition);
+    return NULL;
+  }
+  acquisition->supervising = true;
+
+  // with the fast path, the unprivileged mechanism would fail the same way
+  // and without it, there is nothing left for it if every device needs elevation
+  acquisition->privileged = ctx->fast_path || elevated_count == pending_count;
+  acquisition->phase = PHASE_LAUNCH;
+
+  advance_request(acquisition, 0);
+
+  return acquisition;
+
+}
+
+int
+privelev_request_fd (const privelev_request * acquisition) {
+
+  if (acquisition->phase == PHASE_DONE) {
+    return -1;
+  }
+  return acquisition->supervisor.epoll_fd;
+
+}
+
+privelev_status
+privelev_request_complete (privelev_request * acquisition) {
+
+  return advance_request(acquisition, 0);
+
+}
+
+void
+privelev_request_free (privelev_request * acquisition) {
+
+  if (!acquisition) return;
+
+  // an abandoned request is cancelled like a timed out one
+  if (acquisition->phase == PHASE_WAITING) {
+    for (size_t i = 0; i < acquisition->launches_count; ++i) {
+      Launch * launch = &acquisition->launches[i];
+      if (launch->finished) continue;
+      request_cancel(&launch->request, REQUEST_CANCELLED);
+      end_launch(acquisition, launch, PRIVELEV_ERROR_CANCELLED);
+    }
+  }
+  close_rendezvous(acquisition, true);
+
+  const privelev_ctx * ctx = acquisition->ctx;
+  if (ctx->timings_callback) {
+    int64_t completed_ns = acquisition->completed_ns ? acquisition->completed_ns : monotonic_ns();
+    acquisition->timings.total_ns = completed_ns - acquisition->started_ns;
+    ctx->timings_callback(&acquisition->timings, ctx->timings_data);
+  }
+
+  int cancel_signal = 0;
+  if (acquisition->supervising) {
+    cancel_signal = acquisition->supervisor.cancel_signal;
+    supervisor_destroy(&acquisition->supervisor);
+  }
+
+  free(acquisition->mechanism_args);
+  free(acquisition->pkexec_args);
+  free(acquisition->selected_settings);
+  free(acquisition->launch_map);
+  free(acquisition->launches);
+  free(acquisition->cached);
+  free(acquisition->latency_elevated);
+  free(acquisition);
+
+  // now that the signal is no longer blocked, let it take its usual course
+  if (cancel_signal) {
+    raise(cancel_signal);
+  }
+
+}
+
+privelev_status
+privelev_open_serial_many (
+  privelev_ctx * ctx,
+  privelev_device * devices,
+  size_t devices_count
+) {
+
+  privelev_request * acquisition = privelev_open_async(ctx, devices, devices_count);
+  if (!acquisition) {
+    log_errno(ctx, "privelev_open_async()");
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+
+  privelev_status status = advance_request(acquisition, -1);
+
+  privelev_request_free(acquisition);
+
+  return status;
+
+}
+
+privelev_status
+privelev_open_serial (
+  privelev_ctx * ctx,
+  const char * path,
+  uint32_t baud,
+  int * fd
+) {
+
+  privelev_device device = { .path = path, .baud = baud };
+
+  privelev_status status = privelev_open_serial_many(ctx, &device, 1);
+  if (status != PRIVELEV_OK) {
+    return status;
+  }
+
+  if (device.fd < 0) {
+    errno = device.error;
+    return PRIVELEV_ERROR_DEVICE;
+  }
+
+  *fd = device.fd;
+  return PRIVELEV_OK;
+
+}
+
+privelev_status
+privelev_probe (
+  privelev_ctx * ctx,
+  privelev_device * devices,
+  size_t devices_count
+) {
+
+  // opening a serial port can reset what is attached to it
+  // so the permissions are checked instead, the way open would check them
+  for (size_t i = 0; i < devices_count; ++i) {
+
+    privelev_device * device = &devices[i];
+    device->fd = -1;
+    device->error = 0;
+    device->opener = PRIVELEV_OPENED_NONE;
+    device->major = 0;
+    device->minor = 0;
+    device->applied_baud = 0;
+    device->sysfs_path[0] = '\0';
+    device->latency_timer_ms = -1;
+
+    if (!device_settings_valid(device)) {
+      device->error = EINVAL;
+      continue;
+    }
+
+    struct stat device_stat;
+    if (stat(device->path, &device_stat) != 0) {
+      device->error = errno;
+      continue;
+    }
+    if (!S_ISCHR(device_stat.st_mode)) {
+      device->error = ENOTTY;
+      continue;
+    }
+
+    device->major = major(device_stat.st_rdev);
+    device->minor = minor(device_stat.st_rdev);
+    serial_sysfs_path(device->major, device->minor, device->sysfs_path, sizeof(device->sysfs_path));
+
+    // ttys live in the tty class, pseudo terminals have no sysfs entry at all
+    if (device->sysfs_path[0] && !strstr(device->sysfs_path, "/tty/")) {
+      device->error = ENOTTY;
+      continue;
+    }
+
+    device->latency_timer_ms = serial_latency_timer(device->sysfs_path);
+
+    if (ctx->fast_path && latency_timer_needs_elevation(device)) {
+      device->opener = PRIVELEV_OPENED_BY_ELEVATED_MECHANISM;
+    } else if (faccessat(AT_FDCWD, device->path, R_OK | W_OK, AT_EACCESS) == 0) {
+      device->opener = ctx->fast_path ? PRIVELEV_OPENED_IN_PROCESS : PRIVELEV_OPENED_BY_MECHANISM;
+    } else if (errno == EACCES || errno == EPERM) {
+      device->opener = PRIVELEV_OPENED_BY_ELEVATED_MECHANISM;
+    } else {
+      device->error = errno;
+    }
+
+  }
+
+  return PRIVELEV_OK;
+
+}
+
+privelev_status
+privelev_reconfigure (
+  privelev_device * device,
+  uint32_t baud,
+  const privelev_line * line,
+  privelev_flush flush
+) {
+
+  if (device->fd < 0) {
+    errno = EBADF;
+    return PRIVELEV_ERROR_DEVICE;
+  }
+
+  SerialLine settings = serial_line(line);
+  if (reconfigure_serial(device->fd, baud, &settings, flush == PRIVELEV_FLUSH_INPUT) != 1) {
+    // part of it may have been set before the device turned the rest down
+    int reconfigure_errno = errno;
+    SerialLine previous_settings = serial_line(&device->line);
+    reconfigure_serial(device->fd, device->baud, &previous_settings, false);
+    errno = reconfigure_errno;
+    return PRIVELEV_ERROR_DEVICE;
+  }
+
+  device->baud = baud;
+  device->line = *line;
+  describe_device(device);
+  return PRIVELEV_OK;
+
+}
+
+privelev_status
+privelev_negotiate (
+  privelev_device * device,
+  uint32_t baud,
+  const privelev_line * line,
+  const privelev_negotiation * negotiation
+) {
+
+  int timeout = (negotiation->timeout_ms > 0) ? negotiation->timeout_ms : NEGOTIATION_TIMEOUT_MS;
+  uint32_t previous_baud = device->baud;
+  privelev_line previous_line = device->line;
+
+  if (device->fd < 0) {
+    errno = EBADF;
+    return PRIVELEV_ERROR_DEVICE;
+  }
+
+  if (
+    serial_send(device->fd, negotiation->request, negotiation->request_length, timeout) != 1 ||
+    serial_expect(device->fd, negotiation->ack, negotiation->ack_length, timeout) != 1
+  ) {
+    return PRIVELEV_ERROR_DEVICE;
+  }
+
+  // the request has gone out at the old rate by the time this returns
+  privelev_status status = privelev_reconfigure(device, baud, line, PRIVELEV_FLUSH_INPUT);
+  if (status != PRIVELEV_OK) {
+    return status;
+  }
+
+  if (
+    serial_send(device->fd, negotiation->probe, negotiation->probe_length, timeout) != 1 ||
+    serial_expect(device->fd, negotiation->response, negotiation->response_length, timeout) != 1
+  ) {
+    int negotiate_errno = errno;
+    privelev_reconfigure(device, previous_baud, &previous_line, PRIVELEV_FLUSH_INPUT);
+    errno = negotiate_errno;
+    return PRIVELEV_ERROR_DEVICE;
+  }
+
+  return PRIVELEV_OK;
+
+}
+
+// the rates Arduino's serial monitor offers, most used first, so most devices lock early
+static const uint32_t auto_baud_candidates[] = {
+  9600, 115200, 57600, 38400, 19200, 230400, 4800, 2400, 1200, 14400, 28800,
+  250000, 500000, 1000000, 2000000, 300
+};
+
+/**
+ * One device being listened to by privelev_detect_baud.
+ */
+typedef struct BaudProbe {
+  privelev_device * device;
+  uint32_t original_baud;
+  // the candidate being listened at
+  size_t candidate;
+  // what has been received at it
+  uint64_t received;
+  uint64_t printable;
+  bool counting_errors;
+  uint64_t errors_before;
+  uint32_t best_baud;
+  double best_score;
+  bool done;
+} BaudProbe;
+
+/**
+ * Moves the probe on to the next candidate the device can be set to.
+ * Returns false once there are none left.
+ */
+static bool
+next_candidate (BaudProbe * probe, const uint32_t * candidates, size_t candidates_count) {
+
+  privelev_device * device = probe->device;
+  while (probe->candidate < candidates_count) {
+    uint32_t baud = candidates[probe->candidate];
+    // what was received at the rate before is no use at this one
+    if (privelev_reconfigure(device, baud, &device->line, PRIVELEV_FLUSH_INPUT) == PRIVELEV_OK) {
+      probe->received = 0;
+      probe->printable = 0;
+      probe->counting_errors = serial_errors(device->fd, &probe->errors_before);
+      return true;
+    }
+    // a rate the driver turns down is not the device's
+    ++probe->candidate;
+  }
+  return false;
+
+}
+
+/**
+ * Scores what was received at the current candidate, and decides if the probe is done.
+ */
+static void
+score_candidate (BaudProbe * probe, size_t candidates_count) {
+
+  uint64_t errors = 0;
+  uint64_t errors_after;
+  if (probe->counting_errors && serial_errors(probe->device->fd, &errors_after)) {
+    errors = errors_after - probe->errors_before;
+  }
+
+  if (probe->received >= AUTO_BAUD_MIN_BYTES) {
+    // every error stands for a byte that was lost, and a wrong rate causes many
+    double score = ((double) probe->printable - (double) errors) / (double) (probe->received + errors);
+    if (score > probe->best_score) {
+      probe->best_score = score;
+      probe->best_baud = probe->device->baud;
+    }
+    if (score >= AUTO_BAUD_LOCK_SCORE && probe->received >= AUTO_BAUD_LOCK_BYTES) {
+      probe->done = true;
+      return;
+    }
+  }
+
+  ++probe->candidate;
+  probe->done = probe->candidate >= candidates_count;
+
+}
+
+privelev_status
+privelev_detect_baud (
+  privelev_device * devices,
+  size_t devices_count,
+  const privelev_auto_baud * auto_baud
+) {
+
+  const uint32_t * candidates = auto_baud_candidates;
+  size_t candidates_count = sizeof(auto_baud_candidates) / sizeof(auto_baud_candidates[0]);
+  if (auto_baud && auto_baud->candidates) {
+    candidates = auto_baud->candidates;
+    candidates_count = auto_baud->candidates_count;
+  }
+  int window_ms = (auto_baud && auto_baud->window_ms > 0) ? auto_baud->window_ms : AUTO_BAUD_WINDOW_MS;
+
+  BaudProbe * probes = calloc(devices_count, sizeof(BaudProbe));
+  struct pollfd * poll_fds = calloc(devices_count, sizeof(struct pollfd));
+  size_t * poll_map = calloc(devices_count, sizeof(size_t));
+  if (!probes || !poll_fds || !poll_map) {
+    free(probes);
+    free(poll_fds);
+    free(poll_map);
+    return PRIVELEV_ERROR_SYSTEM;
+  }
+
+  for (size_t i = 0; i < devices_count; ++i) {
+    probes[i] = (BaudProbe) {
+      .device = &devices[i],
+      .original_baud = devices[i].baud,
+      .best_score = -1,
+      .done = devices[i].fd < 0
+    };
+  }
+
+  // every device listens at its next candidate during the same window
+  char buffer[4096];
+  while (true) {
+
+    size_t poll_count = 0;
+    for (size_t i = 0; i < devices_count; ++i) {
+      BaudProbe * probe = &probes[i];
+      if (probe->done) continue;
+      if (!next_candidate(probe, candidates, candidates_count)) {
+        probe->done = true;
+        continue;
+      }
+      poll_fds[poll_count] = (struct pollfd) { .fd = probe->device->fd, .events = POLLIN };
+      poll_map[poll_count++] = i;
+    }
+    if (poll_count == 0) break;
+
+    int64_t deadline = monotonic_ns() + (int64_t) window_ms * 1000000;
+    int64_t remaining;
+    while ((remaining = deadline - monotonic_ns()) > 0) {
+      if (TEMP_FAILURE_RETRY(poll(poll_fds, poll_count, (int) ((remaining + 999999) / 1000000))) <= 0) break;
+      for (size_t j = 0; j < poll_count; ++j) {
+        if (!(poll_fds[j].revents & POLLIN)) {
+          // a device that hung up or failed is left out of the rest of the window
+          if (poll_fds[j].revents) poll_fds[j].fd = -1;
+          continue;
+        }
+        BaudProbe * probe = &probes[poll_map[j]];
+        ssize_t length = read(poll_fds[j].fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+          if (length == 0 || (errno != EAGAIN && errno != EINTR)) poll_fds[j].fd = -1;
+          continue;
+        }
+        probe->received += length;
+        for (ssize_t k = 0; k < length; ++k) {
+          unsigned char byte = (unsigned char) buffer[k];
+          if ((byte >= 0x20 && byte < 0x7f) || byte == '\r' || byte == '\n' || byte == '\t') {
+            ++probe->printable;
+          }
+        }
+      }
+    }
+
+    for (size_t j = 0; j < poll_count; ++j) {
+      score_candidate(&probes[poll_map[j]], candidates_count);
+    }
+
+  }
+
+  privelev_status status = PRIVELEV_OK;
+  for (size_t i = 0; i < devices_count; ++i) {
+    BaudProbe * probe = &probes[i];
+    privelev_device * device = probe->device;
+    if (device->fd < 0) continue;
+    bool detected = probe->best_score >= AUTO_BAUD_MIN_SCORE;
+    uint32_t baud = detected ? probe->best_baud : probe->original_baud;
+    if (privelev_reconfigure(device, baud, &device->line, PRIVELEV_FLUSH_INPUT) != PRIVELEV_OK || !detected) {
+      device->error = detected ? errno : ENODATA;
+      status = PRIVELEV_ERROR_DEVICE;
+    }
+  }
+
+  free(probes);
+  free(poll_fds);
+  free(poll_map);
+  return status;
+
+}
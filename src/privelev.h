@@ -0,0 +1,438 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * libprivelev opens serial devices with lazy privilege elevation.
+ * Devices are first opened in-process, and only devices denied permission
+ * are opened by the mechanism launched through pkexec.
+ *
+ * A context only holds configuration, and the connection to a mechanism serving a lease.
+ * Configure it before sharing it, after that any number of threads may open devices
+ * through it concurrently, every open has its own rendezvous socket and supervisor.
+ */
+
+typedef struct privelev_ctx privelev_ctx;
+
+typedef struct privelev_request privelev_request;
+
+typedef enum {
+  PRIVELEV_OK = 0,
+  // a system call failed, errno is set
+  PRIVELEV_ERROR_SYSTEM,
+  // Polkit denied permission to elevate privileges
+  PRIVELEV_ERROR_DENIED,
+  // the user dismissed the authentication dialog
+  PRIVELEV_ERROR_DISMISSED,
+  // the mechanism failed without reporting any device
+  PRIVELEV_ERROR_MECHANISM,
+  // the mechanism sent something unexpected
+  PRIVELEV_ERROR_PROTOCOL,
+  PRIVELEV_ERROR_TIMED_OUT,
+  PRIVELEV_ERROR_CANCELLED,
+  // the device itself could not be opened, errno is set to the device error
+  PRIVELEV_ERROR_DEVICE,
+  // an asynchronous request is still waiting on the mechanism
+  PRIVELEV_IN_PROGRESS
+} privelev_status;
+
+typedef enum {
+  PRIVELEV_OPENED_NONE = 0,
+  PRIVELEV_OPENED_IN_PROCESS,
+  PRIVELEV_OPENED_BY_MECHANISM,
+  PRIVELEV_OPENED_BY_ELEVATED_MECHANISM
+} privelev_opener;
+
+// sysfs paths are truncated to fit
+#define PRIVELEV_SYSFS_PATH_MAX 256
+
+typedef enum {
+  PRIVELEV_PARITY_NONE = 0,
+  PRIVELEV_PARITY_ODD,
+  PRIVELEV_PARITY_EVEN
+} privelev_parity;
+
+/**
+ * Framing and flow control of a device's line, all zero is 8N1 without flow control.
+ */
+typedef struct privelev_line {
+  // 5 to 8, 0 is 8
+  uint8_t data_bits;
+  privelev_parity parity;
+  // 1 or 2, 0 is 1
+  uint8_t stop_bits;
+  // hardware flow control
+  bool rts_cts;
+  // software flow control
+  bool xon_xoff;
+  // half duplex, the driver asserts RTS to drive the bus while sending
+  bool rs485;
+  // how long RTS is asserted before sending, and kept asserted after it, up to 100
+  uint32_t rs485_delay_before_ms;
+  uint32_t rs485_delay_after_ms;
+  // the driver passes on received bytes as soon as it can, and blocking reads
+  // return on the first byte instead of returning nothing right away
+  bool low_latency;
+} privelev_line;
+
+typedef struct privelev_device {
+  const char * path;
+  uint32_t baud;
+  privelev_line line;
+  // the opened file descriptor (close on exec), -1 if not opened
+  int fd;
+  // errno of the failed open, 0 if opened, for a device left unopened by a failed run
+  // it stands for the run's status, such as EACCES when denied or ETIMEDOUT when timed out
+  int error;
+  privelev_opener opener;
+  // the following describe an opened device, as seen by whoever opened it
+  // the device number of the opened device file
+  unsigned int major;
+  unsigned int minor;
+  // the baud rate in effect, exact where the kernel reports it, 0 if unknown
+  uint32_t applied_baud;
+  // the device's directory in sysfs, empty if it has none
+  char sysfs_path[PRIVELEV_SYSFS_PATH_MAX];
+  // the latency timer of a USB serial adapter in milliseconds, -1 if it has none,
+  // a low latency open only lowers it to 1 where the elevated mechanism opened the device
+  int latency_timer_ms;
+} privelev_device;
+
+typedef enum {
+  // bytes received before the change are kept
+  PRIVELEV_FLUSH_NONE = 0,
+  // bytes received before the change, at the old settings, are discarded
+  PRIVELEV_FLUSH_INPUT
+} privelev_flush;
+
+/**
+ * The device's side of switching an opened device to other settings,
+ * for devices that have to be told to switch, such as bootloaders.
+ * Every part is optional, with a length of 0 leaving it out.
+ */
+typedef struct privelev_negotiation {
+  // sent at the old settings, asking the device to switch
+  const void * request;
+  size_t request_length;
+  // expected back at the old settings before switching
+  const void * ack;
+  size_t ack_length;
+  // sent at the new settings to check the link
+  const void * probe;
+  size_t probe_length;
+  // expected back at the new settings, otherwise the device is switched back
+  const void * response;
+  size_t response_length;
+  // how long to wait for each of them, 0 is 1000
+  int timeout_ms;
+} privelev_negotiation;
+
+/**
+ * How baud rates are detected.
+ */
+typedef struct privelev_auto_baud {
+  // the rates to listen at in order, NULL for the common ones from 9600 and 115200 on
+  const uint32_t * candidates;
+  size_t candidates_count;
+  // how long to listen at each rate, 0 is 250
+  int window_ms;
+} privelev_auto_baud;
+
+/**
+ * The phases of an open that are timed.
+ * Phases that happen more than once (one per mechanism or attempt) are summed.
+ */
+typedef enum {
+  // opening devices in-process
+  PRIVELEV_PHASE_FAST_PATH = 0,
+  // creating the rendezvous socket (and its directory)
+  PRIVELEV_PHASE_RENDEZVOUS,
+  // spawning a mechanism (or pkexec) until its exec has succeeded
+  PRIVELEV_PHASE_SPAWN,
+  // from the exec of the unprivileged mechanism until it connects or sends
+  PRIVELEV_PHASE_MECHANISM_START,
+  // from the exec of pkexec until the elevated mechanism connects, this is the Polkit decision
+  PRIVELEV_PHASE_AUTHORISATION,
+  PRIVELEV_PHASE_ACCEPT,
+  // matching an accepted connection to its mechanism by the peer's pid
+  PRIVELEV_PHASE_PEER_CHECK,
+  // receiving the opened devices from a mechanism
+  PRIVELEV_PHASE_RECEIVE,
+  PRIVELEV_PHASE_UNPRIVILEGED_ATTEMPT,
+  PRIVELEV_PHASE_ELEVATED_ATTEMPT,
+  PRIVELEV_PHASE_COUNT
+} privelev_phase;
+
+typedef struct privelev_timings {
+  // from the start of the open until it completed (or was cancelled)
+  uint64_t total_ns;
+  uint64_t phase_ns[PRIVELEV_PHASE_COUNT];
+  // how often each phase happened, 0 if it was skipped
+  unsigned int phase_count[PRIVELEV_PHASE_COUNT];
+} privelev_timings;
+
+typedef void (* privelev_timings_callback) (const privelev_timings * timings, void * data);
+
+/**
+ * What the elevated mechanism keeps opening after the open it was launched for.
+ * It serves the lease as root, so keep it as short and narrow as the workload allows.
+ */
+typedef struct privelev_lease {
+  // how long the mechanism keeps serving opens after the first, in milliseconds,
+  // which it caps at 15 minutes
+  int duration_ms;
+  // the most further devices it opens, which it caps at 1024, 0 for the cap
+  unsigned int opens;
+  // further paths it may open, besides those of the open it was launched for,
+  // it only opens those that are ttys
+  const char * const * allow;
+  size_t allow_count;
+} privelev_lease;
+
+privelev_ctx * privelev_ctx_new (void);
+
+void privelev_ctx_free (privelev_ctx * ctx);
+
+/**
+ * Gives up on a mechanism (and its Polkit prompt) after the timeout.
+ * 0 waits forever, which is the default.
+ */
+void privelev_ctx_set_timeout (privelev_ctx * ctx, int timeout_ms);
+
+/**
+ * Whether to try opening in-process before launching any mechanism.
+ * Enabled by default.
+ */
+void privelev_ctx_set_fast_path (privelev_ctx * ctx, bool fast_path);
+
+/**
+ * Splits the unprivileged attempt over up to this many mechanisms running at once,
+ * which helps when opening many devices is slow. They all connect to one
+ * listening socket and are told apart by their pid. The elevated attempt always
+ * uses a single mechanism, so there is still at most one Polkit prompt. The default is 1.
+ */
+void privelev_ctx_set_concurrency (privelev_ctx * ctx, unsigned int concurrency);
+
+/**
+ * Remembers in this file which devices needed elevation, so later opens of them
+ * skip straight to the elevated mechanism instead of first failing without it.
+ * A decision is dropped once the device's identity, owner or mode, or our groups, change.
+ * NULL (the default) disables the cache.
+ */
+bool privelev_ctx_set_cache_path (privelev_ctx * ctx, const char * cache_path);
+
+/**
+ * Coalesces elevations with the other processes of the same user, through a lock
+ * and a socket in this runtime directory (usually $XDG_RUNTIME_DIR).
+ * Instead of running pkexec itself, every open needing elevation asks a coalescer,
+ * started by whichever needed it first, which runs one elevated mechanism for the
+ * devices of everyone that asked while it was gathering and hands each their own.
+ * Those asking while an elevation is in progress are served by the next one,
+ * so the user sees one Polkit prompt for the coalescer instead of one per process.
+ * The coalescer uses the mechanism and pkexec paths of the context that started it.
+ * NULL (the default) disables coalescing.
+ */
+bool privelev_ctx_set_coalesce_dir (privelev_ctx * ctx, const char * runtime_dir);
+
+/**
+ * Has a coalescer started by this context keep the devices it opened,
+ * handing them out again without elevating until nobody has asked it for anything
+ * for this many milliseconds. A device is dropped as soon as it is removed, its path
+ * names another device, or its line settings differ from those it was opened with,
+ * and a device asked for with another baud is opened again.
+ * This only applies with coalescing, and a coalescer already running keeps its own timeout.
+ * 0 (the default) keeps nothing.
+ */
+void privelev_ctx_set_keep_timeout (privelev_ctx * ctx, int keep_ms);
+
+/**
+ * Has the elevated mechanism stay around after its open to serve the lease,
+ * so later opens through this context that need elevation ask it over the same connection
+ * instead of running pkexec, and the user is not prompted again until the lease runs out.
+ * An open the lease does not cover, or one that finds the mechanism gone,
+ * launches a new mechanism as usual. The mechanism exits when the lease runs out,
+ * the context is freed, or the lease is changed. With coalescing, the coalescer
+ * started by this context serves its clients under the same duration and opens,
+ * covering only the devices of the elevation that started the lease.
+ * NULL (the default) disables leases.
+ */
+bool privelev_ctx_set_lease (privelev_ctx * ctx, const privelev_lease * lease);
+
+/**
+ * Diagnostics are written to the log stream, NULL (the default) disables them.
+ */
+void privelev_ctx_set_log (privelev_ctx * ctx, FILE * log);
+
+/**
+ * Calls the callback with the timings of every open as it is freed,
+ * which for the synchronous functions is before they return.
+ * The callback may be called from any thread opening through the context.
+ * NULL (the default) disables it.
+ */
+void privelev_ctx_set_timings_callback (
+  privelev_ctx * ctx,
+  privelev_timings_callback callback,
+  void * data
+);
+
+/**
+ * Lets SIGINT and SIGTERM cancel an open waiting on a mechanism.
+ * The signal is re-raised once the open is cleaned up.
+ * This blocks the signals in the thread that starts the open, until the
+ * last such open of that thread is freed, which must then be on the same
+ * thread, or they stay blocked there. It is meant for single threaded
+ * programs. Disabled by default.
+ */
+void privelev_ctx_set_signal_cancellation (privelev_ctx * ctx, bool signal_cancellation);
+
+/**
+ * Overrides the installed mechanism and pkexec, mainly for testing.
+ */
+bool privelev_ctx_set_mechanism_path (privelev_ctx * ctx, const char * mechanism_path);
+
+bool privelev_ctx_set_pkexec_path (privelev_ctx * ctx, const char * pkexec_path);
+
+/**
+ * Opens one serial device, assigning its file descriptor.
+ */
+privelev_status privelev_open_serial (
+  privelev_ctx * ctx,
+  const char * path,
+  uint32_t baud,
+  int * fd
+);
+
+/**
+ * Opens many serial devices with at most one elevated mechanism run.
+ * Each device reports its own result, a failure on one device
+ * does not stop the others. The returned status covers the run as a whole,
+ * so devices can still have failed when it is PRIVELEV_OK.
+ */
+privelev_status privelev_open_serial_many (
+  privelev_ctx * ctx,
+  privelev_device * devices,
+  size_t devices_count
+);
+
+/**
+ * Starts opening devices without blocking on the mechanism (or its Polkit prompt).
+ * Devices that can be opened in-process are opened right away.
+ * The devices must stay valid until the request is freed.
+ * Returns NULL with errno set if the request could not be started.
+ */
+privelev_request * privelev_open_async (
+  privelev_ctx * ctx,
+  privelev_device * devices,
+  size_t devices_count
+);
+
+/**
+ * A file descriptor that becomes readable whenever the request can make progress,
+ * including when its timeout expires. Poll it for reading from your event loop
+ * and call privelev_request_complete when it is readable.
+ * Returns -1 once the request has completed.
+ */
+int privelev_request_fd (const privelev_request * request);
+
+/**
+ * Advances the request without waiting for the mechanism to start sending.
+ * Once its results are readable they are received in one go, which waits
+ * at most a second for each further message of a mechanism that stalls.
+ * Returns PRIVELEV_IN_PROGRESS while it is pending, otherwise the result
+ * as privelev_open_serial_many would, with the devices filled in.
+ */
+privelev_status privelev_request_complete (privelev_request * request);
+
+/**
+ * Frees the request, cancelling it if it is still pending.
+ * Opened file descriptors belong to the caller and are not closed.
+ */
+void privelev_request_free (privelev_request * request);
+
+/**
+ * Predicts how each device would be opened, without opening it or launching anything.
+ * A device's opener is set to the one an open would use, or to PRIVELEV_OPENED_NONE
+ * with the error set if it cannot be opened at all. Its fd stays -1.
+ * The device number and sysfs path are filled in as for an open.
+ */
+privelev_status privelev_probe (
+  privelev_ctx * ctx,
+  privelev_device * devices,
+  size_t devices_count
+);
+
+/**
+ * Whether a device can be opened at the baud rate. Standard rates are always
+ * supported, and any rate in between where the kernel takes arbitrary rates.
+ * Opening a device at an unsupported rate fails with EINVAL, as does opening it at
+ * a custom rate that the driver can only approximate by more than 2%.
+ */
+bool privelev_baud_supported (uint32_t baud);
+
+/**
+ * The supported baud rate closest to the one given. Only without termios2 is this
+ * the nearest standard rate, otherwise it clamps to the range of custom rates.
+ */
+uint32_t privelev_nearest_baud (uint32_t baud);
+
+/**
+ * Whether every line setting is in range. Opening a device with settings out of range
+ * fails with EINVAL, as does opening one whose driver cannot do them all,
+ * except for RS-485 which fails with ENOTTY on devices without it.
+ */
+bool privelev_line_valid (const privelev_line * line);
+
+/**
+ * Changes the baud and line settings of an opened device, without elevating again.
+ * What was written to it is sent at the old settings before the change.
+ * On success the device's baud, line and applied baud are updated, otherwise
+ * PRIVELEV_ERROR_DEVICE is returned with errno set, and the old settings are restored.
+ */
+privelev_status privelev_reconfigure (
+  privelev_device * device,
+  uint32_t baud,
+  const privelev_line * line,
+  privelev_flush flush
+);
+
+/**
+ * Switches an opened device to other settings with the device's agreement:
+ * sends the request and waits for the ack, switches discarding what arrived
+ * in the meantime, then sends the probe and waits for the response.
+ * Without the response in time the device is switched back, and
+ * PRIVELEV_ERROR_DEVICE is returned with errno set to ETIMEDOUT, as it is
+ * for a missing ack, which leaves the device as it was.
+ */
+privelev_status privelev_negotiate (
+  privelev_device * device,
+  uint32_t baud,
+  const privelev_line * line,
+  const privelev_negotiation * negotiation
+);
+
+/**
+ * Detects the baud rate opened devices are sending text at, by listening at each
+ * candidate rate in turn, and scoring what was received by how much of it is printable,
+ * less the framing and parity errors the driver counted where it counts them.
+ * A device is locked to a rate as soon as it scores clearly, otherwise to the best
+ * rate once every candidate has been heard. All devices are listened to at once,
+ * so detecting many takes as long as detecting one.
+ * Returns PRIVELEV_OK if a rate was detected for every opened device, otherwise
+ * PRIVELEV_ERROR_DEVICE, where a device without one has its error set to ENODATA
+ * (or to the error that stopped the detection) and is left at its baud.
+ * Devices that are not opened are skipped.
+ */
+privelev_status privelev_detect_baud (
+  privelev_device * devices,
+  size_t devices_count,
+  const privelev_auto_baud * auto_baud
+);
+
+const char * privelev_strerror (privelev_status status);
+
+const char * privelev_opener_name (privelev_opener opener);
+
+const char * privelev_phase_name (privelev_phase phase);
@@ -6,183 +6,387 @@
 #include <stdbool.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <sysexits.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include <string.h>
-#include <libgen.h>
-#include <ftw.h>
-
-#include <signal.h>
-
-#include <sys/select.h>
-#include <sys/socket.h>
-#include <linux/un.h>
+#include <ctype.h>
 
 #include <sys/param.h>
-#include <sys/types.h>
-#include <sys/prctl.h>
-
-#include <assert.h>
 
 #include "argparse/argparse.h"
-#include "protocol.h"
-
-#if !defined(MECHANISM_PATH)
-  #error "MECHANISM_PATH must be defined."
-#endif
-
-static struct sigaction old_sigint_action;
-
-static int status;
-static size_t size;
-static ssize_t ssize;
-
-static int unix_sock_fd;
-static int unix_peer_fd;
-static char * unix_sock_dir;
-
-static volatile sig_atomic_t mechanism_status = -1;
-
-static int
-nftw_callback (
-  const char * path,
-  const struct stat * sb,
-  int type_flag,
-  struct FTW * ftw_buf
-) {
-
-  status = remove(path);
-
-  if (status != 0) {
-    char error_string[8 + UNIX_PATH_MAX + 1];
-    snprintf(error_string, sizeof(error_string), "remove(%s)", path);
-    perror(error_string);
-  }
+#include "privelev.h"
+#include "relay.h"
+#include "timings.h"
 
-  return status;
-
-}
+// where systemd socket activation passes the first file descriptor
+#define LISTEN_FDS_START 3
 
+/**
+ * Parses `<serial-port-path>[:<baud>]`.
+ * The baud suffix is only split off if it is entirely numeric.
+ */
 static void
-cleanup_and_exit () {
+parse_device (const char * arg, uint32_t default_baud, privelev_device * device) {
 
-  if (unix_peer_fd) close(unix_peer_fd);
-  if (unix_sock_fd) close(unix_sock_fd);
-  if (unix_sock_dir && *unix_sock_dir) {
-    nftw(unix_sock_dir, nftw_callback, 64, FTW_DEPTH | FTW_PHYS);
-  }
+  device->path = arg;
+  device->baud = default_baud;
 
-}
+  const char * separator = strrchr(arg, ':');
+  if (!separator || separator == arg || !separator[1]) return;
 
-static void
-cleanup_and_exit_sigint (int signal, siginfo_t * signal_info, void * context) {
+  char * end;
+  unsigned long baud = strtoul(separator + 1, &end, 10);
+  if (*end != '\0' || !isdigit((unsigned char) separator[1])) return;
 
-  assert(signal == SIGINT);
-  cleanup_and_exit();
-  sigaction(SIGINT, &old_sigint_action, NULL);
-  kill(0, SIGINT);
+  char * path = strndup(arg, separator - arg);
+  if (!path) return;
 
-}
-
-static int
-handle (
-  int sig,
-  void (*handler)(int, siginfo_t *, void *),
-  int flags,
-  struct sigaction * old_action
-) {
-
-  struct sigaction action = {0};
-  action.sa_flags = flags;
-  action.sa_sigaction = handler;
-  return (sigaction(sig, &action, old_action) == 0);
+  device->path = path;
+  // 0 is never supported, so a rate out of range is rejected with the others
+  device->baud = (baud <= UINT32_MAX) ? (uint32_t) baud : 0;
 
 }
 
 /**
- * Blocks SIGCHLD
- * Will assign by reference the original mask prior to blocking.
+ * Parses framing such as `8N1`, as data bits, parity (N, O or E) and stop bits.
  */
-static int
-block_sigchld (sigset_t * signal_orig_mask) {
-
-  sigset_t signal_sigchld_mask;
-  sigemptyset(&signal_sigchld_mask);
-  sigaddset(&signal_sigchld_mask, SIGCHLD);
-  return (sigprocmask(SIG_BLOCK, &signal_sigchld_mask, signal_orig_mask) == 0);
-
-}
+static bool
+parse_framing (const char * framing, privelev_line * line) {
 
-static int
-unblock_sigchld (sigset_t * signal_orig_mask) {
+  static const char parities[] = { 'N', 'O', 'E' };
+  if (strlen(framing) != 3 || !isdigit((unsigned char) framing[0]) || !isdigit((unsigned char) framing[2])) {
+    return false;
+  }
+  const char * parity = memchr(parities, toupper((unsigned char) framing[1]), sizeof(parities));
+  if (!parity) return false;
 
-  return (sigprocmask(SIG_SETMASK, signal_orig_mask, NULL) == 0);
+  line->data_bits = framing[0] - '0';
+  line->parity = (privelev_parity) (parity - parities);
+  line->stop_bits = framing[2] - '0';
+  return true;
 
 }
 
-static void
-record_mechanism_process (int signal, siginfo_t * signal_info, void * context) {
+/**
+ * Decodes the C escapes \\, \r, \n, \t and \xHH in the text, which is left as it is otherwise.
+ * Returns the bytes, which are not NUL terminated, or NULL if they could not be allocated.
+ */
+static char *
+unescape (const char * text, size_t * length) {
 
-  assert(signal == SIGCHLD);
+  char * bytes = malloc(strlen(text) + 1);
+  if (!bytes) return NULL;
 
-  switch (signal_info->si_code) {
-  case CLD_EXITED:
-  case CLD_KILLED:
-  case CLD_DUMPED:
-    mechanism_status = signal_info->si_status;
+  *length = 0;
+  while (*text) {
+    if (text[0] != '\\' || !text[1]) {
+      bytes[(*length)++] = *text++;
+      continue;
+    }
+    switch (text[1]) {
+    case 'r':
+      bytes[(*length)++] = '\r';
+      text += 2;
+      break;
+    case 'n':
+      bytes[(*length)++] = '\n';
+      text += 2;
+      break;
+    case 't':
+      bytes[(*length)++] = '\t';
+      text += 2;
+      break;
+    case 'x':
+      if (isxdigit((unsigned char) text[2]) && isxdigit((unsigned char) text[3])) {
+        char hex[3] = { text[2], text[3], '\0' };
+        bytes[(*length)++] = (char) strtoul(hex, NULL, 16);
+        text += 4;
+        break;
+      }
+      bytes[(*length)++] = *text++;
+      break;
+    default:
+      bytes[(*length)++] = text[1];
+      text += 2;
+    }
   }
+  return bytes;
 
 }
 
-static bool
-check_peer_pid (int peer_sock_fd, pid_t peer_pid) {
-
-  struct ucred peer_credentials;
-  int peer_credentials_size = sizeof(peer_credentials);
-  if (
-    getsockopt(
-      peer_sock_fd,
-      SOL_SOCKET,
-      SO_PEERCRED,
-      &peer_credentials,
-      &peer_credentials_size
-    ) != 0
-  ) {
-    return false;
-  }
-
-  return (peer_credentials.pid == peer_pid);
-
-}
+typedef struct {
+  privelev_device * devices;
+  size_t devices_count;
+  bool fast_path;
+  int timeout;
+  int jobs;
+  bool timings;
+  const char * timings_path;
+  const char * histogram_path;
+  bool cache;
+  bool coalesce;
+  int keep;
+  int lease;
+  int lease_opens;
+  bool probe;
+  // the command to execute with the opened ports, NULL to just greet them
+  const char * const * command;
+  // where the ports go in the command, -1 for systemd socket activation's LISTEN_FDS
+  int fd;
+  bool relay;
+  // where the relay's metrics are written, NULL for nowhere
+  const char * metrics_path;
+  int metrics_interval;
+  // the baud every port is switched to once opened, 0 to keep the one it was opened at
+  uint32_t switch_baud;
+  privelev_negotiation negotiation;
+  // detect the baud every port is sending at once opened
+  bool auto_baud;
+  int auto_baud_window;
+} Options;
 
 static bool
-parse_args (
-  int argc,
-  const char * const * argv,
-  uint32_t * baud,
-  const char * * serial_port
-) {
-
-  // command, -option, option_value, --, param
+parse_args (int argc, const char * const * argv, Options * options) {
 
-  const char * argv_[sizeof(char *) * 5] = {0};
-  memcpy((char * *) argv_, argv, sizeof(argv_));
+  const char * * argv_ = malloc(sizeof(char *) * argc);
+  if (!argv_) return false;
+  memcpy((char * *) argv_, argv, sizeof(char *) * argc);
 
   static const char * const command_usage[] = {
-    "privilege-elevation [options] [--] <serial-port-path>",
+    "privilege-elevation [options] [--] <serial-port-path>[:<baud>] ...",
+    "privilege-elevation [options] [--] <serial-port-path>[:<baud>] ... -- <command> [<argument> ...]",
+    "privilege-elevation [options] --relay [--] <serial-port-path>[:<baud>]",
     NULL,
   };
 
+  int baud = 0;
+  const char * framing = NULL;
+  int rts_cts = 0;
+  int xon_xoff = 0;
+  int rs485 = 0;
+  int rs485_delay_before = 0;
+  int rs485_delay_after = 0;
+  int low_latency = 0;
+  int switch_baud = 0;
+  const char * switch_request = NULL;
+  const char * switch_ack = NULL;
+  const char * switch_probe = NULL;
+  const char * switch_response = NULL;
+  int switch_timeout = 0;
+  int auto_baud = 0;
+  int auto_baud_window = 0;
+  int no_fast_path = 0;
+  int timeout_ = 0;
+  int jobs_ = 1;
+  int timings_ = 0;
+  int no_cache = 0;
+  int coalesce = 0;
+  int keep = 0;
+  int lease = 0;
+  int lease_opens = 0;
+  int probe = 0;
+  int fd = -1;
+  int relay = 0;
+  int metrics_interval = 0;
+
   struct argparse_option command_options[] = {
     OPT_HELP(),
     OPT_INTEGER(
       'b',
       "baud",
       &baud,
-      "select standard baud rate, the default is 9600"
+      "select baud rate for ports without a :<baud> suffix, the default is 9600"
+    ),
+    OPT_STRING(
+      0,
+      "line",
+      &framing,
+      "set data bits, parity (N, O or E) and stop bits of every port, the default is 8N1"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "rts-cts",
+      &rts_cts,
+      "use hardware flow control"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "xon-xoff",
+      &xon_xoff,
+      "use software flow control"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "rs485",
+      &rs485,
+      "drive an RS-485 transceiver with RTS while sending"
+    ),
+    OPT_INTEGER(
+      0,
+      "rs485-delay-before",
+      &rs485_delay_before,
+      "assert RTS this many milliseconds before sending, up to 100, this implies --rs485"
+    ),
+    OPT_INTEGER(
+      0,
+      "rs485-delay-after",
+      &rs485_delay_after,
+      "keep RTS asserted this many milliseconds after sending, up to 100, this implies --rs485"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "low-latency",
+      &low_latency,
+      "have the driver pass on received bytes straight away, and blocking reads wait for the first byte"
+    ),
+    OPT_INTEGER(
+      0,
+      "switch-baud",
+      &switch_baud,
+      "switch every port to this baud rate once opened, before greeting it or running the command"
+    ),
+    OPT_STRING(
+      0,
+      "switch-request",
+      &switch_request,
+      "send this at the opening rate to ask the device to switch, with \\r, \\n and \\xHH escapes"
+    ),
+    OPT_STRING(
+      0,
+      "switch-ack",
+      &switch_ack,
+      "wait for this from the device at the opening rate before switching"
+    ),
+    OPT_STRING(
+      0,
+      "switch-probe",
+      &switch_probe,
+      "send this at the new rate to check the link"
+    ),
+    OPT_STRING(
+      0,
+      "switch-response",
+      &switch_response,
+      "wait for this from the device at the new rate, otherwise switch back"
+    ),
+    OPT_INTEGER(
+      0,
+      "switch-timeout",
+      &switch_timeout,
+      "wait this many milliseconds for the ack and the response, the default is 1000"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "auto-baud",
+      &auto_baud,
+      "detect the baud rate every port is sending text at once opened, by listening at the common rates"
+    ),
+    OPT_INTEGER(
+      0,
+      "auto-baud-window",
+      &auto_baud_window,
+      "listen this many milliseconds at each rate, the default is 250"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "no-fast-path",
+      &no_fast_path,
+      "always open through the mechanism instead of first trying in-process"
+    ),
+    OPT_INTEGER(
+      't',
+      "timeout",
+      &timeout_,
+      "give up on a mechanism (and its Polkit prompt) after this many seconds, the default is to wait forever"
+    ),
+    OPT_INTEGER(
+      'j',
+      "jobs",
+      &jobs_,
+      "run up to this many unprivileged mechanisms at once, the default is 1"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "timings",
+      &timings_,
+      "write how long each phase of the run took as a JSON record to stderr"
+    ),
+    OPT_STRING(
+      0,
+      "timings-file",
+      &options->timings_path,
+      "append the JSON record of the phase timings to this file instead"
+    ),
+    OPT_STRING(
+      0,
+      "timings-histogram",
+      &options->histogram_path,
+      "add the phase timings to the histogram in this file"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "no-cache",
+      &no_cache,
+      "neither use nor remember which ports needed elevation before"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "coalesce",
+      &coalesce,
+      "share one elevation with other runs needing it at the same time, through $XDG_RUNTIME_DIR"
+    ),
+    OPT_INTEGER(
+      0,
+      "keep",
+      &keep,
+      "keep the opened ports for later runs until none has asked for this many seconds, this implies --coalesce"
+    ),
+    OPT_INTEGER(
+      0,
+      "lease",
+      &lease,
+      "have the elevated mechanism open the same ports for later runs for this many seconds without prompting again, up to 900, this implies --coalesce"
+    ),
+    OPT_INTEGER(
+      0,
+      "lease-opens",
+      &lease_opens,
+      "end the lease after this many more opens, the mechanism ends it after 1024 at most"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "probe",
+      &probe,
+      "only report whether each port would need elevation, without opening any"
+    ),
+    OPT_INTEGER(
+      0,
+      "fd",
+      &fd,
+      "give the command the ports as this and the following file descriptors, from 3 up, instead of as LISTEN_FDS from 3"
+    ),
+    OPT_BOOLEAN(
+      0,
+      "relay",
+      &relay,
+      "relay between the port and stdin/stdout until the port hangs up, SIGUSR1 reports the throughput so far"
+    ),
+    OPT_STRING(
+      0,
+      "metrics-file",
+      &options->metrics_path,
+      "write the relay's counters and the port's health to this file in the Prometheus text format while relaying"
+    ),
+    OPT_INTEGER(
+      0,
+      "metrics-interval",
+      &metrics_interval,
+      "write the metrics file every this many milliseconds, the default is 1000"
     ),
     OPT_END(),
   };
@@ -190,235 +394,421 @@ parse_args (
   struct argparse argparse;
   argparse_init(&argparse, command_options, command_usage, 0);
 
-  argparse_describe(&argparse, "\nThis demonstrates lazy privilege elevation via opening a secured serial port resource.", "");
+  argparse_describe(&argparse, "\nThis demonstrates lazy privilege elevation via opening secured serial port resources.\nMultiple ports are opened with a single (elevated) mechanism run.", "");
+
+  // a `--` after the ports starts the command, one before them only ends the options
+  int separator = 1;
+  while (separator < argc && strcmp(argv[separator], "--") != 0) ++separator;
 
-  int argc_ = argparse_parse(&argparse, MIN(argc, 5), argv_);
+  int argc_ = argparse_parse(&argparse, separator, argv_);
+  if (argc_ == 0 && separator < argc) {
+    int ports = separator + 1;
+    separator = ports;
+    while (separator < argc && strcmp(argv[separator], "--") != 0) ++separator;
+    argc_ = separator - ports;
+    memcpy((char * *) argv_, argv + ports, sizeof(char *) * argc_);
+  }
+  if (separator + 1 < argc) {
+    options->command = argv + separator + 1;
+  }
 
-  if (argc_ < 1) {
+  if (
+    argc_ < 1 ||
+    (separator < argc && !options->command) ||
+    // the ports go after stdin, stdout and stderr, and only to a command
+    (fd != -1 && (fd <= STDERR_FILENO || !options->command)) ||
+    (relay && (argc_ != 1 || options->command)) ||
+    ((options->metrics_path || metrics_interval) && !relay) ||
+    metrics_interval < 0 ||
+    // in milliseconds it has to fit an int
+    keep > INT_MAX / 1000 ||
+    lease > INT_MAX / 1000
+  ) {
     argparse_usage(&argparse);
     return false;
   }
 
-  *serial_port = argv_[0];
-
-  return true;
-
-}
-
-static int
-setup_unix_sock (const char * sock_path, int backlog, bool nonblocking) {
+  if (baud <= 0) {
+    baud = 9600;
+  }
 
-  struct sockaddr_un unix_sock_addr;
-  unix_sock_addr.sun_family = AF_UNIX;
-  snprintf(unix_sock_addr.sun_path, UNIX_PATH_MAX, "%s", sock_path);
+  privelev_line line = {
+    .rts_cts = rts_cts,
+    .xon_xoff = xon_xoff,
+    .rs485 = rs485 || rs485_delay_before || rs485_delay_after,
+    // negative delays become out of range
+    .rs485_delay_before_ms = (uint32_t) rs485_delay_before,
+    .rs485_delay_after_ms = (uint32_t) rs485_delay_after,
+    .low_latency = low_latency
+  };
+  if ((framing && !parse_framing(framing, &line)) || !privelev_line_valid(&line)) {
+    fprintf(stderr, "Error: %s\n", "The line settings are not supported");
+    return false;
+  }
 
-  int unix_sock_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-  if (unix_sock_fd < 0) {
-    return -1;
+  options->devices = calloc(argc_, sizeof(privelev_device));
+  if (!options->devices) return false;
+
+  for (int i = 0; i < argc_; ++i) {
+    parse_device(argv_[i], (uint32_t) baud, &options->devices[i]);
+    options->devices[i].line = line;
+    // rejected here, before a mechanism is launched for the others
+    if (!privelev_baud_supported(options->devices[i].baud)) {
+      fprintf(
+        stderr,
+        "Error: %u baud is not supported, the nearest supported is %u\n",
+        options->devices[i].baud,
+        privelev_nearest_baud(options->devices[i].baud)
+      );
+      return false;
+    }
   }
 
+  bool negotiating = switch_request || switch_ack || switch_probe || switch_response;
+  // a detected rate would only be switched away from
+  if (switch_baud < 0 || (negotiating && !switch_baud) || (auto_baud && switch_baud) || auto_baud_window < 0) {
+    argparse_usage(&argparse);
+    return false;
+  }
+  if (switch_baud && !privelev_baud_supported((uint32_t) switch_baud)) {
+    fprintf(
+      stderr,
+      "Error: %u baud is not supported, the nearest supported is %u\n",
+      (unsigned int) switch_baud,
+      privelev_nearest_baud((uint32_t) switch_baud)
+    );
+    return false;
+  }
+  options->switch_baud = (uint32_t) switch_baud;
+  options->negotiation.timeout_ms = MAX(switch_timeout, 0);
+  options->auto_baud = auto_baud || auto_baud_window;
+  options->auto_baud_window = auto_baud_window;
   if (
-    bind(
-      unix_sock_fd,
-      (struct sockaddr *) &unix_sock_addr,
-      sizeof(unix_sock_addr)
-    ) != 0
+    (switch_request && !(options->negotiation.request = unescape(switch_request, &options->negotiation.request_length))) ||
+    (switch_ack && !(options->negotiation.ack = unescape(switch_ack, &options->negotiation.ack_length))) ||
+    (switch_probe && !(options->negotiation.probe = unescape(switch_probe, &options->negotiation.probe_length))) ||
+    (switch_response && !(options->negotiation.response = unescape(switch_response, &options->negotiation.response_length)))
   ) {
-    return -1;
-  }
-
-  // we only expect 1 client, so a backlog of 1 is fine
-  if (listen(unix_sock_fd, backlog) != 0) {
-    return -1;
+    return false;
   }
 
-  if (nonblocking) {
-    int nonblocking_flag = fcntl(unix_sock_fd, F_GETFL, 0) | O_NONBLOCK;
-    if (fcntl(unix_sock_fd, F_SETFL, nonblocking_flag) == -1) {
-      return -1;
-    }
-  }
+  options->devices_count = argc_;
+  options->fast_path = !no_fast_path;
+  options->timeout = MAX(timeout_, 0);
+  options->jobs = MAX(jobs_, 1);
+  options->timings = timings_ || options->timings_path || options->histogram_path;
+  options->cache = !no_cache;
+  options->keep = MAX(keep, 0);
+  options->lease = MAX(lease, 0);
+  options->lease_opens = MAX(lease_opens, 0);
+  options->coalesce = coalesce || options->keep || options->lease;
+  options->probe = probe;
+  options->fd = fd;
+  options->relay = relay;
+  options->metrics_interval = metrics_interval ? metrics_interval : 1000;
 
-  return unix_sock_fd;
+  return true;
 
 }
 
-static int
-exec_mechanism (
-  const char * process_path,
-  const char * const process_arguments[],
-  pid_t * mechanism_pid
-) {
+static void
+store_timings (const privelev_timings * timings, void * data) {
 
-  // setup a pipe for between parent and forked child process
-  // to communicate errors during the fork prior to the exec
-  int exec_pipe[2];
-  if (pipe(exec_pipe) != 0) {
-    return 0;
-  }
+  ((RunTimings *) data)->open = *timings;
 
-  pid_t parent_pid = getpid();
-  pid_t child_pid = fork();
+}
 
-  if (child_pid == -1) {
+static uint64_t
+monotonic_ns (void) {
 
-    return -1;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 
-  } else if (child_pid == 0) {
+}
 
-    // close the read side in the child
-    close(exec_pipe[0]);
+static void
+report_timings (
+  const RunTimings * run_timings,
+  bool timings,
+  const char * timings_path,
+  const char * histogram_path
+) {
 
-    // if the parent dies, we want the child to commit suicide
-    if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1) {
-      // if the parent had died, this would result in a SIGPIPE
-      // which close the parent process as well
-      if (write(exec_pipe[1], &errno, sizeof(errno)));
-      exit(EX_OSERR);
+  if (timings_path) {
+    FILE * timings_file = fopen(timings_path, "a");
+    if (timings_file) {
+      timings_write_json(timings_file, run_timings);
+      fclose(timings_file);
+    } else {
+      perror(timings_path);
     }
+  } else if (timings) {
+    timings_write_json(stderr, run_timings);
+  }
 
-    // what if the parent already died!? If so we must die
-    // since there's no parent, there's no point writing to the exec pipe
-    if (getppid() != parent_pid) {
-      exit(EX_UNAVAILABLE);
-    }
+  if (histogram_path && !timings_update_histogram(histogram_path, run_timings)) {
+    perror(histogram_path);
+  }
 
-    // set the write side to close if the subsequent exec works
-    // this doesn't guarantee that the mechanism process succeeds
-    // only that the fork + exec worked
-    if ((fcntl(exec_pipe[1], F_SETFD, FD_CLOEXEC)) == -1) {
-      if (write(exec_pipe[1], &errno, sizeof(errno)));
-      exit(EX_OSERR);
-    }
+}
 
-    // execute the process with the arguments
-    // the child process can access file descriptors in the parent
-    // however we need to pass file descriptors from the child to the parent
-    // so we'll be using unix domain sockets for communication
-    execvp(process_path, (char * const *) process_arguments);
+/**
+ * The cache of elevation decisions goes in $XDG_CACHE_HOME,
+ * falling back to ~/.cache and then $XDG_RUNTIME_DIR.
+ * Returns NULL if there is nowhere to put it.
+ */
+static char *
+default_cache_path (void) {
+
+  const char * cache_name = "privilege-elevation/elevation-cache";
+  const char * cache_home = getenv("XDG_CACHE_HOME");
+  const char * home = getenv("HOME");
+  const char * runtime_dir = getenv("XDG_RUNTIME_DIR");
+  char * cache_path = NULL;
+
+  if (cache_home && cache_home[0] == '/') {
+    if (asprintf(&cache_path, "%s/%s", cache_home, cache_name) == -1) return NULL;
+  } else if (home && home[0] == '/') {
+    if (asprintf(&cache_path, "%s/.cache/%s", home, cache_name) == -1) return NULL;
+  } else if (runtime_dir && runtime_dir[0] == '/') {
+    if (asprintf(&cache_path, "%s/%s", runtime_dir, cache_name) == -1) return NULL;
+  }
 
-    // exec failed, we must write the errno into the pipe
-    if (write(exec_pipe[1], &errno, sizeof(errno)));
+  return cache_path;
 
-    // exit the child process
-    exit(EX_UNAVAILABLE);
+}
 
-  }
+/**
+ * Why a device was not opened, the run's failure where it has no errno of its own.
+ */
+static const char *
+device_failure (const privelev_device * device, privelev_status status) {
 
-  // close the write end on the parent
-  close(exec_pipe[1]);
+  return device->error ? strerror(device->error) : privelev_strerror(status);
 
-  // this blocks until we either receive a close or an actual write
-  // on close, the size of the read will be 0
-  // on write, the size of the read will be > 0
-  // we use close to mean successful exec
-  // we use write to mean there was an error
-  int exec_errno;
-  if (read(exec_pipe[0], &exec_errno, sizeof(exec_errno)) > 0) {
-    errno = exec_errno;
-    return -2;
-  }
+}
 
-  // exec succeeded, close the read end
-  close(exec_pipe[0]);
+/**
+ * Reports whether each port would need elevation, for --probe.
+ */
+static int
+report_probe (const privelev_device * devices, size_t devices_count, privelev_status status) {
 
-  *mechanism_pid = child_pid;
+  int exit_status = EXIT_SUCCESS;
 
-  return 1;
+  for (size_t i = 0; i < devices_count; ++i) {
+    if (devices[i].opener == PRIVELEV_OPENED_NONE) {
+      fprintf(stderr, "%s: %s\n", devices[i].path, device_failure(&devices[i], status));
+      exit_status = EX_UNAVAILABLE;
+      continue;
+    }
+    fprintf(
+      stderr,
+      "%s: %s (would be %s, device %u:%u%s%s)\n",
+      devices[i].path,
+      (devices[i].opener == PRIVELEV_OPENED_BY_ELEVATED_MECHANISM)
+        ? "needs elevation"
+        : "does not need elevation",
+      privelev_opener_name(devices[i].opener),
+      devices[i].major,
+      devices[i].minor,
+      devices[i].sysfs_path[0] ? ", " : "",
+      devices[i].sysfs_path
+    );
+  }
+
+  return exit_status;
 
 }
 
+/**
+ * Executes the command with the opened ports in place of this process,
+ * so nothing is left between the command and the ports.
+ * The ports become file descriptors fd, fd + 1, ... in the order they were given,
+ * or without fd, those of systemd socket activation, described by LISTEN_FDS,
+ * LISTEN_PID and LISTEN_FDNAMES (the base names of the ports).
+ * Only returns, with the exit status to fail with, if the command could not be executed.
+ */
 static int
-wait_for_message (
-  int sock_fd,
-  sigset_t * signal_mask
-) {
+exec_command (const char * const * command, int fd, const privelev_device * devices, size_t devices_count) {
 
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(sock_fd, &readfds);
+  int first_fd = (fd >= 0) ? fd : LISTEN_FDS_START;
 
-  while (true) {
-
-    status = pselect(sock_fd + 1, &readfds, NULL, NULL, NULL, signal_mask);
-    if (status == -1) {
+  // every port is first moved past the targets, so none is overwritten by another
+  int * moved_fds = calloc(devices_count, sizeof(int));
+  if (!moved_fds) {
+    perror("calloc()");
+    return EX_OSERR;
+  }
+  size_t moved_count = 0;
+  for (; moved_count < devices_count; ++moved_count) {
+    moved_fds[moved_count] = fcntl(devices[moved_count].fd, F_DUPFD_CLOEXEC, first_fd + (int) devices_count);
+    if (moved_fds[moved_count] == -1) {
+      perror("fcntl()");
+      goto close_moved;
+    }
+  }
+  // the targets are the only copies without close on exec
+  for (size_t i = 0; i < devices_count; ++i) {
+    if (dup2(moved_fds[i], first_fd + (int) i) == -1) {
+      perror("dup2()");
+      goto close_moved;
+    }
+  }
+  for (size_t i = 0; i < devices_count; ++i) {
+    close(moved_fds[i]);
+  }
+  free(moved_fds);
 
-      if (errno != EINTR) {
-        return 0;
+  if (fd < 0) {
+    size_t names_size = 1;
+    for (size_t i = 0; i < devices_count; ++i) {
+      names_size += strlen(basename(devices[i].path)) + 1;
+    }
+    char * names = calloc(names_size, 1);
+    if (!names) {
+      perror("calloc()");
+      return EX_OSERR;
+    }
+    for (size_t i = 0; i < devices_count; ++i) {
+      if (i) strcat(names, ":");
+      char * name = names + strlen(names);
+      strcat(names, basename(devices[i].path));
+      // the names are separated by colons, which paths like /dev/serial/by-path/* contain
+      for (; *name; ++name) {
+        if (*name == ':') *name = '_';
       }
+    }
+    char listen_fds[21];
+    char listen_pid[21];
+    snprintf(listen_fds, sizeof(listen_fds), "%zu", devices_count);
+    // the command keeps our pid, as it replaces us
+    snprintf(listen_pid, sizeof(listen_pid), "%ld", (long) getpid());
+    if (
+      setenv("LISTEN_FDS", listen_fds, 1) != 0 ||
+      setenv("LISTEN_PID", listen_pid, 1) != 0 ||
+      setenv("LISTEN_FDNAMES", names, 1) != 0
+    ) {
+      perror("setenv()");
+      free(names);
+      return EX_OSERR;
+    }
+    free(names);
+  } else {
+    // whatever activated us is not passed on
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDNAMES");
+  }
 
-      switch (mechanism_status) {
-      case EXIT_SUCCESS:
-        break;
-      case EX_NOPERM:
-        return -1;
-      default:
-        return -2;
-      }
+  execvp(command[0], (char * const *) command);
+  int exec_errno = errno;
+  perror(command[0]);
 
-      // if not interrupted from the mechanism, just continue
+  // like the shell, 127 for a command that was not found and 126 for one that could not run
+  return (exec_errno == ENOENT) ? 127 : 126;
 
-    } else if (status > 0 && FD_ISSET(unix_sock_fd, &readfds)) {
+close_moved:
+  for (size_t i = 0; i < moved_count; ++i) {
+    close(moved_fds[i]);
+  }
+  free(moved_fds);
+  return EX_OSERR;
 
-      break;
+}
 
-    }
+/**
+ * Relays the port to stdout and stdin to the port, until the port hangs up or stdout closes.
+ * The end of stdin only ends relaying to the port. The throughput is reported to stderr,
+ * and to the metrics file if there is one.
+ * A signal that stopped the relay is raised again once it is reported.
+ */
+static int
+relay_port (const privelev_device * device, const char * metrics_path, int metrics_interval) {
 
+  // the port is in both directions, which epoll only tells apart by file descriptor
+  int port_in_fd = fcntl(device->fd, F_DUPFD_CLOEXEC, 0);
+  if (port_in_fd == -1) {
+    perror("fcntl()");
+    return EX_OSERR;
   }
 
-  return 1;
-
-}
+  char from_port[PATH_MAX + 16];
+  char to_port[PATH_MAX + 16];
+  snprintf(from_port, sizeof(from_port), "%s -> stdout", device->path);
+  snprintf(to_port, sizeof(to_port), "stdin -> %s", device->path);
 
-static int
-launch_mechanism (
-  const char * mechanism_path,
-  const char * const * mechanism_args,
-  const char * pkexec_path,
-  const char * const * pkexec_args,
-  int sock_fd,
-  sigset_t * signal_mask,
-  pid_t * mechanism_pid,
-  bool privileged
-) {
+  Relay relay;
+  if (!relay_init(&relay, RELAY_BACKEND_AUTO)) {
+    perror("relay_init()");
+    close(port_in_fd);
+    return EX_OSERR;
+  }
+  if (
+    !relay_add(&relay, from_port, device->fd, STDOUT_FILENO, true) ||
+    !relay_add(&relay, to_port, STDIN_FILENO, port_in_fd, false)
+  ) {
+    perror("relay_add()");
+    relay_destroy(&relay);
+    close(port_in_fd);
+    return EX_OSERR;
+  }
+  if (metrics_path && !relay_export_metrics(&relay, metrics_path, metrics_interval)) {
+    perror(metrics_path);
+    relay_destroy(&relay);
+    close(port_in_fd);
+    return EX_CANTCREAT;
+  }
 
-  if (!privileged) {
-    fprintf(stderr, "%s\n", "Attempting to open without elevated privileges");
-    status = exec_mechanism(mechanism_path, mechanism_args, mechanism_pid);
-  } else {
-    fprintf(stderr, "%s\n", "Attempting to open with elevated privileges");
-    status = exec_mechanism(pkexec_path, pkexec_args, mechanism_pid);
+  int exit_status = EXIT_SUCCESS;
+  if (relay_run(&relay, stderr) == -1) {
+    perror("relay_run()");
+    exit_status = EX_OSERR;
+  }
+  relay_report(&relay, stderr);
+  if (metrics_path && !relay_write_metrics(&relay, metrics_path)) {
+    perror(metrics_path);
+  }
+  for (size_t i = 0; i < relay.links_count; ++i) {
+    // stdout closing is how a reader says it has had enough
+    if (relay.links[i].error && relay.links[i].error != EPIPE && exit_status == EXIT_SUCCESS) {
+      exit_status = EX_IOERR;
+    }
   }
 
-  switch (status) {
-  case 0:
-    return 0;
-  case -1:
-    return -1;
-  case  -2:
-    return -2;
+  int stop_signal = relay.stop_signal;
+  relay_destroy(&relay);
+  close(port_in_fd);
+  if (stop_signal) {
+    raise(stop_signal);
   }
 
-  status = wait_for_message(sock_fd, signal_mask);
+  return exit_status;
+
+}
+
+static int
+exit_status_for (privelev_status status) {
 
   switch (status) {
-  case 1:
-    return 1;
-  case 0:
-    return -3;
-  case -1:
-    return launch_mechanism(
-      mechanism_path,
-      mechanism_args,
-      pkexec_path,
-      pkexec_args,
-      sock_fd,
-      signal_mask,
-      mechanism_pid,
-      true
-    );
-  case -2:
-    return -4;
+  case PRIVELEV_OK:
+    return EXIT_SUCCESS;
+  case PRIVELEV_ERROR_DENIED:
+    return EX_NOPERM;
+  case PRIVELEV_ERROR_DISMISSED:
+    return EX_USAGE;
+  case PRIVELEV_ERROR_MECHANISM:
+    return EX_SOFTWARE;
+  case PRIVELEV_ERROR_PROTOCOL:
+    return EX_PROTOCOL;
+  case PRIVELEV_ERROR_TIMED_OUT:
+  case PRIVELEV_ERROR_CANCELLED:
+    return EX_TEMPFAIL;
+  case PRIVELEV_ERROR_DEVICE:
+    return EX_UNAVAILABLE;
+  default:
+    return EX_OSERR;
   }
 
 }
@@ -428,291 +818,212 @@ main (int argc, const char * const * argv) {
 
   /* SETUP ENVIRONMENT */
 
-  atexit(cleanup_and_exit);
-  handle(SIGINT, cleanup_and_exit_sigint, 0, &old_sigint_action);
-
   setbuf(stdout, NULL);
   setbuf(stderr, NULL);
 
-  // permanent variables
-  const char * tmp_dir= getenv("TMPDIR");
-  if (!tmp_dir) tmp_dir = "/tmp";
-  const char tmp_name[] = "polkit_demo.XXXXXX";
-  const char socket_name[] = "socket.sock";
-
-  char pkexec_path[] = "pkexec";
-  char mechanism_path[] = MECHANISM_PATH;
-
-  char pkexec_name[] = "pkexec";
-  char mechanism_name[] = MECHANISM_PATH;
-  basename(mechanism_name);
-
-  int serial_port_fd = -1;
-
-  uint32_t baud = 0;
-  const char * serial_port;
-
-  if (!parse_args(argc, argv, &baud, &serial_port)) {
+  Options options = {0};
+  if (!parse_args(argc, argv, &options)) {
     exit(EX_USAGE);
   }
 
-  if (!baud) {
-    baud = 9600;
-  }
+  privelev_device * devices = options.devices;
+  size_t devices_count = options.devices_count;
 
-  assert(UNIX_PATH_MAX >=
-    (
-      strlen(tmp_dir) +
-      sizeof(tmp_name) +
-      sizeof(socket_name) + 1
-    )
-  );
-
-  char template[strlen(tmp_dir) + (sizeof(tmp_name) + 1)];
-  snprintf(template, sizeof(template), "%s/%s", tmp_dir, tmp_name);
-  unix_sock_dir = mkdtemp(template);
-
-  if (!unix_sock_dir) {
-    perror("create_tmp_namespace()");
-    exit(EX_CANTCREAT);
-  }
-
-  // the unix_sock_path = unix_sock_dir + socket_name
-  char unix_sock_path[UNIX_PATH_MAX];
-  snprintf(
-    unix_sock_path,
-    sizeof(unix_sock_path),
-    "%s/%s",
-    unix_sock_dir,
-    socket_name
-  );
-
-  // if an asynchronous network error occurs, accept needs to fail immediately
-  // but accept is a slow system call, so it can block indefinitely
-  // to prevent this, unix_sock_fd is set to non blocking
-  // furthermore we're only expecting one client, so backlog of 1
-  unix_sock_fd = setup_unix_sock(unix_sock_path, 1, true);
-  if (unix_sock_fd == -1) {
-    perror("setup_unix_sock");
+  privelev_ctx * ctx = privelev_ctx_new();
+  if (!ctx) {
+    perror("privelev_ctx_new()");
     exit(EX_OSERR);
   }
 
-  // setup the signal handler for SIGCHLD
-  // this will handle if the child process breaks
-  sigset_t signal_orig_mask;
-  if (!block_sigchld(&signal_orig_mask)) {
-    perror("block_sigchld()");
+  privelev_ctx_set_log(ctx, stderr);
+  privelev_ctx_set_fast_path(ctx, options.fast_path);
+  privelev_ctx_set_timeout(ctx, options.timeout * 1000);
+  privelev_ctx_set_concurrency(ctx, (unsigned int) options.jobs);
+  // SIGINT and SIGTERM cancel a pending Polkit prompt and then terminate us
+  privelev_ctx_set_signal_cancellation(ctx, true);
+
+  // without anywhere to keep the cache, every run just starts over
+  char * cache_path = options.cache ? default_cache_path() : NULL;
+  if (cache_path && !privelev_ctx_set_cache_path(ctx, cache_path)) {
+    perror("privelev_ctx_set_cache_path()");
     exit(EX_OSERR);
   }
+  free(cache_path);
 
-  // SA_SIGINFO for acquiring extra child process info
-  // SA_NOCLDSTOP because we don't care about suspension or continued signals
-  if (!handle(SIGCHLD, record_mechanism_process, SA_SIGINFO | SA_NOCLDSTOP, NULL)) {
-    perror("handle()");
+  // without a runtime directory, every run elevates on its own
+  const char * runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (
+    options.coalesce &&
+    runtime_dir &&
+    runtime_dir[0] == '/' &&
+    !privelev_ctx_set_coalesce_dir(ctx, runtime_dir)
+  ) {
+    perror("privelev_ctx_set_coalesce_dir()");
     exit(EX_OSERR);
   }
-
-  /* EXECUTION CODE */
-
-  char selected_baud[7];
-  snprintf(selected_baud, sizeof(selected_baud), "%u", baud);
-
-  const char * const mechanism_args[] = {
-    mechanism_name,
-    serial_port,
-    selected_baud,
-    unix_sock_path,
-    (char *) NULL
-  };
-
-  const char const * pkexec_args[] = {
-    pkexec_name,
-    mechanism_path,
-    serial_port,
-    selected_baud,
-    unix_sock_path,
-    (char *) NULL
-  };
-
-  pid_t mechanism_pid = 0;
-
-  status = launch_mechanism(
-    mechanism_path,
-    mechanism_args,
-    pkexec_path,
-    pkexec_args,
-    unix_sock_fd,
-    &signal_orig_mask,
-    &mechanism_pid,
-    false
-  );
-
-  char error_string[8 + sizeof(mechanism_path) + 1];
-  switch (status) {
-  case 0:
-    perror("pipe()");
-    exit(EX_OSERR);
-  case -1:
-    perror("fork()");
+  privelev_ctx_set_keep_timeout(ctx, options.keep * 1000);
+  // a lease only outlives this run in the coalescer
+  privelev_lease lease = { options.lease * 1000, (unsigned int) options.lease_opens, NULL, 0 };
+  if (options.lease && !privelev_ctx_set_lease(ctx, &lease)) {
+    perror("privelev_ctx_set_lease()");
     exit(EX_OSERR);
-  case -2:
-    snprintf(error_string, sizeof(error_string), "execvp(%s)", mechanism_path);
-    perror(error_string);
-    exit(EX_OSERR);
-  case -3:
-    perror("pselect()");
-    exit(EX_TEMPFAIL);
-  case -4:
-    switch (mechanism_status) {
-    case 127:
-      fprintf(stderr, "Error: %s\n", "Polkit denied permission to elevate privileges");
-      exit(EX_NOPERM);
-    case 126:
-      fprintf(stderr, "Error: %s\n", "User denied permission to elevate privileges");
-      exit(EX_USAGE);
-    default:
-      fprintf(stderr, "Error: %s %i\n", "Mechanism failed with code:", mechanism_status);
-      exit(EX_SOFTWARE);
-    }
   }
 
-  struct sockaddr_un unix_peer_addr = {0};
-  socklen_t unix_peer_addr_size = sizeof(unix_peer_addr);
-
-  // the accepted connection is not non-blocking
-  unix_peer_fd = TEMP_FAILURE_RETRY(
-    accept(
-      unix_sock_fd,
-      (struct sockaddr *) &unix_peer_addr,
-      &unix_peer_addr_size
-    )
-  );
-
-  if (unix_peer_fd == -1) {
-    perror("accept()");
-    exit(EX_OSERR);
+  RunTimings run_timings = {0};
+  if (options.timings) {
+    privelev_ctx_set_timings_callback(ctx, store_timings, &run_timings);
   }
 
-  close(unix_sock_fd);
+  /* PROBE CODE */
 
-  if (!check_peer_pid(unix_peer_fd, mechanism_pid)) {
-    fprintf(stderr, "Error: %s\n", "Unknown peer pid");
-    exit(EX_PROTOCOL);
+  if (options.probe) {
+    privelev_status status = privelev_probe(ctx, devices, devices_count);
+    privelev_ctx_free(ctx);
+    if (status != PRIVELEV_OK) {
+      fprintf(stderr, "Error: %s\n", privelev_strerror(status));
+      exit(exit_status_for(status));
+    }
+    exit(report_probe(devices, devices_count, status));
   }
 
-  shutdown(unix_peer_fd, SHUT_WR);
-
-  /* RECEIVE CODE */
-
-  // message is an array of 1 MechanismProto
-  MechanismProto message[1] = {0};
-  char message_buffer[sizeof(message)] = {0};
-  struct iovec io_vector[1] = {{
-      .iov_base = message_buffer,
-      .iov_len = sizeof(message_buffer)
-    }
-  };
+  /* EXECUTION CODE */
 
-  // suitably aligned ancillary data
-  union {
-    char buf[CMSG_SPACE(sizeof(int))];
-    struct cmsghdr align;
-  } ancillary_buffer;
+  privelev_status status = privelev_open_serial_many(ctx, devices, devices_count);
 
-  struct msghdr message_options = {0};
-  message_options.msg_iov = io_vector;
-  message_options.msg_iovlen = 1;
-  message_options.msg_control = ancillary_buffer.buf;
-  message_options.msg_controllen = sizeof(ancillary_buffer.buf);
+  privelev_ctx_free(ctx);
 
-  if (!unblock_sigchld(&signal_orig_mask)) {
-    perror("unblock_sigchld()");
-    exit(EX_OSERR);
+  int exit_status = exit_status_for(status);
+  // the details of a failure have already been logged
+  if (status != PRIVELEV_OK) {
+    fprintf(stderr, "Error: %s\n", privelev_strerror(status));
   }
 
-  while (true) {
-
-    ssize = recvmsg(unix_peer_fd, &message_options, MSG_WAITALL);
-
-    if (ssize == -1) {
-
-      if (errno == EINTR) {
+  /* DETECT CODE */
+
+  if (options.auto_baud) {
+    privelev_auto_baud auto_baud = { .window_ms = options.auto_baud_window };
+    if (privelev_detect_baud(devices, devices_count, &auto_baud) != PRIVELEV_OK) {
+      for (size_t i = 0; i < devices_count; ++i) {
+        if (devices[i].fd < 0 || !devices[i].error) continue;
+        fprintf(
+          stderr,
+          "%s: Could not detect the baud rate, staying at %u baud: %s\n",
+          devices[i].path,
+          devices[i].baud,
+          strerror(devices[i].error)
+        );
+        devices[i].error = 0;
+      }
+      if (exit_status == EXIT_SUCCESS) {
+        exit_status = EX_DATAERR;
+      }
+    }
+  }
 
-        if (mechanism_status != -1 && mechanism_status != EXIT_SUCCESS) {
-          fprintf(stderr, "Error: %s %i\n", "Mechanism failed after connecting with code:", mechanism_status);
-          exit(EX_UNAVAILABLE);
+  /* SWITCH CODE */
+
+  // the ports are switched on the file descriptors we already have, without elevating again
+  if (options.switch_baud) {
+    for (size_t i = 0; i < devices_count; ++i) {
+      if (devices[i].fd < 0) continue;
+      if (privelev_negotiate(&devices[i], options.switch_baud, &devices[i].line, &options.negotiation) != PRIVELEV_OK) {
+        fprintf(
+          stderr,
+          "%s: Could not switch to %u baud, staying at %u baud: %s\n",
+          devices[i].path,
+          options.switch_baud,
+          devices[i].baud,
+          strerror(errno)
+        );
+        if (exit_status == EXIT_SUCCESS) {
+          exit_status = EX_PROTOCOL;
         }
-
-      } else {
-
-        perror("recvmsg()");
-        exit(EX_OSERR);
-
       }
-
-    } else if ((size_t) ssize < sizeof(message_buffer)) {
-
-      fprintf(stderr, "recvmsg(): %s\n", "Received incorrect message size from mechanism");
-      exit(EX_PROTOCOL);
-
-    } else {
-
-      break;
-
     }
-
   }
 
-  // reinterpreting message buffer as message
-  memcpy(message, message_buffer, sizeof(message));
-
-  printf("Received Data:");
-  for (int i = 0; i < sizeof(message_buffer); ++i) {
-    printf(" 0x%02X", message_buffer[i]);
+  /* REPORT CODE */
+
+  // devices opened before a failed elevation are still reported
+  for (size_t i = 0; i < devices_count; ++i) {
+    if (devices[i].fd >= 0) {
+      fprintf(
+        stderr,
+        "%s: %s (device %u:%u, %u baud%s%s)\n",
+        devices[i].path,
+        privelev_opener_name(devices[i].opener),
+        devices[i].major,
+        devices[i].minor,
+        devices[i].applied_baud,
+        devices[i].sysfs_path[0] ? ", " : "",
+        devices[i].sysfs_path
+      );
+      // only the elevated mechanism may lower it, the port still has the rest of the profile
+      if (devices[i].line.low_latency && devices[i].latency_timer_ms > 1) {
+        fprintf(
+          stderr,
+          "%s: latency timer not lowered, still %d ms\n",
+          devices[i].path,
+          devices[i].latency_timer_ms
+        );
+      }
+    } else {
+      fprintf(stderr, "%s: %s\n", devices[i].path, device_failure(&devices[i], status));
+      if (exit_status == EXIT_SUCCESS) {
+        exit_status = EX_UNAVAILABLE;
+      }
+    }
   }
-  printf("\n");
 
-  if (message[0].type != PRIVFD) {
-    fprintf(stderr, "Error: %s\n", "Unexpected message from mechanism");
-    exit(EX_PROTOCOL);
-  }
+  /* EXECUTE THE COMMAND CODE */
 
-  if ((message_options.msg_flags & MSG_CTRUNC) == MSG_CTRUNC) {
-    fprintf(stderr, "Error: %s\n", "Not enough space provided for ancillary data");
-    exit(EX_SOFTWARE);
+  // the command is only executed with every port it was given
+  if (options.command) {
+    if (options.timings) {
+      run_timings.status = privelev_strerror(status);
+      report_timings(&run_timings, options.timings, options.timings_path, options.histogram_path);
+    }
+    if (exit_status == EXIT_SUCCESS) {
+      exit_status = exec_command(options.command, options.fd, devices, devices_count);
+    }
+    exit(exit_status);
   }
 
-  struct cmsghdr * ancillary_message = CMSG_FIRSTHDR(&message_options);
+  /* RELAY CODE */
 
-  if (
-    ancillary_message->cmsg_level == SOL_SOCKET &&
-    ancillary_message->cmsg_type == SCM_RIGHTS
-  ) {
-    int * ancillary_p = (int *) CMSG_DATA(ancillary_message);
-    serial_port_fd = *ancillary_p;
-  } else {
-    fprintf(stderr, "Error: %s\n", "Unknown ancillary data from mechanism");
-  }
-
-  if (serial_port_fd < 0) {
-    fprintf(stderr, "Error: %s\n", "Did not get a file descriptor from the mechanism");
-    exit(EX_PROTOCOL);
+  if (options.relay) {
+    if (options.timings) {
+      run_timings.status = privelev_strerror(status);
+      report_timings(&run_timings, options.timings, options.timings_path, options.histogram_path);
+    }
+    if (exit_status == EXIT_SUCCESS) {
+      exit_status = relay_port(&devices[0], options.metrics_path, options.metrics_interval);
+    }
+    exit(exit_status);
   }
 
-  shutdown(unix_peer_fd, SHUT_RDWR);
-  close(unix_peer_fd);
-
   /* USE THE SERIAL PORT CODE */
 
   const char serial_message[] = "Hello World\r\n";
-  ssize = TEMP_FAILURE_RETRY(
-    write(serial_port_fd, serial_message, sizeof(serial_message))
-  );
-  if (ssize != sizeof(serial_message)) {
-    fprintf(stderr, "Error: %s\n", "Could not complete message to serial port");
-    exit(EX_IOERR);
+  uint64_t write_start = monotonic_ns();
+  for (size_t i = 0; i < devices_count; ++i) {
+    if (devices[i].fd < 0) continue;
+    ++run_timings.write_count;
+    ssize_t ssize = TEMP_FAILURE_RETRY(
+      write(devices[i].fd, serial_message, sizeof(serial_message))
+    );
+    if (ssize != sizeof(serial_message)) {
+      fprintf(stderr, "%s: Error: %s\n", devices[i].path, "Could not complete message to serial port");
+      exit_status = EX_IOERR;
+    }
+  }
+  run_timings.write_ns = monotonic_ns() - write_start;
+
+  if (options.timings) {
+    run_timings.status = privelev_strerror(status);
+    report_timings(&run_timings, options.timings, options.timings_path, options.histogram_path);
   }
 
-  exit(EXIT_SUCCESS);
+  exit(exit_status);
 
 }
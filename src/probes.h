@@ -0,0 +1,40 @@
+#pragma once
+
+/**
+ * USDT probes of the privelev provider, for tracing with bpftrace or perf
+ * on hosts where the program cannot be restarted with --timings.
+ * Without --enable-usdt they expand to nothing, and their arguments,
+ * including PROBE_ELAPSED, are never evaluated.
+ *
+ *   bpftrace -e 'usdt:./open-serial-device:privelev:serial__open { printf("%s %d\n", str(arg0), arg2); }'
+ */
+
+#if defined(USDT_PROBES)
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/sdt.h>
+
+static inline int64_t
+probe_clock (void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+}
+
+#define PROBE(name, ...) STAP_PROBEV(privelev, name, ##__VA_ARGS__)
+// declares a start time for PROBE_ELAPSED
+#define PROBE_START(start) int64_t start = probe_clock()
+// nanoseconds since PROBE_START
+#define PROBE_ELAPSED(start) (probe_clock() - (start))
+
+#else
+
+#define PROBE(name, ...) do {} while (0)
+#define PROBE_START(start) do {} while (0)
+#define PROBE_ELAPSED(start) 0
+
+#endif
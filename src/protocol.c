@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <assert.h>
+
+#include "protocol.h"
+
+int
+protocol_send (
+  int sock_fd,
+  MechanismProtoType type,
+  const void * body,
+  size_t length,
+  const int * fds,
+  size_t fds_count,
+  FILE * trace
+) {
+
+  assert(length <= PRIVFD_BODY_MAX && fds_count <= PRIVFD_BATCH_MAX);
+
+  MechanismProtoHeader header = {
+    .magic = PRIVFD_MAGIC,
+    .version = PRIVFD_VERSION,
+    .type = (uint8_t) type,
+    .length = (uint16_t) length
+  };
+  char message_buffer[sizeof(header) + PRIVFD_BODY_MAX] = {0};
+  size_t message_size = sizeof(header) + length;
+  memcpy(message_buffer, &header, sizeof(header));
+  if (length > 0) {
+    memcpy(message_buffer + sizeof(header), body, length);
+  }
+
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * PRIVFD_BATCH_MAX)];
+    struct cmsghdr align;
+  } ancillary_buffer;
+
+  struct iovec io_vector[1] = {
+    {
+      .iov_base = message_buffer,
+      .iov_len = message_size
+    }
+  };
+
+  struct msghdr message_options = {0};
+  message_options.msg_iov = io_vector;
+  message_options.msg_iovlen = 1;
+
+  if (fds_count > 0) {
+    message_options.msg_control = ancillary_buffer.buf;
+    message_options.msg_controllen = CMSG_SPACE(sizeof(int) * fds_count);
+    struct cmsghdr * ancillary_message = CMSG_FIRSTHDR(&message_options);
+    ancillary_message->cmsg_level = SOL_SOCKET;
+    ancillary_message->cmsg_type = SCM_RIGHTS;
+    ancillary_message->cmsg_len = CMSG_LEN(sizeof(int) * fds_count);
+    memcpy(CMSG_DATA(ancillary_message), fds, sizeof(int) * fds_count);
+  }
+
+  if (trace) {
+    fprintf(trace, "Sending Data:");
+    for (size_t i = 0; i < message_size; ++i) {
+      fprintf(trace, " 0x%02X", (unsigned char) message_buffer[i]);
+    }
+    fprintf(trace, "\n");
+  }
+
+  // a peer that hung up is an error, not a signal
+  ssize_t ssize = TEMP_FAILURE_RETRY(
+    sendmsg(sock_fd, &message_options, MSG_NOSIGNAL)
+  );
+
+  if (ssize == -1) {
+    return -1;
+  } else if ((size_t) ssize < message_size) {
+    return 0;
+  }
+
+  return 1;
+
+}
+
+int
+protocol_receive (int sock_fd, MechanismProtoHeader * header, char * body) {
+
+  char header_buffer[sizeof(*header)];
+  ssize_t ssize = TEMP_FAILURE_RETRY(
+    recv(sock_fd, header_buffer, sizeof(header_buffer), MSG_WAITALL)
+  );
+  if (ssize == -1) {
+    return -1;
+  } else if (ssize == 0) {
+    return 0;
+  } else if ((size_t) ssize < sizeof(header_buffer)) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  // reinterpreting message buffer as message
+  memcpy(header, header_buffer, sizeof(*header));
+  if (
+    header->magic != PRIVFD_MAGIC ||
+    header->version != PRIVFD_VERSION ||
+    header->length > PRIVFD_BODY_MAX
+  ) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  if (header->length > 0) {
+    ssize = TEMP_FAILURE_RETRY(
+      recv(sock_fd, body, header->length, MSG_WAITALL)
+    );
+    if (ssize == -1) {
+      return -1;
+    } else if ((size_t) ssize < header->length) {
+      errno = EPROTO;
+      return -1;
+    }
+  }
+
+  return 1;
+
+}
+
+ssize_t
+protocol_parse (const char * buffer, size_t length, MechanismProtoHeader * header, const char * * body) {
+
+  if (length < sizeof(*header)) {
+    return 0;
+  }
+
+  // reinterpreting message buffer as message
+  memcpy(header, buffer, sizeof(*header));
+  if (
+    header->magic != PRIVFD_MAGIC ||
+    header->version != PRIVFD_VERSION ||
+    header->length > PRIVFD_BODY_MAX
+  ) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  if (length < sizeof(*header) + header->length) {
+    return 0;
+  }
+
+  *body = buffer + sizeof(*header);
+  return (ssize_t) (sizeof(*header) + header->length);
+
+}
@@ -1,11 +1,146 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+
+// every message starts with the magic and version, so a mismatched
+// mechanism is rejected instead of being misread
+#define PRIVFD_MAGIC 0x44465650
+#define PRIVFD_VERSION 3
+
+// maximum number of devices reported in a single batch message
+// this keeps the SCM_RIGHTS control message well below SCM_MAX_FD (253)
+#define PRIVFD_BATCH_MAX 64
+
+// sysfs paths are truncated to fit
+#define PRIVFD_SYSFS_PATH_MAX 255
+
+// no message body is larger than this
+#define PRIVFD_BODY_MAX 512
 
 typedef enum {
-  PRIVFD = 1
+  // device results, with the opened file descriptors attached
+  PRIVFD_BATCH = 2,
+  // identity and line settings of an opened device
+  PRIVFD_DEVICE = 3,
+  // the mechanism failed as a whole, nothing else follows
+  PRIVFD_ERROR = 4,
+  // every device has been reported, or every device has been asked for
+  PRIVFD_END = 5,
+  // a device wanted opened, sent to the coalescer or to a mechanism serving a lease
+  PRIVFD_OPEN = 6
 } MechanismProtoType;
 
-typedef struct MechanismProto {
+// every message is a header followed by `length` bytes of body
+// the file descriptors of a batch are attached to the first byte of its header
+// receivers skip the bodies of message types they do not know
+typedef struct MechanismProtoHeader {
+  uint32_t magic;
+  uint8_t version;
   uint8_t type;
-} __attribute__((packed)) MechanismProto;
+  uint16_t length;
+} __attribute__((packed)) MechanismProtoHeader;
+
+// a batch body is the count followed by `count` results
+// the file descriptors of every result with an error of 0
+// are attached as a single SCM_RIGHTS control message in result order
+typedef struct MechanismProtoBatch {
+  uint8_t count;
+} __attribute__((packed)) MechanismProtoBatch;
+
+typedef struct MechanismProtoResult {
+  // position of the device in the mechanism's argument list
+  uint16_t index;
+  // 0 if a file descriptor is attached, otherwise the errno of the failed open
+  int32_t error;
+} __attribute__((packed)) MechanismProtoResult;
+
+// a device body is followed by `sysfs_path_length` bytes of path, not NUL terminated
+// it is sent after the batch that carried the device's file descriptor
+typedef struct MechanismProtoDevice {
+  uint16_t index;
+  uint32_t major;
+  uint32_t minor;
+  // the applied line settings, speeds are in bits per second
+  uint32_t ispeed;
+  uint32_t ospeed;
+  uint32_t iflag;
+  uint32_t oflag;
+  uint32_t cflag;
+  uint32_t lflag;
+  uint16_t sysfs_path_length;
+} __attribute__((packed)) MechanismProtoDevice;
+
+typedef enum {
+  PRIVFD_LINE_RTS_CTS = 1,
+  PRIVFD_LINE_XON_XOFF = 2,
+  PRIVFD_LINE_RS485 = 4,
+  PRIVFD_LINE_LOW_LATENCY = 8
+} MechanismProtoLineFlag;
+
+// a flag outside these is from a newer version, and is refused rather than ignored
+#define PRIVFD_LINE_KNOWN \
+  (PRIVFD_LINE_RTS_CTS | PRIVFD_LINE_XON_XOFF | PRIVFD_LINE_RS485 | PRIVFD_LINE_LOW_LATENCY)
+
+// an open body is followed by `path_length` bytes of path, not NUL terminated
+typedef struct MechanismProtoOpen {
+  uint32_t baud;
+  // the line settings, the parity is 0 for none, 1 for odd and 2 for even
+  uint8_t data_bits;
+  uint8_t parity;
+  uint8_t stop_bits;
+  uint8_t line_flags;
+  uint32_t rs485_delay_before_ms;
+  uint32_t rs485_delay_after_ms;
+  uint16_t path_length;
+} __attribute__((packed)) MechanismProtoOpen;
+
+typedef enum {
+  PRIVFD_ERROR_USAGE = 1,
+  PRIVFD_ERROR_SYSTEM = 2,
+  // only sent by the coalescer, whose elevation was refused by Polkit or by the user
+  PRIVFD_ERROR_DENIED = 3,
+  PRIVFD_ERROR_DISMISSED = 4,
+  // the mechanism's lease has run out or does not cover a device, it exits after sending this
+  PRIVFD_ERROR_LEASE = 5
+} MechanismProtoErrorCode;
+
+typedef struct MechanismProtoError {
+  uint8_t code;
+  // errno of the failure, 0 if there is none
+  int32_t error;
+} __attribute__((packed)) MechanismProtoError;
+
+/**
+ * Sends one message, with any file descriptors attached to its first byte.
+ * The message is traced to the trace stream unless it is NULL.
+ * Returns 1 on success, 0 on a short send, or -1 with errno set.
+ */
+int protocol_send (
+  int sock_fd,
+  MechanismProtoType type,
+  const void * body,
+  size_t length,
+  const int * fds,
+  size_t fds_count,
+  FILE * trace
+);
+
+/**
+ * Receives one message that carries no file descriptors,
+ * into a body of at least PRIVFD_BODY_MAX bytes.
+ * Returns 1 on success, 0 if the peer hung up before the message,
+ * or -1 with errno set, EPROTO if the message is malformed.
+ */
+int protocol_receive (int sock_fd, MechanismProtoHeader * header, char * body);
+
+/**
+ * Takes one message from the start of what was received so far on a non-blocking socket,
+ * with the body pointing into the buffer.
+ * Returns the size of the message, 0 if the buffer does not hold all of it yet,
+ * or -1 with errno set to EPROTO if it is malformed.
+ */
+ssize_t protocol_parse (const char * buffer, size_t length, MechanismProtoHeader * header, const char * * body);
@@ -0,0 +1,1374 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#include <linux/serial.h>
+
+#if defined(IO_URING)
+#include <liburing.h>
+#endif
+
+#include "relay.h"
+
+// the default capacity of a pipe, so one splice can fill it
+#define RELAY_PIPE_SIZE 65536
+// blocking outputs only report writable once most of their buffer is free,
+// a serial port's is a page, so this much fits without blocking
+#define RELAY_BLOCKING_CHUNK 2048
+#define RELAY_MAX_EVENTS 32
+
+// epoll data is the link index with the side in the lowest bit
+#define RELAY_IN 0
+#define RELAY_OUT 1
+#define RELAY_SIGNAL UINT64_MAX
+#define RELAY_METRICS (UINT64_MAX - 1)
+
+// io_uring is only worth it once one wakeup has several links to service
+#define RELAY_URING_MIN_LINKS 4
+
+static int64_t
+now_ns (void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+}
+
+const char *
+relay_backend_name (RelayBackend backend) {
+
+  switch (backend) {
+    case RELAY_BACKEND_AUTO:
+      return "auto";
+    case RELAY_BACKEND_EPOLL:
+      return "epoll";
+    case RELAY_BACKEND_IO_URING:
+      return "io_uring";
+  }
+  return "unknown";
+
+}
+
+bool
+relay_init (Relay * relay, RelayBackend backend) {
+
+  relay->backend = backend;
+  relay->epoll_fd = -1;
+  relay->uring = NULL;
+  relay->signal_fd = -1;
+  relay->metrics_fd = -1;
+  relay->metrics_path = NULL;
+  relay->links = NULL;
+  relay->links_count = 0;
+  relay->links_capacity = 0;
+  relay->started_ns = 0;
+  relay->syscalls = 0;
+  relay->stop_signal = 0;
+
+  sigset_t signal_mask;
+  sigemptyset(&signal_mask);
+  sigaddset(&signal_mask, SIGINT);
+  sigaddset(&signal_mask, SIGTERM);
+  sigaddset(&signal_mask, SIGUSR1);
+  sigaddset(&signal_mask, SIGPIPE);
+
+  if (pthread_sigmask(SIG_BLOCK, &signal_mask, &relay->signal_orig_mask) != 0) {
+    return false;
+  }
+
+  relay->signal_fd = signalfd(-1, &signal_mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (relay->signal_fd == -1) {
+    relay_destroy(relay);
+    return false;
+  }
+
+  return true;
+
+}
+
+bool
+relay_add (Relay * relay, const char * name, int in_fd, int out_fd, bool ends_relay) {
+
+  if (relay->links_count == relay->links_capacity) {
+    size_t capacity = relay->links_capacity ? relay->links_capacity * 2 : 2;
+    RelayLink * links = realloc(relay->links, capacity * sizeof(RelayLink));
+    if (!links) {
+      return false;
+    }
+    relay->links = links;
+    relay->links_capacity = capacity;
+  }
+
+  struct stat out_stat;
+  if (fstat(out_fd, &out_stat) == -1) {
+    return false;
+  }
+
+  RelayLink * link = &relay->links[relay->links_count];
+  *link = (RelayLink) {
+    .name = name,
+    .in_fd = in_fd,
+    .out_fd = out_fd,
+    .ends_relay = ends_relay,
+    .in_tty = isatty(in_fd),
+    .splicing = true,
+    .pipe_fds = { -1, -1 },
+    .tty_health = { .input_queue = -1, .output_queue = -1 }
+  };
+
+  // writes to a pipe never block as splice does not block on it,
+  // and regular files are always writable
+  if (S_ISFIFO(out_stat.st_mode)) {
+    link->out_chunk = RELAY_PIPE_SIZE;
+  } else if (S_ISREG(out_stat.st_mode)) {
+    link->out_chunk = RELAY_PIPE_SIZE;
+  } else {
+    link->out_chunk = RELAY_BLOCKING_CHUNK;
+  }
+
+  ++relay->links_count;
+  return true;
+
+}
+
+static void
+end_link (Relay * relay, RelayLink * link, int error);
+
+static void
+count_read (RelayLink * link, size_t length) {
+
+  ++link->counters.reads;
+  link->counters.read_bytes += length;
+  // the bucket of the smallest power of 2 the read fits in
+  size_t bucket = length > 1 ? 64 - __builtin_clzll((unsigned long long) length - 1) : 0;
+  ++link->counters.read_sizes[MIN(bucket, RELAY_READ_SIZE_BUCKETS - 1)];
+
+}
+
+/**
+ * Writes the metrics once the timer expired, a failure is left for the next time.
+ */
+static void
+handle_metrics (Relay * relay) {
+
+  uint64_t expirations;
+  ++relay->syscalls;
+  if (read(relay->metrics_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    relay_write_metrics(relay, relay->metrics_path);
+  }
+
+}
+
+/**
+ * Returns 1 if the relay goes on, 0 if a signal stopped it, or -1 on failure.
+ */
+static int
+handle_signals (Relay * relay, FILE * progress) {
+
+  struct signalfd_siginfo info;
+  ssize_t length;
+  while (++relay->syscalls, (length = read(relay->signal_fd, &info, sizeof(info))) == sizeof(info)) {
+    switch (info.ssi_signo) {
+      case SIGUSR1:
+        if (progress) {
+          relay_report(relay, progress);
+        }
+        if (relay->metrics_path) {
+          relay_write_metrics(relay, relay->metrics_path);
+        }
+        break;
+      case SIGINT:
+      case SIGTERM:
+        relay->stop_signal = info.ssi_signo;
+        return 0;
+      // SIGPIPE is only consumed, the write that raised it failed with EPIPE
+    }
+  }
+  if (length == -1 && errno != EAGAIN && errno != EINTR) {
+    return -1;
+  }
+  return 1;
+
+}
+
+/**
+ * Whether the relay is over, ending links whose input has ended and been written out.
+ */
+static bool
+relay_over (Relay * relay) {
+
+  bool running = false;
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    RelayLink * link = &relay->links[i];
+    if (link->eof && !link->pending && !link->done) {
+      end_link(relay, link, 0);
+    }
+    if (link->done) {
+      if (link->ends_relay) {
+        return true;
+      }
+      continue;
+    }
+    running = true;
+  }
+  return !running;
+
+}
+
+/* EPOLL BACKEND */
+
+/**
+ * Watches a side of a link with no events, which still reports hangups and errors.
+ * Descriptors epoll refuses are always ready, so they are left unwatched.
+ */
+static bool
+watch_side (Relay * relay, size_t index, int side, int fd, bool * polled) {
+
+  struct epoll_event event = { .events = 0, .data.u64 = index * 2 + side };
+  if (epoll_ctl(relay->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    if (errno != EPERM) {
+      return false;
+    }
+    *polled = false;
+    return true;
+  }
+  *polled = true;
+  return true;
+
+}
+
+static bool
+start_epoll (Relay * relay) {
+
+  relay->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (relay->epoll_fd == -1) {
+    return false;
+  }
+
+  struct epoll_event event = { .events = EPOLLIN, .data.u64 = RELAY_SIGNAL };
+  if (epoll_ctl(relay->epoll_fd, EPOLL_CTL_ADD, relay->signal_fd, &event) == -1) {
+    return false;
+  }
+  if (relay->metrics_fd != -1) {
+    event.data.u64 = RELAY_METRICS;
+    if (epoll_ctl(relay->epoll_fd, EPOLL_CTL_ADD, relay->metrics_fd, &event) == -1) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    RelayLink * link = &relay->links[i];
+    link->buffer = malloc(RELAY_PIPE_SIZE);
+    if (!link->buffer) {
+      return false;
+    }
+    if (pipe2(link->pipe_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+      return false;
+    }
+    if (
+      !watch_side(relay, i, RELAY_IN, link->in_fd, &link->in_polled) ||
+      !watch_side(relay, i, RELAY_OUT, link->out_fd, &link->out_polled)
+    ) {
+      return false;
+    }
+  }
+
+  return true;
+
+}
+
+static bool
+set_events (Relay * relay, size_t index, int side, int fd, uint32_t * current, uint32_t events) {
+
+  if (*current == events) {
+    return true;
+  }
+  struct epoll_event event = { .events = events, .data.u64 = index * 2 + side };
+  ++relay->syscalls;
+  if (epoll_ctl(relay->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+    return false;
+  }
+  *current = events;
+  return true;
+
+}
+
+/**
+ * Stops watching a side, which is then always ready, so the next transfer finds out what happened to it.
+ * A hangup is reported whatever the events asked for, so a side that hung up is no longer watched.
+ */
+static void
+unwatch_side (Relay * relay, int fd, bool * polled, uint32_t * current) {
+
+  if (*polled) {
+    ++relay->syscalls;
+    epoll_ctl(relay->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    *polled = false;
+    *current = 0;
+  }
+
+}
+
+static void
+end_link (Relay * relay, RelayLink * link, int error) {
+
+  link->done = true;
+  link->error = error;
+  // its descriptors may still be in other links as duplicates, which are separate in epoll
+  unwatch_side(relay, link->in_fd, &link->in_polled, &link->in_events);
+  unwatch_side(relay, link->out_fd, &link->out_polled, &link->out_events);
+
+}
+
+/**
+ * Reads what the input has into the pipe, or the buffer once splicing is off.
+ */
+static void
+fill_link (Relay * relay, RelayLink * link) {
+
+  ssize_t length = -1;
+  if (link->splicing) {
+    ++relay->syscalls;
+    length = splice(
+      link->in_fd,
+      NULL,
+      link->pipe_fds[1],
+      NULL,
+      RELAY_PIPE_SIZE,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+    );
+    if (length == -1 && errno == EINVAL) {
+      link->splicing = false;
+    }
+  }
+  if (!link->splicing) {
+    ++relay->syscalls;
+    length = read(link->in_fd, link->buffer, RELAY_PIPE_SIZE);
+  }
+
+  if (length > 0) {
+    link->pending = length;
+    link->pending_in_pipe = link->splicing;
+    link->buffer_offset = 0;
+    count_read(link, length);
+    return;
+  }
+
+  if (length == 0) {
+    // a tty that was readable can still have nothing, unless it hung up
+    if (!link->in_tty || link->in_hung_up) {
+      link->eof = true;
+    }
+    return;
+  }
+
+  if (errno == EAGAIN || errno == EINTR) {
+    return;
+  }
+  // a tty whose other end has gone fails with EIO
+  if (errno == EIO && link->in_tty) {
+    link->eof = true;
+    return;
+  }
+  end_link(relay, link, errno);
+
+}
+
+/**
+ * Writes out what is pending, moving it from the pipe to the buffer
+ * if the output turns out not to take splices.
+ */
+static void
+drain_link (Relay * relay, RelayLink * link) {
+
+  size_t length = MIN(link->pending, link->out_chunk);
+  ssize_t written = -1;
+  bool spliced = false;
+
+  if (link->pending_in_pipe) {
+    ++relay->syscalls;
+    written = splice(
+      link->pipe_fds[0],
+      NULL,
+      link->out_fd,
+      NULL,
+      length,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+    );
+    spliced = true;
+    if (written == -1 && errno == EINVAL) {
+      link->splicing = false;
+      ++relay->syscalls;
+      ssize_t moved = read(link->pipe_fds[0], link->buffer, link->pending);
+      if (moved != (ssize_t) link->pending) {
+        end_link(relay, link, moved == -1 ? errno : EIO);
+        return;
+      }
+      link->pending_in_pipe = false;
+      link->buffer_offset = 0;
+      spliced = false;
+    }
+  }
+  if (!link->pending_in_pipe) {
+    ++relay->syscalls;
+    written = write(link->out_fd, link->buffer + link->buffer_offset, length);
+  }
+
+  if (written > 0) {
+    link->pending -= written;
+    link->buffer_offset += written;
+    link->counters.bytes += written;
+    ++link->counters.writes;
+    if (spliced) {
+      link->counters.spliced_bytes += written;
+    }
+    if (link->eof && !link->pending) {
+      end_link(relay, link, 0);
+    }
+    return;
+  }
+
+  if (written == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  // the output has gone, whatever is still pending is lost with it
+  end_link(relay, link, written == -1 ? errno : EIO);
+
+}
+
+static int
+run_epoll (Relay * relay, FILE * progress) {
+
+  struct epoll_event events[RELAY_MAX_EVENTS];
+  while (true) {
+
+    if (relay_over(relay)) {
+      return 1;
+    }
+
+    bool ready_now = false;
+    for (size_t i = 0; i < relay->links_count; ++i) {
+      RelayLink * link = &relay->links[i];
+      if (link->done) {
+        continue;
+      }
+      bool want_in = !link->eof && !link->pending;
+      bool want_out = link->pending;
+      if (
+        (link->in_polled &&
+         !set_events(relay, i, RELAY_IN, link->in_fd, &link->in_events, want_in ? EPOLLIN : 0)) ||
+        (link->out_polled &&
+         !set_events(relay, i, RELAY_OUT, link->out_fd, &link->out_events, want_out ? EPOLLOUT : 0))
+      ) {
+        return -1;
+      }
+      ready_now = ready_now || (want_in && !link->in_polled) || (want_out && !link->out_polled);
+    }
+
+    ++relay->syscalls;
+    int events_count = epoll_wait(relay->epoll_fd, events, RELAY_MAX_EVENTS, ready_now ? 0 : -1);
+    if (events_count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    for (int i = 0; i < events_count; ++i) {
+      if (events[i].data.u64 == RELAY_SIGNAL) {
+        int status = handle_signals(relay, progress);
+        if (status != 1) {
+          return status;
+        }
+        continue;
+      }
+      if (events[i].data.u64 == RELAY_METRICS) {
+        handle_metrics(relay);
+        continue;
+      }
+      RelayLink * link = &relay->links[events[i].data.u64 / 2];
+      bool hung_up = events[i].events & (EPOLLHUP | EPOLLERR);
+      if (events[i].data.u64 % 2 == RELAY_IN) {
+        link->in_ready = true;
+        if (hung_up) {
+          link->in_hung_up = true;
+          unwatch_side(relay, link->in_fd, &link->in_polled, &link->in_events);
+        }
+      } else {
+        link->out_ready = true;
+        if (hung_up) {
+          unwatch_side(relay, link->out_fd, &link->out_polled, &link->out_events);
+        }
+      }
+    }
+
+    for (size_t i = 0; i < relay->links_count; ++i) {
+      RelayLink * link = &relay->links[i];
+      bool in_ready = link->in_ready || !link->in_polled;
+      bool out_ready = link->out_ready || !link->out_polled;
+      link->in_ready = false;
+      link->out_ready = false;
+      if (link->done) {
+        continue;
+      }
+      if (!link->pending && !link->eof && in_ready) {
+        fill_link(relay, link);
+        // fresh data is written at once, the output is usually still writable
+        out_ready = true;
+      }
+      if (link->pending && !link->done && out_ready) {
+        drain_link(relay, link);
+      }
+    }
+
+  }
+
+}
+
+/* IO_URING BACKEND */
+
+#if defined(IO_URING)
+
+// buffers provided to each link's reads, the count must be a power of 2
+#define RELAY_URING_BUFFERS 16
+#define RELAY_URING_BUFFER_SIZE 4096
+
+// user data is the link index shifted past the operation
+#define URING_READ 0
+#define URING_WRITE 1
+#define URING_POLL_IN 2
+#define URING_POLL_OUT 3
+#define URING_SIGNAL 4
+#define URING_CANCEL 5
+#define URING_METRICS 6
+#define URING_OP_BITS 3
+
+/**
+ * A link's reads pick buffers from its own buffer ring, the read ones are queued
+ * in order until written, and are only given back to the ring after that.
+ * A multishot read stops once every buffer is queued, which is the backpressure.
+ */
+typedef struct UringLink {
+  struct io_uring_buf_ring * buf_ring;
+  char * buffers;
+  uint16_t queue_ids[RELAY_URING_BUFFERS];
+  uint32_t queue_lengths[RELAY_URING_BUFFERS];
+  unsigned int queue_head;
+  unsigned int queue_count;
+  // how much of the first queued buffer has been written
+  size_t queue_offset;
+  struct iovec iovecs[RELAY_URING_BUFFERS];
+  // falls back to a read per completion where multishot reads are not supported
+  bool multishot;
+  bool reading;
+  bool writing;
+  bool polling_in;
+  bool polling_out;
+} UringLink;
+
+struct RelayUring {
+  struct io_uring ring;
+  UringLink * links;
+  bool signal_polling;
+  bool metrics_polling;
+};
+
+static void
+free_uring (Relay * relay) {
+
+  struct RelayUring * uring = relay->uring;
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    if (uring->links[i].buf_ring) {
+      io_uring_free_buf_ring(&uring->ring, uring->links[i].buf_ring, RELAY_URING_BUFFERS, (int) i);
+    }
+  }
+  io_uring_queue_exit(&uring->ring);
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    free(uring->links[i].buffers);
+  }
+  free(uring->links);
+  free(uring);
+  relay->uring = NULL;
+
+}
+
+/**
+ * Returns false with errno set where io_uring or provided buffer rings are unavailable.
+ */
+static bool
+start_uring (Relay * relay) {
+
+  struct RelayUring * uring = calloc(1, sizeof(struct RelayUring));
+  if (!uring) {
+    return false;
+  }
+  uring->links = calloc(relay->links_count, sizeof(UringLink));
+  if (!uring->links) {
+    free(uring);
+    return false;
+  }
+
+  // a link has at most a read, a write and two polls in flight
+  unsigned int entries = (unsigned int) relay->links_count * 4 + 2;
+  // completions are only processed when waiting for them anyway, so interrupting the task is wasted
+  int result = io_uring_queue_init(entries, &uring->ring, IORING_SETUP_COOP_TASKRUN);
+  if (result == -EINVAL) {
+    result = io_uring_queue_init(entries, &uring->ring, 0);
+  }
+  if (result < 0) {
+    free(uring->links);
+    free(uring);
+    errno = -result;
+    return false;
+  }
+  relay->uring = uring;
+
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    UringLink * uring_link = &uring->links[i];
+    uring_link->multishot = true;
+    uring_link->buffers = malloc(RELAY_URING_BUFFERS * RELAY_URING_BUFFER_SIZE);
+    if (!uring_link->buffers) {
+      free_uring(relay);
+      return false;
+    }
+    uring_link->buf_ring = io_uring_setup_buf_ring(
+      &uring->ring,
+      RELAY_URING_BUFFERS,
+      (int) i,
+      0,
+      &result
+    );
+    if (!uring_link->buf_ring) {
+      free_uring(relay);
+      errno = -result;
+      return false;
+    }
+    for (unsigned int buffer = 0; buffer < RELAY_URING_BUFFERS; ++buffer) {
+      io_uring_buf_ring_add(
+        uring_link->buf_ring,
+        uring_link->buffers + buffer * RELAY_URING_BUFFER_SIZE,
+        RELAY_URING_BUFFER_SIZE,
+        buffer,
+        io_uring_buf_ring_mask(RELAY_URING_BUFFERS),
+        (int) buffer
+      );
+    }
+    io_uring_buf_ring_advance(uring_link->buf_ring, RELAY_URING_BUFFERS);
+  }
+
+  return true;
+
+}
+
+/**
+ * Gets a submission entry, submitting those queued if the ring is full.
+ */
+static struct io_uring_sqe *
+get_sqe (Relay * relay, size_t index, unsigned int op) {
+
+  struct io_uring_sqe * sqe = io_uring_get_sqe(&relay->uring->ring);
+  if (!sqe) {
+    ++relay->syscalls;
+    io_uring_submit(&relay->uring->ring);
+    sqe = io_uring_get_sqe(&relay->uring->ring);
+  }
+  if (sqe) {
+    io_uring_sqe_set_data64(sqe, ((uint64_t) index << URING_OP_BITS) | op);
+  }
+  return sqe;
+
+}
+
+static void
+give_back_buffer (UringLink * uring_link, uint16_t buffer) {
+
+  io_uring_buf_ring_add(
+    uring_link->buf_ring,
+    uring_link->buffers + buffer * RELAY_URING_BUFFER_SIZE,
+    RELAY_URING_BUFFER_SIZE,
+    buffer,
+    io_uring_buf_ring_mask(RELAY_URING_BUFFERS),
+    0
+  );
+  io_uring_buf_ring_advance(uring_link->buf_ring, 1);
+
+}
+
+static bool
+arm_poll (Relay * relay, size_t index, int fd, unsigned int op, unsigned int events) {
+
+  struct io_uring_sqe * sqe = get_sqe(relay, index, op);
+  if (!sqe) {
+    return false;
+  }
+  io_uring_prep_poll_add(sqe, fd, events);
+  return true;
+
+}
+
+/**
+ * Arms whatever a link needs next: a read while it has free buffers,
+ * and a write of every queued buffer at once while none is in flight.
+ */
+static bool
+arm_link (Relay * relay, size_t index) {
+
+  RelayLink * link = &relay->links[index];
+  UringLink * uring_link = &relay->uring->links[index];
+  struct io_uring_sqe * sqe;
+
+  if (link->done) {
+    // the read may still be armed after the output failed
+    if (uring_link->reading) {
+      sqe = get_sqe(relay, index, URING_CANCEL);
+      if (!sqe) {
+        return false;
+      }
+      io_uring_prep_cancel64(sqe, ((uint64_t) index << URING_OP_BITS) | URING_READ, 0);
+      uring_link->reading = false;
+    }
+    return true;
+  }
+
+  if (
+    !uring_link->reading &&
+    !uring_link->polling_in &&
+    !link->eof &&
+    uring_link->queue_count < RELAY_URING_BUFFERS
+  ) {
+    sqe = get_sqe(relay, index, URING_READ);
+    if (!sqe) {
+      return false;
+    }
+    if (uring_link->multishot) {
+      io_uring_prep_read_multishot(sqe, link->in_fd, 0, -1, (int) index);
+    } else {
+      io_uring_prep_read(sqe, link->in_fd, NULL, RELAY_URING_BUFFER_SIZE, -1);
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = index;
+    }
+    uring_link->reading = true;
+  }
+
+  if (!uring_link->writing && !uring_link->polling_out && uring_link->queue_count) {
+    for (unsigned int i = 0; i < uring_link->queue_count; ++i) {
+      unsigned int position = (uring_link->queue_head + i) % RELAY_URING_BUFFERS;
+      size_t offset = i ? 0 : uring_link->queue_offset;
+      uring_link->iovecs[i].iov_base =
+        uring_link->buffers + uring_link->queue_ids[position] * RELAY_URING_BUFFER_SIZE + offset;
+      uring_link->iovecs[i].iov_len = uring_link->queue_lengths[position] - offset;
+    }
+    sqe = get_sqe(relay, index, URING_WRITE);
+    if (!sqe) {
+      return false;
+    }
+    io_uring_prep_writev(sqe, link->out_fd, uring_link->iovecs, uring_link->queue_count, -1);
+    uring_link->writing = true;
+  }
+
+  return true;
+
+}
+
+static void
+complete_read (Relay * relay, size_t index, const struct io_uring_cqe * cqe) {
+
+  RelayLink * link = &relay->links[index];
+  UringLink * uring_link = &relay->uring->links[index];
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    uring_link->reading = false;
+  }
+
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    unsigned int position = (uring_link->queue_head + uring_link->queue_count) % RELAY_URING_BUFFERS;
+    uring_link->queue_ids[position] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uring_link->queue_lengths[position] = cqe->res;
+    ++uring_link->queue_count;
+    count_read(link, cqe->res);
+    return;
+  }
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    give_back_buffer(uring_link, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+  }
+  if (link->done) {
+    return;
+  }
+
+  switch (cqe->res) {
+    case 0:
+      // a tty that was readable can still have nothing, unless it hung up
+      if (link->in_tty && !link->in_hung_up) {
+        uring_link->polling_in = arm_poll(relay, index, link->in_fd, URING_POLL_IN, POLLIN);
+      } else {
+        link->eof = true;
+      }
+      break;
+    // out of buffers, the read is armed again once some are written
+    case -ENOBUFS:
+    case -ECANCELED:
+    case -EINTR:
+      break;
+    case -EAGAIN:
+      uring_link->polling_in = arm_poll(relay, index, link->in_fd, URING_POLL_IN, POLLIN);
+      break;
+    // multishot reads need a kernel with them, and an input that can be polled
+    case -EINVAL:
+    case -EBADFD:
+      if (uring_link->multishot) {
+        uring_link->multishot = false;
+        break;
+      }
+      end_link(relay, link, -cqe->res);
+      break;
+    case -EIO:
+      // a tty whose other end has gone fails with EIO
+      if (link->in_tty) {
+        link->eof = true;
+        break;
+      }
+      end_link(relay, link, -cqe->res);
+      break;
+    default:
+      end_link(relay, link, -cqe->res);
+  }
+
+}
+
+static void
+complete_write (Relay * relay, size_t index, const struct io_uring_cqe * cqe) {
+
+  RelayLink * link = &relay->links[index];
+  UringLink * uring_link = &relay->uring->links[index];
+
+  uring_link->writing = false;
+
+  if (cqe->res > 0) {
+    size_t written = cqe->res;
+    link->counters.bytes += written;
+    ++link->counters.writes;
+    while (written) {
+      unsigned int position = uring_link->queue_head;
+      size_t left = uring_link->queue_lengths[position] - uring_link->queue_offset;
+      if (written < left) {
+        uring_link->queue_offset += written;
+        break;
+      }
+      written -= left;
+      give_back_buffer(uring_link, uring_link->queue_ids[position]);
+      uring_link->queue_head = (position + 1) % RELAY_URING_BUFFERS;
+      uring_link->queue_offset = 0;
+      --uring_link->queue_count;
+    }
+    return;
+  }
+
+  if (cqe->res == -EINTR) {
+    return;
+  }
+  if (cqe->res == -EAGAIN) {
+    uring_link->polling_out = arm_poll(relay, index, link->out_fd, URING_POLL_OUT, POLLOUT);
+    return;
+  }
+  // the output has gone, whatever is still pending is lost with it
+  end_link(relay, link, cqe->res ? -cqe->res : EIO);
+
+}
+
+static int
+run_uring (Relay * relay, FILE * progress) {
+
+  struct RelayUring * uring = relay->uring;
+
+  while (true) {
+
+    // the data is in the ring's buffers, pending only tells whether there is any
+    for (size_t i = 0; i < relay->links_count; ++i) {
+      relay->links[i].pending = uring->links[i].queue_count;
+    }
+    if (relay_over(relay)) {
+      return 1;
+    }
+
+    for (size_t i = 0; i < relay->links_count; ++i) {
+      if (!arm_link(relay, i)) {
+        errno = EBUSY;
+        return -1;
+      }
+    }
+    if (!uring->signal_polling) {
+      if (!arm_poll(relay, 0, relay->signal_fd, URING_SIGNAL, POLLIN)) {
+        errno = EBUSY;
+        return -1;
+      }
+      uring->signal_polling = true;
+    }
+    if (relay->metrics_fd != -1 && !uring->metrics_polling) {
+      if (!arm_poll(relay, 0, relay->metrics_fd, URING_METRICS, POLLIN)) {
+        errno = EBUSY;
+        return -1;
+      }
+      uring->metrics_polling = true;
+    }
+
+    // one system call submits everything armed and waits for the next completion
+    ++relay->syscalls;
+    int result = io_uring_submit_and_wait(&uring->ring, 1);
+    if (result < 0 && result != -EINTR) {
+      errno = -result;
+      return -1;
+    }
+
+    struct io_uring_cqe * cqe;
+    unsigned int head;
+    unsigned int seen = 0;
+    bool signalled = false;
+    io_uring_for_each_cqe(&uring->ring, head, cqe) {
+      ++seen;
+      uint64_t data = io_uring_cqe_get_data64(cqe);
+      size_t index = data >> URING_OP_BITS;
+      switch (data & ((1 << URING_OP_BITS) - 1)) {
+        case URING_READ:
+          complete_read(relay, index, cqe);
+          break;
+        case URING_WRITE:
+          complete_write(relay, index, cqe);
+          break;
+        case URING_POLL_IN:
+          uring->links[index].polling_in = false;
+          if (cqe->res > 0 && (cqe->res & (POLLHUP | POLLERR))) {
+            relay->links[index].in_hung_up = true;
+          }
+          break;
+        case URING_POLL_OUT:
+          uring->links[index].polling_out = false;
+          break;
+        case URING_SIGNAL:
+          uring->signal_polling = false;
+          signalled = true;
+          break;
+        case URING_METRICS:
+          uring->metrics_polling = false;
+          handle_metrics(relay);
+          break;
+      }
+    }
+    io_uring_cq_advance(&uring->ring, seen);
+
+    if (signalled) {
+      int status = handle_signals(relay, progress);
+      if (status != 1) {
+        return status;
+      }
+    }
+
+  }
+
+}
+
+#endif
+
+int
+relay_run (Relay * relay, FILE * progress) {
+
+  relay->started_ns = now_ns();
+
+#if defined(IO_URING)
+  if (
+    relay->backend == RELAY_BACKEND_IO_URING ||
+    (relay->backend == RELAY_BACKEND_AUTO && relay->links_count >= RELAY_URING_MIN_LINKS)
+  ) {
+    if (start_uring(relay)) {
+      relay->backend = RELAY_BACKEND_IO_URING;
+      return run_uring(relay, progress);
+    }
+  }
+#endif
+
+  relay->backend = RELAY_BACKEND_EPOLL;
+  if (!start_epoll(relay)) {
+    return -1;
+  }
+  return run_epoll(relay, progress);
+
+}
+
+static void
+print_rate (FILE * stream, double bytes_per_s) {
+
+  if (bytes_per_s >= 1e6) {
+    fprintf(stream, "%.2f MB/s", bytes_per_s / 1e6);
+  } else if (bytes_per_s >= 1e3) {
+    fprintf(stream, "%.2f kB/s", bytes_per_s / 1e3);
+  } else {
+    fprintf(stream, "%.0f B/s", bytes_per_s);
+  }
+
+}
+
+void
+relay_report (const Relay * relay, FILE * stream) {
+
+  double elapsed_s = relay->started_ns ? (now_ns() - relay->started_ns) / 1e9 : 0;
+  uint64_t total_bytes = 0;
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    const RelayLink * link = &relay->links[i];
+    const RelayCounters * counters = &link->counters;
+    total_bytes += counters->bytes;
+    fprintf(
+      stream,
+      "%s: %llu bytes, %llu reads, %llu writes",
+      link->name,
+      (unsigned long long) counters->bytes,
+      (unsigned long long) counters->reads,
+      (unsigned long long) counters->writes
+    );
+    if (counters->bytes) {
+      fprintf(
+        stream,
+        " (%.0f bytes per read, %.0f%% spliced)",
+        (double) counters->bytes / counters->reads,
+        100.0 * counters->spliced_bytes / counters->bytes
+      );
+    }
+    fprintf(stream, ", %.3f s, ", elapsed_s);
+    print_rate(stream, elapsed_s > 0 ? counters->bytes / elapsed_s : 0);
+    if (link->error) {
+      errno = link->error;
+      fprintf(stream, ", failed: %m");
+    }
+    fprintf(stream, "\n");
+  }
+  fprintf(
+    stream,
+    "relay (%s): %llu system calls",
+    relay_backend_name(relay->backend),
+    (unsigned long long) relay->syscalls
+  );
+  if (relay->syscalls) {
+    fprintf(stream, " (%.1f bytes each)", (double) total_bytes / relay->syscalls);
+  }
+  fprintf(stream, "\n");
+
+}
+
+bool
+relay_export_metrics (Relay * relay, const char * path, int interval_ms) {
+
+  if (interval_ms <= 0) {
+    errno = EINVAL;
+    return false;
+  }
+  if (relay->metrics_fd == -1) {
+    relay->metrics_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (relay->metrics_fd == -1) {
+      return false;
+    }
+  }
+  struct timespec interval = { interval_ms / 1000, (long) (interval_ms % 1000) * 1000000 };
+  struct itimerspec timer = { .it_interval = interval, .it_value = interval };
+  if (timerfd_settime(relay->metrics_fd, 0, &timer, NULL) == -1) {
+    return false;
+  }
+  relay->metrics_path = path;
+  // a path that cannot be written is found out now rather than while relaying
+  return relay_write_metrics(relay, path);
+
+}
+
+bool
+relay_tty_health (int fd, RelayTtyHealth * health) {
+
+  health->input_queue = -1;
+  health->output_queue = -1;
+  if (!isatty(fd)) {
+    return false;
+  }
+
+  // ptys and most USB adapters count nothing
+  struct serial_icounter_struct icount;
+  if (ioctl(fd, TIOCGICOUNT, &icount) == 0) {
+    // the driver's counters are int and wrap, the difference between samples does not as uint32_t
+    uint32_t sample[RELAY_TTY_COUNTERS] = {
+      (uint32_t) icount.rx,
+      (uint32_t) icount.tx,
+      (uint32_t) icount.frame,
+      (uint32_t) icount.parity,
+      (uint32_t) icount.overrun,
+      (uint32_t) icount.buf_overrun,
+      (uint32_t) icount.brk
+    };
+    uint64_t * totals[RELAY_TTY_COUNTERS] = {
+      &health->rx,
+      &health->tx,
+      &health->frame_errors,
+      &health->parity_errors,
+      &health->overruns,
+      &health->buffer_overruns,
+      &health->breaks
+    };
+    for (size_t i = 0; i < RELAY_TTY_COUNTERS; ++i) {
+      *totals[i] += health->counted ? (uint32_t) (sample[i] - health->sampled[i]) : sample[i];
+      health->sampled[i] = sample[i];
+    }
+    health->counted = true;
+  }
+
+  int queue;
+  if (ioctl(fd, TIOCINQ, &queue) == 0) {
+    health->input_queue = queue;
+  }
+  if (ioctl(fd, TIOCOUTQ, &queue) == 0) {
+    health->output_queue = queue;
+  }
+  return true;
+
+}
+
+/**
+ * Writes a label value, escaped as the text format requires.
+ */
+static void
+print_label (FILE * stream, const char * value) {
+
+  for (; *value; ++value) {
+    switch (*value) {
+      case '\\':
+        fputs("\\\\", stream);
+        break;
+      case '"':
+        fputs("\\\"", stream);
+        break;
+      case '\n':
+        fputs("\\n", stream);
+        break;
+      default:
+        fputc(*value, stream);
+    }
+  }
+
+}
+
+typedef struct RelayMetric {
+  const char * name;
+  const char * help;
+  // of the uint64_t in RelayCounters or RelayTtyHealth
+  size_t offset;
+} RelayMetric;
+
+static const RelayMetric link_metrics[] = {
+  { "privelev_relay_bytes_total", "Bytes relayed.", offsetof(RelayCounters, bytes) },
+  { "privelev_relay_reads_total", "System calls that read data.", offsetof(RelayCounters, reads) },
+  { "privelev_relay_writes_total", "System calls that wrote data.", offsetof(RelayCounters, writes) },
+  { "privelev_relay_spliced_bytes_total", "Bytes relayed without passing through user space.", offsetof(RelayCounters, spliced_bytes) },
+};
+
+static const RelayMetric tty_metrics[] = {
+  { "privelev_serial_rx_bytes_total", "Bytes the port's driver received.", offsetof(RelayTtyHealth, rx) },
+  { "privelev_serial_tx_bytes_total", "Bytes the port's driver sent.", offsetof(RelayTtyHealth, tx) },
+  { "privelev_serial_frame_errors_total", "Bytes received with a framing error.", offsetof(RelayTtyHealth, frame_errors) },
+  { "privelev_serial_parity_errors_total", "Bytes received with a parity error.", offsetof(RelayTtyHealth, parity_errors) },
+  { "privelev_serial_overruns_total", "Bytes lost because the UART was not read in time.", offsetof(RelayTtyHealth, overruns) },
+  { "privelev_serial_buffer_overruns_total", "Bytes lost because the tty's buffer was full.", offsetof(RelayTtyHealth, buffer_overruns) },
+  { "privelev_serial_breaks_total", "Breaks received.", offsetof(RelayTtyHealth, breaks) },
+};
+
+static void
+print_header (FILE * stream, const char * name, const char * type, const char * help) {
+
+  fprintf(stream, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+
+}
+
+/**
+ * Writes a sample of the link, extra_labels goes after its label.
+ */
+static void
+print_sample (FILE * stream, const char * name, const RelayLink * link, const char * extra_labels, uint64_t value) {
+
+  fprintf(stream, "%s{link=\"", name);
+  print_label(stream, link->name);
+  fprintf(stream, "\"%s} %llu\n", extra_labels, (unsigned long long) value);
+
+}
+
+static uint64_t
+metric_value (const void * values, const RelayMetric * metric) {
+
+  return *(const uint64_t *) ((const char *) values + metric->offset);
+
+}
+
+void
+relay_metrics (Relay * relay, FILE * stream) {
+
+  for (size_t m = 0; m < sizeof(link_metrics) / sizeof(link_metrics[0]); ++m) {
+    print_header(stream, link_metrics[m].name, "counter", link_metrics[m].help);
+    for (size_t i = 0; i < relay->links_count; ++i) {
+      const RelayLink * link = &relay->links[i];
+      print_sample(stream, link_metrics[m].name, link, "", metric_value(&link->counters, &link_metrics[m]));
+    }
+  }
+
+  print_header(
+    stream,
+    "privelev_relay_read_size_bytes",
+    "histogram",
+    "Bytes taken in by each read, many small reads of a fast port mean the relay is starved of CPU."
+  );
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    const RelayLink * link = &relay->links[i];
+    char bucket_label[32];
+    uint64_t cumulative = 0;
+    for (size_t bucket = 0; bucket < RELAY_READ_SIZE_BUCKETS; ++bucket) {
+      cumulative += link->counters.read_sizes[bucket];
+      snprintf(bucket_label, sizeof(bucket_label), ",le=\"%llu\"", 1ULL << bucket);
+      print_sample(stream, "privelev_relay_read_size_bytes_bucket", link, bucket_label, cumulative);
+    }
+    print_sample(stream, "privelev_relay_read_size_bytes_bucket", link, ",le=\"+Inf\"", link->counters.reads);
+    print_sample(stream, "privelev_relay_read_size_bytes_sum", link, "", link->counters.read_bytes);
+    print_sample(stream, "privelev_relay_read_size_bytes_count", link, "", link->counters.reads);
+  }
+
+  // a port is sampled through the link reading it, links from elsewhere have no health
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    if (relay->links[i].in_tty) {
+      relay_tty_health(relay->links[i].in_fd, &relay->links[i].tty_health);
+    }
+  }
+  for (size_t m = 0; m < sizeof(tty_metrics) / sizeof(tty_metrics[0]); ++m) {
+    print_header(stream, tty_metrics[m].name, "counter", tty_metrics[m].help);
+    for (size_t i = 0; i < relay->links_count; ++i) {
+      if (!relay->links[i].tty_health.counted) continue;
+      print_sample(stream, tty_metrics[m].name, &relay->links[i], "", metric_value(&relay->links[i].tty_health, &tty_metrics[m]));
+    }
+  }
+  print_header(stream, "privelev_serial_input_queue_bytes", "gauge", "Bytes received but not yet read.");
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    if (relay->links[i].tty_health.input_queue < 0) continue;
+    print_sample(stream, "privelev_serial_input_queue_bytes", &relay->links[i], "", relay->links[i].tty_health.input_queue);
+  }
+  print_header(stream, "privelev_serial_output_queue_bytes", "gauge", "Bytes written but not yet sent.");
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    if (relay->links[i].tty_health.output_queue < 0) continue;
+    print_sample(stream, "privelev_serial_output_queue_bytes", &relay->links[i], "", relay->links[i].tty_health.output_queue);
+  }
+
+  print_header(stream, "privelev_relay_syscalls_total", "counter", "System calls made while relaying.");
+  fprintf(
+    stream,
+    "privelev_relay_syscalls_total{backend=\"%s\"} %llu\n",
+    relay_backend_name(relay->backend),
+    (unsigned long long) relay->syscalls
+  );
+
+}
+
+bool
+relay_write_metrics (Relay * relay, const char * path) {
+
+  // written next to the path and renamed over it, so a reader gets either the old or the new metrics
+  char temporary_path[PATH_MAX];
+  if (snprintf(temporary_path, sizeof(temporary_path), "%s.XXXXXX", path) >= (int) sizeof(temporary_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  int fd = mkostemp(temporary_path, O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  FILE * stream = fdopen(fd, "w");
+  if (!stream) {
+    int error = errno;
+    close(fd);
+    unlink(temporary_path);
+    errno = error;
+    return false;
+  }
+
+  relay_metrics(relay, stream);
+
+  // mkostemp only lets us read it, the node exporter reads it as another user
+  bool written = !ferror(stream) && fchmod(fd, 0644) == 0;
+  int error = errno;
+  if (fclose(stream) != 0 && written) {
+    written = false;
+    error = errno;
+  }
+  if (written && rename(temporary_path, path) == 0) {
+    return true;
+  }
+  if (written) {
+    error = errno;
+  }
+  unlink(temporary_path);
+  errno = error;
+  return false;
+
+}
+
+void
+relay_destroy (Relay * relay) {
+
+#if defined(IO_URING)
+  if (relay->uring) {
+    free_uring(relay);
+  }
+#endif
+
+  for (size_t i = 0; i < relay->links_count; ++i) {
+    if (relay->links[i].pipe_fds[0] != -1) {
+      close(relay->links[i].pipe_fds[0]);
+      close(relay->links[i].pipe_fds[1]);
+    }
+    free(relay->links[i].buffer);
+  }
+  free(relay->links);
+  relay->links = NULL;
+  relay->links_count = 0;
+  relay->links_capacity = 0;
+
+  if (relay->signal_fd != -1) {
+    close(relay->signal_fd);
+    relay->signal_fd = -1;
+  }
+  if (relay->metrics_fd != -1) {
+    close(relay->metrics_fd);
+    relay->metrics_fd = -1;
+  }
+  if (relay->epoll_fd != -1) {
+    close(relay->epoll_fd);
+    relay->epoll_fd = -1;
+  }
+
+  // a SIGPIPE raised after the last read of the signalfd would kill us once unblocked
+  sigset_t pipe_mask;
+  sigemptyset(&pipe_mask);
+  sigaddset(&pipe_mask, SIGPIPE);
+  while (sigtimedwait(&pipe_mask, NULL, &(struct timespec) { 0, 0 }) == SIGPIPE);
+
+  pthread_sigmask(SIG_SETMASK, &relay->signal_orig_mask, NULL);
+
+}
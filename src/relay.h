@@ -0,0 +1,187 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <signal.h>
+
+typedef enum {
+  // io_uring for many links where it is built in and available, epoll otherwise
+  RELAY_BACKEND_AUTO = 0,
+  // splices where it can, with a system call per transfer
+  RELAY_BACKEND_EPOLL,
+  // reads and writes through one ring, with a system call per wakeup for every link
+  RELAY_BACKEND_IO_URING
+} RelayBackend;
+
+// read sizes are counted in buckets of up to powers of 2 bytes, up to the most read at once
+#define RELAY_READ_SIZE_BUCKETS 17
+
+typedef struct RelayCounters {
+  uint64_t bytes;
+  // system calls that moved data, so bytes / reads is the batch size
+  uint64_t reads;
+  uint64_t writes;
+  // bytes that never passed through user space
+  uint64_t spliced_bytes;
+  uint64_t read_bytes;
+  // reads of up to 1, 2, 4 and so on bytes, a port mostly read a byte at a time is starved of CPU
+  uint64_t read_sizes[RELAY_READ_SIZE_BUCKETS];
+} RelayCounters;
+
+// the driver counts received and sent bytes, framing and parity errors, overruns, buffer overruns and breaks
+#define RELAY_TTY_COUNTERS 7
+
+/**
+ * The state of a tty input, as its driver counts it.
+ */
+typedef struct RelayTtyHealth {
+  // the driver's counters, where it keeps them (TIOCGICOUNT), totalled across their 32 bit wraps
+  bool counted;
+  uint64_t rx;
+  uint64_t tx;
+  uint64_t frame_errors;
+  uint64_t parity_errors;
+  // bytes the UART received faster than they were taken from it
+  uint64_t overruns;
+  // bytes lost because the tty's buffer was full
+  uint64_t buffer_overruns;
+  uint64_t breaks;
+  // received but not yet read, and written but not yet sent, -1 where unknown
+  int input_queue;
+  int output_queue;
+  // the driver's counters at the last sample, in the order above
+  uint32_t sampled[RELAY_TTY_COUNTERS];
+} RelayTtyHealth;
+
+/**
+ * One direction of a relay, from its input to its output.
+ * Data is spliced through a pipe where both ends support it,
+ * otherwise it is read into a buffer and written out from there.
+ * Nothing more is read until everything read before has been written,
+ * so a slow output holds back its input instead of filling memory.
+ */
+typedef struct RelayLink {
+  const char * name;
+  int in_fd;
+  int out_fd;
+  // the relay ends with this link
+  bool ends_relay;
+  // a tty reads nothing without that being the end, which is a hangup instead
+  bool in_tty;
+  // the most written at once, so a blocking output that is writable takes all of it
+  size_t out_chunk;
+  bool splicing;
+  int pipe_fds[2];
+  char * buffer;
+  size_t buffer_offset;
+  // read but not yet written, in the pipe or the buffer
+  size_t pending;
+  bool pending_in_pipe;
+  // the following are only used by the epoll backend
+  // epoll cannot watch regular files and the like, which are always ready
+  bool in_polled;
+  bool out_polled;
+  uint32_t in_events;
+  uint32_t out_events;
+  bool in_ready;
+  bool out_ready;
+  bool in_hung_up;
+  bool eof;
+  bool done;
+  // errno of the failure that ended the link, 0 if it ended normally
+  int error;
+  RelayCounters counters;
+  // sampled with the metrics, only for a tty input
+  RelayTtyHealth tty_health;
+} RelayLink;
+
+struct RelayUring;
+
+/**
+ * Relays between file descriptors with one epoll instance or io_uring.
+ * SIGINT and SIGTERM stop the relay, and SIGUSR1 reports its counters,
+ * through a signalfd while relaying. SIGPIPE is consumed the same way,
+ * so a closed output ends its link instead of the process.
+ */
+typedef struct Relay {
+  // the backend asked for, and once running the one in use
+  RelayBackend backend;
+  int epoll_fd;
+  struct RelayUring * uring;
+  int signal_fd;
+  sigset_t signal_orig_mask;
+  // writes the metrics to metrics_path each time it expires, -1 without
+  int metrics_fd;
+  const char * metrics_path;
+  RelayLink * links;
+  size_t links_count;
+  size_t links_capacity;
+  int64_t started_ns;
+  // system calls made while relaying, including those waiting for the links
+  uint64_t syscalls;
+  // the signal that stopped the relay, 0 if it has not been stopped
+  int stop_signal;
+} Relay;
+
+/**
+ * Asking for io_uring falls back to epoll where it is not built in or not available.
+ */
+bool relay_init (Relay * relay, RelayBackend backend);
+
+/**
+ * Adds a link from in_fd to out_fd, which must stay open while relaying.
+ * A file descriptor may only be in one link, use a duplicate to relay both ways.
+ * Returns false with errno set on failure.
+ */
+bool relay_add (Relay * relay, const char * name, int in_fd, int out_fd, bool ends_relay);
+
+/**
+ * Relays until a link that ends the relay, or every link, is done.
+ * Progress is reported to the stream on SIGUSR1.
+ * Returns 1 once done, 0 if stopped by a signal, or -1 with errno set.
+ */
+int relay_run (Relay * relay, FILE * progress);
+
+/**
+ * Writes a line with the counters of each link, and one with the system calls made.
+ */
+void relay_report (const Relay * relay, FILE * stream);
+
+/**
+ * Writes the metrics to the path every interval while relaying, as well as on SIGUSR1,
+ * for the Prometheus node exporter's textfile collector or anything else reading them.
+ * The file is replaced as a whole, so readers never see part of it.
+ * Returns false with errno set on failure.
+ */
+bool relay_export_metrics (Relay * relay, const char * path, int interval_ms);
+
+/**
+ * Samples what the driver knows about a tty input, adding what it counted
+ * since the last sample in the health to its totals. A zeroed health takes
+ * the driver's counters as they are. Samples must be less than 2^32 counts
+ * apart, which at 20 Mbaud is over half an hour.
+ * Returns false with errno set if it is not a tty.
+ */
+bool relay_tty_health (int fd, RelayTtyHealth * health);
+
+/**
+ * Writes the counters of each link, and the health of those from a tty,
+ * in the Prometheus text format.
+ */
+void relay_metrics (Relay * relay, FILE * stream);
+
+/**
+ * Replaces the file at the path with the metrics.
+ * Returns false with errno set on failure.
+ */
+bool relay_write_metrics (Relay * relay, const char * path);
+
+/**
+ * Restores the signal mask, a stopping signal is left for the caller to raise.
+ */
+void relay_destroy (Relay * relay);
+
+const char * relay_backend_name (RelayBackend backend);
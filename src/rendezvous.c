@@ -0,0 +1,51 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "rendezvous.h"
+
+socklen_t
+rendezvous_sockaddr (const char * address, struct sockaddr_un * sock_addr) {
+
+  memset(sock_addr, 0, sizeof(*sock_addr));
+  sock_addr->sun_family = AF_UNIX;
+
+  if (address[0] != RENDEZVOUS_ABSTRACT_PREFIX) {
+    snprintf(sock_addr->sun_path, UNIX_PATH_MAX, "%s", address);
+    return sizeof(*sock_addr);
+  }
+
+  // abstract names start with a null byte and are not null terminated
+  // so the length must cover the name exactly on both sides
+  snprintf(sock_addr->sun_path + 1, UNIX_PATH_MAX - 1, "%s", address + 1);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sock_addr->sun_path + 1);
+
+}
+
+int
+rendezvous_inherited_fd (const char * address) {
+
+  size_t prefix_size = sizeof(RENDEZVOUS_FD_PREFIX) - 1;
+  if (strncmp(address, RENDEZVOUS_FD_PREFIX, prefix_size) != 0) {
+    return -1;
+  }
+
+  const char * number = address + prefix_size;
+  if (!isdigit((unsigned char) *number)) {
+    return -1;
+  }
+
+  char * end;
+  long fd = strtol(number, &end, 10);
+  if (*end != '\0' || fd > INT_MAX) {
+    return -1;
+  }
+
+  return (int) fd;
+
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <linux/un.h>
+
+// prefix of a rendezvous address naming a socket inherited by the mechanism
+#define RENDEZVOUS_FD_PREFIX "fd:"
+// prefix of a rendezvous address naming a linux abstract namespace socket
+#define RENDEZVOUS_ABSTRACT_PREFIX '@'
+
+/**
+ * Fills a unix socket address from a rendezvous address.
+ * `@<name>` refers to the abstract namespace, anything else is a path.
+ * Returns the address length to be used with bind or connect.
+ */
+socklen_t rendezvous_sockaddr (const char * address, struct sockaddr_un * sock_addr);
+
+/**
+ * Parses `fd:<n>` rendezvous addresses.
+ * Returns the inherited file descriptor, or -1 if the address is not one.
+ */
+int rendezvous_inherited_fd (const char * address);
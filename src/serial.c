@@ -0,0 +1,732 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/serial.h>
+
+#include "baudrates.h"
+#include "probes.h"
+#include "serial.h"
+
+#if defined(TCGETS2)
+// <asm/termbits.h> clashes with <termios.h>, so this is struct termios2 as the kernel has it
+struct termios2 {
+  tcflag_t c_iflag;
+  tcflag_t c_oflag;
+  tcflag_t c_cflag;
+  tcflag_t c_lflag;
+  cc_t c_line;
+  cc_t c_cc[19];
+  speed_t c_ispeed;
+  speed_t c_ospeed;
+};
+#if !defined(BOTHER)
+#define BOTHER CBAUDEX
+#endif
+#if !defined(IBSHIFT)
+#define IBSHIFT 16
+#endif
+#endif
+
+bool
+baud_speed (unsigned int rate, speed_t * speed) {
+
+  size_t low = 0;
+  size_t high = BAUD_RATES_COUNT;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (baud_rates[middle].rate == rate) {
+      *speed = baud_rates[middle].speed;
+      return true;
+    }
+    if (baud_rates[middle].rate < rate) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return false;
+
+}
+
+unsigned int
+baud_rate (speed_t speed) {
+
+  for (size_t i = 0; i < BAUD_RATES_COUNT; ++i) {
+    if (baud_rates[i].speed == speed) {
+      return baud_rates[i].rate;
+    }
+  }
+  return 0;
+
+}
+
+bool
+baud_supported (unsigned int rate) {
+
+  speed_t speed;
+  if (baud_speed(rate, &speed)) {
+    return true;
+  }
+#if defined(TCGETS2)
+  return rate >= SERIAL_CUSTOM_BAUD_MIN && rate <= SERIAL_CUSTOM_BAUD_MAX;
+#else
+  return false;
+#endif
+
+}
+
+unsigned int
+nearest_baud (unsigned int rate) {
+
+  if (baud_supported(rate)) {
+    return rate;
+  }
+#if defined(TCGETS2)
+  return MIN(MAX(rate, SERIAL_CUSTOM_BAUD_MIN), SERIAL_CUSTOM_BAUD_MAX);
+#else
+  unsigned int nearest = baud_rates[0].rate;
+  for (size_t i = 1; i < BAUD_RATES_COUNT; ++i) {
+    unsigned int distance = (baud_rates[i].rate > rate) ? baud_rates[i].rate - rate : rate - baud_rates[i].rate;
+    unsigned int nearest_distance = (nearest > rate) ? nearest - rate : rate - nearest;
+    if (distance < nearest_distance) nearest = baud_rates[i].rate;
+  }
+  return nearest;
+#endif
+
+}
+
+bool
+serial_line_valid (const SerialLine * line) {
+
+  return (
+    line->data_bits >= 5 && line->data_bits <= 8 &&
+    (line->parity == SERIAL_PARITY_NONE || line->parity == SERIAL_PARITY_ODD || line->parity == SERIAL_PARITY_EVEN) &&
+    (line->stop_bits == 1 || line->stop_bits == 2) &&
+    line->rs485_delay_before_ms <= SERIAL_RS485_DELAY_MAX_MS &&
+    line->rs485_delay_after_ms <= SERIAL_RS485_DELAY_MAX_MS &&
+    // without RS-485 there is nothing to delay
+    (line->rs485 || (line->rs485_delay_before_ms == 0 && line->rs485_delay_after_ms == 0))
+  );
+
+}
+
+bool
+serial_line_equal (const SerialLine * line, const SerialLine * other_line) {
+
+  return (
+    line->data_bits == other_line->data_bits &&
+    line->parity == other_line->parity &&
+    line->stop_bits == other_line->stop_bits &&
+    line->rts_cts == other_line->rts_cts &&
+    line->xon_xoff == other_line->xon_xoff &&
+    line->rs485 == other_line->rs485 &&
+    line->low_latency == other_line->low_latency &&
+    line->rs485_delay_before_ms == other_line->rs485_delay_before_ms &&
+    line->rs485_delay_after_ms == other_line->rs485_delay_after_ms
+  );
+
+}
+
+static const char parity_names[] = { 'N', 'O', 'E' };
+
+void
+serial_settings_format (unsigned int baud, const SerialLine * line, char * settings, size_t settings_size) {
+
+  int length = snprintf(settings, settings_size, "%u", baud);
+  if (serial_line_equal(line, &SERIAL_LINE_DEFAULT) || length < 0 || (size_t) length >= settings_size) {
+    return;
+  }
+
+  length += snprintf(
+    settings + length,
+    settings_size - length,
+    ":%u%c%u%s%s%s",
+    line->data_bits,
+    (line->parity <= SERIAL_PARITY_EVEN) ? parity_names[line->parity] : '?',
+    line->stop_bits,
+    line->rts_cts ? ",rtscts" : "",
+    line->xon_xoff ? ",xonxoff" : "",
+    line->low_latency ? ",lowlatency" : ""
+  );
+  if (line->rs485 && (size_t) length < settings_size) {
+    snprintf(
+      settings + length,
+      settings_size - length,
+      ",rs485=%u/%u",
+      line->rs485_delay_before_ms,
+      line->rs485_delay_after_ms
+    );
+  }
+
+}
+
+/**
+ * Parses a decimal number up to the next character that is not a digit.
+ */
+static bool
+parse_number (const char * * text, unsigned long * number) {
+
+  if (**text < '0' || **text > '9') return false;
+  char * end;
+  errno = 0;
+  *number = strtoul(*text, &end, 10);
+  if (errno == ERANGE) *number = ULONG_MAX;
+  *text = end;
+  return true;
+
+}
+
+bool
+serial_settings_parse (const char * settings, unsigned int * baud, SerialLine * line) {
+
+  const char * text = settings;
+  unsigned long number;
+  if (!parse_number(&text, &number)) return false;
+  *baud = (number <= UINT_MAX) ? (unsigned int) number : 0;
+  *line = SERIAL_LINE_DEFAULT;
+  if (*text == '\0') return true;
+  if (*text++ != ':') return false;
+
+  // out of range numbers are kept out of range, so validating rejects them
+  if (!parse_number(&text, &number)) return false;
+  line->data_bits = MIN(number, UINT_MAX);
+  const char * parity = memchr(parity_names, *text, sizeof(parity_names));
+  if (!parity) return false;
+  line->parity = (SerialParity) (parity - parity_names);
+  ++text;
+  if (!parse_number(&text, &number)) return false;
+  line->stop_bits = MIN(number, UINT_MAX);
+
+  while (*text == ',') {
+    ++text;
+    if (!strncmp(text, "rtscts", 6)) {
+      line->rts_cts = true;
+      text += 6;
+    } else if (!strncmp(text, "xonxoff", 7)) {
+      line->xon_xoff = true;
+      text += 7;
+    } else if (!strncmp(text, "lowlatency", 10)) {
+      line->low_latency = true;
+      text += 10;
+    } else if (!strncmp(text, "rs485=", 6)) {
+      line->rs485 = true;
+      text += 6;
+      if (!parse_number(&text, &number)) return false;
+      line->rs485_delay_before_ms = MIN(number, UINT_MAX);
+      if (*text++ != '/') return false;
+      if (!parse_number(&text, &number)) return false;
+      line->rs485_delay_after_ms = MIN(number, UINT_MAX);
+    } else {
+      return false;
+    }
+  }
+
+  return *text == '\0';
+
+}
+
+// RS-485 as it was before set_rs485 changed it, so a later failure can put it back
+typedef struct SerialRs485State {
+  bool changed;
+#if defined(TIOCSRS485)
+  struct serial_rs485 rs485;
+#endif
+} SerialRs485State;
+
+/**
+ * Sets RS-485 as the line has it, disabling it where it is enabled but not wanted,
+ * and keeps what it replaced in previous.
+ * Devices without RS-485 fail with ENOTTY if it is wanted.
+ * Returns 1 on success, or -1 with errno set on failure.
+ */
+static int
+set_rs485 (int fd, const SerialLine * line, SerialRs485State * previous) {
+
+  previous->changed = false;
+
+#if defined(TIOCSRS485)
+  struct serial_rs485 rs485;
+  if (ioctl(fd, TIOCGRS485, &rs485) != 0) {
+    // a device without RS-485 only fails if it is wanted
+    return line->rs485 ? -1 : 1;
+  }
+  if (!line->rs485 && !(rs485.flags & SER_RS485_ENABLED)) {
+    return 1;
+  }
+  previous->rs485 = rs485;
+
+  memset(&rs485, 0, sizeof(rs485));
+  if (line->rs485) {
+    // RTS drives the transmitter while sending, and releases the bus after it
+    rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+    rs485.delay_rts_before_send = line->rs485_delay_before_ms;
+    rs485.delay_rts_after_send = line->rs485_delay_after_ms;
+  }
+  if (ioctl(fd, TIOCSRS485, &rs485) != 0) {
+    return -1;
+  }
+  previous->changed = true;
+  return 1;
+#else
+  if (line->rs485) {
+    errno = ENOTTY;
+    return -1;
+  }
+  return 1;
+#endif
+
+}
+
+/**
+ * Puts back the RS-485 settings set_rs485 replaced, keeping errno.
+ */
+static void
+restore_rs485 (int fd, const SerialRs485State * previous) {
+
+#if defined(TIOCSRS485)
+  if (previous->changed) {
+    int error = errno;
+    ioctl(fd, TIOCSRS485, &previous->rs485);
+    errno = error;
+  }
+#else
+  (void) fd;
+  (void) previous;
+#endif
+
+}
+
+/**
+ * Has the driver pass on received bytes as soon as it can, where it has a way to,
+ * or go back to its usual latency where that is not wanted, as set_rs485 does for RS-485.
+ * Drivers without one keep their latency, which is not worth failing the open for.
+ */
+static void
+set_low_latency (int fd, const SerialLine * line) {
+
+#if defined(TIOCSSERIAL)
+  // USB serial drivers that have a latency timer also set it to 1 ms for this
+  struct serial_struct serial_info;
+  if (ioctl(fd, TIOCGSERIAL, &serial_info) == 0 && !(serial_info.flags & ASYNC_LOW_LATENCY) == line->low_latency) {
+    serial_info.flags ^= ASYNC_LOW_LATENCY;
+    ioctl(fd, TIOCSSERIAL, &serial_info);
+  }
+#endif
+
+  // a timer lowered by sysfs is left alone, its earlier value is not known
+  if (!line->low_latency) return;
+
+  // FTDI adapters otherwise hold small reads for up to 16 ms, only root may shorten that
+  struct stat device_stat;
+  if (fstat(fd, &device_stat) != 0) return;
+  char sysfs_path[SERIAL_SYSFS_PATH_MAX];
+  serial_sysfs_path(major(device_stat.st_rdev), minor(device_stat.st_rdev), sysfs_path, sizeof(sysfs_path));
+  if (serial_latency_timer(sysfs_path) <= 1) return;
+  char timer_path[SERIAL_SYSFS_PATH_MAX + 32];
+  snprintf(timer_path, sizeof(timer_path), "%s/device/latency_timer", sysfs_path);
+  int timer_fd = open(timer_path, O_WRONLY | O_CLOEXEC);
+  if (timer_fd == -1) return;
+  // a refusal leaves the timer where it was, which the caller reads back
+  (void) write(timer_fd, "1", 1);
+  close(timer_fd);
+
+}
+
+/**
+ * Sets the attributes as tcsetattr does with the action,
+ * and, for custom rates, as the termios2 request for it does.
+ */
+static int
+apply_tty_attribs (int fd, unsigned int baud, const SerialLine * line, int action) {
+
+  speed_t speed;
+  bool standard = baud_speed(baud, &speed);
+  if ((!standard && !baud_supported(baud)) || !serial_line_valid(line)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // get the current attributes
+  struct termios tty_attribs;
+  if (tcgetattr(fd, &tty_attribs) < 0) {
+    return 0;
+  }
+
+  // a device that cannot do RS-485 fails here, before anything else changes,
+  // and it is put back if anything after it fails, so a failed reconfigure leaves the port as it was
+  SerialRs485State previous_rs485;
+  if (set_rs485(fd, line, &previous_rs485) != 1) {
+    return -1;
+  }
+
+  // only set what we want to change for the current attributes
+
+  // set input and output baud rate, other rates are set through termios2 below
+  if (standard) {
+    cfsetospeed(&tty_attribs, speed);
+    cfsetispeed(&tty_attribs, speed);
+  }
+
+  // helper for setting up for non-canonical mode settings
+  // this basically means input, line and output processing are all disabled
+  // canonical mode is designed for actual terminals, not dumb serial transports
+  cfmakeraw(&tty_attribs);
+
+  // ignore modem controls and enable receiver
+  tty_attribs.c_cflag |= (CLOCAL | CREAD);
+
+  // framing
+  static const tcflag_t data_bits_flags[] = { CS5, CS6, CS7, CS8 };
+  tcflag_t framing = data_bits_flags[line->data_bits - 5];
+  if (line->parity != SERIAL_PARITY_NONE) {
+    framing |= PARENB | ((line->parity == SERIAL_PARITY_ODD) ? PARODD : 0);
+  }
+  if (line->stop_bits == 2) {
+    framing |= CSTOPB;
+  }
+  if (line->rts_cts) {
+    framing |= CRTSCTS;
+  }
+  tty_attribs.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+  tty_attribs.c_cflag |= framing;
+
+  // bytes failing the parity check are dropped, rather than passed on as NULs
+  tty_attribs.c_iflag &= ~(INPCK | IGNPAR | IXON | IXOFF | IXANY);
+  if (line->parity != SERIAL_PARITY_NONE) {
+    tty_attribs.c_iflag |= INPCK | IGNPAR;
+  }
+  if (line->xon_xoff) {
+    tty_attribs.c_iflag |= IXON | IXOFF;
+    tty_attribs.c_cc[VSTART] = 0x11;
+    tty_attribs.c_cc[VSTOP] = 0x13;
+  }
+
+  if (line->low_latency) {
+    // blocking reads wait for the first byte and return it straight away,
+    // instead of returning nothing so readers have to spin, poll wakes on it either way
+    tty_attribs.c_cc[VMIN] = 1;
+    tty_attribs.c_cc[VTIME] = 0;
+  } else {
+    // here we setup the non-blocking non-canonical mode
+    // this means O_NONBLOCK must not be set on the file descriptor
+    tty_attribs.c_cc[VMIN] = 0;
+    tty_attribs.c_cc[VTIME] = 0;
+  }
+
+  // set the modified attributes, with the rate in the same call
+  if (standard) {
+    if (tcsetattr(fd, action, &tty_attribs) != 0) {
+      goto restore;
+    }
+  } else {
+#if defined(TCGETS2)
+    // BOTHER has the driver use the rates as given, for input as well as output
+    // drivers round them to what their clock can divide down to
+    struct termios2 tty_attribs2 = {
+      .c_iflag = tty_attribs.c_iflag,
+      .c_oflag = tty_attribs.c_oflag,
+      .c_cflag = tty_attribs.c_cflag,
+      .c_lflag = tty_attribs.c_lflag,
+      .c_line = tty_attribs.c_line,
+      .c_ispeed = baud,
+      .c_ospeed = baud
+    };
+    // the control characters are at the same positions, there are only fewer of them
+    memcpy(tty_attribs2.c_cc, tty_attribs.c_cc, sizeof(tty_attribs2.c_cc));
+    tty_attribs2.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tty_attribs2.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    unsigned long request = (action == TCSAFLUSH) ? TCSETSF2 : (action == TCSADRAIN) ? TCSETSW2 : TCSETS2;
+    if (ioctl(fd, request, &tty_attribs2) != 0) {
+      goto restore;
+    }
+    // the driver reports the rate it rounded to, too far off and the peer cannot frame it
+    if (ioctl(fd, TCGETS2, &tty_attribs2) != 0) {
+      goto restore;
+    }
+    unsigned int applied = tty_attribs2.c_ospeed;
+    unsigned int deviation = (applied > baud) ? applied - baud : baud - applied;
+    if ((uint64_t) deviation * 1000 > (uint64_t) baud * SERIAL_CUSTOM_BAUD_TOLERANCE) {
+      errno = EINVAL;
+      goto restore;
+    }
+#endif
+  }
+
+  // drivers quietly keep what their hardware cannot do, such as 5 data bits
+  struct termios applied_attribs;
+  if (tcgetattr(fd, &applied_attribs) != 0) {
+    goto restore;
+  }
+  if ((applied_attribs.c_cflag & (CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS)) != framing) {
+    errno = EINVAL;
+    goto restore;
+  }
+
+  // the driver's latency cannot fail the open, so it changes once nothing else can
+  set_low_latency(fd, line);
+
+  return 1;
+
+restore:
+  restore_rs485(fd, &previous_rs485);
+  return -1;
+
+}
+
+int
+set_tty_attribs (int fd, unsigned int baud, const SerialLine * line) {
+
+  return apply_tty_attribs(fd, baud, line, TCSANOW);
+
+}
+
+int
+reconfigure_serial (int fd, unsigned int baud, const SerialLine * line, bool discard_input) {
+
+  // what was written is sent at the old settings, and the change waits for it
+  return apply_tty_attribs(fd, baud, line, discard_input ? TCSAFLUSH : TCSADRAIN);
+
+}
+
+/**
+ * Waits until the device can take more, or until the deadline.
+ * Returns 1 once it can, 0 if the deadline passed, or -1 with errno set.
+ */
+static int
+wait_serial (int fd, short events, const struct timespec * deadline) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t remaining_ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+  if (remaining_ms <= 0) return 0;
+  struct pollfd poll_fd = { .fd = fd, .events = events };
+  int status = TEMP_FAILURE_RETRY(poll(&poll_fd, 1, (int) remaining_ms));
+  if (status == 1 && (poll_fd.revents & (POLLERR | POLLNVAL))) {
+    errno = EIO;
+    return -1;
+  }
+  return status;
+
+}
+
+static void
+serial_deadline (int timeout_ms, struct timespec * deadline) {
+
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += timeout_ms / 1000;
+  deadline->tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_nsec -= 1000000000;
+    ++deadline->tv_sec;
+  }
+
+}
+
+int
+serial_send (int fd, const void * data, size_t length, int timeout_ms) {
+
+  struct timespec deadline;
+  serial_deadline(timeout_ms, &deadline);
+  size_t written = 0;
+  while (written < length) {
+    ssize_t ssize = write(fd, (const char *) data + written, length - written);
+    if (ssize > 0) {
+      written += ssize;
+      continue;
+    }
+    if (ssize == -1 && errno != EAGAIN && errno != EINTR) {
+      return -1;
+    }
+    int status = wait_serial(fd, POLLOUT, &deadline);
+    if (status != 1) {
+      if (status == 0) errno = ETIMEDOUT;
+      return status;
+    }
+  }
+  return 1;
+
+}
+
+int
+serial_expect (int fd, const void * expected, size_t length, int timeout_ms) {
+
+  if (length == 0) return 1;
+
+  struct timespec deadline;
+  serial_deadline(timeout_ms, &deadline);
+  // the tail of what was received, only the last bytes can still start a match
+  char * window = malloc(length * 2);
+  if (!window) return -1;
+  size_t window_length = 0;
+  int status;
+  while (true) {
+    status = wait_serial(fd, POLLIN, &deadline);
+    if (status != 1) break;
+    ssize_t ssize = read(fd, window + window_length, length * 2 - window_length);
+    if (ssize == -1 && errno != EAGAIN && errno != EINTR) {
+      status = -1;
+      break;
+    }
+    if (ssize <= 0) {
+      // a tty reads nothing when it polls readable after a hangup
+      struct pollfd poll_fd = { .fd = fd, .events = POLLIN };
+      if (ssize == 0 && poll(&poll_fd, 1, 0) == 1 && (poll_fd.revents & POLLHUP)) {
+        errno = EIO;
+        status = -1;
+        break;
+      }
+      continue;
+    }
+    window_length += ssize;
+    if (memmem(window, window_length, expected, length)) {
+      status = 1;
+      break;
+    }
+    if (window_length >= length) {
+      memmove(window, window + window_length - (length - 1), length - 1);
+      window_length = length - 1;
+    }
+  }
+  free(window);
+  if (status == 0) errno = ETIMEDOUT;
+  return status;
+
+}
+
+bool
+serial_errors (int fd, uint64_t * errors) {
+
+#if defined(TIOCGICOUNT)
+  struct serial_icounter_struct counters;
+  if (ioctl(fd, TIOCGICOUNT, &counters) != 0) {
+    return false;
+  }
+  *errors = (uint64_t) counters.frame + counters.parity + counters.brk;
+  return true;
+#else
+  return false;
+#endif
+
+}
+
+void
+serial_sysfs_path (unsigned int major, unsigned int minor, char * sysfs_path, size_t sysfs_path_size) {
+
+  // /sys/dev/char/<major>:<minor> links to the device directory
+  // pseudo terminals and other virtual devices may have none
+  sysfs_path[0] = '\0';
+  char link_path[64];
+  snprintf(link_path, sizeof(link_path), "/sys/dev/char/%u:%u", major, minor);
+  char * resolved_path = realpath(link_path, NULL);
+  if (resolved_path) {
+    snprintf(sysfs_path, sysfs_path_size, "%s", resolved_path);
+    free(resolved_path);
+  }
+
+}
+
+int
+serial_latency_timer (const char * sysfs_path) {
+
+  if (!sysfs_path[0]) return -1;
+  char timer_path[SERIAL_SYSFS_PATH_MAX + 32];
+  snprintf(timer_path, sizeof(timer_path), "%s/device/latency_timer", sysfs_path);
+  FILE * timer = fopen(timer_path, "re");
+  if (!timer) return -1;
+  int latency_timer = -1;
+  if (fscanf(timer, "%d", &latency_timer) != 1) latency_timer = -1;
+  fclose(timer);
+  return latency_timer;
+
+}
+
+bool
+describe_serial (int fd, SerialInfo * info) {
+
+  struct stat device_stat;
+  struct termios tty_attribs;
+  if (fstat(fd, &device_stat) != 0 || tcgetattr(fd, &tty_attribs) != 0) {
+    return false;
+  }
+
+  info->major = major(device_stat.st_rdev);
+  info->minor = minor(device_stat.st_rdev);
+  info->ispeed = baud_rate(cfgetispeed(&tty_attribs));
+  info->ospeed = baud_rate(cfgetospeed(&tty_attribs));
+#if defined(TCGETS2)
+  // termios2 has the exact rates in effect, including those that are not standard
+  struct termios2 tty_attribs2;
+  if (ioctl(fd, TCGETS2, &tty_attribs2) == 0) {
+    info->ispeed = tty_attribs2.c_ispeed;
+    info->ospeed = tty_attribs2.c_ospeed;
+  }
+#endif
+  info->iflag = tty_attribs.c_iflag;
+  info->oflag = tty_attribs.c_oflag;
+  info->cflag = tty_attribs.c_cflag;
+  info->lflag = tty_attribs.c_lflag;
+  serial_sysfs_path(info->major, info->minor, info->sysfs_path, sizeof(info->sysfs_path));
+
+  return true;
+
+}
+
+int
+open_serial (const char * serial_port, unsigned int baud, const SerialLine * line) {
+
+  if (!baud_supported(baud) || !serial_line_valid(line)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // do not open in non-blocking mode when using non-canonical mode
+  PROBE_START(open_start);
+  int serial_fd = open(serial_port, O_RDWR | O_NOCTTY | O_SYNC | O_CLOEXEC);
+  PROBE(serial__open, serial_port, serial_fd, (serial_fd < 0) ? errno : 0, PROBE_ELAPSED(open_start));
+  if (serial_fd < 0) {
+    return -1;
+  }
+
+  if (!isatty(serial_fd)) {
+    close(serial_fd);
+    errno = ENOTTY;
+    return -1;
+  }
+
+  PROBE_START(attribs_start);
+  int attribs_status = set_tty_attribs(serial_fd, baud, line);
+  PROBE(
+    serial__attribs,
+    serial_port,
+    serial_fd,
+    (attribs_status <= 0) ? errno : 0,
+    PROBE_ELAPSED(attribs_start)
+  );
+  if (attribs_status <= 0) {
+    int tty_errno = errno;
+    close(serial_fd);
+    errno = tty_errno;
+    return -1;
+  }
+
+  return serial_fd;
+
+}
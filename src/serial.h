@@ -0,0 +1,178 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <termios.h>
+
+// sysfs paths are truncated to fit
+#define SERIAL_SYSFS_PATH_MAX 256
+
+// the range of rates that are not standard, which only termios2 can set
+// the fastest USB serial adapters run at 12 Mbaud
+#define SERIAL_CUSTOM_BAUD_MIN 50
+#define SERIAL_CUSTOM_BAUD_MAX 20000000
+
+// how far, in tenths of a percent, the rate a driver applies for a custom one may be off,
+// both ends may be off, and asynchronous framing starts losing bits past about 4% between them
+#define SERIAL_CUSTOM_BAUD_TOLERANCE 20
+
+// the kernel clamps longer RS-485 delays to this, so they are rejected instead
+#define SERIAL_RS485_DELAY_MAX_MS 100
+
+// the longest `<baud>[:<line>]` argument of the mechanism, with its NUL
+#define SERIAL_SETTINGS_MAX 64
+
+typedef enum {
+  SERIAL_PARITY_NONE = 0,
+  SERIAL_PARITY_ODD,
+  SERIAL_PARITY_EVEN
+} SerialParity;
+
+/**
+ * Framing and flow control of a line.
+ */
+typedef struct SerialLine {
+  // 5 to 8
+  unsigned int data_bits;
+  SerialParity parity;
+  // 1 or 2
+  unsigned int stop_bits;
+  bool rts_cts;
+  bool xon_xoff;
+  // half duplex, the driver asserts RTS to drive the bus while sending
+  bool rs485;
+  // how long RTS is asserted before sending, and kept asserted after it
+  unsigned int rs485_delay_before_ms;
+  unsigned int rs485_delay_after_ms;
+  // the driver passes on received bytes as soon as it can, and reads wait for the first
+  bool low_latency;
+} SerialLine;
+
+// 8N1 without flow control
+#define SERIAL_LINE_DEFAULT ((SerialLine) { .data_bits = 8, .parity = SERIAL_PARITY_NONE, .stop_bits = 1 })
+
+/**
+ * Identity and line settings of an opened serial device.
+ */
+typedef struct SerialInfo {
+  unsigned int major;
+  unsigned int minor;
+  // speeds are in bits per second, exact where the kernel has termios2,
+  // otherwise 0 if not a standard rate
+  unsigned int ispeed;
+  unsigned int ospeed;
+  tcflag_t iflag;
+  tcflag_t oflag;
+  tcflag_t cflag;
+  tcflag_t lflag;
+  // the device's directory in sysfs, empty if it has none
+  char sysfs_path[SERIAL_SYSFS_PATH_MAX];
+} SerialInfo;
+
+/**
+ * Assigns the speed of a standard rate, returns false if the rate is not one.
+ */
+bool baud_speed (unsigned int rate, speed_t * speed);
+
+/**
+ * The inverse of baud_speed, returns 0 for speeds that are not a standard rate.
+ */
+unsigned int baud_rate (speed_t speed);
+
+/**
+ * Whether the rate can be set, either as a standard rate,
+ * or as a custom one where the kernel has termios2.
+ */
+bool baud_supported (unsigned int rate);
+
+/**
+ * The supported rate closest to the rate, which is the rate itself if it is supported.
+ * Where there is termios2 any rate in range is supported, so this only clamps to the range,
+ * and whether the driver's clock can divide down to it is only known once it is set.
+ */
+unsigned int nearest_baud (unsigned int rate);
+
+/**
+ * Whether every setting of the line is in range.
+ * Whether the device can do them is only known once they are set.
+ */
+bool serial_line_valid (const SerialLine * line);
+
+bool serial_line_equal (const SerialLine * line, const SerialLine * other_line);
+
+/**
+ * Formats the rate and line as the mechanism takes them, `<baud>[:<line>]`,
+ * where the line is left out if it is the default, and is otherwise
+ * `<data bits><N|O|E><stop bits>[,rtscts][,xonxoff][,lowlatency][,rs485=<before ms>/<after ms>]`.
+ */
+void serial_settings_format (unsigned int baud, const SerialLine * line, char * settings, size_t settings_size);
+
+/**
+ * Parses what serial_settings_format formats, the settings are not validated.
+ * A rate that does not fit is 0, which is never supported.
+ * Returns false if the settings are malformed.
+ */
+bool serial_settings_parse (const char * settings, unsigned int * baud, SerialLine * line);
+
+/**
+ * Makes the device raw at the rate with the line settings, which must be supported.
+ * RS-485 is set first, so a device without it fails before anything changes,
+ * then everything else in one call, and the framing is read back, so a device
+ * that cannot do all of it fails with EINVAL, with RS-485 put back as it was.
+ * Only then is the driver's latency set for the low latency profile where it
+ * has a way to, or back to its usual one without it.
+ * Returns 1 on success, 0 or -1 with errno set on failure.
+ */
+int set_tty_attribs (int fd, unsigned int baud, const SerialLine * line);
+
+/**
+ * Changes the rate and line settings of an opened device once what was written to it
+ * has been sent, discarding what was received but not read if asked to.
+ * Returns as set_tty_attribs does.
+ */
+int reconfigure_serial (int fd, unsigned int baud, const SerialLine * line, bool discard_input);
+
+/**
+ * Writes all of the data, waiting for the device to take it until the timeout.
+ * Returns 1 once written, 0 with errno set to ETIMEDOUT, or -1 with errno set.
+ */
+int serial_send (int fd, const void * data, size_t length, int timeout_ms);
+
+/**
+ * Reads until the expected bytes have been received, anything around them is dropped.
+ * Returns 1 once received, 0 with errno set to ETIMEDOUT, or -1 with errno set.
+ */
+int serial_expect (int fd, const void * expected, size_t length, int timeout_ms);
+
+/**
+ * Adds up the framing, parity and break errors the driver has counted,
+ * which is what receiving at the wrong rate mostly causes.
+ * Returns false if the driver does not count them.
+ */
+bool serial_errors (int fd, uint64_t * errors);
+
+/**
+ * Opens and configures a serial device.
+ * Returns the file descriptor, or -1 with errno set.
+ * A path that does not refer to a tty fails with ENOTTY, and a rate or line
+ * settings that are not supported fail with EINVAL without opening anything.
+ */
+int open_serial (const char * serial_port, unsigned int baud, const SerialLine * line);
+
+/**
+ * Resolves the sysfs directory of a character device, empty if it has none.
+ */
+void serial_sysfs_path (unsigned int major, unsigned int minor, char * sysfs_path, size_t sysfs_path_size);
+
+/**
+ * Reads the latency timer, in milliseconds, of the USB serial adapter in the sysfs directory.
+ * Returns -1 if it has none.
+ */
+int serial_latency_timer (const char * sysfs_path);
+
+/**
+ * Describes an opened serial device.
+ * Returns false with errno set if it could not be inspected.
+ */
+bool describe_serial (int fd, SerialInfo * info);
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <sysexits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "spawn.h"
+
+const char * const spawn_backend_names[] = {
+  [SPAWN_FORK] = "fork",
+  [SPAWN_CLONE_VFORK] = "clone-vfork",
+  [SPAWN_POSIX_SPAWN] = "posix-spawn"
+};
+
+static int
+spawn_fork (
+  const char * process_path,
+  const char * const process_arguments[],
+  const sigset_t * signal_mask,
+  int inherit_fd,
+  pid_t * child_pid
+) {
+
+  // setup a pipe for between parent and forked child process
+  // to communicate errors during the fork prior to the exec
+  // both ends close on exec, so a successful exec closes the write end
+  int exec_pipe[2];
+  if (pipe2(exec_pipe, O_CLOEXEC) != 0) {
+    return 0;
+  }
+
+  pid_t pid = fork();
+
+  if (pid == -1) {
+
+    close(exec_pipe[0]);
+    close(exec_pipe[1]);
+    return -1;
+
+  } else if (pid == 0) {
+
+    // close the read side in the child
+    close(exec_pipe[0]);
+
+    // signals blocked for the supervisor would otherwise stay blocked across the exec
+    // and the mechanism could not be terminated on cancellation
+    if (sigprocmask(SIG_SETMASK, signal_mask, NULL) == -1) {
+      if (write(exec_pipe[1], &errno, sizeof(errno)));
+      _exit(EX_OSERR);
+    }
+
+    // the child has its own descriptor table, so this leaves the parent's copy close on exec
+    if (inherit_fd != -1 && fcntl(inherit_fd, F_SETFD, 0) == -1) {
+      if (write(exec_pipe[1], &errno, sizeof(errno)));
+      _exit(EX_OSERR);
+    }
+
+    // there is no parent death signal, which would fire when the spawning thread exits
+    // rather than the process, and requests may be started on a thread that does not outlive them
+    // a parent that is gone is noticed through the socket instead, and cancellation kills us through our pidfd
+
+    // execute the process with the arguments
+    // the child process can access file descriptors in the parent
+    // however we need to pass file descriptors from the child to the parent
+    // so we'll be using unix domain sockets for communication
+    execvp(process_path, (char * const *) process_arguments);
+
+    // exec failed, we must write the errno into the pipe
+    if (write(exec_pipe[1], &errno, sizeof(errno)));
+
+    // exit the child process without running the parent's atexit handlers
+    _exit(EX_UNAVAILABLE);
+
+  }
+
+  // close the write end on the parent
+  close(exec_pipe[1]);
+
+  // this blocks until we either receive a close or an actual write
+  // on close, the size of the read will be 0
+  // on write, the size of the read will be > 0
+  // we use close to mean successful exec
+  // we use write to mean there was an error
+  int exec_errno;
+  if (TEMP_FAILURE_RETRY(read(exec_pipe[0], &exec_errno, sizeof(exec_errno))) > 0) {
+    close(exec_pipe[0]);
+    waitpid(pid, NULL, 0);
+    errno = exec_errno;
+    return -2;
+  }
+
+  // exec succeeded, close the read end
+  close(exec_pipe[0]);
+
+  *child_pid = pid;
+
+  return 1;
+
+}
+
+typedef struct CloneArgs {
+  const char * process_path;
+  const char * const * process_arguments;
+  const sigset_t * signal_mask;
+  int inherit_fd;
+  // written by the child, the parent is suspended until the exec or exit
+  int exec_errno;
+} CloneArgs;
+
+static int
+clone_child (void * arg) {
+
+  CloneArgs * clone_args = arg;
+
+  // the child runs on the parent's memory, so none of the parent's
+  // signal handlers may run here, every handled signal goes back to default
+  // the handler table itself is not shared since CLONE_SIGHAND is not used
+  struct sigaction default_action = { .sa_handler = SIG_DFL };
+  for (int sig = 1; sig < NSIG; ++sig) {
+    struct sigaction action;
+    if (
+      sigaction(sig, NULL, &action) == 0 &&
+      action.sa_handler != SIG_DFL &&
+      action.sa_handler != SIG_IGN
+    ) {
+      sigaction(sig, &default_action, NULL);
+    }
+  }
+
+  if (sigprocmask(SIG_SETMASK, clone_args->signal_mask, NULL) == -1) {
+    clone_args->exec_errno = errno;
+    _exit(EX_OSERR);
+  }
+
+  // without CLONE_FILES the descriptor table is the child's own, unlike the memory
+  if (clone_args->inherit_fd != -1 && fcntl(clone_args->inherit_fd, F_SETFD, 0) == -1) {
+    clone_args->exec_errno = errno;
+    _exit(EX_OSERR);
+  }
+
+  execvp(clone_args->process_path, (char * const *) clone_args->process_arguments);
+
+  clone_args->exec_errno = errno;
+  _exit(EX_UNAVAILABLE);
+
+}
+
+static int
+spawn_clone_vfork (
+  const char * process_path,
+  const char * const process_arguments[],
+  const sigset_t * signal_mask,
+  int inherit_fd,
+  pid_t * child_pid
+) {
+
+  // execvp may need room for a PATH search buffer on top of the arguments
+  size_t stack_size = 64 * 1024;
+  for (const char * const * argument = process_arguments; *argument; ++argument) {
+    stack_size += sizeof(char *);
+  }
+
+  void * stack = mmap(
+    NULL,
+    stack_size,
+    PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+    -1,
+    0
+  );
+  if (stack == MAP_FAILED) {
+    return 0;
+  }
+
+  CloneArgs clone_args = {
+    .process_path = process_path,
+    .process_arguments = process_arguments,
+    .signal_mask = signal_mask,
+    .inherit_fd = inherit_fd,
+    .exec_errno = 0
+  };
+
+  // block everything until the child has reset its handlers
+  sigset_t signal_all_mask;
+  sigset_t signal_prev_mask;
+  sigfillset(&signal_all_mask);
+  pthread_sigmask(SIG_SETMASK, &signal_all_mask, &signal_prev_mask);
+
+  // the stack grows down on every architecture we build for
+  pid_t pid = clone(
+    clone_child,
+    (char *) stack + stack_size,
+    CLONE_VM | CLONE_VFORK | SIGCHLD,
+    &clone_args
+  );
+  int clone_errno = errno;
+
+  pthread_sigmask(SIG_SETMASK, &signal_prev_mask, NULL);
+  munmap(stack, stack_size);
+
+  if (pid == -1) {
+    errno = clone_errno;
+    return -1;
+  }
+
+  // CLONE_VFORK resumes us once the child has exec'd or exited
+  if (clone_args.exec_errno != 0) {
+    waitpid(pid, NULL, 0);
+    errno = clone_args.exec_errno;
+    return -2;
+  }
+
+  *child_pid = pid;
+
+  return 1;
+
+}
+
+static int
+spawn_posix_spawn (
+  const char * process_path,
+  const char * const process_arguments[],
+  const sigset_t * signal_mask,
+  int inherit_fd,
+  pid_t * child_pid
+) {
+
+  posix_spawnattr_t spawn_attr;
+  if (posix_spawnattr_init(&spawn_attr) != 0) {
+    return 0;
+  }
+
+  // a dup2 onto itself clears FD_CLOEXEC in the child only
+  posix_spawn_file_actions_t file_actions;
+  if (posix_spawn_file_actions_init(&file_actions) != 0) {
+    posix_spawnattr_destroy(&spawn_attr);
+    return 0;
+  }
+  if (inherit_fd != -1 && posix_spawn_file_actions_adddup2(&file_actions, inherit_fd, inherit_fd) != 0) {
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&spawn_attr);
+    return 0;
+  }
+
+  sigset_t signal_default_mask;
+  sigemptyset(&signal_default_mask);
+  sigaddset(&signal_default_mask, SIGINT);
+  sigaddset(&signal_default_mask, SIGTERM);
+
+  posix_spawnattr_setsigmask(&spawn_attr, signal_mask);
+  posix_spawnattr_setsigdefault(&spawn_attr, &signal_default_mask);
+  posix_spawnattr_setflags(&spawn_attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  extern char * * environ;
+  int spawn_errno = posix_spawnp(
+    child_pid,
+    process_path,
+    &file_actions,
+    &spawn_attr,
+    (char * const *) process_arguments,
+    environ
+  );
+
+  posix_spawn_file_actions_destroy(&file_actions);
+  posix_spawnattr_destroy(&spawn_attr);
+
+  // glibc reports exec failures as the return value
+  if (spawn_errno != 0) {
+    errno = spawn_errno;
+    return -2;
+  }
+
+  return 1;
+
+}
+
+int
+spawn_process (
+  SpawnBackend backend,
+  const char * process_path,
+  const char * const process_arguments[],
+  const sigset_t * signal_mask,
+  int inherit_fd,
+  pid_t * child_pid
+) {
+
+  switch (backend) {
+  case SPAWN_CLONE_VFORK:
+    return spawn_clone_vfork(process_path, process_arguments, signal_mask, inherit_fd, child_pid);
+  case SPAWN_POSIX_SPAWN:
+    return spawn_posix_spawn(process_path, process_arguments, signal_mask, inherit_fd, child_pid);
+  default:
+    return spawn_fork(process_path, process_arguments, signal_mask, inherit_fd, child_pid);
+  }
+
+}
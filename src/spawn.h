@@ -0,0 +1,37 @@
+#pragma once
+
+#include <signal.h>
+#include <sys/types.h>
+
+typedef enum {
+  // fork + exec, reporting exec errors through a close-on-exec pipe
+  SPAWN_FORK = 0,
+  // clone(CLONE_VM | CLONE_VFORK), shares the parent's page tables
+  // so the cost does not grow with the parent's resident set size
+  SPAWN_CLONE_VFORK,
+  // posix_spawnp, only here as a baseline for benchmarks
+  SPAWN_POSIX_SPAWN
+} SpawnBackend;
+
+extern const char * const spawn_backend_names[];
+
+/**
+ * Launches process_path (searched in PATH) with process_arguments.
+ * The child gets the given signal mask, but no parent death signal, as that fires
+ * when the spawning thread exits rather than the process. It only inherits
+ * file descriptors without FD_CLOEXEC, and inherit_fd unless it is -1.
+ * inherit_fd keeps FD_CLOEXEC in the parent, so processes spawned meanwhile by other
+ * threads do not inherit it.
+ * Returns 1 on success and assigns the pid,
+ * 0 if the error reporting channel could not be set up,
+ * -1 if the process could not be created,
+ * -2 if the exec failed, with errno set to the exec errno.
+ */
+int spawn_process (
+  SpawnBackend backend,
+  const char * process_path,
+  const char * const process_arguments[],
+  const sigset_t * signal_mask,
+  int inherit_fd,
+  pid_t * child_pid
+);
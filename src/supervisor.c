@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include "supervisor.h"
+
+static int
+pidfd_open (pid_t pid) {
+
+  return (int) syscall(SYS_pidfd_open, pid, 0);
+
+}
+
+static int
+pidfd_send_signal (int pidfd, int sig) {
+
+  return (int) syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+
+}
+
+// supervisors of one thread handling signals share its blocking of them,
+// which the last one to be destroyed undoes for the signals that were not blocked before the first
+static __thread unsigned int signal_holds;
+static __thread sigset_t held_signals;
+
+int64_t
+monotonic_ns (void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+}
+
+bool
+supervisor_init (Supervisor * supervisor, bool handle_signals) {
+
+  supervisor->epoll_fd = -1;
+  supervisor->signal_fd = -1;
+  supervisor->timer_fd = -1;
+  supervisor->timer_source = (RequestSource) { NULL, false };
+  supervisor->listen_fd = -1;
+  supervisor->listen_source = (RequestSource) { NULL, false };
+  supervisor->listen_ready = false;
+  supervisor->requests = NULL;
+  supervisor->cancel_signal = 0;
+  supervisor->holds_signals = false;
+
+  sigset_t signal_mask;
+  sigemptyset(&signal_mask);
+  if (handle_signals) {
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
+  }
+
+  // signals must be blocked to be read from the signalfd
+  // the original mask is kept either way, it is what mechanisms start with
+  if (pthread_sigmask(SIG_BLOCK, &signal_mask, &supervisor->signal_orig_mask) != 0) {
+    return false;
+  }
+  if (handle_signals) {
+    if (signal_holds++ == 0) {
+      sigemptyset(&held_signals);
+      if (!sigismember(&supervisor->signal_orig_mask, SIGINT)) sigaddset(&held_signals, SIGINT);
+      if (!sigismember(&supervisor->signal_orig_mask, SIGTERM)) sigaddset(&held_signals, SIGTERM);
+    }
+    supervisor->holds_signals = true;
+    supervisor->thread = pthread_self();
+  }
+
+  supervisor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (supervisor->epoll_fd == -1) {
+    supervisor_destroy(supervisor);
+    return false;
+  }
+
+  // deadlines are a timer on the epoll instance, so they also wake
+  // callers polling the epoll file descriptor from their own event loop
+  supervisor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (supervisor->timer_fd == -1) {
+    supervisor_destroy(supervisor);
+    return false;
+  }
+
+  struct epoll_event timer_event = { .events = EPOLLIN, .data.ptr = &supervisor->timer_source };
+  if (epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_ADD, supervisor->timer_fd, &timer_event) != 0) {
+    supervisor_destroy(supervisor);
+    return false;
+  }
+
+  if (!handle_signals) {
+    return true;
+  }
+
+  supervisor->signal_fd = signalfd(-1, &signal_mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (supervisor->signal_fd == -1) {
+    supervisor_destroy(supervisor);
+    return false;
+  }
+
+  // the signalfd is identified by a NULL data pointer
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_ADD, supervisor->signal_fd, &event) != 0) {
+    supervisor_destroy(supervisor);
+    return false;
+  }
+
+  return true;
+
+}
+
+void
+supervisor_destroy (Supervisor * supervisor) {
+
+  while (supervisor->requests) {
+    supervisor_remove(supervisor, supervisor->requests);
+  }
+  supervisor_unlisten(supervisor);
+
+  if (supervisor->epoll_fd != -1) close(supervisor->epoll_fd);
+  if (supervisor->signal_fd != -1) close(supervisor->signal_fd);
+  if (supervisor->timer_fd != -1) close(supervisor->timer_fd);
+  supervisor->epoll_fd = -1;
+  supervisor->signal_fd = -1;
+  supervisor->timer_fd = -1;
+
+  // any signal that arrived after the last wait is delivered here,
+  // the mask of another thread cannot be changed from this one
+  if (supervisor->holds_signals && pthread_equal(supervisor->thread, pthread_self())) {
+    supervisor->holds_signals = false;
+    if (--signal_holds == 0) {
+      pthread_sigmask(SIG_UNBLOCK, &held_signals, NULL);
+    }
+  }
+
+}
+
+static bool
+sock_readable (int sock_fd) {
+
+  struct pollfd poll_fd = { .fd = sock_fd, .events = POLLIN };
+  return (poll(&poll_fd, 1, 0) == 1 && (poll_fd.revents & POLLIN));
+
+}
+
+/**
+ * Times out expired requests and arms the timer for the next deadline.
+ * Returns the number of requests that are no longer pending.
+ */
+static int
+check_deadlines (Supervisor * supervisor) {
+
+  int settled = 0;
+  int64_t now = monotonic_ns();
+  int64_t next_deadline = 0;
+
+  for (Request * request = supervisor->requests; request; request = request->next) {
+    if (request->state == REQUEST_PENDING && request->deadline) {
+      if (request->deadline <= now) {
+        request_cancel(request, REQUEST_TIMED_OUT);
+      } else if (!next_deadline || request->deadline < next_deadline) {
+        next_deadline = request->deadline;
+      }
+    }
+    if (request->state != REQUEST_PENDING) ++settled;
+  }
+
+  // an all zero value disarms the timer
+  struct itimerspec timer = {
+    .it_value = {
+      .tv_sec = next_deadline / 1000000000,
+      .tv_nsec = next_deadline % 1000000000
+    }
+  };
+  timerfd_settime(supervisor->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+  return settled;
+
+}
+
+/**
+ * Waits on the socket again, unless the mechanism already exited
+ * in which case its pidfd is no longer watched and it settles right away.
+ */
+static void
+resume_request (Request * request) {
+
+  if (request->status == -1) {
+    request->state = REQUEST_PENDING;
+  } else {
+    request->state = sock_readable(request->sock_fd) ? REQUEST_READY : REQUEST_EXITED;
+  }
+
+}
+
+bool
+supervisor_add (
+  Supervisor * supervisor,
+  Request * request,
+  pid_t pid,
+  int sock_fd,
+  int64_t deadline
+) {
+
+  request->pid = pid;
+  request->sock_fd = sock_fd;
+  request->deadline = deadline;
+  request->state = REQUEST_PENDING;
+  request->status = -1;
+  request->status_code = 0;
+  request->process_source = (RequestSource) { request, true };
+  request->sock_source = (RequestSource) { request, false };
+
+  // the child is never reaped by anyone else, so the pid cannot be reused here
+  request->pidfd = -1;
+  if (pid != 0) {
+    request->pidfd = pidfd_open(pid);
+    if (request->pidfd == -1) {
+      return false;
+    }
+  }
+
+  struct epoll_event process_event = {
+    .events = EPOLLIN,
+    .data.ptr = &request->process_source
+  };
+  struct epoll_event sock_event = {
+    .events = EPOLLIN | EPOLLONESHOT,
+    .data.ptr = &request->sock_source
+  };
+
+  if (
+    (
+      request->pidfd != -1 &&
+      epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_ADD, request->pidfd, &process_event) != 0
+    ) ||
+    (
+      request->sock_fd != -1 &&
+      epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_ADD, request->sock_fd, &sock_event) != 0
+    )
+  ) {
+    int epoll_errno = errno;
+    if (request->pidfd != -1) {
+      epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_DEL, request->pidfd, NULL);
+      close(request->pidfd);
+      request->pidfd = -1;
+    }
+    errno = epoll_errno;
+    return false;
+  }
+
+  request->next = supervisor->requests;
+  supervisor->requests = request;
+
+  check_deadlines(supervisor);
+
+  return true;
+
+}
+
+void
+supervisor_remove (Supervisor * supervisor, Request * request) {
+
+  for (Request * * link = &supervisor->requests; *link; link = &(*link)->next) {
+    if (*link == request) {
+      *link = request->next;
+      break;
+    }
+  }
+
+  if (request->pidfd != -1) {
+    epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_DEL, request->pidfd, NULL);
+    // reap if it already exited, otherwise leave it to request_reap
+    if (request->status == -1) {
+      siginfo_t info = {0};
+      if (
+        waitid(P_PIDFD, request->pidfd, &info, WEXITED | WNOHANG) == 0 &&
+        info.si_pid != 0
+      ) {
+        request->status = info.si_status;
+        request->status_code = info.si_code;
+      }
+    }
+  }
+  epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_DEL, request->sock_fd, NULL);
+
+}
+
+bool
+supervisor_listen (Supervisor * supervisor, int listen_fd) {
+
+  if (supervisor->listen_fd == listen_fd) return true;
+  supervisor_unlisten(supervisor);
+
+  // level triggered, the caller accepts until the backlog is empty
+  struct epoll_event listen_event = { .events = EPOLLIN, .data.ptr = &supervisor->listen_source };
+  if (epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) != 0) {
+    return false;
+  }
+
+  supervisor->listen_fd = listen_fd;
+  supervisor->listen_ready = false;
+  return true;
+
+}
+
+void
+supervisor_unlisten (Supervisor * supervisor) {
+
+  if (supervisor->listen_fd == -1) return;
+  epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_DEL, supervisor->listen_fd, NULL);
+  supervisor->listen_fd = -1;
+  supervisor->listen_ready = false;
+
+}
+
+bool
+supervisor_rearm (Supervisor * supervisor, Request * request) {
+
+  struct epoll_event sock_event = {
+    .events = EPOLLIN | EPOLLONESHOT,
+    .data.ptr = &request->sock_source
+  };
+  if (epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_MOD, request->sock_fd, &sock_event) != 0) {
+    return false;
+  }
+
+  resume_request(request);
+  return true;
+
+}
+
+bool
+supervisor_watch (Supervisor * supervisor, Request * request, int sock_fd) {
+
+  epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_DEL, request->sock_fd, NULL);
+  request->sock_fd = sock_fd;
+
+  struct epoll_event sock_event = {
+    .events = EPOLLIN | EPOLLONESHOT,
+    .data.ptr = &request->sock_source
+  };
+  if (epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_ADD, request->sock_fd, &sock_event) != 0) {
+    return false;
+  }
+
+  resume_request(request);
+  return true;
+
+}
+
+void
+request_cancel (Request * request, RequestState state) {
+
+  if (request->state != REQUEST_PENDING) return;
+  request->state = state;
+  if (request->pidfd != -1 && request->status == -1) {
+    pidfd_send_signal(request->pidfd, SIGTERM);
+  }
+
+}
+
+int
+request_reap (Request * request) {
+
+  if (request->pidfd == -1) {
+    return request->status;
+  }
+
+  if (request->status == -1) {
+    siginfo_t info = {0};
+    if (TEMP_FAILURE_RETRY(waitid(P_PIDFD, request->pidfd, &info, WEXITED)) == 0) {
+      request->status = info.si_status;
+      request->status_code = info.si_code;
+    }
+  }
+
+  close(request->pidfd);
+  request->pidfd = -1;
+
+  return request->status;
+
+}
+
+static void
+handle_process_exit (Supervisor * supervisor, Request * request) {
+
+  siginfo_t info = {0};
+  if (waitid(P_PIDFD, request->pidfd, &info, WEXITED | WNOHANG) != 0 || info.si_pid == 0) {
+    return;
+  }
+
+  request->status = info.si_status;
+  request->status_code = info.si_code;
+
+  // a pidfd stays readable after the exit, so stop watching it
+  epoll_ctl(supervisor->epoll_fd, EPOLL_CTL_DEL, request->pidfd, NULL);
+
+  if (request->state != REQUEST_PENDING) return;
+
+  // the mechanism writes before exiting, so its message
+  // may already be queued even though the exit was seen first
+  request->state = sock_readable(request->sock_fd) ? REQUEST_READY : REQUEST_EXITED;
+
+}
+
+int
+supervisor_wait (Supervisor * supervisor, int timeout) {
+
+  while (true) {
+
+    int settled = check_deadlines(supervisor);
+    if (settled || supervisor->listen_ready) {
+      return settled + supervisor->listen_ready;
+    }
+
+    // the timer wakes us at the next deadline
+    struct epoll_event events[16];
+    int events_count = epoll_wait(supervisor->epoll_fd, events, 16, timeout);
+    if (events_count == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    } else if (events_count == 0) {
+      return 0;
+    }
+
+    for (int i = 0; i < events_count; ++i) {
+
+      RequestSource * source = events[i].data.ptr;
+
+      if (!source) {
+        struct signalfd_siginfo signal_info;
+        while (read(supervisor->signal_fd, &signal_info, sizeof(signal_info)) == sizeof(signal_info)) {
+          supervisor->cancel_signal = signal_info.ssi_signo;
+        }
+        for (Request * request = supervisor->requests; request; request = request->next) {
+          request_cancel(request, REQUEST_CANCELLED);
+        }
+        continue;
+      }
+
+      if (source == &supervisor->timer_source) {
+        uint64_t expirations;
+        while (read(supervisor->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+        continue;
+      }
+
+      if (source == &supervisor->listen_source) {
+        supervisor->listen_ready = true;
+        continue;
+      }
+
+      if (source->is_process) {
+        handle_process_exit(supervisor, source->request);
+      } else if (source->request->state == REQUEST_PENDING) {
+        source->request->state = REQUEST_READY;
+      }
+
+    }
+
+  }
+
+}
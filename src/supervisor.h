@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef enum {
+  REQUEST_PENDING = 0,
+  // the mechanism's message (or connection) is waiting on the socket
+  REQUEST_READY,
+  // the mechanism exited without anything waiting on the socket
+  REQUEST_EXITED,
+  REQUEST_TIMED_OUT,
+  REQUEST_CANCELLED
+} RequestState;
+
+struct Request;
+
+// the timer's and the listener's sources have no request
+typedef struct RequestSource {
+  struct Request * request;
+  bool is_process;
+} RequestSource;
+
+/**
+ * A launched mechanism being supervised.
+ * The socket is either the listening socket the mechanism connects to,
+ * a socket already connected to the mechanism, or -1 while the mechanism
+ * is connecting to a listening socket shared through supervisor_listen.
+ */
+typedef struct Request {
+  pid_t pid;
+  int pidfd;
+  int sock_fd;
+  // CLOCK_MONOTONIC nanoseconds, 0 means no deadline
+  int64_t deadline;
+  RequestState state;
+  // exit code, or signal number if killed, -1 while running
+  int status;
+  int status_code;
+  RequestSource process_source;
+  RequestSource sock_source;
+  struct Request * next;
+} Request;
+
+/**
+ * Multiplexes any number of requests on one epoll instance.
+ * Each mechanism is tracked through its pidfd, so no SIGCHLD handler is needed.
+ * When handling signals, SIGINT and SIGTERM are consumed through a signalfd
+ * while supervising and cancel every request.
+ * Deadlines are kept with a timerfd, so the epoll file descriptor
+ * can be polled from another event loop and becomes readable
+ * whenever supervisor_wait has something to do.
+ * A supervisor belongs to the thread that initialised it.
+ */
+typedef struct Supervisor {
+  int epoll_fd;
+  int signal_fd;
+  int timer_fd;
+  RequestSource timer_source;
+  // a listening socket shared by many requests
+  int listen_fd;
+  RequestSource listen_source;
+  // connections are waiting on the shared listening socket
+  bool listen_ready;
+  // the mask before SIGINT and SIGTERM were blocked, which mechanisms start with
+  sigset_t signal_orig_mask;
+  // this blocked SIGINT and SIGTERM in the thread, along with any other supervisor of it
+  bool holds_signals;
+  pthread_t thread;
+  Request * requests;
+  // the signal that cancelled supervision, 0 if none
+  int cancel_signal;
+} Supervisor;
+
+int64_t monotonic_ns (void);
+
+/**
+ * Blocks SIGINT and SIGTERM in the calling thread if handle_signals is set,
+ * until the last of the thread's supervisors handling signals is destroyed,
+ * which unblocks those of them that were not blocked before. The mask is
+ * otherwise left alone, and only the initialising thread's destroy can undo it.
+ */
+bool supervisor_init (Supervisor * supervisor, bool handle_signals);
+
+void supervisor_destroy (Supervisor * supervisor);
+
+/**
+ * Starts supervising a launched mechanism.
+ * A pid of 0 supervises only the socket, for a peer that is not our child,
+ * which then settles when the socket is readable (including when it hangs up).
+ * Returns false with errno set if the pidfd could not be opened.
+ */
+bool supervisor_add (
+  Supervisor * supervisor,
+  Request * request,
+  pid_t pid,
+  int sock_fd,
+  int64_t deadline
+);
+
+void supervisor_remove (Supervisor * supervisor, Request * request);
+
+/**
+ * Watches a listening socket shared by many requests, where the caller
+ * matches each connection to its request and hands it over with supervisor_watch.
+ * supervisor_wait returns while listen_ready is set, so the caller clears it
+ * before accepting until the backlog is empty.
+ */
+bool supervisor_listen (Supervisor * supervisor, int listen_fd);
+
+void supervisor_unlisten (Supervisor * supervisor);
+
+/**
+ * Waits until the socket of a still pending request is readable again.
+ * This is used when an accepted connection turned out to be from an unknown peer.
+ */
+bool supervisor_rearm (Supervisor * supervisor, Request * request);
+
+/**
+ * Waits on another socket for the request, such as the accepted connection
+ * in place of the listening socket.
+ */
+bool supervisor_watch (Supervisor * supervisor, Request * request, int sock_fd);
+
+/**
+ * Dispatches events until at least one request leaves REQUEST_PENDING
+ * or the shared listening socket is ready, or until the timeout
+ * in milliseconds passes (-1 waits indefinitely).
+ * Returns the number of requests that settled (plus one for the listening socket),
+ * 0 on timeout, or -1 with errno set.
+ */
+int supervisor_wait (Supervisor * supervisor, int timeout);
+
+/**
+ * Cancels a pending request, signalling its mechanism to terminate.
+ * A mechanism that now runs as another user may not be signalled,
+ * in which case it fails on its own when the socket is closed.
+ */
+void request_cancel (Request * request, RequestState state);
+
+/**
+ * Reaps the mechanism, blocking until it exits.
+ * Returns the exit status as in Request.status.
+ */
+int request_reap (Request * request);
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/file.h>
+
+#include "timings.h"
+
+// the library's phases, then the whole run and the program's own phases
+#define TIMINGS_TOTAL PRIVELEV_PHASE_COUNT
+#define TIMINGS_WRITE (PRIVELEV_PHASE_COUNT + 1)
+#define TIMINGS_PHASES (PRIVELEV_PHASE_COUNT + 2)
+
+static const char *
+phase_name (size_t phase) {
+
+  switch (phase) {
+  case TIMINGS_TOTAL:
+    return "total";
+  case TIMINGS_WRITE:
+    return "write";
+  default:
+    return privelev_phase_name((privelev_phase) phase);
+  }
+
+}
+
+/**
+ * Assigns the duration of a phase, returns false if it did not happen.
+ */
+static bool
+phase_duration (const RunTimings * timings, size_t phase, uint64_t * duration_ns, unsigned int * count) {
+
+  switch (phase) {
+  case TIMINGS_TOTAL:
+    *duration_ns = timings->open.total_ns + timings->write_ns;
+    *count = 1;
+    break;
+  case TIMINGS_WRITE:
+    *duration_ns = timings->write_ns;
+    *count = timings->write_count;
+    break;
+  default:
+    *duration_ns = timings->open.phase_ns[phase];
+    *count = timings->open.phase_count[phase];
+    break;
+  }
+  return *count > 0;
+
+}
+
+void
+timings_write_json (FILE * stream, const RunTimings * timings) {
+
+  fprintf(stream, "{\"status\": \"%s\", \"phases\": {", timings->status);
+
+  bool first = true;
+  for (size_t phase = 0; phase < TIMINGS_PHASES; ++phase) {
+    uint64_t duration_ns;
+    unsigned int count;
+    if (!phase_duration(timings, phase, &duration_ns, &count)) continue;
+    fprintf(
+      stream,
+      "%s\"%s\": {\"us\": %.1f, \"count\": %u}",
+      first ? "" : ", ",
+      phase_name(phase),
+      duration_ns / 1000.0,
+      count
+    );
+    first = false;
+  }
+
+  fprintf(stream, "}}\n");
+  fflush(stream);
+
+}
+
+static size_t
+bucket_of (uint64_t duration_ns) {
+
+  uint64_t duration_us = duration_ns / 1000;
+  size_t bucket = 0;
+  while (duration_us && bucket < TIMINGS_BUCKETS - 1) {
+    duration_us >>= 1;
+    ++bucket;
+  }
+  return bucket;
+
+}
+
+bool
+timings_update_histogram (const char * path, const RunTimings * timings) {
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) return false;
+
+  FILE * stream = fdopen(fd, "r+");
+  if (!stream) {
+    close(fd);
+    return false;
+  }
+
+  if (flock(fd, LOCK_EX) != 0) {
+    fclose(stream);
+    return false;
+  }
+
+  uint64_t counts[TIMINGS_PHASES][TIMINGS_BUCKETS] = {{0}};
+
+  // lines of phases we no longer know are dropped
+  char line[1024];
+  while (fgets(line, sizeof(line), stream)) {
+    char * save;
+    char * name = strtok_r(line, " \n", &save);
+    if (!name) continue;
+    size_t phase = 0;
+    while (phase < TIMINGS_PHASES && strcmp(phase_name(phase), name) != 0) ++phase;
+    if (phase == TIMINGS_PHASES) continue;
+    for (size_t bucket = 0; bucket < TIMINGS_BUCKETS; ++bucket) {
+      char * count = strtok_r(NULL, " \n", &save);
+      if (!count) break;
+      counts[phase][bucket] = strtoull(count, NULL, 10);
+    }
+  }
+
+  for (size_t phase = 0; phase < TIMINGS_PHASES; ++phase) {
+    uint64_t duration_ns;
+    unsigned int count;
+    if (!phase_duration(timings, phase, &duration_ns, &count)) continue;
+    ++counts[phase][bucket_of(duration_ns)];
+  }
+
+  rewind(stream);
+  for (size_t phase = 0; phase < TIMINGS_PHASES; ++phase) {
+    fprintf(stream, "%s", phase_name(phase));
+    for (size_t bucket = 0; bucket < TIMINGS_BUCKETS; ++bucket) {
+      fprintf(stream, " %llu", (unsigned long long) counts[phase][bucket]);
+    }
+    fprintf(stream, "\n");
+  }
+
+  bool written = fflush(stream) == 0 && ftruncate(fd, ftell(stream)) == 0;
+
+  // closing releases the lock
+  return (fclose(stream) == 0) && written;
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "privelev.h"
+
+// histogram buckets are powers of 2 microseconds, the last one takes everything longer
+#define TIMINGS_BUCKETS 40
+
+/**
+ * Timings of one run of privilege-elevation.
+ * The open is timed by libprivelev, the rest by the program itself.
+ */
+typedef struct {
+  privelev_timings open;
+  const char * status;
+  // writing to the opened devices
+  uint64_t write_ns;
+  unsigned int write_count;
+} RunTimings;
+
+/**
+ * Writes the run as a single line JSON record.
+ */
+void timings_write_json (FILE * stream, const RunTimings * timings);
+
+/**
+ * Adds the run to the histogram file, creating it if it doesn't exist.
+ * The file has a line for each phase, with its name followed by the bucket counts.
+ * Concurrent runs are serialised with a lock on the file.
+ */
+bool timings_update_histogram (const char * path, const RunTimings * timings);
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "src/cache.h"
+
+static unsigned int failures;
+
+#define check(condition, ...) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      ++failures; \
+    } \
+  } while (0)
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+static char dir_path[] = "/tmp/privelev-cache-test.XXXXXX";
+static char cache_path[PATH_MAX];
+
+static CacheKey
+test_key (unsigned int device_minor, const char * sysfs_path) {
+
+  CacheKey key = {
+    .rdev = makedev(188, device_minor),
+    .uid = 0,
+    .gid = 20,
+    .mode = S_IFCHR | 0660,
+    .credentials = 0x0123456789abcdef
+  };
+  snprintf(key.sysfs_path, sizeof(key.sysfs_path), "%s", sysfs_path);
+  return key;
+
+}
+
+static void
+write_cache (const char * contents) {
+
+  FILE * stream = fopen(cache_path, "w");
+  if (!stream) {
+    perror("fopen()");
+    exit(EXIT_FAILURE);
+  }
+  fputs(contents, stream);
+  fclose(stream);
+
+}
+
+static CacheDecision
+lookup_one (const CacheKey * key) {
+
+  CacheDecision decision;
+  cache_lookup(cache_path, key, &decision, 1);
+  return decision;
+
+}
+
+static void
+check_round_trip (void) {
+
+  unlink(cache_path);
+  CacheKey keys[] = {
+    test_key(0, "/sys/devices/pci0000:00/0000:00:14.0/usb1/1-1/1-1:1.0/ttyUSB0"),
+    test_key(1, ""),
+    test_key(2, "/sys/devices/platform/serial8250/tty/ttyS2")
+  };
+  CacheDecision decisions[] = { CACHE_ELEVATED, CACHE_UNPRIVILEGED, CACHE_UNKNOWN };
+
+  CacheDecision looked_up[COUNT(keys)];
+  cache_lookup(cache_path, keys, looked_up, COUNT(keys));
+  for (size_t i = 0; i < COUNT(keys); ++i) {
+    check(looked_up[i] == CACHE_UNKNOWN, "device %zu is known without a cache", i);
+  }
+
+  check(cache_store(cache_path, keys, decisions, COUNT(keys)), "storing failed");
+  cache_lookup(cache_path, keys, looked_up, COUNT(keys));
+  for (size_t i = 0; i < COUNT(keys); ++i) {
+    check(looked_up[i] == decisions[i], "device %zu looks up %d instead of %d", i, looked_up[i], decisions[i]);
+  }
+
+  // a later decision replaces the device's entry and keeps the others
+  CacheDecision decision = CACHE_UNPRIVILEGED;
+  check(cache_store(cache_path, &keys[0], &decision, 1), "storing failed");
+  check(lookup_one(&keys[0]) == CACHE_UNPRIVILEGED, "a stored decision was not replaced");
+  check(lookup_one(&keys[1]) == CACHE_UNPRIVILEGED, "another device's decision was lost");
+
+  // so does a decision for the same device with a changed owner
+  CacheKey chowned_key = keys[0];
+  chowned_key.uid = 1000;
+  decision = CACHE_ELEVATED;
+  check(cache_store(cache_path, &chowned_key, &decision, 1), "storing failed");
+  check(lookup_one(&chowned_key) == CACHE_ELEVATED, "the changed device's decision was not stored");
+  check(lookup_one(&keys[0]) == CACHE_UNKNOWN, "the device's old decision was kept");
+
+  FILE * stream = fopen(cache_path, "r");
+  unsigned int lines = 0;
+  char line[512];
+  while (stream && fgets(line, sizeof(line), stream)) ++lines;
+  if (stream) fclose(stream);
+  check(lines == COUNT(keys), "the cache has %u entries for %zu devices", lines, COUNT(keys));
+
+}
+
+static void
+check_mismatched_keys (void) {
+
+  unlink(cache_path);
+  CacheKey key = test_key(0, "/sys/devices/platform/serial8250/tty/ttyS0");
+  CacheDecision decision = CACHE_ELEVATED;
+  check(cache_store(cache_path, &key, &decision, 1), "storing failed");
+  check(lookup_one(&key) == CACHE_ELEVATED, "the stored decision was not found");
+
+  CacheKey changed_keys[7];
+  for (size_t i = 0; i < COUNT(changed_keys); ++i) changed_keys[i] = key;
+  changed_keys[0].rdev = makedev(188, 1);
+  changed_keys[1].rdev = makedev(189, 0);
+  changed_keys[2].uid = 1000;
+  changed_keys[3].gid = 1000;
+  changed_keys[4].mode = S_IFCHR | 0666;
+  changed_keys[5].credentials ^= 1;
+  snprintf(changed_keys[6].sysfs_path, sizeof(changed_keys[6].sysfs_path), "%s", "/sys/devices/platform/serial8250/tty/ttyS1");
+
+  for (size_t i = 0; i < COUNT(changed_keys); ++i) {
+    check(lookup_one(&changed_keys[i]) == CACHE_UNKNOWN, "changed key %zu matches", i);
+  }
+
+  // a device that could not be inspected never matches
+  CacheKey unknown_key = { .rdev = 0 };
+  write_cache("0:0 0 0 0 0 2 -\n");
+  check(lookup_one(&unknown_key) == CACHE_UNKNOWN, "a key without a device matches");
+
+}
+
+static void
+check_malformed_entries (void) {
+
+  CacheKey key = test_key(0, "/sys/devices/platform/serial8250/tty/ttyS0");
+  CacheDecision decision = CACHE_UNPRIVILEGED;
+
+  static const char * const malformed[] = {
+    "",
+    "\n",
+    "garbage\n",
+    "188:0\n",
+    "188:0 0 20 20660 123456789abcdef\n",
+    "188:0 0 20 20660 123456789abcdef 2\n",
+    "188:0 0 20 20660 123456789abcdef 3 /sys/devices/platform/serial8250/tty/ttyS0\n",
+    "188:0 0 20 20660 123456789abcdef 99999999999 /sys/devices/platform/serial8250/tty/ttyS0\n",
+    "188:0 0 20 20660 123456789abcdef -1 /sys/devices/platform/serial8250/tty/ttyS0\n",
+    "188:0 0 20 20660 123456789abcdef x /sys/devices/platform/serial8250/tty/ttyS0\n",
+    "188 0 0 20 20660 123456789abcdef 2 /sys/devices/platform/serial8250/tty/ttyS0\n",
+    "188:0 0 20 20660 123456789abcdeg 2 /sys/devices/platform/serial8250/tty/ttyS0\n",
+    "\x01\x02\x03\xff\xfe\n"
+  };
+
+  for (size_t i = 0; i < COUNT(malformed); ++i) {
+    write_cache(malformed[i]);
+    check(lookup_one(&key) == CACHE_UNKNOWN, "malformed entry %zu matches", i);
+
+    // storing over a malformed entry drops it and keeps the new decision
+    check(cache_store(cache_path, &key, &decision, 1), "storing over malformed entry %zu failed", i);
+    check(lookup_one(&key) == CACHE_UNPRIVILEGED, "storing over malformed entry %zu was lost", i);
+  }
+
+  // an entry as cache_store writes it, between malformed ones
+  write_cache(
+    "garbage\n"
+    "188:0 0 20 20660 123456789abcdef 2 /sys/devices/platform/serial8250/tty/ttyS0\n"
+    "188:0 0 20 20660 123456789abcdef 3 /sys/devices/platform/serial8250/tty/ttyS0\n"
+  );
+  check(lookup_one(&key) == CACHE_ELEVATED, "an entry between malformed ones was not found");
+
+  // a truncated cache, as if it was cut while being copied
+  write_cache("188:0 0 20 20660 123456789abcdef 2 /sys/devices/platform/seri");
+  check(lookup_one(&key) == CACHE_UNKNOWN, "a truncated entry matches");
+
+  // a line too long for the reader, which is never written
+  char long_line[2048];
+  memset(long_line, 'x', sizeof(long_line) - 2);
+  long_line[sizeof(long_line) - 2] = '\n';
+  long_line[sizeof(long_line) - 1] = '\0';
+  write_cache(long_line);
+  check(lookup_one(&key) == CACHE_UNKNOWN, "an overlong line matches");
+
+}
+
+static void
+check_missing_parents (void) {
+
+  char nested_path[PATH_MAX];
+  snprintf(nested_path, sizeof(nested_path), "%s/nested/deeper/cache", dir_path);
+  CacheKey key = test_key(0, "");
+  CacheDecision decision = CACHE_ELEVATED;
+  check(cache_store(nested_path, &key, &decision, 1), "storing without the parent directories failed");
+
+  CacheDecision looked_up;
+  cache_lookup(nested_path, &key, &looked_up, 1);
+  check(looked_up == CACHE_ELEVATED, "the decision stored without the parent directories was not found");
+
+  struct stat dir_stat;
+  char nested_dir_path[PATH_MAX];
+  snprintf(nested_dir_path, sizeof(nested_dir_path), "%s/nested", dir_path);
+  check(stat(nested_dir_path, &dir_stat) == 0 && (dir_stat.st_mode & 0077) == 0, "the parent directories can be read by others");
+
+  unlink(nested_path);
+  snprintf(nested_dir_path, sizeof(nested_dir_path), "%s/nested/deeper", dir_path);
+  rmdir(nested_dir_path);
+  snprintf(nested_dir_path, sizeof(nested_dir_path), "%s/nested", dir_path);
+  rmdir(nested_dir_path);
+
+}
+
+int
+main (void) {
+
+  if (!mkdtemp(dir_path)) {
+    perror("mkdtemp()");
+    return EXIT_FAILURE;
+  }
+  snprintf(cache_path, sizeof(cache_path), "%s/cache", dir_path);
+
+  check_round_trip();
+  check_mismatched_keys();
+  check_malformed_entries();
+  check_missing_parents();
+
+  unlink(cache_path);
+  rmdir(dir_path);
+
+  if (failures > 0) {
+    fprintf(stderr, "%u checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <sys/types.h>
+
+#include "src/protocol.h"
+#include "src/serial.h"
+
+static unsigned int failures;
+
+#define check(condition, ...) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      ++failures; \
+    } \
+  } while (0)
+
+static const unsigned int bauds[] = { 50, 9600, 115200, 250000, 4000000, 4294967295u };
+
+static const unsigned int rs485_delays[][2] = {
+  { 0, 0 },
+  { 1, 0 },
+  { 0, 1 },
+  { 7, 13 },
+  { SERIAL_RS485_DELAY_MAX_MS, SERIAL_RS485_DELAY_MAX_MS }
+};
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+/**
+ * Calls the callback with every line the settings can describe.
+ */
+static void
+each_line (void (* callback) (const SerialLine * line)) {
+
+  for (unsigned int data_bits = 5; data_bits <= 8; ++data_bits) {
+    for (SerialParity parity = SERIAL_PARITY_NONE; parity <= SERIAL_PARITY_EVEN; ++parity) {
+      for (unsigned int stop_bits = 1; stop_bits <= 2; ++stop_bits) {
+        // rts_cts, xon_xoff, low_latency and rs485 as the bits of flags
+        for (unsigned int flags = 0; flags < 16; ++flags) {
+          bool rs485 = flags & 8;
+          for (size_t delay = 0; delay < (rs485 ? COUNT(rs485_delays) : 1); ++delay) {
+            SerialLine line = {
+              .data_bits = data_bits,
+              .parity = parity,
+              .stop_bits = stop_bits,
+              .rts_cts = flags & 1,
+              .xon_xoff = flags & 2,
+              .low_latency = flags & 4,
+              .rs485 = rs485,
+              .rs485_delay_before_ms = rs485 ? rs485_delays[delay][0] : 0,
+              .rs485_delay_after_ms = rs485 ? rs485_delays[delay][1] : 0
+            };
+            callback(&line);
+          }
+        }
+      }
+    }
+  }
+
+}
+
+static void
+check_settings_round_trip (const SerialLine * line) {
+
+  check(serial_line_valid(line), "line %u/%d/%u is not valid", line->data_bits, line->parity, line->stop_bits);
+
+  for (size_t i = 0; i < COUNT(bauds); ++i) {
+    char settings[SERIAL_SETTINGS_MAX];
+    serial_settings_format(bauds[i], line, settings, sizeof(settings));
+    check(strlen(settings) < sizeof(settings) - 1, "%s may have been truncated", settings);
+
+    unsigned int baud;
+    SerialLine parsed_line;
+    check(serial_settings_parse(settings, &baud, &parsed_line), "%s does not parse", settings);
+    check(baud == bauds[i], "%s parses to a rate of %u", settings, baud);
+    check(serial_line_equal(&parsed_line, line), "%s parses to a different line", settings);
+    check(serial_line_valid(&parsed_line), "%s parses to an invalid line", settings);
+  }
+
+}
+
+static void
+check_open_round_trip (const SerialLine * line) {
+
+  // as the library sends it, and as the coalescer and the mechanism take it
+  MechanismProtoOpen open_device = {
+    .baud = 115200,
+    .data_bits = (uint8_t) line->data_bits,
+    .parity = (uint8_t) line->parity,
+    .stop_bits = (uint8_t) line->stop_bits,
+    .line_flags = (line->rts_cts ? PRIVFD_LINE_RTS_CTS : 0) |
+      (line->xon_xoff ? PRIVFD_LINE_XON_XOFF : 0) |
+      (line->rs485 ? PRIVFD_LINE_RS485 : 0) |
+      (line->low_latency ? PRIVFD_LINE_LOW_LATENCY : 0),
+    .rs485_delay_before_ms = line->rs485_delay_before_ms,
+    .rs485_delay_after_ms = line->rs485_delay_after_ms,
+    .path_length = 0
+  };
+  check(!(open_device.line_flags & ~PRIVFD_LINE_KNOWN), "line flags 0x%x are not all known", open_device.line_flags);
+
+  MechanismProtoHeader header = {
+    .magic = PRIVFD_MAGIC,
+    .version = PRIVFD_VERSION,
+    .type = PRIVFD_OPEN,
+    .length = sizeof(open_device)
+  };
+  char buffer[sizeof(header) + sizeof(open_device)];
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &open_device, sizeof(open_device));
+
+  MechanismProtoHeader parsed_header;
+  const char * body;
+  ssize_t size = protocol_parse(buffer, sizeof(buffer), &parsed_header, &body);
+  check(size == (ssize_t) sizeof(buffer), "open message parses to a size of %zd", size);
+  if (size != (ssize_t) sizeof(buffer)) return;
+
+  MechanismProtoOpen parsed_open;
+  memcpy(&parsed_open, body, sizeof(parsed_open));
+  SerialLine parsed_line = {
+    .data_bits = parsed_open.data_bits,
+    .parity = (SerialParity) parsed_open.parity,
+    .stop_bits = parsed_open.stop_bits,
+    .rts_cts = parsed_open.line_flags & PRIVFD_LINE_RTS_CTS,
+    .xon_xoff = parsed_open.line_flags & PRIVFD_LINE_XON_XOFF,
+    .rs485 = parsed_open.line_flags & PRIVFD_LINE_RS485,
+    .rs485_delay_before_ms = parsed_open.rs485_delay_before_ms,
+    .rs485_delay_after_ms = parsed_open.rs485_delay_after_ms,
+    .low_latency = parsed_open.line_flags & PRIVFD_LINE_LOW_LATENCY
+  };
+  check(parsed_header.type == PRIVFD_OPEN, "open message parses to type %u", parsed_header.type);
+  check(parsed_open.baud == 115200, "open message parses to a rate of %u", parsed_open.baud);
+  check(serial_line_equal(&parsed_line, line), "open message with line flags 0x%x parses to a different line", open_device.line_flags);
+
+}
+
+static void
+check_malformed_settings (void) {
+
+  static const char * const malformed[] = {
+    "",
+    ":8N1",
+    "abc",
+    "-9600",
+    "9600:",
+    "9600;8N1",
+    "9600:8X1",
+    "9600:8n1",
+    "9600:N1",
+    "9600:8N",
+    "9600:8N1,",
+    "9600:8N1,,rtscts",
+    "9600:8N1,rtscts,",
+    "9600:8N1rtscts",
+    "9600:8N1,rtscts2",
+    "9600:8N1,RTSCTS",
+    "9600:8N1,unknown",
+    "9600:8N1,rs485",
+    "9600:8N1,rs485=",
+    "9600:8N1,rs485=1",
+    "9600:8N1,rs485=1/",
+    "9600:8N1,rs485=/1",
+    "9600:8N1,rs485=1:1",
+    "9600:8N1,rs485=-1/1",
+    "9600:8N1,rs485=1/1,",
+    "9600:8N1 ",
+    " 9600"
+  };
+
+  for (size_t i = 0; i < COUNT(malformed); ++i) {
+    unsigned int baud;
+    SerialLine line;
+    check(!serial_settings_parse(malformed[i], &baud, &line), "malformed \"%s\" parses", malformed[i]);
+  }
+
+  // well formed but out of range, which parses and then fails validation
+  static const char * const invalid[] = {
+    "9600:4N1",
+    "9600:9N1",
+    "9600:8N0",
+    "9600:8N3",
+    "9600:4294967304N1",
+    "9600:8N1,rs485=101/0",
+    "9600:8N1,rs485=0/101",
+    "9600:8N1,rs485=4294967296/0",
+    "9600:8N1,rs485=0/4294967296",
+    "9600:8N1,rs485=99999999999999999999999/0",
+    "9600:8N1,rs485=0/99999999999999999999999"
+  };
+
+  for (size_t i = 0; i < COUNT(invalid); ++i) {
+    unsigned int baud;
+    SerialLine line;
+    check(
+      !serial_settings_parse(invalid[i], &baud, &line) || !serial_line_valid(&line),
+      "out of range \"%s\" is valid",
+      invalid[i]
+    );
+  }
+
+  // a rate that does not fit is 0, which is never supported
+  static const char * const overflowing_bauds[] = {
+    "4294967296",
+    "99999999999999999999999:8N1"
+  };
+
+  for (size_t i = 0; i < COUNT(overflowing_bauds); ++i) {
+    unsigned int baud;
+    SerialLine line;
+    check(serial_settings_parse(overflowing_bauds[i], &baud, &line), "\"%s\" does not parse", overflowing_bauds[i]);
+    check(baud == 0, "\"%s\" parses to a rate of %u", overflowing_bauds[i], baud);
+  }
+
+  // a line that is not valid has nothing the settings could mean by it
+  SerialLine line = SERIAL_LINE_DEFAULT;
+  line.rs485_delay_before_ms = 1;
+  check(!serial_line_valid(&line), "RS-485 delays without RS-485 are valid");
+
+}
+
+static void
+check_malformed_messages (void) {
+
+  MechanismProtoHeader header = {
+    .magic = PRIVFD_MAGIC,
+    .version = PRIVFD_VERSION,
+    .type = PRIVFD_END,
+    .length = 4
+  };
+  char buffer[sizeof(header) + PRIVFD_BODY_MAX] = {0};
+  MechanismProtoHeader parsed_header;
+  const char * body;
+
+  // anything short of the whole message waits for the rest
+  memcpy(buffer, &header, sizeof(header));
+  for (size_t length = 0; length < sizeof(header) + header.length; ++length) {
+    check(protocol_parse(buffer, length, &parsed_header, &body) == 0, "a message cut to %zu bytes parses", length);
+  }
+  check(
+    protocol_parse(buffer, sizeof(header) + header.length + 1, &parsed_header, &body) == (ssize_t) (sizeof(header) + header.length),
+    "a message followed by another does not parse to its own size"
+  );
+
+  MechanismProtoHeader bad_headers[] = {
+    { .magic = PRIVFD_MAGIC + 1, .version = PRIVFD_VERSION, .type = PRIVFD_END },
+    { .magic = PRIVFD_MAGIC, .version = PRIVFD_VERSION - 1, .type = PRIVFD_END },
+    { .magic = PRIVFD_MAGIC, .version = PRIVFD_VERSION + 1, .type = PRIVFD_END },
+    { .magic = PRIVFD_MAGIC, .version = PRIVFD_VERSION, .type = PRIVFD_END, .length = PRIVFD_BODY_MAX + 1 }
+  };
+
+  for (size_t i = 0; i < COUNT(bad_headers); ++i) {
+    memcpy(buffer, &bad_headers[i], sizeof(bad_headers[i]));
+    errno = 0;
+    check(
+      protocol_parse(buffer, sizeof(buffer), &parsed_header, &body) == -1 && errno == EPROTO,
+      "malformed header %zu parses",
+      i
+    );
+  }
+
+}
+
+int
+main (void) {
+
+  each_line(check_settings_round_trip);
+  each_line(check_open_round_trip);
+  check_malformed_settings();
+  check_malformed_messages();
+
+  if (failures > 0) {
+    fprintf(stderr, "%u checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+
+}